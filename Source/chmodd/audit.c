@@ -0,0 +1,367 @@
+/*
+ *	audit.c -- reporting what a policy would change, without changing it
+ *	(-A).
+ *
+ *	The walk is the usual one (fd relative, on as many threads as -T says);
+ *	only the chmod/chown/ACL calls are swapped for a record.  Records are
+ *	built by hand into a buffer per thread, and a buffer only goes out in one
+ *	write() when it's full (or its thread is done), so threads don't fight
+ *	over the output and lines never get mixed up.
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "audit.h"
+
+#define AUDIT_BUFFER_SIZE		131072
+
+// Room for the biggest record: a path where every byte needs \u00XX, and the
+// rest of the line.
+#define AUDIT_RECORD_MAX		(6 * PATH_MAX + 256)
+
+struct audit_buffer_t {
+	size_t					used;
+	struct audit_stats_t	stats;
+	char					bytes[AUDIT_BUFFER_SIZE];
+};
+
+static struct {
+	pthread_mutex_t			lock;
+	pthread_key_t			key;
+	Boolean					open;
+	int						fd;
+	int						format;
+	struct audit_stats_t	stats;
+} audit = { PTHREAD_MUTEX_INITIALIZER };
+
+// Writes the buffer out whole and adds its counts to the totals.
+static void AuditFlush(struct audit_buffer_t *buffer)
+{
+	size_t written = 0;
+	ssize_t n;
+
+	pthread_mutex_lock(&audit.lock);
+
+	while (written < buffer->used)
+	{
+		if ((n = write(audit.fd, buffer->bytes + written,
+					   buffer->used - written)) == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			LogError("Couldn't write audit records: %s\n", strerror(errno));
+			break;
+		}
+		written += n;
+	}
+
+	audit.stats.records += buffer->stats.records;
+	audit.stats.mode += buffer->stats.mode;
+	audit.stats.owner += buffer->stats.owner;
+	audit.stats.group += buffer->stats.group;
+	audit.stats.acl += buffer->stats.acl;
+
+	pthread_mutex_unlock(&audit.lock);
+
+	buffer->used = 0;
+	memset(&buffer->stats, 0, sizeof(buffer->stats));
+}
+
+// Walker threads go away at the end of every parallel walk; what they had
+// buffered goes out as they do.
+static void AuditThreadExit(void *value)
+{
+	AuditFlush(value);
+	free(value);
+}
+
+Boolean AuditOpen(const char *path, int format)
+{
+	if (strcmp(path, "-") == 0)
+	{
+		audit.fd = STDOUT_FILENO;
+	}
+	else if ((audit.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+							  0644)) == -1)
+	{
+		LogError("Couldn't open audit output %s: %s\n", path, strerror(errno));
+		return false;
+	}
+
+	if (pthread_key_create(&audit.key, AuditThreadExit) != 0)
+	{
+		LogError("Couldn't set up audit buffers\n");
+		if (audit.fd != STDOUT_FILENO)
+		{
+			close(audit.fd);
+		}
+		return false;
+	}
+
+	audit.format = format;
+	memset(&audit.stats, 0, sizeof(audit.stats));
+
+	if (format == AUDIT_FORMAT_BINARY &&
+		write(audit.fd, AUDIT_BINARY_MAGIC,
+			  sizeof(AUDIT_BINARY_MAGIC) - 1) == -1)
+	{
+		LogError("Couldn't write audit output %s: %s\n", path, strerror(errno));
+	}
+
+	audit.open = true;
+
+	return true;
+}
+
+Boolean AuditIsOpen(void)
+{
+	return audit.open;
+}
+
+static char AuditTypeOf(mode_t mode)
+{
+	if (S_ISREG(mode))
+	{
+		return 'f';
+	}
+	else if (S_ISDIR(mode))
+	{
+		return 'd';
+	}
+	else if (S_ISLNK(mode))
+	{
+		return 'l';
+	}
+	else if (S_ISFIFO(mode))
+	{
+		return 'p';
+	}
+	else if (S_ISSOCK(mode))
+	{
+		return 's';
+	}
+	else if (S_ISCHR(mode))
+	{
+		return 'c';
+	}
+	else if (S_ISBLK(mode))
+	{
+		return 'b';
+	}
+
+	return '?';
+}
+
+static void AuditAppend(struct audit_buffer_t *buffer, const char *string,
+						size_t length)
+{
+	memcpy(buffer->bytes + buffer->used, string, length);
+	buffer->used += length;
+}
+
+static void AuditAppendDecimal(struct audit_buffer_t *buffer,
+							   unsigned long value)
+{
+	char digits[24];
+	int i = sizeof(digits);
+
+	do
+	{
+		digits[--i] = '0' + (value % 10);
+		value /= 10;
+	} while (value);
+
+	AuditAppend(buffer, digits + i, sizeof(digits) - i);
+}
+
+// Four digits at least, the way chmod(1) writes them.
+static void AuditAppendMode(struct audit_buffer_t *buffer, mode_t mode)
+{
+	char digits[8];
+	int i = sizeof(digits);
+
+	mode &= 07777;
+
+	do
+	{
+		digits[--i] = '0' + (mode & 07);
+		mode >>= 3;
+	} while (mode || i > (int)sizeof(digits) - 4);
+
+	buffer->bytes[buffer->used++] = '"';
+	AuditAppend(buffer, digits + i, sizeof(digits) - i);
+	buffer->bytes[buffer->used++] = '"';
+}
+
+static void AuditAppendJSONString(struct audit_buffer_t *buffer,
+								  const char *string)
+{
+	static const char hex[] = "0123456789abcdef";
+	const unsigned char *p = (const unsigned char *)string;
+	char *out = buffer->bytes + buffer->used;
+
+	*out++ = '"';
+
+	for (; *p; p++)
+	{
+		if (*p == '"' || *p == '\\')
+		{
+			*out++ = '\\';
+			*out++ = *p;
+		}
+		else if (*p < 0x20)
+		{
+			*out++ = '\\';
+			*out++ = 'u';
+			*out++ = '0';
+			*out++ = '0';
+			*out++ = hex[*p >> 4];
+			*out++ = hex[*p & 0x0f];
+		}
+		else
+		{
+			*out++ = *p;
+		}
+	}
+
+	*out++ = '"';
+
+	buffer->used = out - buffer->bytes;
+}
+
+#define AUDIT_APPEND_LITERAL(buffer, literal) \
+	AuditAppend((buffer), (literal), sizeof(literal) - 1)
+
+void AuditRecord(const char *path, const struct stat *info, int flags,
+				 mode_t desiredMode, uid_t desiredOwner, gid_t desiredGroup)
+{
+	struct audit_buffer_t *buffer = pthread_getspecific(audit.key);
+	struct audit_record_t record;
+	size_t pathLength;
+
+	if (!buffer)
+	{
+		if ((buffer = malloc(sizeof(struct audit_buffer_t))) == NULL)
+		{
+			LogError("Couldn't allocate audit buffer for %s\n", path);
+			return;
+		}
+		buffer->used = 0;
+		memset(&buffer->stats, 0, sizeof(buffer->stats));
+		pthread_setspecific(audit.key, buffer);
+	}
+
+	if (AUDIT_BUFFER_SIZE - buffer->used < AUDIT_RECORD_MAX)
+	{
+		AuditFlush(buffer);
+	}
+
+	buffer->stats.records++;
+	buffer->stats.mode += (flags & AUDIT_MODE) ? 1 : 0;
+	buffer->stats.owner += (flags & AUDIT_OWNER) ? 1 : 0;
+	buffer->stats.group += (flags & AUDIT_GROUP) ? 1 : 0;
+	buffer->stats.acl += (flags & AUDIT_ACL) ? 1 : 0;
+
+	if (audit.format == AUDIT_FORMAT_BINARY)
+	{
+		pathLength = strlen(path);
+
+		record.pathLength = (UInt16)pathLength;
+		record.type = AuditTypeOf(info->st_mode);
+		record.flags = flags;
+		record.currentMode = info->st_mode & 07777;
+		record.desiredMode = (flags & AUDIT_MODE) ? (desiredMode & 07777) :
+			record.currentMode;
+		record.currentOwner = info->st_uid;
+		record.desiredOwner = (flags & AUDIT_OWNER) ? desiredOwner :
+			info->st_uid;
+		record.currentGroup = info->st_gid;
+		record.desiredGroup = (flags & AUDIT_GROUP) ? desiredGroup :
+			info->st_gid;
+
+		AuditAppend(buffer, (const char *)&record, sizeof(record));
+		AuditAppend(buffer, path, pathLength);
+		return;
+	}
+
+	AUDIT_APPEND_LITERAL(buffer, "{\"path\":");
+	AuditAppendJSONString(buffer, path);
+	AUDIT_APPEND_LITERAL(buffer, ",\"type\":\"");
+	buffer->bytes[buffer->used++] = AuditTypeOf(info->st_mode);
+	buffer->bytes[buffer->used++] = '"';
+
+	if (flags & AUDIT_MODE)
+	{
+		AUDIT_APPEND_LITERAL(buffer, ",\"mode\":[");
+		AuditAppendMode(buffer, info->st_mode);
+		buffer->bytes[buffer->used++] = ',';
+		AuditAppendMode(buffer, desiredMode);
+		buffer->bytes[buffer->used++] = ']';
+	}
+
+	if (flags & AUDIT_OWNER)
+	{
+		AUDIT_APPEND_LITERAL(buffer, ",\"uid\":[");
+		AuditAppendDecimal(buffer, info->st_uid);
+		buffer->bytes[buffer->used++] = ',';
+		AuditAppendDecimal(buffer, desiredOwner);
+		buffer->bytes[buffer->used++] = ']';
+	}
+
+	if (flags & AUDIT_GROUP)
+	{
+		AUDIT_APPEND_LITERAL(buffer, ",\"gid\":[");
+		AuditAppendDecimal(buffer, info->st_gid);
+		buffer->bytes[buffer->used++] = ',';
+		AuditAppendDecimal(buffer, desiredGroup);
+		buffer->bytes[buffer->used++] = ']';
+	}
+
+	if (flags & AUDIT_ACL)
+	{
+		AUDIT_APPEND_LITERAL(buffer, ",\"acl\":true");
+	}
+
+	AUDIT_APPEND_LITERAL(buffer, "}\n");
+}
+
+void AuditClose(struct audit_stats_t *stats)
+{
+	struct audit_buffer_t *buffer;
+
+	if (!audit.open)
+	{
+		memset(stats, 0, sizeof(*stats));
+		return;
+	}
+
+	// Only this thread's is left; the walkers' went out when they finished.
+	if ((buffer = pthread_getspecific(audit.key)) != NULL)
+	{
+		pthread_setspecific(audit.key, NULL);
+		AuditThreadExit(buffer);
+	}
+
+	audit.open = false;
+
+	if (audit.fd != STDOUT_FILENO)
+	{
+		close(audit.fd);
+	}
+
+	pthread_mutex_lock(&audit.lock);
+	*stats = audit.stats;
+	pthread_mutex_unlock(&audit.lock);
+}
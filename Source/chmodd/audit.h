@@ -0,0 +1,80 @@
+/*
+ *	audit.h -- reporting what a policy would change, without changing it
+ *	(-A).
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#ifndef CHMODD_AUDIT_H
+#define CHMODD_AUDIT_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "chmodd.h"
+
+// Output formats; -b picks binary.
+#define AUDIT_FORMAT_JSONL		0
+#define AUDIT_FORMAT_BINARY		1
+
+// What's out of policy about an entry.
+#define AUDIT_MODE				0x01
+#define AUDIT_OWNER				0x02
+#define AUDIT_GROUP				0x04
+#define AUDIT_ACL				0x08
+
+// JSONL is one object per line, with only the fields that are out of policy:
+//
+//	{"path":"/a/b","type":"f","mode":["0777","0644"],"uid":[501,0]}
+//
+// (current, then desired.  "gid" is like "uid"; "acl":true means it doesn't
+// have the root's ACL.  type is f, d, l, p, s, c, b, or ? for anything else,
+// and path is escaped for JSON but otherwise the bytes it is on disk.)
+//
+// Binary starts with AUDIT_BINARY_MAGIC, then for each entry an
+// audit_record_t (in host byte order) followed by pathLength bytes of path,
+// with no terminator.  Fields that aren't flagged just repeat the current
+// value.
+#define AUDIT_BINARY_MAGIC		"chmodda\001"
+
+struct audit_record_t {
+	UInt16					pathLength;
+	UInt8					type;		// As in the JSONL: f, d, l, ...
+	UInt8					flags;		// AUDIT_*
+	UInt32					currentMode;
+	UInt32					desiredMode;
+	UInt32					currentOwner;
+	UInt32					desiredOwner;
+	UInt32					currentGroup;
+	UInt32					desiredGroup;
+};
+
+struct audit_stats_t {
+	unsigned long			records;	// Entries out of policy
+	unsigned long			mode;		// ...by what's wrong
+	unsigned long			owner;
+	unsigned long			group;
+	unsigned long			acl;
+};
+
+// Starts sending records to path ("-" for stdout) in format.  Returns false if
+// it can't be opened.
+Boolean AuditOpen(const char *path, int format);
+
+// Returns true between AuditOpen() and AuditClose().  Walks make no changes
+// while it is.
+Boolean AuditIsOpen(void);
+
+// Records the entry at path, currently info, as out of policy in the ways
+// flags says.  Safe to call from any number of walker threads: each one
+// buffers its own records, and buffers are written whole.
+void AuditRecord(const char *path, const struct stat *info, int flags,
+				 mode_t desiredMode, uid_t desiredOwner, gid_t desiredGroup);
+
+// Writes out whatever's buffered, closes the output and fills in stats.
+void AuditClose(struct audit_stats_t *stats);
+
+#endif
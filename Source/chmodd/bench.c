@@ -0,0 +1,612 @@
+/*
+ *	bench.c -- end-to-end enforcement benchmark.
+ *
+ *	Builds a synthetic tree in a temporary directory, with some fraction of it
+ *	out of policy, then times a prescan over it and a run of targeted event
+ *	walks, the same way the daemon would do them, and what each entry's stat
+ *	costs.  Last it checks that a change made deep in the tree between runs
+ *	is found by the next one.  Run it with "make bench".
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "chmodd.h"
+#include "policy.h"
+#include "walk.h"
+#include "verified.h"
+#include "coalesce.h"
+#include "logging.h"
+
+#define PROGNAME	"chmodd-bench"
+
+// Compliant and non-compliant modes for the policy "go-w".
+#define BENCH_POLICY		"go-w"
+#define BENCH_FILE_GOOD		0644
+#define BENCH_FILE_BAD		0666
+#define BENCH_DIR_GOOD		0755
+#define BENCH_DIR_BAD		0777
+
+struct globals_t _globals;
+
+struct globals_t *globals = &_globals;
+
+static struct {
+	int						depth;
+	int						fanout;
+	int						files;
+	double					badFraction;
+	int						eventWalks;
+	int						eventBatch;
+	unsigned int			seed;
+	Boolean					chown;
+	Boolean					cachedAttributes;
+	Boolean					keep;
+	char					root[PATH_MAX];
+	char					indexPath[PATH_MAX + 6];	// Beside it
+
+	// Every directory we made, for picking event targets.
+	char					**directories;
+	size_t					directoryCount;
+	size_t					directoryCapacity;
+
+	unsigned long			entries;
+	unsigned long			bad;
+	UInt64					random;
+} bench;
+
+void LogError(const char *format, ...)
+{
+	va_list ap;
+	va_start(ap, format);
+	LoggingWrite(format, ap);
+	va_end(ap);
+}
+void LogV(const char *format, ...)
+{
+	if (!globals->verbose) {
+		return;
+	}
+
+	va_list ap;
+	va_start(ap, format);
+	LoggingWrite(format, ap);
+	va_end(ap);
+}
+void LogMV(const char *format, ...)
+{
+	if (!globals->megaVerbose) {
+		return;
+	}
+
+	va_list ap;
+	va_start(ap, format);
+	LoggingWrite(format, ap);
+	va_end(ap);
+}
+
+// xorshift64*, so runs with the same -s build the same tree.
+static UInt64 BenchRandom(void)
+{
+	bench.random ^= bench.random >> 12;
+	bench.random ^= bench.random << 25;
+	bench.random ^= bench.random >> 27;
+
+	return bench.random * 2685821657736338717ULL;
+}
+
+static Boolean BenchIsBad(void)
+{
+	return (BenchRandom() >> 11) * (1.0 / 9007199254740992.0) <
+		bench.badFraction;
+}
+
+static double BenchNow(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Puts path in the state we want it: compliant or not.
+static void BenchSetEntry(const char *path, Boolean directory, Boolean bad)
+{
+	if (bad)
+	{
+		chmod(path, directory ? BENCH_DIR_BAD : BENCH_FILE_BAD);
+
+		// Out of policy on ownership too, when we're allowed to do that.
+		if (bench.chown && lchown(path, 1, 1) != 0)
+		{
+			LogError("chown %s: %s\n", path, strerror(errno));
+		}
+
+		bench.bad++;
+	}
+	else
+	{
+		chmod(path, directory ? BENCH_DIR_GOOD : BENCH_FILE_GOOD);
+	}
+}
+
+static void BenchRememberDirectory(const char *path)
+{
+	if (bench.directoryCount == bench.directoryCapacity)
+	{
+		bench.directoryCapacity = bench.directoryCapacity ?
+			bench.directoryCapacity * 2 : 256;
+		bench.directories = realloc(bench.directories,
+									bench.directoryCapacity * sizeof(char *));
+		if (!bench.directories)
+		{
+			LogError("Out of memory\n");
+			exit(1);
+		}
+	}
+
+	bench.directories[bench.directoryCount++] = strdup(path);
+}
+
+static void BenchBuildTree(const char *path, int level)
+{
+	char child[PATH_MAX];
+	int i;
+
+	BenchRememberDirectory(path);
+
+	for (i = 0; i < bench.files; i++)
+	{
+		int fd;
+
+		snprintf(child, PATH_MAX, "%s/f%d", path, i);
+		if ((fd = open(child, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1)
+		{
+			LogError("%s: %s\n", child, strerror(errno));
+			exit(1);
+		}
+		close(fd);
+
+		BenchSetEntry(child, false, BenchIsBad());
+		bench.entries++;
+	}
+
+	if (level >= bench.depth)
+	{
+		return;
+	}
+
+	for (i = 0; i < bench.fanout; i++)
+	{
+		snprintf(child, PATH_MAX, "%s/d%d", path, i);
+		if (mkdir(child, 0700) != 0)
+		{
+			LogError("%s: %s\n", child, strerror(errno));
+			exit(1);
+		}
+
+		BenchBuildTree(child, level + 1);
+
+		// Set last, so a bad directory can't get in the way of building it.
+		BenchSetEntry(child, true, BenchIsBad());
+		bench.entries++;
+	}
+}
+
+static int BenchRemoveEntry(const char *path, const struct stat *info,
+							int type, struct FTW *ftw)
+{
+	if (remove(path) != 0)
+	{
+		LogError("%s: %s\n", path, strerror(errno));
+	}
+
+	return 0;
+}
+
+static int BenchCompareDoubles(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double BenchPercentile(double *sorted, int count, double percentile)
+{
+	int index = (int)(percentile * (count - 1) + 0.5);
+
+	return sorted[index];
+}
+
+static unsigned long BenchSyscalls(const struct walk_stats_t *stats)
+{
+	return stats->statCalls + stats->openCalls + stats->chmodCalls +
+		stats->chownCalls + stats->aclReadCalls + stats->aclWriteCalls;
+}
+
+// Runs a full walk of the tree and reports on it.
+static void BenchPrescan(struct policy_t *policy, const char *label)
+{
+	struct walk_stats_t before, after;
+	unsigned long visited;
+	double start, elapsed;
+
+	WalkGetTotals(&before);
+	start = BenchNow();
+	applyPermissionsToFolder(bench.root, policy, true);
+	elapsed = BenchNow() - start;
+	WalkGetTotals(&after);
+
+	visited = after.filesVisited - before.filesVisited;
+
+	printf("%-18s %10.0f entries/s  %5.2f syscalls/entry  %8.3f s  "
+		   "(%lu changed)\n", label,
+		   visited / elapsed,
+		   (double)(BenchSyscalls(&after) - BenchSyscalls(&before)) /
+		   (visited ? visited : 1),
+		   elapsed, after.filesChanged - before.filesChanged);
+}
+
+// Breaks a file or two in random directories, then applies batches of event
+// paths through the coalescer the way FSCallback does, timing each walk.
+static void BenchEventWalks(struct policy_t *policy)
+{
+	struct coalesce_request_t *requests;
+	struct walk_stats_t before, after;
+	double *latencies, total = 0;
+	unsigned long visited;
+	int i, j, walks = 0;
+
+	latencies = calloc(bench.eventWalks * bench.eventBatch, sizeof(double));
+	requests = calloc(bench.eventBatch, sizeof(struct coalesce_request_t));
+	if (!latencies || !requests)
+	{
+		LogError("Out of memory\n");
+		exit(1);
+	}
+
+	WalkGetTotals(&before);
+
+	for (i = 0; i < bench.eventWalks; i++)
+	{
+		size_t count;
+
+		for (j = 0; j < bench.eventBatch; j++)
+		{
+			const char *directory =
+				bench.directories[BenchRandom() % bench.directoryCount];
+			char child[PATH_MAX];
+
+			if (bench.files > 0)
+			{
+				snprintf(child, PATH_MAX, "%s/f%d", directory,
+						 (int)(BenchRandom() % bench.files));
+				BenchSetEntry(child, false, true);
+			}
+
+			requests[j].path = directory;
+			requests[j].recursive = false;
+		}
+
+		count = CoalesceRequests(requests, bench.eventBatch);
+
+		for (j = 0; j < (int)count; j++)
+		{
+			double start = BenchNow();
+
+			applyPermissionsToFolder(requests[j].path, policy, false);
+			latencies[walks] = BenchNow() - start;
+			total += latencies[walks++];
+		}
+	}
+
+	WalkGetTotals(&after);
+
+	visited = after.filesVisited - before.filesVisited;
+
+	qsort(latencies, walks, sizeof(double), BenchCompareDoubles);
+
+	printf("%-18s %10.0f entries/s  %5.2f syscalls/entry  "
+		   "p50 %.3f ms  p99 %.3f ms  (%d walks)\n", "event walks",
+		   visited / (total > 0 ? total : 1),
+		   (double)(BenchSyscalls(&after) - BenchSyscalls(&before)) /
+		   (visited ? visited : 1),
+		   BenchPercentile(latencies, walks, 0.50) * 1000,
+		   BenchPercentile(latencies, walks, 0.99) * 1000, walks);
+
+	free(latencies);
+	free(requests);
+}
+
+// Stats every entry in the tree, with WalkStat() if walker or as lstat() does
+// otherwise, and returns how many there were.  Nothing the bench makes starts
+// with a dot.
+static unsigned long BenchStatTree(const struct policy_t *policy,
+								   Boolean walker)
+{
+	unsigned long entries = 0;
+	struct dirent *entry;
+	struct stat info;
+	size_t i;
+	DIR *dir;
+
+	for (i = 0; i < bench.directoryCount; i++)
+	{
+		if ((dir = opendir(bench.directories[i])) == NULL)
+		{
+			continue;
+		}
+
+		while ((entry = readdir(dir)) != NULL)
+		{
+			if (entry->d_name[0] == '.')
+			{
+				continue;
+			}
+
+			if ((walker ?
+				 WalkStat(policy, dirfd(dir), entry->d_name, &info) :
+				 fstatat(dirfd(dir), entry->d_name, &info,
+						 AT_SYMLINK_NOFOLLOW)) == 0)
+			{
+				entries++;
+			}
+		}
+
+		closedir(dir);
+	}
+
+	return entries;
+}
+
+// Times a full lstat() of every entry against the walkers' WalkStat(), each
+// after a pass to warm the cache.  The directory reads are in both.
+static void BenchStatCost(const struct policy_t *policy)
+{
+	unsigned long entries;
+	double start, elapsed;
+	int walker;
+
+	for (walker = 0; walker < 2; walker++)
+	{
+		BenchStatTree(policy, walker);
+
+		start = BenchNow();
+		entries = BenchStatTree(policy, walker);
+		elapsed = BenchNow() - start;
+
+		printf("%-18s %10.0f ns/entry  (%lu entries)\n",
+			   walker ? "stat (walker)" : "stat (lstat)",
+			   elapsed * 1e9 / (entries ? entries : 1), entries);
+	}
+}
+
+// Stops, puts a file in the deepest directory out of policy while nothing is
+// watching, and starts again the way the daemon would, with the verified
+// index it left behind.  None of the directories above the file look any
+// different, so a walk of the root finds it only if it doesn't take the
+// index's word for them.  Returns false if it's still out of policy.
+static Boolean BenchRestart(struct policy_t *policy)
+{
+	struct walk_stats_t before, after;
+	char child[PATH_MAX];
+	struct stat info;
+	Boolean fixed;
+
+	if (bench.files < 1)
+	{
+		return true;
+	}
+
+	snprintf(child, PATH_MAX, "%s/f0",
+			 bench.directories[bench.directoryCount - 1]);
+
+	VerifiedIndexClose();
+	chmod(child, BENCH_FILE_BAD);
+	VerifiedIndexOpen(bench.indexPath);
+
+	WalkGetTotals(&before);
+	applyPermissionsToFolder(bench.root, policy, false);
+	WalkGetTotals(&after);
+
+	fixed = (stat(child, &info) == 0 &&
+			 (info.st_mode & 07777) == BENCH_FILE_GOOD);
+
+	printf("%-18s %s  (%lu visited, %lu skipped)\n", "restart (deep)",
+		   fixed ? "fixed" : "MISSED", after.filesVisited - before.filesVisited,
+		   after.directoriesSkipped - before.directoriesSkipped);
+
+	return fixed;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "\nUsage: %s [-v -V -c -k -N] [-D depth] [-F fanout] "
+			"[-n files per directory]\n"
+			"       [-b non-compliant fraction] [-e event batches] "
+			"[-B batch size]\n"
+			"       [-W fts|fd] [-T threads] [-s seed] [tmpdir]\n",
+			PROGNAME);
+}
+
+int main(int argc, char *argv[])
+{
+	struct policy_t *policy;
+	const char *tmpdir;
+	Boolean passed;
+	size_t i;
+	double start;
+	int c;
+
+	bench.depth = 4;
+	bench.fanout = 6;
+	bench.files = 20;
+	bench.badFraction = 0.25;
+	bench.eventWalks = 200;
+	bench.eventBatch = 1;
+	bench.seed = 1;
+
+	globals->walkEngine = WALK_ENGINE_FD;
+	globals->walkThreads = WalkDefaultThreadCount();
+	// Nothing is watched, so full walks share out the way they do for -O.
+	globals->once = true;
+
+	while ((c = getopt(argc, argv, "vVckND:F:n:b:e:B:W:T:s:")) != -1)
+	{
+		switch (c) {
+			case 'V':
+				globals->megaVerbose = true;
+				/* FALLTHROUGH: V implies v*/
+			case 'v':
+				globals->verbose = true;
+				break;
+			case 'c':
+				bench.chown = true;
+				break;
+			case 'k':
+				bench.keep = true;
+				break;
+			case 'N':
+				bench.cachedAttributes = true;
+				break;
+			case 'D':
+				bench.depth = atoi(optarg);
+				break;
+			case 'F':
+				bench.fanout = atoi(optarg);
+				break;
+			case 'n':
+				bench.files = atoi(optarg);
+				break;
+			case 'b':
+				bench.badFraction = strtod(optarg, NULL);
+				break;
+			case 'e':
+				bench.eventWalks = atoi(optarg);
+				break;
+			case 'B':
+				bench.eventBatch = atoi(optarg);
+				break;
+			case 'W':
+				if ((globals->walkEngine = WalkEngineFromString(optarg)) == -1)
+				{
+					LogError("Unknown traversal engine %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'T':
+				globals->walkThreads = atoi(optarg);
+				break;
+			case 's':
+				bench.seed = (unsigned int)strtoul(optarg, NULL, 10);
+				break;
+			default:
+				usage();
+				exit(1);
+		}
+	}
+
+	if (bench.depth < 0 || bench.fanout < 0 || bench.files < 0 ||
+		bench.eventWalks < 1 || bench.eventBatch < 1 ||
+		globals->walkThreads < 1 || globals->walkThreads > WALK_MAX_THREADS)
+	{
+		usage();
+		exit(1);
+	}
+
+	// Log the way the daemon does, so -v/-V runs cost what they would there.
+	LoggingStart(NULL);
+
+	if (bench.chown && geteuid() != 0)
+	{
+		LogError("-c needs root, ignoring it\n");
+		bench.chown = false;
+	}
+
+	bench.random = 0x9E3779B97F4A7C15ULL ^ bench.seed;
+
+	if (optind < argc)
+	{
+		tmpdir = argv[optind];
+	}
+	else if ((tmpdir = getenv("TMPDIR")) == NULL)
+	{
+		tmpdir = "/tmp";
+	}
+
+	snprintf(bench.root, PATH_MAX, "%s/chmodd-bench.XXXXXX", tmpdir);
+	if (mkdtemp(bench.root) == NULL)
+	{
+		LogError("%s: %s\n", bench.root, strerror(errno));
+		exit(1);
+	}
+
+	// The verified index is part of what's being measured, but the bench
+	// shouldn't leave one behind.  It's a file so a restart can reopen it.
+	snprintf(bench.indexPath, sizeof(bench.indexPath), "%s.index",
+			 bench.root);
+	VerifiedIndexOpen(bench.indexPath);
+
+	start = BenchNow();
+	BenchBuildTree(bench.root, 0);
+	chmod(bench.root, BENCH_DIR_GOOD);
+
+	printf("tree               %lu entries in %lu directories, %lu out of "
+		   "policy (built in %.2f s)\n", bench.entries,
+		   (unsigned long)bench.directoryCount, bench.bad, BenchNow() - start);
+	printf("engine             %s, %d thread%s\n",
+		   (globals->walkEngine == WALK_ENGINE_FD) ? "fd" : "fts",
+		   globals->walkThreads, (globals->walkThreads != 1) ? "s" : "");
+
+	policy = PolicyCreate(bench.root, bench.root);
+	PolicySetMode(policy, BENCH_POLICY);
+	if (bench.chown)
+	{
+		PolicySetOwner(policy, "0");
+		PolicySetGroup(policy, "0");
+	}
+	policy->cachedAttributes = bench.cachedAttributes;
+
+	BenchPrescan(policy, "prescan (dirty)");
+	BenchPrescan(policy, "prescan (clean)");
+	BenchEventWalks(policy);
+	BenchStatCost(policy);
+	passed = BenchRestart(policy);
+
+	PolicyRelease(policy);
+	VerifiedIndexClose();
+	unlink(bench.indexPath);
+
+	if (bench.keep)
+	{
+		printf("tree kept at %s\n", bench.root);
+	}
+	else
+	{
+		nftw(bench.root, BenchRemoveEntry, 64, FTW_DEPTH | FTW_PHYS);
+	}
+
+	for (i = 0; i < bench.directoryCount; i++)
+	{
+		free(bench.directories[i]);
+	}
+	free(bench.directories);
+
+	return passed ? 0 : 1;
+}
@@ -0,0 +1,230 @@
+/*
+ *	budget.c -- keeping background walks (prescans, rescans) out of the way
+ *	of the ones events ask for.
+ *
+ *	A prescan of a big share can keep a file server's metadata busy for hours.
+ *	Background walks run at a lower I/O priority, pay for their syscalls out
+ *	of a token bucket (-B), and wait whenever a walk for live events is going,
+ *	so somebody's ls doesn't queue up behind us.
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include "budget.h"
+
+#ifdef __linux__
+// glibc has no wrapper for ioprio_set(); these are from linux/ioprio.h.
+#define BUDGET_IOPRIO_WHO_PROCESS	1
+#define BUDGET_IOPRIO_CLASS_BE		2
+#define BUDGET_IOPRIO_VALUE			((BUDGET_IOPRIO_CLASS_BE << 13) | 7)
+#endif
+
+// How much nicer than us background threads are, where that's per thread.
+#define BUDGET_NICE					10
+
+static pthread_key_t budgetKey;
+static pthread_once_t budgetOnce = PTHREAD_ONCE_INIT;
+
+static struct {
+	pthread_mutex_t			lock;
+	pthread_cond_t			wake;		// Live walks done, or stopping
+	double					tokens;
+	double					lastRefill;
+	Boolean					stopping;
+	struct budget_status_t	status;
+} budget = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void BudgetMakeKey(void)
+{
+	pthread_key_create(&budgetKey, NULL);
+}
+
+static double BudgetNow(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return now.tv_sec + now.tv_usec / 1e6;
+}
+
+void BudgetSetRate(unsigned long opsPerSecond)
+{
+	pthread_mutex_lock(&budget.lock);
+	budget.status.rate = opsPerSecond;
+	budget.tokens = opsPerSecond;
+	budget.lastRefill = BudgetNow();
+	pthread_mutex_unlock(&budget.lock);
+}
+
+void BudgetEnterBackground(void)
+{
+	pthread_once(&budgetOnce, BudgetMakeKey);
+	pthread_setspecific(budgetKey, &budget);
+
+#ifdef __APPLE__
+	if (setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_THREAD,
+					   IOPOL_THROTTLE) != 0)
+	{
+		LogV("Couldn't lower background I/O priority: %s\n", strerror(errno));
+	}
+#elif defined(__linux__)
+	// The lowest best effort level rather than idle, which would never get
+	// anywhere on a disk that's always busy.
+	if (syscall(SYS_ioprio_set, BUDGET_IOPRIO_WHO_PROCESS, 0,
+				BUDGET_IOPRIO_VALUE) != 0)
+	{
+		LogV("Couldn't lower background I/O priority: %s\n", strerror(errno));
+	}
+
+	// Linux nice values belong to threads, so this only touches this one.
+	if (setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), BUDGET_NICE) != 0)
+	{
+		LogV("Couldn't lower background CPU priority: %s\n", strerror(errno));
+	}
+#endif
+}
+
+Boolean BudgetIsBackground(void)
+{
+	pthread_once(&budgetOnce, BudgetMakeKey);
+
+	return (pthread_getspecific(budgetKey) != NULL);
+}
+
+Boolean BudgetCharge(unsigned long ops)
+{
+	struct timespec until;
+	struct timeval tv;
+	double started, now, wait;
+	Boolean keepGoing;
+
+	pthread_mutex_lock(&budget.lock);
+
+	if (budget.stopping)
+	{
+		pthread_mutex_unlock(&budget.lock);
+		return false;
+	}
+
+	budget.status.charged += ops;
+
+	if (budget.status.liveWalks > 0 && !budget.stopping)
+	{
+		budget.status.preempted++;
+		started = BudgetNow();
+
+		while (budget.status.liveWalks > 0 && !budget.stopping)
+		{
+			pthread_cond_wait(&budget.wake, &budget.lock);
+		}
+
+		budget.status.preemptedSeconds += BudgetNow() - started;
+	}
+
+	if (budget.stopping)
+	{
+		pthread_mutex_unlock(&budget.lock);
+		return false;
+	}
+
+	if (budget.status.rate == 0)
+	{
+		pthread_mutex_unlock(&budget.lock);
+		return true;
+	}
+
+	// Top up for the time gone by, but never past a second's worth, so a quiet
+	// spell can't turn into a burst.
+	now = BudgetNow();
+	budget.tokens += (now - budget.lastRefill) * budget.status.rate;
+	if (budget.tokens > budget.status.rate)
+	{
+		budget.tokens = budget.status.rate;
+	}
+	budget.lastRefill = now;
+	budget.tokens -= ops;
+
+	if (budget.tokens < 0)
+	{
+		// In debt: sit out however long it takes to pay it back.  Other
+		// background threads find the bucket emptier still and wait longer,
+		// so between them they keep to the rate.
+		wait = -budget.tokens / budget.status.rate;
+		budget.status.throttled++;
+		budget.status.throttledSeconds += wait;
+
+		gettimeofday(&tv, NULL);
+		until.tv_sec = tv.tv_sec + (time_t)wait;
+		until.tv_nsec = tv.tv_usec * 1000 +
+			(long)((wait - (time_t)wait) * 1e9);
+		if (until.tv_nsec >= 1000000000)
+		{
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000;
+		}
+
+		while (!budget.stopping &&
+			   pthread_cond_timedwait(&budget.wake, &budget.lock,
+									  &until) != ETIMEDOUT)
+		{
+		}
+	}
+
+	keepGoing = !budget.stopping;
+
+	pthread_mutex_unlock(&budget.lock);
+
+	return keepGoing;
+}
+
+void BudgetLiveBegin(void)
+{
+	pthread_mutex_lock(&budget.lock);
+	budget.status.liveWalks++;
+	pthread_mutex_unlock(&budget.lock);
+}
+
+void BudgetLiveEnd(void)
+{
+	pthread_mutex_lock(&budget.lock);
+	if (--budget.status.liveWalks == 0)
+	{
+		pthread_cond_broadcast(&budget.wake);
+	}
+	pthread_mutex_unlock(&budget.lock);
+}
+
+void BudgetStop(void)
+{
+	pthread_mutex_lock(&budget.lock);
+	budget.stopping = true;
+	pthread_cond_broadcast(&budget.wake);
+	pthread_mutex_unlock(&budget.lock);
+}
+
+Boolean BudgetIsStopping(void)
+{
+	return __sync_fetch_and_add(&budget.stopping, 0);
+}
+
+void BudgetGetStatus(struct budget_status_t *status)
+{
+	pthread_mutex_lock(&budget.lock);
+	*status = budget.status;
+	pthread_mutex_unlock(&budget.lock);
+}
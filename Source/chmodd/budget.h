@@ -0,0 +1,56 @@
+/*
+ *	budget.h -- keeping background walks (prescans, rescans) out of the way
+ *	of the ones events ask for.
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#ifndef CHMODD_BUDGET_H
+#define CHMODD_BUDGET_H
+
+#include "chmodd.h"
+
+struct budget_status_t {
+	unsigned long			rate;			// Syscalls a second, 0 for no limit
+	unsigned long			charged;		// Syscalls background walks made
+	unsigned long			throttled;		// Times one waited for the bucket
+	double					throttledSeconds;
+	unsigned long			preempted;		// Times one waited for live walks
+	double					preemptedSeconds;
+	int						liveWalks;		// Going right now
+};
+
+// Limits background walks to opsPerSecond syscalls between them (-B), with
+// up to a second's worth saved up.  0 turns the limit off.
+void BudgetSetRate(unsigned long opsPerSecond);
+
+// Marks the calling thread as doing background walks, and drops its I/O (and,
+// where it can be done per thread, CPU) priority.
+void BudgetEnterBackground(void);
+
+// Returns true if the calling thread is doing background walks.
+Boolean BudgetIsBackground(void);
+
+// For background threads, after ops syscalls: waits until no live walk is
+// going, then for the bucket to pay for them.  Returns false, without
+// waiting, once BudgetStop() has been called: the walk should give up.
+Boolean BudgetCharge(unsigned long ops);
+
+// Bracket a walk events asked for.  Background walks stand aside from the
+// moment one starts until the last one ends.
+void BudgetLiveBegin(void);
+void BudgetLiveEnd(void);
+
+// Tells every background walk to give up as soon as it can, so we can quit.
+void BudgetStop(void);
+
+// Returns true once BudgetStop() has been called.
+Boolean BudgetIsStopping(void);
+
+void BudgetGetStatus(struct budget_status_t *status);
+
+#endif
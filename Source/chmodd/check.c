@@ -0,0 +1,453 @@
+/*
+ *	check.c -- table-driven checks of the engine's pure functions.
+ *
+ *	Each table is a list of cases with what should come out of them; a case
+ *	that doesn't is printed, and the run fails.  Nothing here touches the
+ *	filesystem.  Run it with "make check".
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "chmodd.h"
+#include "coalesce.h"
+#include "policy.h"
+#include "compat.h"
+#include "logging.h"
+
+#define PROGNAME	"chmodd-check"
+
+// Most requests or expected walks in one coalescing case, and sub-rules in one
+// matching case.
+#define CHECK_MAX_REQUESTS	8
+#define CHECK_MAX_RULES		4
+
+// The root the sub-rule cases are under.
+#define CHECK_ROOT			"/r"
+
+struct globals_t _globals;
+
+struct globals_t *globals = &_globals;
+
+static struct {
+	unsigned long			cases;
+	unsigned long			failures;
+} check;
+
+void LogError(const char *format, ...)
+{
+	va_list ap;
+	va_start(ap, format);
+	LoggingWrite(format, ap);
+	va_end(ap);
+}
+void LogV(const char *format, ...)
+{
+	if (!globals->verbose) {
+		return;
+	}
+
+	va_list ap;
+	va_start(ap, format);
+	LoggingWrite(format, ap);
+	va_end(ap);
+}
+void LogMV(const char *format, ...)
+{
+	if (!globals->megaVerbose) {
+		return;
+	}
+
+	va_list ap;
+	va_start(ap, format);
+	LoggingWrite(format, ap);
+	va_end(ap);
+}
+
+// Counts a case, and reports it if it failed.
+static void CheckResult(Boolean passed, const char *table, const char *format,
+						...)
+{
+	va_list ap;
+
+	check.cases++;
+
+	if (passed)
+	{
+		return;
+	}
+
+	check.failures++;
+
+	fprintf(stderr, "FAIL %s: ", table);
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+}
+
+#pragma mark -
+#pragma mark Coalescing
+
+// Requests and walks are written "path" for a plain walk, "path R" for a
+// recursive one, and "path E"/"path ER" for entries, with "@id" after any of
+// them for an event id other than 0.
+struct check_coalesce_t {
+	const char				*name;
+	const char				*requests[CHECK_MAX_REQUESTS];
+	const char				*expected[CHECK_MAX_REQUESTS];
+};
+
+static const struct check_coalesce_t checkCoalesce[] = {
+	{ "one request",
+		{ "/a/b" },
+		{ "/a/b" } },
+	{ "duplicates merge",
+		{ "/a", "/a", "/a" },
+		{ "/a" } },
+	{ "recursive wins a duplicate",
+		{ "/a", "/a R", "/a" },
+		{ "/a R" } },
+	{ "walk beats an entry of the same path",
+		{ "/a E", "/a" },
+		{ "/a" } },
+	{ "trailing slashes are the same path",
+		{ "/a/", "/a//", "/a R" },
+		{ "/a R" } },
+	{ "recursive walk covers descendants",
+		{ "/a/b/c", "/a R", "/a/b", "/a/b/c/d E" },
+		{ "/a R" } },
+	{ "plain walk doesn't cover subdirectories",
+		{ "/a/b", "/a" },
+		{ "/a", "/a/b" } },
+	{ "'/' sorts before every other character",
+		{ "/a/b-c", "/a/b/c", "/a/b R", "/a/b.c" },
+		{ "/a/b R", "/a/b-c", "/a/b.c" } },
+	{ "a sibling sorted between doesn't hide a descendant",
+		{ "/a/b/c", "/a/b-c R", "/a/b R" },
+		{ "/a/b R", "/a/b-c R" } },
+	{ "nor an entry directly inside",
+		{ "/a/f E", "/a-b", "/a" },
+		{ "/a", "/a-b" } },
+	{ "a shared prefix isn't an ancestor",
+		{ "/ab", "/a R", "/a-b" },
+		{ "/a R", "/a-b", "/ab" } },
+	{ "the root covers everything",
+		{ "/x/y", "/ R", "/a E" },
+		{ "/ R" } },
+	{ "plain walk takes in entries directly inside",
+		{ "/a/f E", "/a", "/a/g E" },
+		{ "/a" } },
+	{ "but not entries further down",
+		{ "/a", "/a/b/f E" },
+		{ "/a", "/a/b/f E" } },
+	{ "nor new directories inside",
+		{ "/a/d ER", "/a" },
+		{ "/a", "/a/d ER" } },
+	{ "an entry doesn't take in its neighbours",
+		{ "/a/f E", "/a/f/g E", "/a/g E" },
+		{ "/a/f E", "/a/f/g E", "/a/g E" } },
+	{ "new directory covers entries under it",
+		{ "/a/d/f E", "/a/d ER", "/a/d/e/g E" },
+		{ "/a/d ER" } },
+	{ "duplicates keep the newest event",
+		{ "/a @3", "/a R @9", "/a @5" },
+		{ "/a R @9" } },
+	{ "a recursive walk takes on the events it covers",
+		{ "/a R @2", "/a/b @8", "/a/b/c E @5" },
+		{ "/a R @8" } },
+	{ "and a plain walk those of entries it takes in",
+		{ "/a/f E @6", "/a @4" },
+		{ "/a @6" } },
+	{ "walks kept apart keep their own",
+		{ "/a @3", "/a/b @1" },
+		{ "/a @3", "/a/b @1" } },
+};
+
+// Parses one "path [R|E|ER]" into request, with the path copied to buffer.
+static void CheckParseRequest(const char *spec, char *buffer, size_t size,
+							  struct coalesce_request_t *request)
+{
+	char *flags;
+
+	snprintf(buffer, size, "%s", spec);
+	memset(request, 0, sizeof(*request));
+
+	if ((flags = strchr(buffer, ' ')) != NULL)
+	{
+		*flags++ = '\0';
+		request->entry = (strchr(flags, 'E') != NULL);
+		request->recursive = (strchr(flags, 'R') != NULL);
+		if ((flags = strchr(flags, '@')) != NULL)
+		{
+			request->eventId = strtoull(flags + 1, NULL, 10);
+		}
+	}
+
+	request->path = buffer;
+}
+
+static void CheckCoalesce(void)
+{
+	struct coalesce_request_t requests[CHECK_MAX_REQUESTS], want;
+	char paths[CHECK_MAX_REQUESTS][PATH_MAX], wantPath[PATH_MAX];
+	size_t i, j, count, expected, kept;
+	Boolean passed;
+
+	for (i = 0; i < sizeof(checkCoalesce) / sizeof(checkCoalesce[0]); i++)
+	{
+		const struct check_coalesce_t *test = &checkCoalesce[i];
+
+		for (count = 0; count < CHECK_MAX_REQUESTS && test->requests[count];
+			 count++)
+		{
+			CheckParseRequest(test->requests[count], paths[count], PATH_MAX,
+							  &requests[count]);
+		}
+
+		for (expected = 0;
+			 expected < CHECK_MAX_REQUESTS && test->expected[expected];
+			 expected++)
+		{
+		}
+
+		kept = CoalesceRequests(requests, count);
+		passed = (kept == expected);
+
+		for (j = 0; passed && j < kept; j++)
+		{
+			CheckParseRequest(test->expected[j], wantPath, PATH_MAX, &want);
+			passed = (strcmp(requests[j].path, want.path) == 0 &&
+					  requests[j].recursive == want.recursive &&
+					  requests[j].entry == want.entry &&
+					  requests[j].eventId == want.eventId);
+		}
+
+		CheckResult(passed, "coalesce", "%s (%lu walks, wanted %lu%s%s%s)",
+					test->name, (unsigned long)kept, (unsigned long)expected,
+					kept ? ", first " : "", kept ? requests[0].path : "",
+					(kept && requests[0].recursive) ? " R" : "");
+	}
+}
+
+#pragma mark -
+#pragma mark Sub-rules
+
+// Rules are written as for -R, and the entry's path is relative to
+// CHECK_ROOT.  expected is the index of the rule that should apply, or -1.
+struct check_rule_t {
+	const char				*name;
+	const char				*rules[CHECK_MAX_RULES];
+	const char				*path;
+	mode_t					type;
+	int						expected;
+};
+
+static const struct check_rule_t checkRules[] = {
+	{ "name pattern matches at any depth",
+		{ "*.sh=755" }, "a/b/run.sh", S_IFREG, 0 },
+	{ "name pattern matches at the top",
+		{ "*.sh=755" }, "run.sh", S_IFREG, 0 },
+	{ "suffix has to be the whole end",
+		{ "*.sh=755" }, "run.shx", S_IFREG, -1 },
+	{ "name shorter than the suffix",
+		{ "*.sh=755" }, "sh", S_IFREG, -1 },
+	{ "all-literal name pattern",
+		{ "Makefile=644" }, "src/Makefile", S_IFREG, 0 },
+	{ "all-literal name isn't a suffix match",
+		{ "Makefile=644" }, "src/OldMakefile", S_IFREG, -1 },
+	{ "'*' stops at '/'",
+		{ "bin/*=755" }, "bin/tools/x", S_IFREG, -1 },
+	{ "path pattern is anchored at the root",
+		{ "bin/*=755" }, "a/bin/x", S_IFREG, -1 },
+	{ "path pattern",
+		{ "bin/*=755" }, "bin/x", S_IFREG, 0 },
+	{ "leading '/' anchors a name",
+		{ "/top=700" }, "a/top", S_IFDIR, -1 },
+	{ "leading '/' still matches at the root",
+		{ "/top=700" }, "top", S_IFDIR, 0 },
+	{ "\"**/\" matches no directories",
+		{ "**/*.c=644" }, "x.c", S_IFREG, 0 },
+	{ "\"**/\" matches several",
+		{ "**/*.c=644" }, "a/b/c/x.c", S_IFREG, 0 },
+	{ "\"**\" at the end takes everything below",
+		{ "a/**=700" }, "a/b/c", S_IFREG, 0 },
+	{ "\"/**/\" in the middle matches none",
+		{ "a/**/z=700" }, "a/z", S_IFREG, 0 },
+	{ "\"/**/\" in the middle matches several",
+		{ "a/**/z=700" }, "a/b/c/z", S_IFREG, 0 },
+	{ "\"/**/\" doesn't match a partial name",
+		{ "a/**/z=700" }, "a/b/xz", S_IFREG, -1 },
+	{ "'?' is one character",
+		{ "x/?=700" }, "x/yy", S_IFREG, -1 },
+	{ "'?' doesn't match '/'",
+		{ "x?y=700" }, "x/y", S_IFREG, -1 },
+	{ "range class",
+		{ "[a-c]x=700" }, "bx", S_IFREG, 0 },
+	{ "range class misses",
+		{ "[a-c]x=700" }, "dx", S_IFREG, -1 },
+	{ "negated class",
+		{ "[!.]*=700" }, ".hidden", S_IFREG, -1 },
+	{ "']' first in a class is literal",
+		{ "[]]x=700" }, "]x", S_IFREG, 0 },
+	{ "escaped '*' is literal",
+		{ "\\*.md=644" }, "a.md", S_IFREG, -1 },
+	{ "escaped '*' matches itself",
+		{ "\\*.md=644" }, "*.md", S_IFREG, 0 },
+	{ "type has to match",
+		{ "f:*.txt=644" }, "notes.txt", S_IFDIR, -1 },
+	{ "links only for l:",
+		{ "l:*=777" }, "link", S_IFLNK, 0 },
+	{ "first matching rule wins",
+		{ "d:*=700", "*.d=755", "*=644" }, "conf.d", S_IFREG, 1 },
+	{ "later rules when earlier ones don't match",
+		{ "f:*.sh=755", "*=644" }, "dir.sh", S_IFDIR, 1 },
+	{ "the root itself never matches",
+		{ "*=700" }, "", S_IFDIR, -1 },
+};
+
+static void CheckRules(void)
+{
+	const struct policy_rule_t *rule;
+	struct policy_t *policy;
+	char path[PATH_MAX];
+	size_t i, j;
+	int index;
+
+	for (i = 0; i < sizeof(checkRules) / sizeof(checkRules[0]); i++)
+	{
+		const struct check_rule_t *test = &checkRules[i];
+
+		policy = PolicyCreate(CHECK_ROOT, NULL);
+		for (j = 0; j < CHECK_MAX_RULES && test->rules[j]; j++)
+		{
+			PolicyAddRuleFromString(policy, test->rules[j]);
+		}
+
+		snprintf(path, PATH_MAX, "%s%s%s", CHECK_ROOT,
+				 *test->path ? "/" : "", test->path);
+		rule = PolicyMatchRule(policy, path, test->type | 0644);
+		index = rule ? (int)(rule - policy->rules) : -1;
+
+		CheckResult(index == test->expected, "rules",
+					"%s (%s: rule %d, wanted %d)", test->name, test->path,
+					index, test->expected);
+
+		PolicyRelease(policy);
+	}
+}
+
+#pragma mark -
+#pragma mark Modes
+
+// What setmode()/getmode() make of mode, from start, with umask in force.
+// A mode that shouldn't parse has CHECK_MODE_INVALID for expected.
+#define CHECK_MODE_INVALID	((mode_t)-1)
+
+struct check_mode_t {
+	const char				*mode;
+	mode_t					umask;
+	mode_t					start;
+	mode_t					expected;
+};
+
+static const struct check_mode_t checkModes[] = {
+	{ "644",			022,	0100777,	0100644 },
+	{ "4755",			022,	0100644,	0104755 },
+	{ "0",				022,	0041777,	0040000 },
+	{ "u+x",			022,	0100644,	0100744 },
+	{ "go-w",			022,	0100666,	0100644 },
+	{ "u=rwx,g=rx,o=",	022,	0100000,	0100750 },
+	{ "u+x-w",			022,	0100644,	0100544 },
+	{ "a=rX",			022,	0100640,	0100444 },
+	{ "a=rX",			022,	0100744,	0100555 },
+	{ "a=rX",			022,	0040700,	0040555 },
+	{ "a+X",			022,	0100600,	0100600 },
+	{ "g=u",			022,	0100640,	0100660 },
+	{ "o=g",			022,	0100654,	0100655 },
+	{ "u+s",			022,	0100755,	0104755 },
+	{ "g+s",			022,	0040755,	0042755 },
+	{ "o+s",			022,	0100755,	0100755 },
+
+	// With no "who", the umask holds back bits to set or clear...
+	{ "+w",				022,	0100444,	0100644 },
+	{ "+x",				0,		0100644,	0100755 },
+	{ "-x",				022,	0100777,	0100666 },
+	{ "-w",				022,	0100666,	0100466 },
+	{ "=rw",			077,	0100000,	0100600 },
+
+	// ...but '=' still clears everything it's in charge of.
+	{ "=r",				022,	0100777,	0100444 },
+	{ "=",				022,	0100777,	0100000 },
+
+	// The sticky bit is only touched when asked for, and not by "o".
+	{ "a=rx",			022,	0041777,	0041555 },
+	{ "=rx",			022,	0041777,	0041555 },
+	{ "+t",				022,	0040755,	0041755 },
+	{ "a+t",			022,	0040755,	0041755 },
+	{ "o+t",			022,	0040755,	0040755 },
+	{ "a-t",			022,	0041777,	0040777 },
+	{ "a=rwxt",			022,	0040700,	0041777 },
+
+	{ "",				022,	0,			CHECK_MODE_INVALID },
+	{ "u+z",			022,	0,			CHECK_MODE_INVALID },
+	{ "x+r",			022,	0,			CHECK_MODE_INVALID },
+	{ "u",				022,	0,			CHECK_MODE_INVALID },
+	{ "8",				022,	0,			CHECK_MODE_INVALID },
+	{ "0644x",			022,	0,			CHECK_MODE_INVALID },
+	{ "17777",			022,	0,			CHECK_MODE_INVALID },
+};
+
+static void CheckModes(void)
+{
+	mode_t saved, result;
+	size_t i;
+	void *set;
+
+	for (i = 0; i < sizeof(checkModes) / sizeof(checkModes[0]); i++)
+	{
+		const struct check_mode_t *test = &checkModes[i];
+
+		saved = umask(test->umask);
+		set = setmode(test->mode);
+		umask(saved);
+
+		result = set ? getmode(set, test->start) : CHECK_MODE_INVALID;
+		free(set);
+
+		CheckResult(result == test->expected, "modes",
+					"\"%s\" with umask %03o on %07o: %07o, wanted %07o",
+					test->mode, (unsigned int)test->umask,
+					(unsigned int)test->start, (unsigned int)result,
+					(unsigned int)test->expected);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1)
+	{
+		fprintf(stderr, "\nUsage: %s\n", PROGNAME);
+		exit(1);
+	}
+
+	LoggingStart(NULL);
+
+	CheckCoalesce();
+	CheckRules();
+	CheckModes();
+
+	printf("%lu cases, %lu failed\n", check.cases, check.failures);
+
+	return (check.failures > 0);
+}
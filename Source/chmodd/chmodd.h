@@ -0,0 +1,160 @@
+/*
+ *	chmodd.h -- declarations shared between the daemon's source files.
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#ifndef CHMODD_H
+#define CHMODD_H
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <time.h>
+
+#ifdef __APPLE__
+#import <CoreFoundation/CoreFoundation.h>
+#else
+// The handful of MacTypes the portable parts of chmodd use.
+#include <stdbool.h>
+#include <stdint.h>
+typedef unsigned char	Boolean;
+typedef uint8_t			UInt8;
+typedef uint16_t		UInt16;
+typedef int32_t			SInt32;
+typedef uint32_t		UInt32;
+typedef int64_t			SInt64;
+typedef uint64_t		UInt64;
+#ifndef TRUE
+#define TRUE			1
+#define FALSE			0
+#endif
+#endif
+
+// struct stat's timespec members are spelled differently on the Mac.
+#ifdef __APPLE__
+#define STAT_ATIME(st)		((st)->st_atimespec)
+#define STAT_MTIME(st)		((st)->st_mtimespec)
+#define STAT_CTIME(st)		((st)->st_ctimespec)
+#else
+#define STAT_ATIME(st)		((st)->st_atim)
+#define STAT_MTIME(st)		((st)->st_mtim)
+#define STAT_CTIME(st)		((st)->st_ctim)
+#endif
+
+// Global variables.
+struct globals_t {
+	// Control verbosity/output
+	Boolean					verbose;
+	Boolean					megaVerbose;
+	Boolean					quiet;
+
+	// For signal handling
+	Boolean					rescanSignal;
+	Boolean					quitSignal;
+	Boolean					hangupSignal;
+
+	// Plist file path (if provided)
+	char					plistPath[PATH_MAX];
+
+	// Setup for one entry (command line style)
+	char					*mode;
+	char					*owner; // Names or numbers, NULL if not set
+	char					*group;
+	char					**rules; // -R sub-rules, in order given
+	int						ruleCount;
+	char					directoryPath[PATH_MAX];
+	int						acl; // -1 for not set, 0 for false, and 1 for set.
+	Boolean					followSymbolicLinks;
+	Boolean					create;
+	Boolean					force;
+	Boolean					prescan;
+	Boolean					cachedAttributes; // -N, see WalkStat()
+	Boolean					once; // Apply once and exit, don't watch.
+	// Bounds on how long streams hold events (-l), in seconds (a
+	// CFAbsoluteTime on the Mac); each stream moves between them (see
+	// latency.h), or stays put if they're the same.
+	double					latency;
+	double					latencyMaximum;
+
+	// With -s every root goes on one stream, and events are handed to the
+	// right policy by path (see dispatch.h).  NULL without -s.
+	Boolean					sharedStream;
+	struct dispatch_t		*dispatch;
+
+	// With -e, events name the entry that changed (FSEvents file events, or
+	// the name inotify/fanotify give), and only that entry gets fixed; just
+	// new directories are walked.  Otherwise an event walks its directory.
+	Boolean					fileEvents;
+
+	// Which traversal applyPermissionsToFolder() uses (WALK_ENGINE_*), and
+	// how many threads share full (prescan/rescan) walks.
+	int						walkEngine;
+	int						walkThreads;
+
+	// Threads walking for events (-w), so the run loop never has to.  See
+	// work.h.
+	int						workers;
+
+	// Syscalls a second that background walks (prescans, rescans) may make
+	// between them (-B), 0 for no limit.  See budget.h.
+	unsigned long			ioBudget;
+
+#ifdef __APPLE__
+	// Array for FSEventStreamRef storage:
+	CFMutableArrayRef		streamArray;
+	// And their policies, index for index (FSEvents won't give a stream's
+	// context back, and a config reload needs to compare them).  Empty with
+	// -s, where the roots are in globals->dispatch instead:
+	CFMutableArrayRef		policyArray;
+	// Set once the streams from startup are going.  Until then a root picks
+	// up from where it got to last run (see history.h); roots started by a
+	// reload have a new config, so they start from now.
+	Boolean					streamsStarted;
+#else
+	// Everywhere else, our own streams (see stream.h), and which kind
+	// (STREAM_SOURCE_*):
+	struct stream_t			*streamList;
+	int						eventSource;
+#endif
+
+	// Where the verified index lives (-i), so we can be smart and skip over
+	// directories we've already been through, even across restarts.
+	char					indexPath[PATH_MAX];
+
+	// Unix domain socket to serve metrics on (-m), empty for none.
+	char					metricsPath[PATH_MAX];
+
+	// File to append log output to (-o), empty for stderr.
+	char					logPath[PATH_MAX];
+
+	// With -A, where to report what would be changed ("-" for stdout),
+	// instead of changing it; -b makes the report binary.  Empty normally.
+	char					auditPath[PATH_MAX];
+	Boolean					auditBinary;
+
+	// If we're on an OS later than Leopard, we can ignore ourself by sending
+	// a flag to the FSEventStreamCreate() call.  We can do it a slightly sneaky
+	// way to avoid having to have a compiled version for Leopard and one for
+	// later OS's.
+	Boolean					ignoreSelf;
+};
+
+extern struct globals_t *globals;
+
+// Logs errors to stderr (or the -o file).
+void LogError(const char *format, ...)
+__attribute__((format(printf, 1, 2)));
+
+// For verbose (-v) output, goes to stderr (or the -o file).
+void LogV(const char *format, ...)
+__attribute__((format(printf, 1, 2)));
+
+// For mega-verbose (-V) output, goes to stderr (or the -o file).
+void LogMV(const char *format, ...)
+__attribute__((format(printf, 1, 2)));
+
+#endif
@@ -0,0 +1,177 @@
+/*
+ *	coalesce.c -- folding a batch of event paths into as few walks as possible.
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "coalesce.h"
+
+static unsigned long walksSaved = 0;
+
+// Length of path without any trailing slashes.  "/" comes out as 0, which
+// makes it the ancestor of everything.
+static size_t CoalescePathLength(const char *path)
+{
+	size_t length = strlen(path);
+
+	while (length > 0 && path[length - 1] == '/')
+	{
+		length--;
+	}
+
+	return length;
+}
+
+// Orders paths so '/' sorts before every other character.  That way a
+// directory is immediately followed by everything underneath it ("/a/b" then
+// "/a/b/c" then "/a/b-c"), which is what lets CoalesceRequests() work in one
+// pass.
+static int CoalesceCompare(const void *first, const void *second)
+{
+	const struct coalesce_request_t *a = first;
+	const struct coalesce_request_t *b = second;
+	size_t i, length = (a->length < b->length) ? a->length : b->length;
+
+	for (i = 0; i < length; i++)
+	{
+		int ca = (unsigned char)a->path[i];
+		int cb = (unsigned char)b->path[i];
+
+		if (ca != cb)
+		{
+			ca = (ca == '/') ? 0 : ca;
+			cb = (cb == '/') ? 0 : cb;
+			return ca - cb;
+		}
+	}
+
+	if (a->length != b->length)
+	{
+		return (a->length < b->length) ? -1 : 1;
+	}
+
+	// Recursive requests first, then walks before entries, so a duplicate
+	// only ever upgrades the walk.
+	if (a->recursive != b->recursive)
+	{
+		return (int)b->recursive - (int)a->recursive;
+	}
+
+	return (int)a->entry - (int)b->entry;
+}
+
+// Returns true if request lies somewhere underneath ancestor.
+static Boolean CoalesceIsBelow(const struct coalesce_request_t *request,
+							   const struct coalesce_request_t *ancestor)
+{
+	return (request->length > ancestor->length &&
+			request->path[ancestor->length] == '/' &&
+			memcmp(request->path, ancestor->path, ancestor->length) == 0);
+}
+
+// Returns true if request is an entry directly inside the directory walk
+// covers.
+static Boolean CoalesceIsChild(const struct coalesce_request_t *request,
+							   const struct coalesce_request_t *walk)
+{
+	return (CoalesceIsBelow(request, walk) &&
+			memchr(request->path + walk->length + 1, '/',
+				   request->length - walk->length - 1) == NULL);
+}
+
+// request is being dropped for kept, which has to answer for its event too.
+static void CoalesceTakeEvent(struct coalesce_request_t *kept,
+							  const struct coalesce_request_t *request)
+{
+	if (request->eventId > kept->eventId)
+	{
+		kept->eventId = request->eventId;
+	}
+}
+
+size_t CoalesceRequests(struct coalesce_request_t *requests, size_t count)
+{
+	struct coalesce_request_t *cover = NULL, *directory = NULL;
+	size_t i, kept = 0;
+
+	if (count < 2)
+	{
+		if (count == 1)
+		{
+			requests[0].length = CoalescePathLength(requests[0].path);
+		}
+		return count;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		requests[i].length = CoalescePathLength(requests[i].path);
+	}
+
+	qsort(requests, count, sizeof(struct coalesce_request_t), CoalesceCompare);
+
+	for (i = 0; i < count; i++)
+	{
+		struct coalesce_request_t *last = kept ? &requests[kept - 1] : NULL;
+
+		if (last && last->length == requests[i].length &&
+			memcmp(last->path, requests[i].path, last->length) == 0)
+		{
+			// Same directory twice.  The sort put a recursive one first, and
+			// a walk before an entry; a walk takes in its own directory.
+			CoalesceTakeEvent(last, &requests[i]);
+			continue;
+		}
+
+		// Only a recursive walk is sure to reach everything below it; a plain
+		// one skips subdirectories it has already verified, which is exactly
+		// where a descendant's event says something changed.
+		if (cover && CoalesceIsBelow(&requests[i], cover))
+		{
+			CoalesceTakeEvent(cover, &requests[i]);
+			continue;
+		}
+
+		// A plain walk does look at everything directly inside, though.
+		if (directory && requests[i].entry && !requests[i].recursive &&
+			CoalesceIsChild(&requests[i], directory))
+		{
+			CoalesceTakeEvent(directory, &requests[i]);
+			continue;
+		}
+
+		requests[kept] = requests[i];
+
+		if (requests[kept].recursive)
+		{
+			cover = &requests[kept];
+		}
+
+		if (!requests[kept].entry)
+		{
+			directory = &requests[kept];
+		}
+
+		kept++;
+	}
+
+	if (kept < count)
+	{
+		walksSaved += count - kept;
+		LogV("Coalesced %lu event paths into %lu walks.\n",
+			 (unsigned long)count, (unsigned long)kept);
+	}
+
+	return kept;
+}
+
+unsigned long CoalesceWalksSaved(void)
+{
+	return walksSaved;
+}
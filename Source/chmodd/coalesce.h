@@ -0,0 +1,39 @@
+/*
+ *	coalesce.h -- folding a batch of event paths into as few walks as possible.
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#ifndef CHMODD_COALESCE_H
+#define CHMODD_COALESCE_H
+
+#include <stddef.h>
+#include "chmodd.h"
+
+// One walk we've been asked for.  length is filled in by CoalesceRequests().
+// With entry set it's only the one file or directory at path (file events,
+// -e); recursive then means walking it too if it's a directory.  eventId is
+// the event that asked for it (0 if there's no such thing).
+struct coalesce_request_t {
+	const char				*path;
+	size_t					length;
+	Boolean					recursive;
+	Boolean					entry;
+	UInt64					eventId;
+};
+
+// Sorts requests, merges duplicates (recursive wins, and a walk beats an
+// entry) and drops anything a recursive walk of an ancestor in the same batch
+// will already cover, along with entries whose directory is being walked.
+// Whatever's kept takes the newest eventId of the requests it stands in for.
+// The survivors are packed at the front; returns how many there are.
+size_t CoalesceRequests(struct coalesce_request_t *requests, size_t count);
+
+// Total number of walks CoalesceRequests() has saved us since launch.
+unsigned long CoalesceWalksSaved(void);
+
+#endif
@@ -0,0 +1,211 @@
+/*
+ *	compat.c -- BSD library routines chmodd relies on that other platforms
+ *	don't have.
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#ifndef __APPLE__
+
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chmodd.h"
+#include "compat.h"
+
+#define USER_BITS		(S_ISUID | S_IRWXU)
+#define GROUP_BITS		(S_ISGID | S_IRWXG)
+#define OTHER_BITS		(S_IRWXO)
+#define STANDARD_BITS	(USER_BITS | GROUP_BITS | OTHER_BITS)
+#define ALL_BITS		(STANDARD_BITS | S_ISVTX)
+
+// One "who op perms" step of a symbolic mode.  The list ends with op == 0.
+struct modeop_t {
+	char		op;			// '+', '-' or '='
+	mode_t		who;		// Bits this step may touch
+	mode_t		clear;		// Bits '=' clears before setting
+	mode_t		bits;		// Bits to add/remove/set (before X and copies)
+	Boolean		conditionalExecute;	// "X"
+	char		copy;		// 'u', 'g' or 'o' to copy that class, else 0
+};
+
+// Which bits of a class (shifted to the "other" position) to copy.
+static mode_t copyClass(mode_t mode, char from)
+{
+	switch (from) {
+		case 'u':
+			return (mode >> 6) & 07;
+		case 'g':
+			return (mode >> 3) & 07;
+		case 'o':
+		default:
+			return mode & 07;
+	}
+}
+
+void *setmode(const char *mode_str)
+{
+	struct modeop_t *ops;
+	size_t count = 0, capacity;
+	const char *p = mode_str;
+	mode_t mask;
+	char *end;
+
+	if (!mode_str || !*mode_str)
+	{
+		return NULL;
+	}
+
+	// Every op character needs at most one step, plus the terminator.
+	capacity = strlen(mode_str) + 1;
+	if ((ops = calloc(capacity, sizeof(struct modeop_t))) == NULL)
+	{
+		return NULL;
+	}
+
+	// Absolute (octal) modes are one '=' over everything.
+	if (*p >= '0' && *p <= '7')
+	{
+		unsigned long value = strtoul(p, &end, 8);
+
+		if (*end != '\0' || value > 07777)
+		{
+			free(ops);
+			return NULL;
+		}
+
+		ops[0].op = '=';
+		ops[0].who = ALL_BITS;
+		ops[0].clear = ALL_BITS;
+		ops[0].bits = (mode_t)value;
+		return ops;
+	}
+
+	// Like chmod(1), bits in the umask are left alone when no "who" is given.
+	mask = umask(0);
+	umask(mask);
+
+	while (*p)
+	{
+		mode_t who = 0;
+		Boolean whoGiven = false;
+
+		for (;; p++)
+		{
+			if (*p == 'u')			who |= USER_BITS;
+			else if (*p == 'g')		who |= GROUP_BITS;
+			else if (*p == 'o')		who |= OTHER_BITS;
+			else if (*p == 'a')		who |= STANDARD_BITS;
+			else break;
+			whoGiven = true;
+		}
+
+		if (!whoGiven)
+		{
+			who = STANDARD_BITS & ~mask;
+		}
+
+		if (*p != '+' && *p != '-' && *p != '=')
+		{
+			free(ops);
+			return NULL;
+		}
+
+		while (*p == '+' || *p == '-' || *p == '=')
+		{
+			struct modeop_t *op = &ops[count++];
+
+			op->op = *p++;
+			op->who = who;
+
+			if (*p == 'u' || *p == 'g' || *p == 'o')
+			{
+				op->copy = *p++;
+				op->clear = whoGiven ? who : STANDARD_BITS;
+				continue;
+			}
+
+			for (;; p++)
+			{
+				if (*p == 'r')			op->bits |= S_IRUSR | S_IRGRP | S_IROTH;
+				else if (*p == 'w')		op->bits |= S_IWUSR | S_IWGRP | S_IWOTH;
+				else if (*p == 'x')		op->bits |= S_IXUSR | S_IXGRP | S_IXOTH;
+				else if (*p == 'X')		op->conditionalExecute = true;
+				else if (*p == 's')		op->bits |= S_ISUID | S_ISGID;
+				else if (*p == 't')
+				{
+					// As in BSD, the sticky bit is ignored for "o" alone.
+					op->bits |= S_ISVTX;
+					if (!whoGiven || (who & ~OTHER_BITS))
+					{
+						op->who |= S_ISVTX;
+					}
+				}
+				else break;
+			}
+
+			// With no "who", '=' clears everything but the sticky bit (unless
+			// it's being set), whatever the umask, and sets what the umask
+			// lets through.
+			op->clear = whoGiven ? op->who :
+				STANDARD_BITS | (op->who & S_ISVTX);
+		}
+
+		if (*p == ',')
+		{
+			p++;
+		}
+		else if (*p)
+		{
+			free(ops);
+			return NULL;
+		}
+	}
+
+	ops[count].op = 0;
+	return ops;
+}
+
+mode_t getmode(const void *set, mode_t mode)
+{
+	const struct modeop_t *op;
+	mode_t newmode = mode;
+
+	for (op = set; op->op; op++)
+	{
+		mode_t bits = op->bits;
+
+		if (op->copy)
+		{
+			bits = copyClass(newmode, op->copy) * (S_IXUSR | S_IXGRP | S_IXOTH);
+		}
+
+		if (op->conditionalExecute &&
+			(S_ISDIR(newmode) || (newmode & (S_IXUSR | S_IXGRP | S_IXOTH))))
+		{
+			bits |= S_IXUSR | S_IXGRP | S_IXOTH;
+		}
+
+		bits &= op->who;
+
+		switch (op->op) {
+			case '+':
+				newmode |= bits;
+				break;
+			case '-':
+				newmode &= ~bits;
+				break;
+			case '=':
+				newmode = (newmode & ~op->clear) | bits;
+				break;
+		}
+	}
+
+	return newmode;
+}
+
+#endif
@@ -0,0 +1,27 @@
+/*
+ *	compat.h -- BSD library routines chmodd relies on that other platforms
+ *	don't have.
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#ifndef CHMODD_COMPAT_H
+#define CHMODD_COMPAT_H
+
+#ifndef __APPLE__
+
+#include <sys/types.h>
+
+// Same contract as setmode(3)/getmode(3): setmode() compiles a chmod(1) style
+// mode (octal or symbolic) into a malloc'd blob the caller frees, or returns
+// NULL if it doesn't parse.  getmode() applies it to an existing st_mode.
+void *setmode(const char *mode_str);
+mode_t getmode(const void *set, mode_t mode);
+
+#endif
+
+#endif
@@ -0,0 +1,302 @@
+/*
+ *	dispatch.c -- which policy an event path belongs to, when every root
+ *	shares one stream (-s).
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "dispatch.h"
+#include "latency.h"
+
+struct dispatch_t *DispatchCreate(void)
+{
+	struct dispatch_t *dispatch = calloc(1, sizeof(struct dispatch_t));
+
+	if (!dispatch)
+	{
+		LogError("Couldn't allocate root table\n");
+		return NULL;
+	}
+
+	dispatch->refCount = 1;
+
+	return dispatch;
+}
+
+const void *DispatchRetain(const void *info)
+{
+	struct dispatch_t *dispatch = (struct dispatch_t *)info;
+
+	__sync_add_and_fetch(&dispatch->refCount, 1);
+
+	return info;
+}
+
+static void DispatchFreeNode(struct dispatch_node_t *node)
+{
+	size_t i;
+
+	for (i = 0; i < node->childCount; i++)
+	{
+		DispatchFreeNode(node->children[i]);
+		free(node->children[i]);
+	}
+
+	free(node->children);
+	free(node->name);
+}
+
+void DispatchRelease(const void *info)
+{
+	struct dispatch_t *dispatch = (struct dispatch_t *)info;
+	size_t i;
+
+	if (__sync_sub_and_fetch(&dispatch->refCount, 1) > 0)
+	{
+		return;
+	}
+
+	for (i = 0; i < dispatch->policyCount; i++)
+	{
+		PolicyRelease(dispatch->policies[i]);
+	}
+
+	if (dispatch->latency)
+	{
+		LatencyRelease(dispatch->latency);
+	}
+
+	DispatchFreeNode(&dispatch->root);
+	free(dispatch->policies);
+	free(dispatch);
+}
+
+// Finds where name (length long) is, or would go, in node's children.
+static size_t DispatchSearch(const struct dispatch_node_t *node,
+							 const char *name, size_t length, Boolean *found)
+{
+	size_t low = 0, high = node->childCount;
+
+	*found = false;
+
+	while (low < high)
+	{
+		size_t middle = (low + high) / 2;
+		const struct dispatch_node_t *child = node->children[middle];
+		size_t shorter = (child->nameLength < length) ? child->nameLength :
+			length;
+		int compare = memcmp(child->name, name, shorter);
+
+		if (compare == 0)
+		{
+			compare = (child->nameLength > length) -
+				(child->nameLength < length);
+		}
+
+		if (compare == 0)
+		{
+			*found = true;
+			return middle;
+		}
+
+		if (compare < 0)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+
+	return low;
+}
+
+// Returns the start of the next component at or after *path, and its length
+// in *length, leaving *path just past it.  NULL when there are no more.
+static const char *DispatchNextComponent(const char **path, size_t *length)
+{
+	const char *start = *path;
+
+	while (*start == '/')
+	{
+		start++;
+	}
+
+	if (!*start)
+	{
+		return NULL;
+	}
+
+	*path = start;
+	while (**path && **path != '/')
+	{
+		(*path)++;
+	}
+
+	*length = *path - start;
+
+	return start;
+}
+
+static struct dispatch_node_t *DispatchInsertChild(struct dispatch_node_t *node,
+												   const char *name,
+												   size_t length,
+												   size_t index)
+{
+	struct dispatch_node_t *child = calloc(1, sizeof(struct dispatch_node_t));
+
+	if (!child || (child->name = malloc(length + 1)) == NULL)
+	{
+		free(child);
+		return NULL;
+	}
+
+	memcpy(child->name, name, length);
+	child->name[length] = '\0';
+	child->nameLength = length;
+
+	if (node->childCount == node->childCapacity)
+	{
+		size_t capacity = node->childCapacity ? node->childCapacity * 2 : 4;
+		struct dispatch_node_t **children =
+			realloc(node->children, capacity * sizeof(*children));
+
+		if (!children)
+		{
+			free(child->name);
+			free(child);
+			return NULL;
+		}
+
+		node->children = children;
+		node->childCapacity = capacity;
+	}
+
+	memmove(node->children + index + 1, node->children + index,
+			(node->childCount - index) * sizeof(*(node->children)));
+	node->children[index] = child;
+	node->childCount++;
+
+	return child;
+}
+
+// Tells outer about the topmost roots below node.
+static void DispatchNestBelow(struct policy_t *outer,
+							  const struct dispatch_node_t *node)
+{
+	size_t i;
+
+	for (i = 0; i < node->childCount; i++)
+	{
+		if (node->children[i]->policy)
+		{
+			PolicyAddNestedRoot(outer, node->children[i]->policy->path);
+		}
+		else
+		{
+			DispatchNestBelow(outer, node->children[i]);
+		}
+	}
+}
+
+Boolean DispatchAddPolicy(struct dispatch_t *dispatch, struct policy_t *policy)
+{
+	struct dispatch_node_t *node = &dispatch->root;
+	struct policy_t *outer = node->policy;
+	const char *p = policy->path, *name;
+	size_t length, index;
+	Boolean found;
+
+	while ((name = DispatchNextComponent(&p, &length)) != NULL)
+	{
+		index = DispatchSearch(node, name, length, &found);
+
+		if (!found &&
+			(node = DispatchInsertChild(node, name, length, index)) == NULL)
+		{
+			LogError("Couldn't allocate root table entry for %s\n",
+					 policy->path);
+			return false;
+		}
+		else if (found)
+		{
+			node = node->children[index];
+		}
+
+		if (node->policy && *p)
+		{
+			outer = node->policy;
+		}
+	}
+
+	if (node->policy)
+	{
+		LogError("%s is configured more than once\n", policy->path);
+		return false;
+	}
+
+	if (dispatch->policyCount == dispatch->policyCapacity)
+	{
+		size_t capacity = dispatch->policyCapacity ?
+			dispatch->policyCapacity * 2 : 16;
+		struct policy_t **policies = realloc(dispatch->policies,
+											 capacity * sizeof(*policies));
+
+		if (!policies)
+		{
+			return false;
+		}
+
+		dispatch->policies = policies;
+		dispatch->policyCapacity = capacity;
+	}
+
+	node->policy = (struct policy_t *)PolicyRetain(policy);
+	dispatch->policies[dispatch->policyCount++] = policy;
+
+	// Whoever held this part of the tree before has to stop at it now, and
+	// anything already configured below it is its to stop at.
+	if (outer)
+	{
+		PolicyAddNestedRoot(outer, policy->path);
+	}
+	DispatchNestBelow(policy, node);
+
+	return true;
+}
+
+struct policy_t *DispatchLookup(const struct dispatch_t *dispatch,
+								const char *path)
+{
+	const struct dispatch_node_t *node = &dispatch->root;
+	struct policy_t *retVal = node->policy;
+	const char *name;
+	size_t length, index;
+	Boolean found;
+
+	while ((name = DispatchNextComponent(&path, &length)) != NULL)
+	{
+		index = DispatchSearch(node, name, length, &found);
+
+		if (!found)
+		{
+			break;
+		}
+
+		node = node->children[index];
+
+		if (node->policy)
+		{
+			retVal = node->policy;
+		}
+	}
+
+	return retVal;
+}
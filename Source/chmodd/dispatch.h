@@ -0,0 +1,56 @@
+/*
+ *	dispatch.h -- which policy an event path belongs to, when every root
+ *	shares one stream (-s).
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#ifndef CHMODD_DISPATCH_H
+#define CHMODD_DISPATCH_H
+
+#include "chmodd.h"
+#include "policy.h"
+
+// One path component.  children is kept sorted by name, so finding the next
+// component is a binary search.
+struct dispatch_node_t {
+	char					*name;
+	size_t					nameLength;
+	struct dispatch_node_t	**children;
+	size_t					childCount;
+	size_t					childCapacity;
+	struct policy_t			*policy;	// If a root ends here
+};
+
+// A trie of root paths, plus every policy in it in the order it was added.
+struct dispatch_t {
+	int						refCount;
+	struct dispatch_node_t	root;
+	struct policy_t			**policies;
+	size_t					policyCount;
+	size_t					policyCapacity;
+
+	// The shared stream's latency (see latency.h), made when it starts.
+	struct latency_t		*latency;
+};
+
+struct dispatch_t *DispatchCreate(void);
+
+// Reference counting, shaped to be used as FSEventStreamContext callbacks.
+const void *DispatchRetain(const void *info);
+void DispatchRelease(const void *info);
+
+// Adds (retaining) policy under its root path.  Roots inside other roots are
+// fine: each one is told about the roots nested in it, so its walks leave
+// them alone.  Returns false if the root is already there.
+Boolean DispatchAddPolicy(struct dispatch_t *dispatch, struct policy_t *policy);
+
+// Returns the policy of the most specific root path is in, or NULL.
+struct policy_t *DispatchLookup(const struct dispatch_t *dispatch,
+								const char *path);
+
+#endif
@@ -0,0 +1,87 @@
+/*
+ *	echo.c -- telling the attribute events our own fixes cause apart from
+ *	everyone else's.
+ *
+ *	Every chmod or chown a walk makes comes straight back from inotify (or
+ *	fanotify) as an attribute event on the entry and its directory.  Taken
+ *	at face value, each one walks the directory that was just put right.  So
+ *	walks note what they change here, by a hash of the path, and the streams
+ *	turn an attribute event for something on the list into a look at just
+ *	that entry.  A slot that gets reused before its time is up only costs a
+ *	walk we'd have done anyway.
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#ifndef __APPLE__
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include "echo.h"
+
+struct echo_slot_t {
+	UInt64					hash;		// 0 when empty
+	double					expires;
+};
+
+static struct {
+	pthread_mutex_t			lock;
+	struct echo_slot_t		slots[ECHO_SLOTS];
+} echo = { PTHREAD_MUTEX_INITIALIZER };
+
+// FNV-1a, never 0.
+static UInt64 EchoHash(const char *path)
+{
+	const unsigned char *p = (const unsigned char *)path;
+	UInt64 hash = 14695981039346656037ULL;
+
+	while (*p)
+	{
+		hash ^= *p++;
+		hash *= 1099511628211ULL;
+	}
+
+	return hash ? hash : 1;
+}
+
+static double EchoNow(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void EchoNoteChange(const char *path)
+{
+	UInt64 hash = EchoHash(path);
+	struct echo_slot_t *slot = &(echo.slots[hash & (ECHO_SLOTS - 1)]);
+	double expires = EchoNow() + ECHO_SECONDS;
+
+	pthread_mutex_lock(&echo.lock);
+	slot->hash = hash;
+	slot->expires = expires;
+	pthread_mutex_unlock(&echo.lock);
+}
+
+Boolean EchoIsOwnChange(const char *path)
+{
+	UInt64 hash = EchoHash(path);
+	struct echo_slot_t *slot = &(echo.slots[hash & (ECHO_SLOTS - 1)]);
+	double now = EchoNow();
+	Boolean own;
+
+	pthread_mutex_lock(&echo.lock);
+	own = (slot->hash == hash && slot->expires > now);
+	pthread_mutex_unlock(&echo.lock);
+
+	return own;
+}
+
+#endif
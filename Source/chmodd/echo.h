@@ -0,0 +1,37 @@
+/*
+ *	echo.h -- telling the attribute events our own fixes cause apart from
+ *	everyone else's.
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#ifndef CHMODD_ECHO_H
+#define CHMODD_ECHO_H
+
+#ifndef __APPLE__
+
+#include "chmodd.h"
+
+// How long after a fix its events are taken for ours, and how many fixes
+// are remembered.  FSEvents has kFSEventStreamCreateFlagIgnoreSelf for this;
+// inotify and fanotify don't.
+#define ECHO_SECONDS		2.0
+#define ECHO_SLOTS			4096	// A power of two
+
+// Notes that a walk just changed the entry at path.  Safe to call from any
+// number of walker threads.
+void EchoNoteChange(const char *path);
+
+// Returns true if the entry at path was changed by a walk within the last
+// ECHO_SECONDS, so an attribute event for it is most likely ours.  Only most
+// likely: somebody else could have changed it in between, so the caller
+// should still look at the entry, just not at everything around it.
+Boolean EchoIsOwnChange(const char *path);
+
+#endif
+
+#endif
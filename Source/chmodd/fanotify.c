@@ -0,0 +1,425 @@
+/*
+ *	fanotify.c -- a Linux event stream that watches the root's whole
+ *	filesystem with one mark.
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#ifdef __linux__
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/fanotify.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "stream.h"
+#include "metrics.h"
+#include "rescan.h"
+#include "echo.h"
+
+#ifdef FAN_REPORT_DFID_NAME
+
+#define FANOTIFY_EVENTS		(FAN_ATTRIB | FAN_CREATE | FAN_MOVED_FROM |	\
+							 FAN_MOVED_TO | FAN_ONDIR)
+
+#define FANOTIFY_BUFFER_SIZE	65536
+#define FANOTIFY_HANDLE_SIZE	128
+
+// Something open on each filesystem we have a mark on, for
+// open_by_handle_at().
+struct fanotify_mount_t {
+	fsid_t					fsid;
+	int						fd;
+};
+
+struct fanotify_context_t {
+	struct fanotify_mount_t	*mounts;
+	size_t					mountCount;
+
+	// Events come in runs from the same directory, so remember the last
+	// handle we turned into a path.
+	unsigned char			lastHandle[sizeof(struct file_handle) +
+									   FANOTIFY_HANDLE_SIZE];
+	size_t					lastHandleSize;
+	fsid_t					lastFsid;
+	char					lastPath[PATH_MAX];
+	Boolean					lastInRoot;
+
+	unsigned long			eventsSeen;
+	unsigned long			eventsOutside;
+};
+
+// Turns a directory handle on the filesystem fsid into its current path,
+// and sets inRoot.  Returns false if the directory is already gone.
+static Boolean FanotifyResolve(struct stream_t *stream,
+							   const fsid_t *fsid,
+							   struct file_handle *handle,
+							   char *path,
+							   Boolean *inRoot)
+{
+	struct fanotify_context_t *context = stream->context;
+	size_t i, handleSize = sizeof(struct file_handle) + handle->handle_bytes;
+	char link[64];
+	ssize_t length;
+	int fd, mountFd = -1;
+
+	if (handleSize == context->lastHandleSize &&
+		memcmp(fsid, &context->lastFsid, sizeof(fsid_t)) == 0 &&
+		memcmp(handle, context->lastHandle, handleSize) == 0)
+	{
+		memcpy(path, context->lastPath, PATH_MAX);
+		*inRoot = context->lastInRoot;
+		return true;
+	}
+
+	for (i = 0; i < context->mountCount && mountFd == -1; i++)
+	{
+		if (memcmp(fsid, &context->mounts[i].fsid, sizeof(fsid_t)) == 0)
+		{
+			mountFd = context->mounts[i].fd;
+		}
+	}
+
+	if (mountFd == -1)
+	{
+		return false;
+	}
+
+	if ((fd = open_by_handle_at(mountFd, handle, O_PATH)) == -1)
+	{
+		// Deleted since, most likely.
+		if (errno != ESTALE && errno != ENOENT)
+		{
+			LogError("open_by_handle_at: %s\n", strerror(errno));
+		}
+		return false;
+	}
+
+	snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+	length = readlink(link, path, PATH_MAX - 1);
+	close(fd);
+
+	if (length == -1)
+	{
+		return false;
+	}
+
+	path[length] = '\0';
+	*inRoot = (StreamPolicyForPath(stream, path) != NULL);
+
+	if (handleSize <= sizeof(context->lastHandle))
+	{
+		memcpy(context->lastHandle, handle, handleSize);
+		context->lastHandleSize = handleSize;
+		memcpy(&context->lastFsid, fsid, sizeof(fsid_t));
+		memcpy(context->lastPath, path, PATH_MAX);
+		context->lastInRoot = *inRoot;
+	}
+
+	return true;
+}
+
+// An attribute change to something a walk has just fixed is most likely the
+// walk's own (see echo.h): worth a look at that entry, but not a walk of the
+// directory it's in.
+static Boolean FanotifyIsEcho(const struct fanotify_event_metadata *event,
+							  const char *path, const char *name)
+{
+	char childPath[PATH_MAX];
+
+	if ((event->mask & (FAN_ATTRIB | FAN_CREATE | FAN_MOVED_TO)) != FAN_ATTRIB)
+	{
+		return false;
+	}
+
+	if (strcmp(name, ".") == 0)
+	{
+		return EchoIsOwnChange(path);
+	}
+
+	return snprintf(childPath, PATH_MAX, "%s/%s",
+					strcmp(path, "/") ? path : "", name) < PATH_MAX &&
+		EchoIsOwnChange(childPath);
+}
+
+static void FanotifyHandleEvent(struct stream_t *stream,
+								const struct fanotify_event_metadata *event)
+{
+	struct fanotify_context_t *context = stream->context;
+	const struct fanotify_event_info_fid *fid;
+	struct file_handle *handle;
+	char path[PATH_MAX], childPath[PATH_MAX];
+	Boolean inRoot;
+	const char *name;
+	size_t i;
+
+	context->eventsSeen++;
+	MetricsCountEvents(1);
+
+	if (event->mask & FAN_Q_OVERFLOW)
+	{
+		// As with inotify, the queue is this stream's, and the walks fold
+		// together while they're queued.
+		for (i = 0; i < StreamRootCount(stream); i++)
+		{
+			LogV("fanotify queue overflowed, rescanning %s\n",
+				 StreamRootAt(stream, i)->path);
+			RescanRequestWalk(StreamRootAt(stream, i),
+							  StreamRootAt(stream, i)->path, true);
+		}
+		return;
+	}
+
+	if (event->event_len < event->metadata_len + sizeof(*fid))
+	{
+		return;
+	}
+
+	fid = (const struct fanotify_event_info_fid *)
+		((const char *)event + event->metadata_len);
+
+	if (fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME)
+	{
+		return;
+	}
+
+	handle = (struct file_handle *)fid->handle;
+	name = (const char *)handle->f_handle + handle->handle_bytes;
+
+	if (!FanotifyResolve(stream, (const fsid_t *)&fid->fsid, handle, path,
+						 &inRoot))
+	{
+		return;
+	}
+
+	if (!inRoot)
+	{
+		// We see the whole filesystem; this is where it gets narrowed down
+		// to the roots.  A _force root being moved away happens in its
+		// parent, though, which is outside.
+		if ((event->mask & FAN_MOVED_FROM) &&
+			snprintf(childPath, PATH_MAX, "%s/%s", path, name) < PATH_MAX)
+		{
+			for (i = 0; i < StreamRootCount(stream); i++)
+			{
+				struct policy_t *policy = StreamRootAt(stream, i);
+
+				if (policy->force &&
+					strcmp(childPath, policy->configPath) == 0)
+				{
+					StreamRootMoved(policy);
+				}
+			}
+		}
+
+		context->eventsOutside++;
+		return;
+	}
+
+	if (event->mask & FAN_MOVED_FROM)
+	{
+		// Whatever was renamed may be a directory we have cached.
+		context->lastHandleSize = 0;
+		return;
+	}
+
+	if ((event->mask & FAN_ONDIR) &&
+		(event->mask & (FAN_CREATE | FAN_MOVED_TO)) &&
+		strcmp(name, ".") != 0 &&
+		snprintf(childPath, PATH_MAX, "%s/%s",
+				 strcmp(path, "/") ? path : "", name) < PATH_MAX)
+	{
+		// A new directory may have filled up before we got to it.
+		StreamRequestWalk(stream, childPath, true);
+	}
+	else if (!globals->fileEvents && !FanotifyIsEcho(event, path, name))
+	{
+		StreamRequestWalk(stream, path, false);
+	}
+	else if (strcmp(name, ".") == 0)
+	{
+		// Something about the directory itself.
+		StreamRequestEntry(stream, path, false);
+	}
+	else if (snprintf(childPath, PATH_MAX, "%s/%s",
+					  strcmp(path, "/") ? path : "", name) < PATH_MAX)
+	{
+		StreamRequestEntry(stream, childPath, false);
+	}
+}
+
+static void FanotifyRead(struct stream_t *stream)
+{
+	char buffer[FANOTIFY_BUFFER_SIZE]
+	__attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+	ssize_t length;
+
+	// Directories may have moved since we last looked.
+	((struct fanotify_context_t *)stream->context)->lastHandleSize = 0;
+
+	while ((length = read(stream->fd, buffer, FANOTIFY_BUFFER_SIZE)) > 0)
+	{
+		struct fanotify_event_metadata *event;
+
+		for (event = (struct fanotify_event_metadata *)buffer;
+			 FAN_EVENT_OK(event, length);
+			 event = FAN_EVENT_NEXT(event, length))
+		{
+			if (event->vers != FANOTIFY_METADATA_VERSION)
+			{
+				LogError("fanotify metadata version mismatch\n");
+				return;
+			}
+
+			FanotifyHandleEvent(stream, event);
+		}
+	}
+
+	if (length == -1 && errno != EAGAIN && errno != EINTR)
+	{
+		LogError("fanotify read: %s\n", strerror(errno));
+	}
+}
+
+static void FanotifyRelease(struct stream_t *stream)
+{
+	struct fanotify_context_t *context = stream->context;
+	size_t i;
+
+	LogMV("MV: fanotify saw %lu events, %lu outside the roots\n",
+		  context->eventsSeen, context->eventsOutside);
+
+	for (i = 0; i < context->mountCount; i++)
+	{
+		close(context->mounts[i].fd);
+	}
+
+	free(context->mounts);
+	free(context);
+}
+
+// Marks the filesystem holding path, keeping something open on it if it's
+// one we haven't seen.  Returns false if that can't be done.
+static Boolean FanotifyMarkRoot(struct stream_t *stream, const char *path)
+{
+	struct fanotify_context_t *context = stream->context;
+	struct fanotify_mount_t *mounts;
+	struct statfs info;
+	size_t i;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1 ||
+		fstatfs(fd, &info) == -1)
+	{
+		LogError("%s: %s\n", path, strerror(errno));
+		if (fd != -1)
+		{
+			close(fd);
+		}
+		return false;
+	}
+
+	for (i = 0; i < context->mountCount; i++)
+	{
+		if (memcmp(&info.f_fsid, &context->mounts[i].fsid,
+				   sizeof(fsid_t)) == 0)
+		{
+			// Already marked, along with the rest of its filesystem.
+			close(fd);
+			return true;
+		}
+	}
+
+	mounts = realloc(context->mounts,
+					 (context->mountCount + 1) * sizeof(*mounts));
+	if (!mounts)
+	{
+		close(fd);
+		return false;
+	}
+
+	context->mounts = mounts;
+	mounts[context->mountCount].fsid = info.f_fsid;
+	mounts[context->mountCount].fd = fd;
+	context->mountCount++;
+
+	if (fanotify_mark(stream->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+					  FANOTIFY_EVENTS, AT_FDCWD, path) == -1)
+	{
+		LogError("fanotify_mark %s: %s\n", path, strerror(errno));
+		return false;
+	}
+
+	LogV("Watching the filesystem holding %s with fanotify\n", path);
+
+	return true;
+}
+
+struct stream_t *FanotifyStreamCreate(struct policy_t *policy,
+									  struct dispatch_t *dispatch)
+{
+	struct fanotify_context_t *context;
+	struct stream_t *stream;
+	size_t i;
+
+	if ((stream = StreamCreate(policy, dispatch, "fanotify")) == NULL)
+	{
+		return NULL;
+	}
+
+	if ((context = calloc(1, sizeof(struct fanotify_context_t))) == NULL)
+	{
+		LogError("Couldn't allocate fanotify stream\n");
+		StreamReleaseOne(stream);
+		return NULL;
+	}
+
+	stream->context = context;
+	stream->read = &FanotifyRead;
+	stream->release = &FanotifyRelease;
+
+	stream->fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK |
+							   FAN_REPORT_DFID_NAME,
+							   O_RDONLY | O_CLOEXEC);
+	if (stream->fd == -1)
+	{
+		LogError("fanotify_init: %s (needs CAP_SYS_ADMIN and Linux 5.9)\n",
+				 strerror(errno));
+		StreamReleaseOne(stream);
+		return NULL;
+	}
+
+	for (i = 0; i < StreamRootCount(stream); i++)
+	{
+		if (!FanotifyMarkRoot(stream, StreamRootAt(stream, i)->path))
+		{
+			StreamReleaseOne(stream);
+			return NULL;
+		}
+	}
+
+	return stream;
+}
+
+#else
+
+struct stream_t *FanotifyStreamCreate(struct policy_t *policy,
+									  struct dispatch_t *dispatch)
+{
+	LogError("This system's headers don't have FAN_REPORT_DFID_NAME, use "
+			 "-S inotify\n");
+	return NULL;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,363 @@
+/*
+ *	history.c -- where each root's event stream got to, so a restart can pick
+ *	up from there.
+ *
+ *	FSEvents keeps a history of every volume, so a stream started from the
+ *	last event we dealt with gets everything that happened while we weren't
+ *	running, and that's far cheaper than walking the whole root again.  What
+ *	we keep is one line per root:
+ *
+ *		<event id> <volume UUID> <root path>
+ *
+ *	The UUID is the volume's event history's, not the volume's; it changes if
+ *	that history is thrown away, and then the ids mean nothing any more.  The
+ *	file is written whole to a temporary and renamed over the old one, so a
+ *	crash leaves either the old ids or the new ones, never half of each.
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "history.h"
+
+// Saving means an fsync, so a busy stream doesn't get one every run loop pass.
+#define HISTORY_SAVE_SECONDS	30
+#define HISTORY_UUID_LENGTH		40
+
+struct history_entry_t {
+	char					*path;
+	char					uuid[HISTORY_UUID_LENGTH];
+	UInt64					eventId;
+	UInt64					handedOver;	// Not done yet, if past eventId
+};
+
+static struct {
+	pthread_mutex_t			lock;
+	char					path[PATH_MAX];		// Empty: don't save
+	struct history_entry_t	*entries;
+	size_t					count;
+	Boolean					dirty;
+	time_t					lastSave;
+} history = { PTHREAD_MUTEX_INITIALIZER };
+
+static struct history_entry_t *HistoryFindLocked(const char *rootPath)
+{
+	size_t i;
+
+	for (i = 0; i < history.count; i++)
+	{
+		if (strcmp(history.entries[i].path, rootPath) == 0)
+		{
+			return &history.entries[i];
+		}
+	}
+
+	return NULL;
+}
+
+static struct history_entry_t *HistoryAddLocked(const char *rootPath)
+{
+	struct history_entry_t *entries, *entry;
+
+	if ((entries = realloc(history.entries, (history.count + 1) *
+						   sizeof(struct history_entry_t))) == NULL)
+	{
+		return NULL;
+	}
+	history.entries = entries;
+
+	entry = &history.entries[history.count];
+	memset(entry, 0, sizeof(*entry));
+
+	if ((entry->path = strdup(rootPath)) == NULL)
+	{
+		return NULL;
+	}
+
+	history.count++;
+
+	return entry;
+}
+
+static void HistorySetLocked(struct history_entry_t *entry, const char *uuid,
+							 UInt64 eventId)
+{
+	snprintf(entry->uuid, sizeof(entry->uuid), "%s", uuid);
+	entry->eventId = eventId;
+	entry->handedOver = eventId;
+	history.dirty = true;
+}
+
+static void HistoryLoadLocked(void)
+{
+	FILE *file;
+	char line[PATH_MAX + 64];
+	char uuid[HISTORY_UUID_LENGTH];
+	unsigned long long eventId;
+	struct history_entry_t *entry;
+	int pathStart;
+	size_t length;
+
+	if ((file = fopen(history.path, "r")) == NULL)
+	{
+		if (errno != ENOENT)
+		{
+			LogError("Couldn't read event history %s: %s\n", history.path,
+					 strerror(errno));
+		}
+		return;
+	}
+
+	while (fgets(line, sizeof(line), file))
+	{
+		length = strlen(line);
+		if (length > 0 && line[length - 1] == '\n')
+		{
+			line[--length] = '\0';
+		}
+
+		if (sscanf(line, "%llu %39s %n", &eventId, uuid, &pathStart) != 2 ||
+			line[pathStart] != '/')
+		{
+			LogV("Skipping bad line in event history %s\n", history.path);
+			continue;
+		}
+
+		if ((entry = HistoryFindLocked(line + pathStart)) == NULL &&
+			(entry = HistoryAddLocked(line + pathStart)) == NULL)
+		{
+			break;
+		}
+
+		snprintf(entry->uuid, sizeof(entry->uuid), "%s", uuid);
+		entry->eventId = eventId;
+		entry->handedOver = eventId;
+	}
+
+	fclose(file);
+
+	LogV("Read event history for %lu root%s from %s\n",
+		 (unsigned long)history.count, (history.count != 1) ? "s" : "",
+		 history.path);
+}
+
+static void HistoryWriteLocked(void)
+{
+	char temporary[PATH_MAX];
+	FILE *file;
+	size_t i;
+	int fd;
+
+	history.lastSave = time(NULL);
+
+	if (!*(history.path) || !history.dirty)
+	{
+		return;
+	}
+
+	if (snprintf(temporary, sizeof(temporary), "%s.XXXXXX",
+				 history.path) >= (int)sizeof(temporary) ||
+		(fd = mkstemp(temporary)) == -1)
+	{
+		LogError("Couldn't save event history %s: %s\n", history.path,
+				 strerror(errno));
+		return;
+	}
+
+	if ((file = fdopen(fd, "w")) == NULL)
+	{
+		close(fd);
+		unlink(temporary);
+		return;
+	}
+
+	for (i = 0; i < history.count; i++)
+	{
+		// Roots we never got an id for have nothing worth keeping.
+		if (history.entries[i].uuid[0])
+		{
+			fprintf(file, "%llu %s %s\n",
+					(unsigned long long)history.entries[i].eventId,
+					history.entries[i].uuid, history.entries[i].path);
+		}
+	}
+
+	if (fflush(file) != 0 || fsync(fileno(file)) != 0)
+	{
+		LogError("Couldn't save event history %s: %s\n", history.path,
+				 strerror(errno));
+		fclose(file);
+		unlink(temporary);
+		return;
+	}
+
+	fclose(file);
+
+	if (rename(temporary, history.path) != 0)
+	{
+		LogError("Couldn't save event history %s: %s\n", history.path,
+				 strerror(errno));
+		unlink(temporary);
+		return;
+	}
+
+	history.dirty = false;
+}
+
+void HistoryOpen(const char *path)
+{
+	pthread_mutex_lock(&history.lock);
+
+	history.lastSave = time(NULL);
+
+	if (path)
+	{
+		snprintf(history.path, sizeof(history.path), "%s", path);
+		HistoryLoadLocked();
+	}
+
+	pthread_mutex_unlock(&history.lock);
+}
+
+int HistoryResume(const char *rootPath, const char *uuid, UInt64 currentId,
+				  UInt64 *since)
+{
+	struct history_entry_t *entry;
+	int retVal = HISTORY_NONE;
+
+	pthread_mutex_lock(&history.lock);
+
+	if ((entry = HistoryFindLocked(rootPath)) != NULL && entry->uuid[0])
+	{
+		// An id from the future means the history was reset under the same
+		// UUID, which we can't tell from anything else gone wrong.
+		if (strcmp(entry->uuid, uuid) == 0 && entry->eventId != 0 &&
+			entry->eventId <= currentId)
+		{
+			*since = entry->eventId;
+			pthread_mutex_unlock(&history.lock);
+			return HISTORY_RESUME;
+		}
+
+		retVal = HISTORY_LOST;
+	}
+
+	if (entry || (entry = HistoryAddLocked(rootPath)) != NULL)
+	{
+		HistorySetLocked(entry, uuid, currentId);
+	}
+
+	pthread_mutex_unlock(&history.lock);
+
+	return retVal;
+}
+
+void HistoryRestart(const char *rootPath, const char *uuid, UInt64 currentId)
+{
+	struct history_entry_t *entry;
+
+	pthread_mutex_lock(&history.lock);
+
+	if ((entry = HistoryFindLocked(rootPath)) != NULL ||
+		(entry = HistoryAddLocked(rootPath)) != NULL)
+	{
+		HistorySetLocked(entry, uuid, currentId);
+	}
+
+	pthread_mutex_unlock(&history.lock);
+}
+
+void HistoryAdvance(const char *rootPath, UInt64 eventId)
+{
+	struct history_entry_t *entry;
+
+	pthread_mutex_lock(&history.lock);
+
+	if ((entry = HistoryFindLocked(rootPath)) != NULL && entry->uuid[0] &&
+		eventId > entry->handedOver)
+	{
+		entry->handedOver = eventId;
+	}
+
+	pthread_mutex_unlock(&history.lock);
+}
+
+void HistoryCommit(void)
+{
+	size_t i;
+
+	pthread_mutex_lock(&history.lock);
+
+	for (i = 0; i < history.count; i++)
+	{
+		if (history.entries[i].handedOver > history.entries[i].eventId)
+		{
+			history.entries[i].eventId = history.entries[i].handedOver;
+			history.dirty = true;
+		}
+	}
+
+	pthread_mutex_unlock(&history.lock);
+}
+
+void HistoryLose(const char *rootPath)
+{
+	struct history_entry_t *entry;
+
+	pthread_mutex_lock(&history.lock);
+
+	// HistoryResume() takes an id of 0 to mean lost, and HistoryCommit()
+	// leaves it be.
+	if ((entry = HistoryFindLocked(rootPath)) != NULL && entry->uuid[0])
+	{
+		entry->eventId = 0;
+		entry->handedOver = 0;
+		history.dirty = true;
+	}
+
+	pthread_mutex_unlock(&history.lock);
+}
+
+void HistorySave(void)
+{
+	pthread_mutex_lock(&history.lock);
+
+	if (history.dirty && time(NULL) - history.lastSave >= HISTORY_SAVE_SECONDS)
+	{
+		HistoryWriteLocked();
+	}
+
+	pthread_mutex_unlock(&history.lock);
+}
+
+void HistoryClose(void)
+{
+	size_t i;
+
+	pthread_mutex_lock(&history.lock);
+
+	HistoryWriteLocked();
+
+	for (i = 0; i < history.count; i++)
+	{
+		free(history.entries[i].path);
+	}
+	free(history.entries);
+	history.entries = NULL;
+	history.count = 0;
+	history.path[0] = '\0';
+
+	pthread_mutex_unlock(&history.lock);
+}
@@ -0,0 +1,55 @@
+/*
+ *	history.h -- where each root's event stream got to, so a restart can pick
+ *	up from there.
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#ifndef CHMODD_HISTORY_H
+#define CHMODD_HISTORY_H
+
+#include "chmodd.h"
+
+// What HistoryResume() found for a root.
+#define HISTORY_NONE			0	// Never seen it; start from now
+#define HISTORY_RESUME			1	// *since is where to start
+#define HISTORY_LOST			2	// Seen, but its history can't be trusted
+
+// Reads what was saved at path, and saves there from now on.  With path NULL
+// nothing is read or saved.
+void HistoryOpen(const char *path);
+
+// Looks up rootPath, on the volume whose event history is uuid, whose newest
+// event is currentId.  Unless it returns HISTORY_RESUME, the root starts over
+// at currentId.
+int HistoryResume(const char *rootPath, const char *uuid, UInt64 currentId,
+				  UInt64 *since);
+
+// Forgets where rootPath got to and starts it over at currentId, as for a
+// root whose config changed.
+void HistoryRestart(const char *rootPath, const char *uuid, UInt64 currentId);
+
+// Notes that every event for rootPath up to eventId has been handed to the
+// workers (see work.h).  It only counts as dealt with, and gets saved, after
+// the next HistoryCommit().
+void HistoryAdvance(const char *rootPath, UInt64 eventId);
+
+// For when the workers have nothing left to do: whatever was handed to them
+// has been dealt with.
+void HistoryCommit(void);
+
+// Marks rootPath's history as lost, so the next start walks all of it, as for
+// a root with a walk it needed that never got done.
+void HistoryLose(const char *rootPath);
+
+// Saves, if anything has moved and it's been long enough since last time.
+void HistorySave(void);
+
+// Saves whatever has moved, and stops.
+void HistoryClose(void);
+
+#endif
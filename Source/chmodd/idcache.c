@@ -0,0 +1,200 @@
+/*
+ *	idcache.c -- user/group name to id cache shared by every stream.
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <grp.h>
+#include "idcache.h"
+
+#define IDCACHE_BUCKETS			64
+#define IDCACHE_NAME_LENGTH		256
+
+#define IDCACHE_USER			0
+#define IDCACHE_GROUP			1
+
+struct idcache_entry_t {
+	struct idcache_entry_t	*next;
+	int						type;
+	UInt32					id;
+	char					name[IDCACHE_NAME_LENGTH];
+};
+
+static struct {
+	pthread_mutex_t			lock;
+	struct idcache_entry_t	*buckets[IDCACHE_BUCKETS];
+	unsigned long			generation;
+	time_t					lastRefresh;
+	struct idcache_stats_t	stats;
+} idcache = { PTHREAD_MUTEX_INITIALIZER };
+
+static unsigned int IDCacheHash(const char *name, int type)
+{
+	unsigned int hash = 5381 + type;
+
+	while (*name)
+	{
+		hash = (hash * 33) ^ (unsigned char)*name++;
+	}
+
+	return hash % IDCACHE_BUCKETS;
+}
+
+// Must be called with the lock held.
+static void IDCacheFlushLocked(void)
+{
+	int i;
+
+	for (i = 0; i < IDCACHE_BUCKETS; i++)
+	{
+		struct idcache_entry_t *entry = idcache.buckets[i];
+
+		while (entry)
+		{
+			struct idcache_entry_t *next = entry->next;
+			free(entry);
+			entry = next;
+		}
+
+		idcache.buckets[i] = NULL;
+	}
+
+	idcache.generation++;
+	idcache.stats.refreshes++;
+	idcache.lastRefresh = time(NULL);
+}
+
+// Must be called with the lock held.
+static void IDCacheExpireLocked(void)
+{
+	if (time(NULL) - idcache.lastRefresh >= IDCACHE_REFRESH_INTERVAL)
+	{
+		IDCacheFlushLocked();
+	}
+}
+
+// Asks the directory service.  This is the expensive part we're avoiding.
+static UInt32 IDCacheResolve(const char *name, int type)
+{
+	char buffer[4096];
+	UInt32 retVal = -1;
+
+	if (type == IDCACHE_GROUP)
+	{
+		struct group group_storage, *group_info = NULL;
+
+		if (getgrnam_r(name, &group_storage, buffer, sizeof(buffer),
+					   &group_info) == 0 && group_info)
+		{
+			retVal = group_info->gr_gid;
+		}
+	}
+	else
+	{
+		struct passwd user_storage, *user_info = NULL;
+
+		if (getpwnam_r(name, &user_storage, buffer, sizeof(buffer),
+					   &user_info) == 0 && user_info)
+		{
+			retVal = user_info->pw_uid;
+		}
+	}
+
+	return retVal;
+}
+
+static UInt32 IDCacheLookup(const char *name, int type)
+{
+	struct idcache_entry_t *entry;
+	unsigned int bucket = IDCacheHash(name, type);
+	UInt32 retVal;
+
+	pthread_mutex_lock(&idcache.lock);
+
+	IDCacheExpireLocked();
+
+	for (entry = idcache.buckets[bucket]; entry; entry = entry->next)
+	{
+		if (entry->type == type && strcmp(entry->name, name) == 0)
+		{
+			idcache.stats.hits++;
+			retVal = entry->id;
+			pthread_mutex_unlock(&idcache.lock);
+			return retVal;
+		}
+	}
+
+	idcache.stats.misses++;
+	pthread_mutex_unlock(&idcache.lock);
+
+	// Don't hold the lock across what might be a network round trip.  Two
+	// threads missing on the same name at once just both ask; harmless.
+	retVal = IDCacheResolve(name, type);
+
+	if (retVal == (UInt32)-1)
+	{
+		LogError("Couldn't resolve %s name \"%s\"\n",
+				 (type == IDCACHE_GROUP) ? "group" : "user", name);
+	}
+
+	entry = calloc(1, sizeof(struct idcache_entry_t));
+	if (entry)
+	{
+		entry->type = type;
+		entry->id = retVal;
+		snprintf(entry->name, IDCACHE_NAME_LENGTH, "%s", name);
+
+		pthread_mutex_lock(&idcache.lock);
+		entry->next = idcache.buckets[bucket];
+		idcache.buckets[bucket] = entry;
+		pthread_mutex_unlock(&idcache.lock);
+	}
+
+	return retVal;
+}
+
+uid_t IDCacheLookupUser(const char *name)
+{
+	return (uid_t)IDCacheLookup(name, IDCACHE_USER);
+}
+
+gid_t IDCacheLookupGroup(const char *name)
+{
+	return (gid_t)IDCacheLookup(name, IDCACHE_GROUP);
+}
+
+void IDCacheInvalidate(void)
+{
+	pthread_mutex_lock(&idcache.lock);
+	IDCacheFlushLocked();
+	pthread_mutex_unlock(&idcache.lock);
+}
+
+unsigned long IDCacheGeneration(void)
+{
+	unsigned long retVal;
+
+	pthread_mutex_lock(&idcache.lock);
+	IDCacheExpireLocked();
+	retVal = idcache.generation;
+	pthread_mutex_unlock(&idcache.lock);
+
+	return retVal;
+}
+
+void IDCacheGetStats(struct idcache_stats_t *stats)
+{
+	pthread_mutex_lock(&idcache.lock);
+	*stats = idcache.stats;
+	pthread_mutex_unlock(&idcache.lock);
+}
@@ -0,0 +1,41 @@
+/*
+ *	idcache.h -- user/group name to id cache shared by every stream.
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#ifndef CHMODD_IDCACHE_H
+#define CHMODD_IDCACHE_H
+
+#include <sys/types.h>
+#include "chmodd.h"
+
+// How long (in seconds) an answer from the directory service is trusted.
+#define IDCACHE_REFRESH_INTERVAL	600
+
+struct idcache_stats_t {
+	unsigned long			hits;
+	unsigned long			misses;
+	unsigned long			refreshes;
+};
+
+// Returns the uid/gid for name, asking getpwnam/getgrnam only when the cache
+// doesn't already know the answer.  Names that don't resolve are cached too,
+// and come back as -1.
+uid_t IDCacheLookupUser(const char *name);
+gid_t IDCacheLookupGroup(const char *name);
+
+// Throws away everything we know, e.g. on SIGHUP.
+void IDCacheInvalidate(void);
+
+// Bumped every time the cache is thrown away (explicitly or because the
+// refresh interval passed).  Policies compare this to know when to re-resolve.
+unsigned long IDCacheGeneration(void);
+
+void IDCacheGetStats(struct idcache_stats_t *stats);
+
+#endif
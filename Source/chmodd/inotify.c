@@ -0,0 +1,527 @@
+/*
+ *	inotify.c -- a Linux event stream that watches every directory of a root.
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#ifdef __linux__
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "stream.h"
+#include "metrics.h"
+#include "rescan.h"
+#include "echo.h"
+
+// What makes a directory worth a look.  Content changes don't matter to us,
+// only things appearing and attributes changing.
+#define INOTIFY_EVENTS		(IN_ATTRIB | IN_CREATE | IN_MOVED_FROM |		\
+							 IN_MOVED_TO | IN_MOVE_SELF | IN_DONT_FOLLOW |	\
+							 IN_ONLYDIR | IN_EXCL_UNLINK)
+
+#define INOTIFY_BUFFER_SIZE	65536
+
+struct inotify_watch_t {
+	struct inotify_watch_t	*next;
+	int						wd;
+	char					*path;
+};
+
+// Watch descriptor to path, so an event can be turned back into a directory.
+struct inotify_context_t {
+	struct inotify_watch_t	**buckets;
+	size_t					bucketCount;
+	size_t					watchCount;
+	int						*rootWatches;	// One per StreamRootAt()
+};
+
+static struct inotify_watch_t *InotifyFindWatch(struct inotify_context_t *context,
+												int wd)
+{
+	struct inotify_watch_t *watch;
+
+	for (watch = context->buckets[(size_t)wd % context->bucketCount]; watch;
+		 watch = watch->next)
+	{
+		if (watch->wd == wd)
+		{
+			return watch;
+		}
+	}
+
+	return NULL;
+}
+
+static void InotifyGrow(struct inotify_context_t *context)
+{
+	size_t i, bucketCount = context->bucketCount * 2;
+	struct inotify_watch_t **buckets;
+
+	if ((buckets = calloc(bucketCount, sizeof(struct inotify_watch_t *))) == NULL)
+	{
+		// Longer chains, but still correct.
+		return;
+	}
+
+	for (i = 0; i < context->bucketCount; i++)
+	{
+		struct inotify_watch_t *watch = context->buckets[i];
+
+		while (watch)
+		{
+			struct inotify_watch_t *next = watch->next;
+
+			watch->next = buckets[(size_t)watch->wd % bucketCount];
+			buckets[(size_t)watch->wd % bucketCount] = watch;
+			watch = next;
+		}
+	}
+
+	free(context->buckets);
+	context->buckets = buckets;
+	context->bucketCount = bucketCount;
+}
+
+// Watches one directory.  Returns false if the kernel won't give us any more
+// watches, which is worth giving up over.
+static Boolean InotifyAddWatch(struct stream_t *stream, const char *path)
+{
+	struct inotify_context_t *context = stream->context;
+	struct inotify_watch_t *watch;
+	char *pathCopy;
+	int wd;
+
+	if ((wd = inotify_add_watch(stream->fd, path, INOTIFY_EVENTS)) == -1)
+	{
+		if (errno == ENOSPC)
+		{
+			LogError("Out of inotify watches at %s, raise "
+					 "fs.inotify.max_user_watches\n", path);
+			return false;
+		}
+
+		// Gone again already, or not a directory after all.
+		if (errno != ENOENT && errno != ENOTDIR)
+		{
+			LogError("inotify %s: %s\n", path, strerror(errno));
+		}
+		return true;
+	}
+
+	if ((pathCopy = strdup(path)) == NULL)
+	{
+		return true;
+	}
+
+	// The same directory (say, moved within the tree) gets the same wd back.
+	if ((watch = InotifyFindWatch(context, wd)) != NULL)
+	{
+		free(watch->path);
+		watch->path = pathCopy;
+		return true;
+	}
+
+	if ((watch = calloc(1, sizeof(struct inotify_watch_t))) == NULL)
+	{
+		free(pathCopy);
+		return true;
+	}
+
+	watch->wd = wd;
+	watch->path = pathCopy;
+	watch->next = context->buckets[(size_t)wd % context->bucketCount];
+	context->buckets[(size_t)wd % context->bucketCount] = watch;
+
+	if (++context->watchCount > context->bucketCount)
+	{
+		InotifyGrow(context);
+	}
+
+	return true;
+}
+
+// Watches the directory in path (pathLength long, with room to append to)
+// and everything below it.
+static Boolean InotifyAddTreeAt(struct stream_t *stream, char *path,
+								size_t pathLength)
+{
+	struct dirent *entry;
+	Boolean retVal = true;
+	DIR *dir;
+	int fd;
+
+	if (!InotifyAddWatch(stream, pathLength ? path : "/"))
+	{
+		return false;
+	}
+
+	fd = open(pathLength ? path : "/",
+			  O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1 || (dir = fdopendir(fd)) == NULL)
+	{
+		if (fd != -1)
+		{
+			close(fd);
+		}
+		return true;
+	}
+
+	while (retVal && (entry = readdir(dir)) != NULL)
+	{
+		size_t nameLength;
+		struct stat info;
+
+		if (entry->d_name[0] == '.' &&
+			(entry->d_name[1] == '\0' ||
+			 (entry->d_name[1] == '.' && entry->d_name[2] == '\0')))
+		{
+			continue;
+		}
+
+		if (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN)
+		{
+			continue;
+		}
+
+		if (entry->d_type == DT_UNKNOWN &&
+			(fstatat(fd, entry->d_name, &info, AT_SYMLINK_NOFOLLOW) != 0 ||
+			 !S_ISDIR(info.st_mode)))
+		{
+			continue;
+		}
+
+		nameLength = strlen(entry->d_name);
+		if (pathLength + 1 + nameLength >= PATH_MAX)
+		{
+			continue;
+		}
+
+		path[pathLength] = '/';
+		memcpy(path + pathLength + 1, entry->d_name, nameLength + 1);
+
+		retVal = InotifyAddTreeAt(stream, path, pathLength + 1 + nameLength);
+
+		path[pathLength] = '\0';
+	}
+
+	closedir(dir);
+
+	return retVal;
+}
+
+static Boolean InotifyAddTree(struct stream_t *stream, const char *path)
+{
+	char buffer[PATH_MAX];
+	size_t pathLength = strlen(path);
+
+	if (pathLength >= PATH_MAX)
+	{
+		return true;
+	}
+
+	memcpy(buffer, path, pathLength + 1);
+
+	// A root of "/" would otherwise give us "//child".
+	if (pathLength == 1 && buffer[0] == '/')
+	{
+		pathLength = 0;
+		buffer[0] = '\0';
+	}
+
+	return InotifyAddTreeAt(stream, buffer, pathLength);
+}
+
+// Drops the watches on path and below, for a directory that left the tree.
+static void InotifyRemoveTree(struct stream_t *stream, const char *path)
+{
+	struct inotify_context_t *context = stream->context;
+	size_t i, pathLength = strlen(path);
+
+	for (i = 0; i < context->bucketCount; i++)
+	{
+		struct inotify_watch_t *watch;
+
+		for (watch = context->buckets[i]; watch; watch = watch->next)
+		{
+			if (strncmp(watch->path, path, pathLength) == 0 &&
+				(watch->path[pathLength] == '\0' ||
+				 watch->path[pathLength] == '/'))
+			{
+				// The table entry goes when IN_IGNORED comes back.
+				inotify_rm_watch(stream->fd, watch->wd);
+			}
+		}
+	}
+}
+
+static void InotifyForgetWatch(struct inotify_context_t *context, int wd)
+{
+	struct inotify_watch_t **link;
+
+	for (link = &(context->buckets[(size_t)wd % context->bucketCount]); *link;
+		 link = &((*link)->next))
+	{
+		if ((*link)->wd == wd)
+		{
+			struct inotify_watch_t *watch = *link;
+
+			*link = watch->next;
+			free(watch->path);
+			free(watch);
+			context->watchCount--;
+			return;
+		}
+	}
+}
+
+// An attribute change to something a walk has just fixed is most likely the
+// walk's own (see echo.h): worth a look at that entry, but not a walk of the
+// directory around it.
+static Boolean InotifyIsEcho(const struct inotify_event *event,
+							 const char *path)
+{
+	return (event->mask & (IN_ATTRIB | IN_CREATE | IN_MOVED_TO)) == IN_ATTRIB &&
+		EchoIsOwnChange(path);
+}
+
+static void InotifyHandleEvent(struct stream_t *stream,
+							   const struct inotify_event *event)
+{
+	struct inotify_context_t *context = stream->context;
+	struct inotify_watch_t *watch;
+	char childPath[PATH_MAX];
+	size_t i;
+
+	MetricsCountEvents(1);
+
+	if (event->mask & IN_Q_OVERFLOW)
+	{
+		// Events were lost, and so maybe were directories we never got to
+		// watch, with no telling where.  The queue is this stream's own, so
+		// it's only its roots (just the one, unless -s) that are picked up
+		// again and walked in full.  Overflows while that walk is still
+		// queued fold into it (see RescanRequestWalk()), so a storm of them
+		// costs a walk per root, not one per overflow.
+		for (i = 0; i < StreamRootCount(stream); i++)
+		{
+			struct policy_t *policy = StreamRootAt(stream, i);
+
+			LogV("inotify queue overflowed, rescanning %s\n", policy->path);
+			InotifyAddTree(stream, policy->path);
+			RescanRequestWalk(policy, policy->path, true);
+		}
+		return;
+	}
+
+	if ((watch = InotifyFindWatch(context, event->wd)) == NULL)
+	{
+		return;
+	}
+
+	if (event->mask & IN_IGNORED)
+	{
+		InotifyForgetWatch(context, event->wd);
+		return;
+	}
+
+	if (event->mask & IN_MOVE_SELF)
+	{
+		for (i = 0; i < StreamRootCount(stream); i++)
+		{
+			if (event->wd == context->rootWatches[i] &&
+				StreamRootAt(stream, i)->force)
+			{
+				StreamRootMoved(StreamRootAt(stream, i));
+			}
+		}
+		return;
+	}
+
+	if (event->len == 0 || !event->name[0])
+	{
+		// Something about the directory itself.
+		if (globals->fileEvents || InotifyIsEcho(event, watch->path))
+		{
+			StreamRequestEntry(stream, watch->path, false);
+		}
+		else
+		{
+			StreamRequestWalk(stream, watch->path, false);
+		}
+		return;
+	}
+
+	if (snprintf(childPath, PATH_MAX, "%s/%s",
+				 strcmp(watch->path, "/") ? watch->path : "",
+				 event->name) >= PATH_MAX)
+	{
+		return;
+	}
+
+	if ((event->mask & IN_ISDIR) && (event->mask & IN_MOVED_FROM))
+	{
+		InotifyRemoveTree(stream, childPath);
+	}
+	else if ((event->mask & IN_ISDIR) &&
+			 (event->mask & (IN_CREATE | IN_MOVED_TO)))
+	{
+		// Watch it first, then go over all of it: anything created inside it
+		// before the watch existed would otherwise never be seen.
+		InotifyAddTree(stream, childPath);
+		StreamRequestWalk(stream, childPath, true);
+	}
+	else if (!(event->mask & IN_MOVED_FROM))
+	{
+		// With -e, only what the event names; otherwise all of the
+		// directory it happened in.
+		if (globals->fileEvents || InotifyIsEcho(event, childPath))
+		{
+			StreamRequestEntry(stream, childPath, false);
+		}
+		else
+		{
+			StreamRequestWalk(stream, watch->path, false);
+		}
+	}
+}
+
+static void InotifyRead(struct stream_t *stream)
+{
+	char buffer[INOTIFY_BUFFER_SIZE]
+	__attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t length;
+
+	while ((length = read(stream->fd, buffer, INOTIFY_BUFFER_SIZE)) > 0)
+	{
+		char *p = buffer;
+
+		while (p < buffer + length)
+		{
+			const struct inotify_event *event = (const struct inotify_event *)p;
+
+			InotifyHandleEvent(stream, event);
+			p += sizeof(struct inotify_event) + event->len;
+		}
+	}
+
+	if (length == -1 && errno != EAGAIN && errno != EINTR)
+	{
+		LogError("inotify read: %s\n", strerror(errno));
+	}
+}
+
+static void InotifyRelease(struct stream_t *stream)
+{
+	struct inotify_context_t *context = stream->context;
+	size_t i;
+
+	for (i = 0; i < context->bucketCount; i++)
+	{
+		struct inotify_watch_t *watch = context->buckets[i];
+
+		while (watch)
+		{
+			struct inotify_watch_t *next = watch->next;
+
+			free(watch->path);
+			free(watch);
+			watch = next;
+		}
+	}
+
+	free(context->buckets);
+	free(context->rootWatches);
+	free(context);
+}
+
+struct stream_t *InotifyStreamCreate(struct policy_t *policy,
+									 struct dispatch_t *dispatch)
+{
+	struct inotify_context_t *context;
+	struct stream_t *stream;
+	size_t i, rootCount;
+
+	if ((stream = StreamCreate(policy, dispatch, "inotify")) == NULL)
+	{
+		return NULL;
+	}
+
+	rootCount = StreamRootCount(stream);
+
+	context = calloc(1, sizeof(struct inotify_context_t));
+	if (context)
+	{
+		context->bucketCount = 1024;
+		context->buckets = calloc(context->bucketCount,
+								  sizeof(struct inotify_watch_t *));
+		context->rootWatches = calloc(rootCount + 1, sizeof(int));
+	}
+
+	if (!context || !context->buckets || !context->rootWatches)
+	{
+		LogError("Couldn't allocate inotify watch table\n");
+		if (context)
+		{
+			free(context->buckets);
+			free(context->rootWatches);
+		}
+		free(context);
+		StreamReleaseOne(stream);
+		return NULL;
+	}
+
+	stream->context = context;
+	stream->read = &InotifyRead;
+	stream->release = &InotifyRelease;
+
+	if ((stream->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1)
+	{
+		LogError("inotify_init1: %s\n", strerror(errno));
+		StreamReleaseOne(stream);
+		return NULL;
+	}
+
+	for (i = 0; i < rootCount; i++)
+	{
+		const char *path = StreamRootAt(stream, i)->path;
+
+		// Nested roots are already watched by the time we get to them; that
+		// only costs a walk, since asking again just hands back the same wd.
+		if (!InotifyAddTree(stream, path))
+		{
+			StreamReleaseOne(stream);
+			return NULL;
+		}
+
+		context->rootWatches[i] = inotify_add_watch(stream->fd, path,
+													INOTIFY_EVENTS);
+	}
+
+	if (policy)
+	{
+		LogV("Watching %lu directories under %s with inotify\n",
+			 (unsigned long)context->watchCount, policy->path);
+	}
+	else
+	{
+		LogV("Watching %lu directories under %lu root%s with inotify\n",
+			 (unsigned long)context->watchCount, (unsigned long)rootCount,
+			 (rootCount != 1) ? "s" : "");
+	}
+
+	return stream;
+}
+
+#endif
@@ -0,0 +1,282 @@
+/*
+ *	latency.c -- how long a stream holds events before handing them over,
+ *	worked out as it goes.
+ *
+ *	A short latency gets a new file fixed before anybody notices; a long one
+ *	lets a 200k file rsync turn into a few big batches, which coalesce into
+ *	far fewer walks than thousands of small ones.  So each stream starts at
+ *	the bottom of the -l bounds, doubles its latency while events come faster
+ *	than we'd want to walk them one by one (or the walks are eating the time
+ *	between batches), and halves it as they slow down.
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#include <sys/time.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "latency.h"
+
+// How much of each batch goes into the smoothed rate and share.
+#define LATENCY_SMOOTHING			0.3
+
+// Events a second above which batching pays, and below which it doesn't.
+#define LATENCY_BURST_RATE			100.0
+#define LATENCY_QUIET_RATE			10.0
+
+// Share of the time spent walking above which we're falling behind, and below
+// which there's room to spare.
+#define LATENCY_BUSY_SHARE			0.5
+#define LATENCY_QUIET_SHARE			0.1
+
+#define LATENCY_STEP				2.0
+
+static struct {
+	pthread_mutex_t			lock;
+	struct latency_t		*list;
+} latencies = { PTHREAD_MUTEX_INITIALIZER, NULL };
+
+static double LatencyNow(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return now.tv_sec + now.tv_usec / 1e6;
+}
+
+struct latency_t *LatencyCreate(const char *name)
+{
+	struct latency_t *latency = calloc(1, sizeof(struct latency_t));
+
+	if (!latency)
+	{
+		LogError("Couldn't allocate latency for %s\n", name);
+		return NULL;
+	}
+
+	snprintf(latency->name, sizeof(latency->name), "%s", name);
+	latency->minimum = globals->latency;
+	latency->maximum = (globals->latencyMaximum > globals->latency) ?
+		globals->latencyMaximum : globals->latency;
+	latency->current = latency->minimum;
+	latency->applied = latency->minimum;
+	latency->lastBatch = LatencyNow();
+
+	pthread_mutex_lock(&latencies.lock);
+	latency->next = latencies.list;
+	latencies.list = latency;
+	pthread_mutex_unlock(&latencies.lock);
+
+	return latency;
+}
+
+void LatencyRelease(struct latency_t *latency)
+{
+	struct latency_t **link;
+
+	pthread_mutex_lock(&latencies.lock);
+
+	for (link = &latencies.list; *link; link = &(*link)->next)
+	{
+		if (*link == latency)
+		{
+			*link = latency->next;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&latencies.lock);
+
+	free(latency);
+}
+
+// Back to the bottom after a quiet spell longer than the cap: whatever the
+// last burst was, it's over.
+static void LatencyIdleLocked(struct latency_t *latency, double now)
+{
+	if (latency->current > latency->minimum &&
+		now - latency->lastBatch > latency->maximum)
+	{
+		LogMV("%s quiet for %.1fs, latency back to %gs\n", latency->name,
+			  now - latency->lastBatch, latency->minimum);
+		latency->current = latency->minimum;
+		latency->eventRate = 0;
+		latency->walkShare = 0;
+		latency->lowered++;
+	}
+}
+
+double LatencyCurrent(struct latency_t *latency)
+{
+	double current;
+
+	pthread_mutex_lock(&latencies.lock);
+	LatencyIdleLocked(latency, LatencyNow());
+	current = latency->current;
+	pthread_mutex_unlock(&latencies.lock);
+
+	return current;
+}
+
+void LatencyBatch(struct latency_t *latency, unsigned long events)
+{
+	double now = LatencyNow(), interval, before;
+
+	pthread_mutex_lock(&latencies.lock);
+
+	LatencyIdleLocked(latency, now);
+
+	// A batch covers at least the latency it was held for, even when it came
+	// early (the first event after a quiet spell, with no defer).
+	interval = now - latency->lastBatch;
+	if (interval < latency->current)
+	{
+		interval = latency->current;
+	}
+	if (interval < 0.01)
+	{
+		interval = 0.01;
+	}
+
+	latency->eventRate += LATENCY_SMOOTHING *
+		(events / interval - latency->eventRate);
+	latency->walkShare += LATENCY_SMOOTHING *
+		(latency->walked / interval - latency->walkShare);
+	latency->walked = 0;
+	latency->lastBatch = now;
+	latency->batches++;
+
+	before = latency->current;
+
+	if (latency->eventRate > LATENCY_BURST_RATE ||
+		latency->walkShare > LATENCY_BUSY_SHARE)
+	{
+		latency->current *= LATENCY_STEP;
+		if (latency->current > latency->maximum)
+		{
+			latency->current = latency->maximum;
+		}
+	}
+	else if (latency->eventRate < LATENCY_QUIET_RATE &&
+			 latency->walkShare < LATENCY_QUIET_SHARE)
+	{
+		latency->current /= LATENCY_STEP;
+		if (latency->current < latency->minimum)
+		{
+			latency->current = latency->minimum;
+		}
+	}
+
+	if (latency->current != before)
+	{
+		if (latency->current > before)
+		{
+			latency->raised++;
+		}
+		else
+		{
+			latency->lowered++;
+		}
+
+		LogMV("%s: %.0f events/s, walking %.0f%% of the time, latency %gs\n",
+			  latency->name, latency->eventRate, latency->walkShare * 100,
+			  latency->current);
+	}
+
+	pthread_mutex_unlock(&latencies.lock);
+}
+
+void LatencyWalked(struct latency_t *latency, double seconds)
+{
+	pthread_mutex_lock(&latencies.lock);
+	latency->walked += seconds;
+	pthread_mutex_unlock(&latencies.lock);
+}
+
+void LatencyApplied(struct latency_t *latency, double applied)
+{
+	pthread_mutex_lock(&latencies.lock);
+	latency->applied = applied;
+	pthread_mutex_unlock(&latencies.lock);
+}
+
+Boolean LatencyNeedsRestart(struct latency_t *latency)
+{
+	Boolean retVal;
+
+	pthread_mutex_lock(&latencies.lock);
+	LatencyIdleLocked(latency, LatencyNow());
+	retVal = (latency->current != latency->applied);
+	pthread_mutex_unlock(&latencies.lock);
+
+	return retVal;
+}
+
+size_t LatencyGetStatus(struct latency_status_t *statuses, size_t count)
+{
+	struct latency_t *latency;
+	size_t total = 0;
+	double now = LatencyNow();
+
+	pthread_mutex_lock(&latencies.lock);
+
+	for (latency = latencies.list; latency; latency = latency->next, total++)
+	{
+		if (total < count)
+		{
+			LatencyIdleLocked(latency, now);
+
+			snprintf(statuses[total].name, sizeof(statuses[total].name), "%s",
+					 latency->name);
+			statuses[total].current = latency->current;
+			statuses[total].minimum = latency->minimum;
+			statuses[total].maximum = latency->maximum;
+			statuses[total].eventRate = latency->eventRate;
+			statuses[total].walkShare = latency->walkShare;
+			statuses[total].batches = latency->batches;
+			statuses[total].raised = latency->raised;
+			statuses[total].lowered = latency->lowered;
+		}
+	}
+
+	pthread_mutex_unlock(&latencies.lock);
+
+	return total;
+}
+
+Boolean LatencyParseBounds(const char *string, double *minimum,
+						   double *maximum)
+{
+	char *end;
+
+	*minimum = strtod(string, &end);
+
+	if (end == string)
+	{
+		return false;
+	}
+
+	if (*end == ':')
+	{
+		string = end + 1;
+		*maximum = strtod(string, &end);
+
+		if (end == string)
+		{
+			return false;
+		}
+	}
+	else
+	{
+		*maximum = *minimum;
+	}
+
+	return (*end == '\0' && *minimum >= 0 && *maximum >= *minimum);
+}
@@ -0,0 +1,88 @@
+/*
+ *	latency.h -- how long a stream holds events before handing them over,
+ *	worked out as it goes.
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#ifndef CHMODD_LATENCY_H
+#define CHMODD_LATENCY_H
+
+#include "chmodd.h"
+
+// Below this, a stream delivers the first event after a quiet spell right
+// away (kFSEventStreamCreateFlagNoDefer, and the same thing on Linux).
+#define LATENCY_NO_DEFER			2.5
+
+// One per stream: a root's own, or (with -s) the one every root shares.
+struct latency_t {
+	struct latency_t		*next;		// Every controller, for the metrics
+	char					name[PATH_MAX];
+
+	// The bounds (-l min:max); with them equal, latency never moves.
+	double					minimum;
+	double					maximum;
+	double					current;
+	double					applied;	// What the stream was made with
+
+	// Smoothed over the last few batches: events a second, and the share of
+	// the time spent walking for them.
+	double					eventRate;
+	double					walkShare;
+	double					lastBatch;
+	double					walked;		// Seconds, since the last batch
+
+	unsigned long			batches;
+	unsigned long			raised;
+	unsigned long			lowered;
+};
+
+struct latency_status_t {
+	char					name[PATH_MAX];
+	double					current;
+	double					minimum;
+	double					maximum;
+	double					eventRate;
+	double					walkShare;
+	unsigned long			batches;
+	unsigned long			raised;
+	unsigned long			lowered;
+};
+
+// Returns a new controller for the stream of the root at name (or
+// "every root"), within the -l bounds, starting at the bottom of them.
+struct latency_t *LatencyCreate(const char *name);
+
+void LatencyRelease(struct latency_t *latency);
+
+// Returns the latency to use now.  A stream that's been quiet for longer than
+// the cap goes straight back to the bottom.
+double LatencyCurrent(struct latency_t *latency);
+
+// As a batch of events is handed over: raises latency while they come thick
+// and fast (or walking them is taking up the time), and lowers it again once
+// they slow down.
+void LatencyBatch(struct latency_t *latency, unsigned long events);
+
+// Adds the time a worker spent walking for the stream's events, which counts
+// towards the next batch.
+void LatencyWalked(struct latency_t *latency, double seconds);
+
+// For streams whose latency is fixed once they're made (FSEvents): notes the
+// latency one was made with, and whether it's since moved far enough to be
+// worth making it again.
+void LatencyApplied(struct latency_t *latency, double applied);
+Boolean LatencyNeedsRestart(struct latency_t *latency);
+
+// Copies out up to count controllers' status, and returns how many there are.
+size_t LatencyGetStatus(struct latency_status_t *statuses, size_t count);
+
+// Reads -l: "latency" for a fixed one, or "min:max" to let it move.
+Boolean LatencyParseBounds(const char *string, double *minimum,
+						   double *maximum);
+
+#endif
@@ -0,0 +1,744 @@
+/*
+ *	logging.c -- getting LogError/LogV/LogMV output off the hot path.
+ *
+ *	A log call doesn't format anything.  It copies the format pointer and the
+ *	arguments into a compact record in the calling thread's own ring, and a
+ *	writer thread turns records back into text.  Each ring has one producer
+ *	and one consumer, so neither side ever takes a lock; when a ring is full
+ *	the record is dropped and counted instead of waiting.
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#include <sys/types.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include "logging.h"
+
+// Biggest single record; long strings are cut to fit.
+#define LOGGING_MAX_RECORD		2048
+#define LOGGING_MAX_LINE		8192
+#define LOGGING_IDLE_NSEC		10000000	// 10ms between looks when idle
+
+// Argument tags, so the writer can check it's reading what it expects.
+#define LOGGING_ARG_SIGNED		1
+#define LOGGING_ARG_UNSIGNED	2
+#define LOGGING_ARG_DOUBLE		3
+#define LOGGING_ARG_STRING		4
+#define LOGGING_ARG_POINTER		5
+
+struct logging_record_t {
+	UInt32					size;	// Whole record, rounded up to 8
+	UInt32					argBytes;
+	const char				*format;
+};
+
+struct logging_ring_t {
+	struct logging_ring_t	*next;
+
+	// Both only ever go up; the producer owns head, the writer owns tail.
+	unsigned long			head;
+	unsigned long			tail;
+
+	// Set when the thread that owns it exits; the writer frees it once empty.
+	int						orphaned;
+
+	unsigned char			bytes[LOGGING_RING_SIZE];
+};
+
+static struct {
+	pthread_mutex_t			lock;	// Guards rings (the list, not the data)
+	struct logging_ring_t	*rings;
+	pthread_key_t			key;
+	pthread_t				thread;
+	int						running;
+	FILE					*out;
+	unsigned long			dropped;
+	unsigned long			droppedReported;
+} logging = { PTHREAD_MUTEX_INITIALIZER };
+
+#pragma mark -
+#pragma mark Records
+
+// One conversion in a format string, as far as we care about it.
+struct logging_spec_t {
+	const char				*start;		// The '%'
+	const char				*end;		// Just past the conversion character
+	char					conversion;
+	int						longs;		// 'l' count; 'L', 'j', 'z', 't' count 2
+	int						shorts;		// 'h' count
+	int						stars;		// '*' width/precision arguments
+};
+
+// Finds the next conversion at or after p, skipping "%%".  Returns false at
+// the end of the format.
+static Boolean LoggingNextSpec(const char *p, struct logging_spec_t *spec)
+{
+	for (;;)
+	{
+		while (*p && *p != '%')
+		{
+			p++;
+		}
+
+		if (!*p)
+		{
+			return false;
+		}
+
+		if (p[1] == '%')
+		{
+			p += 2;
+			continue;
+		}
+
+		break;
+	}
+
+	bzero(spec, sizeof(*spec));
+	spec->start = p++;
+
+	while (*p && strchr("-+ #0'", *p))
+	{
+		p++;
+	}
+
+	for (; *p == '*' || *p == '.' || (*p >= '0' && *p <= '9'); p++)
+	{
+		if (*p == '*')
+		{
+			spec->stars++;
+		}
+	}
+
+	for (; *p && strchr("hlLqjzt", *p); p++)
+	{
+		if (*p == 'h')
+		{
+			spec->shorts++;
+		}
+		else if (*p == 'l')
+		{
+			spec->longs++;
+		}
+		else
+		{
+			spec->longs = 2;
+		}
+	}
+
+	spec->conversion = *p;
+	spec->end = *p ? p + 1 : p;
+
+	return true;
+}
+
+static Boolean LoggingPut(unsigned char *buffer, size_t *used,
+						  const void *bytes, size_t length)
+{
+	if (*used + length > LOGGING_MAX_RECORD)
+	{
+		return false;
+	}
+
+	memcpy(buffer + *used, bytes, length);
+	*used += length;
+
+	return true;
+}
+
+// Copies the arguments format is about to use into buffer.  Returns how many
+// bytes that took.
+static size_t LoggingEncode(unsigned char *buffer, size_t size,
+							const char *format, va_list ap)
+{
+	struct logging_spec_t spec;
+	const char *p = format;
+	size_t used = 0;
+	int i;
+
+	while (LoggingNextSpec(p, &spec))
+	{
+		unsigned char tag;
+		Boolean ok = true;
+
+		p = spec.end;
+
+		for (i = 0; i < spec.stars; i++)
+		{
+			SInt64 value = va_arg(ap, int);
+
+			tag = LOGGING_ARG_SIGNED;
+			ok = ok && LoggingPut(buffer, &used, &tag, 1) &&
+				LoggingPut(buffer, &used, &value, sizeof(value));
+		}
+
+		switch (spec.conversion) {
+			case 'd':
+			case 'i':
+			{
+				SInt64 value = (spec.longs >= 2) ? va_arg(ap, long long) :
+					(spec.longs == 1) ? va_arg(ap, long) : va_arg(ap, int);
+
+				if (spec.shorts == 1)
+				{
+					value = (short)value;
+				}
+				else if (spec.shorts >= 2)
+				{
+					value = (signed char)value;
+				}
+
+				tag = LOGGING_ARG_SIGNED;
+				ok = ok && LoggingPut(buffer, &used, &tag, 1) &&
+					LoggingPut(buffer, &used, &value, sizeof(value));
+				break;
+			}
+			case 'u':
+			case 'o':
+			case 'x':
+			case 'X':
+			case 'c':
+			{
+				UInt64 value = (spec.longs >= 2) ?
+					va_arg(ap, unsigned long long) :
+					(spec.longs == 1) ? va_arg(ap, unsigned long) :
+					va_arg(ap, unsigned int);
+
+				if (spec.shorts == 1)
+				{
+					value = (unsigned short)value;
+				}
+				else if (spec.shorts >= 2)
+				{
+					value = (unsigned char)value;
+				}
+
+				tag = LOGGING_ARG_UNSIGNED;
+				ok = ok && LoggingPut(buffer, &used, &tag, 1) &&
+					LoggingPut(buffer, &used, &value, sizeof(value));
+				break;
+			}
+			case 'e':
+			case 'E':
+			case 'f':
+			case 'F':
+			case 'g':
+			case 'G':
+			case 'a':
+			case 'A':
+			{
+				double value = (spec.longs >= 2) ?
+					(double)va_arg(ap, long double) : va_arg(ap, double);
+
+				tag = LOGGING_ARG_DOUBLE;
+				ok = ok && LoggingPut(buffer, &used, &tag, 1) &&
+					LoggingPut(buffer, &used, &value, sizeof(value));
+				break;
+			}
+			case 's':
+			{
+				const char *value = va_arg(ap, const char *);
+				size_t room = LOGGING_MAX_RECORD - used;
+				UInt32 length;
+
+				if (!value)
+				{
+					value = "(null)";
+				}
+
+				// Tag, length and terminator, then as much as fits.
+				if (room < 1 + sizeof(length) + 1)
+				{
+					return 0;
+				}
+
+				length = strnlen(value, room - (1 + sizeof(length) + 1));
+				tag = LOGGING_ARG_STRING;
+				LoggingPut(buffer, &used, &tag, 1);
+				LoggingPut(buffer, &used, &length, sizeof(length));
+				LoggingPut(buffer, &used, value, length);
+				buffer[used++] = '\0';
+				break;
+			}
+			case 'p':
+			{
+				UInt64 value = (UInt64)(uintptr_t)va_arg(ap, void *);
+
+				tag = LOGGING_ARG_POINTER;
+				ok = ok && LoggingPut(buffer, &used, &tag, 1) &&
+					LoggingPut(buffer, &used, &value, sizeof(value));
+				break;
+			}
+			default:
+				// %n and anything we don't know: there's nothing sensible
+				// to keep, and no way to know the argument's size.
+				return 0;
+		}
+
+		if (!ok)
+		{
+			return 0;
+		}
+	}
+
+	return used;
+}
+
+// Takes the next argument of the given kind out of args.
+static const unsigned char *LoggingTake(const unsigned char *args,
+										const unsigned char *end,
+										unsigned char tag, void *value)
+{
+	if (args >= end || *args != tag || end - args < 1 + 8)
+	{
+		return NULL;
+	}
+
+	memcpy(value, args + 1, 8);
+
+	return args + 1 + 8;
+}
+
+// Turns a record back into text in line.  Returns the length.
+static size_t LoggingDecode(const struct logging_record_t *record,
+							char *line, size_t size)
+{
+	const unsigned char *args = (const unsigned char *)(record + 1);
+	const unsigned char *end = args + record->argBytes;
+	const char *p = record->format;
+	struct logging_spec_t spec;
+	size_t used = 0;
+
+	while (args && used < size - 1 && LoggingNextSpec(p, &spec))
+	{
+		char format[64];
+		size_t f = 0;
+		const char *s;
+		int length = 0;
+
+		// The literal text before this conversion, with "%%" undone.
+		for (s = p; s < spec.start && used < size - 1; s++)
+		{
+			line[used++] = *s;
+			if (s[0] == '%' && s[1] == '%')
+			{
+				s++;
+			}
+		}
+
+		// Rebuild the conversion with any '*' filled in and the length
+		// modifiers normalised to what we stored.
+		format[f++] = '%';
+		for (s = spec.start + 1; s < spec.end - 1 && f < sizeof(format) - 24;
+			 s++)
+		{
+			if (*s == '*')
+			{
+				SInt64 value;
+
+				if ((args = LoggingTake(args, end, LOGGING_ARG_SIGNED,
+										&value)) == NULL)
+				{
+					break;
+				}
+				f += snprintf(format + f, sizeof(format) - f, "%d", (int)value);
+			}
+			else if (!strchr("hlLqjzt", *s))
+			{
+				format[f++] = *s;
+			}
+		}
+
+		if (!args)
+		{
+			break;
+		}
+
+		switch (spec.conversion) {
+			case 'd':
+			case 'i':
+			case 'u':
+			case 'o':
+			case 'x':
+			case 'X':
+			{
+				UInt64 value;
+				unsigned char tag = strchr("di", spec.conversion) ?
+					LOGGING_ARG_SIGNED : LOGGING_ARG_UNSIGNED;
+
+				format[f++] = 'l';
+				format[f++] = 'l';
+				format[f++] = spec.conversion;
+				format[f] = '\0';
+				if ((args = LoggingTake(args, end, tag, &value)) != NULL)
+				{
+					length = snprintf(line + used, size - used, format,
+									  value);
+				}
+				break;
+			}
+			case 'c':
+			{
+				UInt64 value;
+
+				format[f++] = 'c';
+				format[f] = '\0';
+				if ((args = LoggingTake(args, end, LOGGING_ARG_UNSIGNED,
+										&value)) != NULL)
+				{
+					length = snprintf(line + used, size - used, format,
+									  (int)value);
+				}
+				break;
+			}
+			case 's':
+			{
+				UInt32 stringLength;
+
+				format[f++] = 's';
+				format[f] = '\0';
+				if (args < end && *args == LOGGING_ARG_STRING &&
+					end - args >= 1 + (long)sizeof(stringLength))
+				{
+					memcpy(&stringLength, args + 1, sizeof(stringLength));
+					if (end - args >= (long)(1 + sizeof(stringLength) +
+											 stringLength + 1))
+					{
+						length = snprintf(line + used, size - used, format,
+										  args + 1 + sizeof(stringLength));
+						args += 1 + sizeof(stringLength) + stringLength + 1;
+						break;
+					}
+				}
+				args = NULL;
+				break;
+			}
+			case 'p':
+			{
+				UInt64 value;
+
+				format[f++] = 'p';
+				format[f] = '\0';
+				if ((args = LoggingTake(args, end, LOGGING_ARG_POINTER,
+										&value)) != NULL)
+				{
+					length = snprintf(line + used, size - used, format,
+									  (void *)(uintptr_t)value);
+				}
+				break;
+			}
+			default:
+			{
+				double value;
+
+				format[f++] = spec.conversion;
+				format[f] = '\0';
+				if ((args = LoggingTake(args, end, LOGGING_ARG_DOUBLE,
+										&value)) != NULL)
+				{
+					length = snprintf(line + used, size - used, format,
+									  value);
+				}
+				break;
+			}
+		}
+
+		if (length > 0)
+		{
+			used += ((size_t)length < size - used) ? (size_t)length :
+				size - used - 1;
+		}
+
+		p = spec.end;
+	}
+
+	// Whatever's left after the last conversion.
+	for (; *p && used < size - 1; p++)
+	{
+		line[used++] = *p;
+		if (p[0] == '%' && p[1] == '%')
+		{
+			p++;
+		}
+	}
+
+	line[used] = '\0';
+
+	return used;
+}
+
+#pragma mark -
+#pragma mark Rings
+
+static void LoggingOrphanRing(void *value)
+{
+	struct logging_ring_t *ring = value;
+
+	__atomic_store_n(&ring->orphaned, 1, __ATOMIC_RELEASE);
+}
+
+static struct logging_ring_t *LoggingThreadRing(void)
+{
+	struct logging_ring_t *ring = pthread_getspecific(logging.key);
+
+	if (ring)
+	{
+		return ring;
+	}
+
+	// Once per thread, so the lock here is fine.
+	if ((ring = calloc(1, sizeof(struct logging_ring_t))) == NULL)
+	{
+		return NULL;
+	}
+
+	pthread_setspecific(logging.key, ring);
+
+	pthread_mutex_lock(&logging.lock);
+	ring->next = logging.rings;
+	logging.rings = ring;
+	pthread_mutex_unlock(&logging.lock);
+
+	return ring;
+}
+
+static void LoggingCopyIn(struct logging_ring_t *ring, unsigned long at,
+						  const void *bytes, size_t length)
+{
+	size_t offset = at % LOGGING_RING_SIZE;
+	size_t first = LOGGING_RING_SIZE - offset;
+
+	if (first > length)
+	{
+		first = length;
+	}
+
+	memcpy(ring->bytes + offset, bytes, first);
+	memcpy(ring->bytes, (const unsigned char *)bytes + first, length - first);
+}
+
+static void LoggingCopyOut(struct logging_ring_t *ring, unsigned long at,
+						   void *bytes, size_t length)
+{
+	size_t offset = at % LOGGING_RING_SIZE;
+	size_t first = LOGGING_RING_SIZE - offset;
+
+	if (first > length)
+	{
+		first = length;
+	}
+
+	memcpy(bytes, ring->bytes + offset, first);
+	memcpy((unsigned char *)bytes + first, ring->bytes, length - first);
+}
+
+void LoggingWrite(const char *format, va_list ap)
+{
+	unsigned char buffer[sizeof(struct logging_record_t) + LOGGING_MAX_RECORD]
+	__attribute__((aligned(8)));
+	struct logging_record_t *record = (struct logging_record_t *)buffer;
+	struct logging_ring_t *ring;
+	unsigned long head;
+	va_list copy;
+
+	if (!__atomic_load_n(&logging.running, __ATOMIC_ACQUIRE) ||
+		(ring = LoggingThreadRing()) == NULL)
+	{
+		vfprintf(logging.out ? logging.out : stderr, format, ap);
+		return;
+	}
+
+	va_copy(copy, ap);
+	record->argBytes = LoggingEncode(buffer + sizeof(*record),
+									 LOGGING_MAX_RECORD, format, copy);
+	va_end(copy);
+
+	record->format = format;
+	record->size = (sizeof(*record) + record->argBytes + 7) & ~7U;
+
+	head = ring->head;
+
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) + record->size >
+		LOGGING_RING_SIZE)
+	{
+		__sync_fetch_and_add(&logging.dropped, 1);
+		return;
+	}
+
+	LoggingCopyIn(ring, head, buffer, record->size);
+
+	// The record has to be all there before the writer can see it.
+	__atomic_store_n(&ring->head, head + record->size, __ATOMIC_RELEASE);
+}
+
+// Writes out everything queued in ring.  Returns true if there was anything.
+static Boolean LoggingDrainRing(struct logging_ring_t *ring)
+{
+	unsigned char buffer[sizeof(struct logging_record_t) + LOGGING_MAX_RECORD]
+	__attribute__((aligned(8)));
+	struct logging_record_t *record = (struct logging_record_t *)buffer;
+	char line[LOGGING_MAX_LINE];
+	unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	unsigned long tail = ring->tail;
+	Boolean retVal = (head != tail);
+
+	while (tail != head)
+	{
+		LoggingCopyOut(ring, tail, buffer, sizeof(*record));
+		LoggingCopyOut(ring, tail, buffer, record->size);
+
+		fwrite(line, 1, LoggingDecode(record, line, LOGGING_MAX_LINE),
+			   logging.out);
+
+		tail += record->size;
+	}
+
+	// Only now can the producer reuse the space.
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+	return retVal;
+}
+
+// Drains every ring, freeing the ones whose thread has gone.  Returns true if
+// anything was written.
+static Boolean LoggingDrain(void)
+{
+	struct logging_ring_t **link, *ring;
+	Boolean retVal = false;
+	unsigned long dropped;
+
+	pthread_mutex_lock(&logging.lock);
+
+	for (link = &logging.rings; (ring = *link) != NULL; )
+	{
+		int orphaned = __atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE);
+
+		retVal = LoggingDrainRing(ring) || retVal;
+
+		if (orphaned)
+		{
+			*link = ring->next;
+			free(ring);
+		}
+		else
+		{
+			link = &ring->next;
+		}
+	}
+
+	pthread_mutex_unlock(&logging.lock);
+
+	dropped = __atomic_load_n(&logging.dropped, __ATOMIC_RELAXED);
+	if (dropped != logging.droppedReported)
+	{
+		fprintf(logging.out, "chmodd: dropped %lu log message%s\n",
+				dropped - logging.droppedReported,
+				(dropped - logging.droppedReported != 1) ? "s" : "");
+		logging.droppedReported = dropped;
+		retVal = true;
+	}
+
+	if (retVal)
+	{
+		fflush(logging.out);
+	}
+
+	return retVal;
+}
+
+static void *LoggingWriter(void *context)
+{
+	struct timespec idle = { 0, LOGGING_IDLE_NSEC };
+
+	while (__atomic_load_n(&logging.running, __ATOMIC_ACQUIRE))
+	{
+		if (!LoggingDrain())
+		{
+			nanosleep(&idle, NULL);
+		}
+	}
+
+	// One more pass for anything that came in while we were stopping.
+	LoggingDrain();
+
+	return NULL;
+}
+
+#pragma mark -
+#pragma mark Control
+
+Boolean LoggingStart(const char *path)
+{
+	sigset_t allSignals, oldSignals;
+	int error;
+
+	if (path)
+	{
+		if ((logging.out = fopen(path, "a")) == NULL)
+		{
+			fprintf(stderr, "Couldn't open log %s: %s\n", path,
+					strerror(errno));
+			logging.out = stderr;
+			return false;
+		}
+	}
+	else
+	{
+		logging.out = stderr;
+	}
+
+	if ((error = pthread_key_create(&logging.key, LoggingOrphanRing)) != 0)
+	{
+		return false;
+	}
+
+	logging.running = 1;
+
+	// Signals are for the run loop, so the writer starts with them blocked.
+	sigfillset(&allSignals);
+	pthread_sigmask(SIG_SETMASK, &allSignals, &oldSignals);
+	error = pthread_create(&logging.thread, NULL, LoggingWriter, NULL);
+	pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+
+	if (error != 0)
+	{
+		logging.running = 0;
+		fprintf(logging.out, "Couldn't start log writer: %s\n",
+				strerror(error));
+		return false;
+	}
+
+	// So an exit() anywhere still gets the queue written out.
+	atexit(LoggingStop);
+
+	return true;
+}
+
+void LoggingStop(void)
+{
+	if (!logging.running)
+	{
+		return;
+	}
+
+	__atomic_store_n(&logging.running, 0, __ATOMIC_RELEASE);
+	pthread_join(logging.thread, NULL);
+	fflush(logging.out);
+}
+
+unsigned long LoggingDropped(void)
+{
+	return __atomic_load_n(&logging.dropped, __ATOMIC_RELAXED);
+}
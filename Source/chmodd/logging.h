@@ -0,0 +1,35 @@
+/*
+ *	logging.h -- getting LogError/LogV/LogMV output off the hot path.
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#ifndef CHMODD_LOGGING_H
+#define CHMODD_LOGGING_H
+
+#include <stdarg.h>
+#include "chmodd.h"
+
+// Bytes of records each thread can have waiting for the writer.
+#define LOGGING_RING_SIZE		65536
+
+// Starts the writer thread, appending to the file at path (or stderr if path
+// is NULL).  Until this is called, and after LoggingStop(), messages are
+// written out immediately.
+Boolean LoggingStart(const char *path);
+
+// Writes out everything still queued and stops the writer.
+void LoggingStop(void);
+
+// Queues a message for the writer.  Never blocks: if this thread's ring is
+// full the message is dropped, and counted.
+void LoggingWrite(const char *format, va_list ap);
+
+// Messages dropped because a ring was full.
+unsigned long LoggingDropped(void);
+
+#endif
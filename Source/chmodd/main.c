@@ -8,22 +8,43 @@
  *
  */
 
-#import <sys/types.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <sys/time.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __APPLE__
 #import <sys/acl.h>
-#import <sys/dirent.h>
-#import <sys/stat.h>
-#import <dirent.h>
 #import <membership.h>
-#import <unistd.h>
 #import <uuid/uuid.h>
-#import <sys/param.h>
-#import <fts.h>
-#import <sys/time.h>
-#import <signal.h>
 #import <CoreFoundation/CoreFoundation.h>
 #import <CoreServices/CoreServices.h>
-#import <pwd.h>
-#import <grp.h>
+#endif
+#include "chmodd.h"
+#include "policy.h"
+#include "idcache.h"
+#include "walk.h"
+#include "coalesce.h"
+#include "stream.h"
+#include "verified.h"
+#include "metrics.h"
+#include "logging.h"
+#include "rescan.h"
+#include "dispatch.h"
+#include "budget.h"
+#include "audit.h"
+#include "history.h"
+#include "latency.h"
+#include "work.h"
+#include "subtree.h"
 
 #ifdef __APPLE__
 #define PROGNAME getprogname()
@@ -33,6 +54,7 @@
 
 #define VERSION	"0.9"
 
+#ifdef __APPLE__
 #pragma mark -
 #pragma mark Dictionary Keys
 #define kCHMODDPathKey				(CFSTR("_path"))
@@ -46,73 +68,77 @@
 #define kCHMODDDebugKey				(CFSTR("_debug"))
 #define kCHMODDPreScanKey			(CFSTR("_prescan"))
 #define kCHMODDDescriptorKey		(CFSTR("_descriptor"))
+#define kCHMODDRulesKey				(CFSTR("_rules"))
+#define kCHMODDMatchKey				(CFSTR("_match"))
+#define kCHMODDTypeKey				(CFSTR("_type"))
+#define kCHMODDCachedKey			(CFSTR("_cachedAttributes"))
+#endif
 
-// Global variables.
-struct globals_t {
-	// Control verbosity/output
-	Boolean					verbose;
-	Boolean					megaVerbose;
-	Boolean					quiet;
-	
-	// For signal handling
-	Boolean					rescanSignal;
-	Boolean					quitSignal;
-	
-	// Plist file path (if provided)
-	char					plistPath[PATH_MAX];
-	
-	// Setup for one entry (command line style)
-	char					*mode;
-	uid_t					owner; //unsigned int 32
-	gid_t					group;
-	char					directoryPath[PATH_MAX];
-	int						acl; // -1 for not set, 0 for false, and 1 for set.
-	Boolean					followSymbolicLinks;
-	Boolean					create;
-	Boolean					force;
-	Boolean					prescan;
-    CFAbsoluteTime          latency; // CFAbsoluteTime = typedef double
-	
-	// Array for FSEventStreamRef storage:
-	CFMutableArrayRef		streamArray;
-	
-	// Time the program launched.  This is used to keep track of when the daemon
-	// is launched, so we can be smart and skip over some items after we've
-	// prescanned.
-	time_t					launch_time;
-	
-	// If we're on an OS later than Leopard, we can ignore ourself by sending
-	// a flag to the FSEventStreamCreate() call.  We can do it a slightly sneaky
-	// way to avoid having to have a compiled version for Leopard and one for
-	// later OS's.
-	Boolean					ignoreSelf;
-	
-	CFMutableDictionaryRef	descriptorDict;
-} _globals;
+struct globals_t _globals;
 
 struct globals_t *globals = &_globals;
 
 #pragma mark -
 #pragma mark Function Prototypes
 
-// Logs errors to stderr.
-static void LogError(const char *format, ...)
-__attribute__((format(printf, 1, 2)));
+// Returns a policy built from the command line options (-d, -p, ...).
+struct policy_t *PolicyCreateFromGlobals(void);
 
-// For verbose (-v) output, goes to stderr.
-static void LogV(const char *format, ...)
-__attribute__((format(printf, 1, 2)));
+// Starts enforcing policy: runs its prescan if it has one, and sets up
+// whatever will tell us about changes under its root.  Returns false if that
+// couldn't be done.
+Boolean WatchPolicy(struct policy_t *policy);
 
-// For mega-verbose (-V) output, goes to stderr.
-static void LogMV(const char *format, ...)
-__attribute__((format(printf, 1, 2)));
+// With -s, starts the one stream for every root WatchPolicy() was given, then
+// runs their prescans.  Returns false if the stream couldn't be made.
+Boolean StartSharedStream(void);
 
+#ifdef __APPLE__
 // Returns a CFPropertyList (could be CFDictionary, CFArray, etc....) from a
 // path.  Returns NULL if something goes wrong.
 CFPropertyListRef CreatePropertyListFromFile(const char *path);
 
-// Returns an FSEventStreamRef configured with a given CFDictionary Object.
-FSEventStreamRef EventStreamFromDictionary(CFDictionaryRef config);
+// Returns the config dictionaries in the plist at path (which may be a single
+// dictionary or an array of them).  Returns NULL if the plist can't be used.
+CFArrayRef CopyConfigArray(const char *path);
+
+// Re-reads the plist, and only touches the streams whose config changed.
+void ReloadConfig(void);
+
+// Stops the stream at index in streamArray and forgets its policy.
+void StopStreamAtIndex(CFIndex index);
+
+// FSEvents fixes a stream's latency when it's made, so streams whose
+// controller has moved are made again, from the last event they delivered.
+void RestartRetunedStreams(void);
+
+// ReloadConfig() for -s: the shared stream is replaced, picking up where the
+// old one left off, and only new or changed roots are prescanned.
+void ReloadSharedConfig(CFArrayRef configArray);
+
+// Works out where policy's stream should start: where it got to last run if
+// resume is true and that's still in the event history, or else now, with a
+// prescan (or, if its history was lost, a full rescan) queued.
+FSEventStreamEventId EventIdToStartFrom(struct policy_t *policy,
+										Boolean resume);
+
+// For RescanStop(): a background walk under policy never got done, so where
+// its stream got to can't be trusted next time.
+void HistoryLoseWalk(struct policy_t *policy, const char *path);
+
+// Returns an FSEventStreamRef configured with a given policy, starting from
+// since, with the latency its controller is at right now.
+FSEventStreamRef EventStreamFromPolicy(struct policy_t *policy,
+									   FSEventStreamEventId since);
+
+// Returns one FSEventStreamRef for every root in dispatch, starting from
+// since.
+FSEventStreamRef EventStreamFromDispatch(struct dispatch_t *dispatch,
+										 FSEventStreamEventId since);
+
+// Decodes a config dictionary into a policy, making the root first if the
+// config asks for it.  Returns NULL if the config can't be used.
+struct policy_t *PolicyCreateFromDictionary(CFDictionaryRef config);
 
 // Stream Array callbacks:
 void MyCFArrayReleaseCallback(CFAllocatorRef allocator,
@@ -122,7 +148,23 @@ Boolean MyCFArrayEqualCallBack(const void *value1,
 const void *MyCFArrayRetainCallBack(CFAllocatorRef allocator,
 									const void *value);
 
-// Heavy lifting.  Call back that occurs when a change is made.
+// Policy Array callbacks:
+void MyPolicyArrayReleaseCallBack(CFAllocatorRef allocator,
+								  const void *value);
+const void *MyPolicyArrayRetainCallBack(CFAllocatorRef allocator,
+										const void *value);
+
+// Heavy lifting.  Works out what a batch of policy's events needs walked
+// and hands it to the workers (see work.h); dispatch is the shared stream's,
+// or NULL if the root has its own.
+void HandleEvents(struct policy_t *policy,
+				  struct dispatch_t *dispatch,
+				  size_t numEvents,
+				  char **pathArray,
+				  const FSEventStreamEventFlags eventFlags[],
+				  const FSEventStreamEventId eventIds[]);
+
+// Call back that occurs when a change is made.
 void FSCallback(ConstFSEventStreamRef streamRef,
 				void *clientCallBackInfo,
 				size_t numEvents,
@@ -130,26 +172,41 @@ void FSCallback(ConstFSEventStreamRef streamRef,
 				const FSEventStreamEventFlags eventFlags[],
 				const FSEventStreamEventId eventIds[]);
 
-// No, this is the actual heavy lifting.  Applies what's in the config passed
-// down through the tree.  Forcing recursion if necessary.
-int applyPermissionsToFolder(const char *path,
-							 CFDictionaryRef config,
-							 Boolean force_recursion);
+// Same for the shared stream: sorts the events out by policy and hands each
+// policy's share to HandleEvents().
+void SharedFSCallback(ConstFSEventStreamRef streamRef,
+					  void *clientCallBackInfo,
+					  size_t numEvents,
+					  void *eventPaths,
+					  const FSEventStreamEventFlags eventFlags[],
+					  const FSEventStreamEventId eventIds[]);
+
+// Adds the sub-rules in a config's _rules array to policy.  Returns false if
+// any of them can't be used.
+Boolean addRulesFromConfig(struct policy_t *policy, CFArrayRef rules);
 
-// Returns the UID specified in the CFString (whether the string is a username
-// or a UID itself.
-uid_t getUIDfromCFString(CFStringRef myString);
+// Returns true only if key is present in config and is a true CFBoolean.
+Boolean getBooleanFromConfig(CFDictionaryRef config, CFStringRef key);
 
-// Returns the GID specified in the CFString (whether the string is a username
-// or a GID itself.
-gid_t getGIDfromCFString(CFStringRef myString);
+// Copies the string or number at key in config into buffer as a C string
+// (empty if it isn't there).  Returns false if it's something else, or
+// doesn't fit.
+Boolean getIDStringFromConfig(CFDictionaryRef config, CFStringRef key,
+							  char *buffer, CFIndex bufferSize);
 
-// Returns TRUE if the file at path does NOT have the acl specified.
-Boolean fileNeedsACLApplied(const char *path, acl_t acl);
+// Copies a CFString into buffer, returning false if it doesn't fit.
+Boolean getCStringFromCFString(CFStringRef myString,
+							   char *buffer,
+							   CFIndex bufferSize);
+#endif
 
 // Prints the usage to stderr
 void usage(void);
 
+// Deals with whatever signals came in while the run loop was running.
+// Returns true when it's time to quit.
+Boolean HandleSignals(void);
+
 // Signal related functions
 void setup_signals(void);
 void handle(int signal);
@@ -166,22 +223,42 @@ int main (int argc, char * argv[]) {
 	globals->quiet						=	false;
 	globals->rescanSignal				=	false;
 	globals->quitSignal					=	false;
+	globals->hangupSignal				=	false;
 	globals->mode						=	NULL;
-	globals->owner						=	-1;
-	globals->group						=	-1;
+	globals->owner						=	NULL;
+	globals->group						=	NULL;
+	globals->rules						=	NULL;
+	globals->ruleCount					=	0;
 	globals->acl						=	-1;
 	globals->force						=	false;
 	globals->create						=	false;
 	globals->followSymbolicLinks		=	false;
 	globals->ignoreSelf					=	false;
 	globals->prescan					=	false;
-    globals->latency                    =   5.0;
+	globals->cachedAttributes			=	false;
+	globals->once						=	false;
+	globals->sharedStream				=	false;
+	globals->dispatch					=	NULL;
+	globals->fileEvents					=	false;
+	globals->latency					=	0.5;
+	globals->latencyMaximum				=	5.0;
+	globals->walkEngine					=	WALK_ENGINE_FTS;
+	globals->walkThreads				=	WalkDefaultThreadCount();
+	globals->workers					=	WORK_DEFAULT_WORKERS;
+	globals->ioBudget					=	0;
+#ifndef __APPLE__
+	globals->eventSource				=	STREAM_SOURCE_INOTIFY;
+#endif
 
 	bzero(globals->plistPath, PATH_MAX);
 	bzero(globals->directoryPath, PATH_MAX);
-		
-	globals->launch_time = time(NULL);
+	bzero(globals->metricsPath, PATH_MAX);
+	bzero(globals->logPath, PATH_MAX);
+	bzero(globals->auditPath, PATH_MAX);
+	globals->auditBinary				=	false;
+	snprintf(globals->indexPath, PATH_MAX, "%s", VERIFIED_DEFAULT_PATH);
 	
+#ifdef __APPLE__
 	CFArrayCallBacks streamArrayCallbacks;
 	streamArrayCallbacks.version = 0;
 	streamArrayCallbacks.retain = &MyCFArrayRetainCallBack;
@@ -191,8 +268,20 @@ int main (int argc, char * argv[]) {
 												0,
 												&streamArrayCallbacks);
 	
+	CFArrayCallBacks policyArrayCallbacks;
+	policyArrayCallbacks.version = 0;
+	policyArrayCallbacks.retain = &MyPolicyArrayRetainCallBack;
+	policyArrayCallbacks.release = &MyPolicyArrayReleaseCallBack;
+	policyArrayCallbacks.copyDescription = NULL;
+	policyArrayCallbacks.equal = &MyCFArrayEqualCallBack;
+	globals->policyArray = CFArrayCreateMutable(kCFAllocatorDefault,
+												0,
+												&policyArrayCallbacks);
+	
 	// Determine if we can send the ignore self flag to FSEventStreamCreate()
+	// (and, from Lion on, ask for file events).
 	SInt32 minorVersion, majorVersion;
+	Boolean canFileEvents = false;
 	
 	if ((Gestalt(gestaltSystemVersionMajor, &majorVersion) != noErr) ||
 		(Gestalt(gestaltSystemVersionMinor, &minorVersion) != noErr))
@@ -202,13 +291,15 @@ int main (int argc, char * argv[]) {
 	else
 	{
 		globals->ignoreSelf = (majorVersion == 10 && minorVersion > 5);
+		canFileEvents = (majorVersion > 10 || minorVersion > 6);
 	}
+#endif
 	
 	
 	// GET PARAMETERS
 	char absolutePath[PATH_MAX];
    	int c; opterr = 0;
-	while ((c = getopt(argc, argv, "vVPqaLHfCp:c:d:l:")) != -1)
+	while ((c = getopt(argc, argv, "vVPNqaLHfCOsbep:c:d:l:W:T:S:i:u:g:m:o:R:B:A:w:")) != -1)
 	{
 		switch (c) {
 			case 'V':
@@ -227,7 +318,7 @@ int main (int argc, char * argv[]) {
 					LogError("Cannot find file %s\n", optarg);
 					exit(1);
 				}
-				snprintf(globals->plistPath, PATH_MAX-1, "%s", absolutePath);
+				snprintf(globals->plistPath, PATH_MAX, "%s", absolutePath);
 				break;
 			case 'd':
 				if (realpath(optarg, absolutePath) == NULL)
@@ -235,10 +326,17 @@ int main (int argc, char * argv[]) {
 					LogError("Cannot find file %s\n", optarg);
 					exit(1);
 				}
-				snprintf(globals->directoryPath, PATH_MAX-1, "%s", absolutePath);
+				snprintf(globals->directoryPath, PATH_MAX, "%s", absolutePath);
+				break;
+			case 'l':
+				if (!LatencyParseBounds(optarg, &globals->latency,
+										&globals->latencyMaximum))
+				{
+					LogError("Bad latency %s (use seconds, or min:max)\n",
+							 optarg);
+					exit(1);
+				}
 				break;
-            case 'l':
-                globals->latency = strtod(optarg, (char **)NULL);
 			case 'p':
 				globals->mode = strdup(optarg);
 				break;
@@ -257,9 +355,104 @@ int main (int argc, char * argv[]) {
 			case 'P':
 				globals->prescan = true;
 				break;
+			case 'N':
+				globals->cachedAttributes = true;
+				break;
+			case 'O':
+				globals->once = true;
+				break;
+			case 's':
+				globals->sharedStream = true;
+				break;
+			case 'e':
+				globals->fileEvents = true;
+				break;
+			case 'A':
+				snprintf(globals->auditPath, PATH_MAX, "%s", optarg);
+				break;
+			case 'b':
+				globals->auditBinary = true;
+				break;
+			case 'W':
+				if ((globals->walkEngine = WalkEngineFromString(optarg)) == -1)
+				{
+					LogError("Unknown traversal engine %s (use fts or fd)\n",
+							 optarg);
+					exit(1);
+				}
+				break;
+			case 'T':
+				globals->walkThreads = atoi(optarg);
+				if (globals->walkThreads < 1 ||
+					globals->walkThreads > WALK_MAX_THREADS)
+				{
+					LogError("Walker threads must be between 1 and %d\n",
+							 WALK_MAX_THREADS);
+					exit(1);
+				}
+				break;
+			case 'B':
+				globals->ioBudget = strtoul(optarg, (char **)NULL, 10);
+				break;
+			case 'w':
+				globals->workers = atoi(optarg);
+				if (globals->workers < 1 ||
+					globals->workers > WORK_MAX_WORKERS)
+				{
+					LogError("Workers must be between 1 and %d\n",
+							 WORK_MAX_WORKERS);
+					exit(1);
+				}
+				break;
+			case 'u':
+				globals->owner = strdup(optarg);
+				break;
+			case 'g':
+				globals->group = strdup(optarg);
+				break;
+			case 'R':
+			{
+				char **rules = realloc(globals->rules, (globals->ruleCount + 1) *
+									   sizeof(char *));
+				
+				if (!rules)
+				{
+					LogError("Couldn't allocate sub-rule %s\n", optarg);
+					exit(1);
+				}
+				globals->rules = rules;
+				globals->rules[globals->ruleCount++] = strdup(optarg);
+				break;
+			}
+			case 'm':
+				snprintf(globals->metricsPath, PATH_MAX, "%s", optarg);
+				break;
+			case 'o':
+				snprintf(globals->logPath, PATH_MAX, "%s", optarg);
+				break;
+			case 'i':
+				snprintf(globals->indexPath, PATH_MAX, "%s", optarg);
+				break;
+			case 'S':
+#ifdef __APPLE__
+				LogError("Ignoring -S, Mac OS X always uses FSEvents\n");
+#else
+				if ((globals->eventSource = StreamSourceFromString(optarg)) == -1)
+				{
+					LogError("Unknown event source %s (use inotify or "
+							 "fanotify)\n", optarg);
+					exit(1);
+				}
+#endif
+				break;
 			case '?':
 			default:
-				if (optopt == 'p' || optopt == 'd' || optopt == 'c') {
+				if (optopt == 'p' || optopt == 'd' || optopt == 'c' ||
+					optopt == 'l' || optopt == 'W' || optopt == 'T' ||
+					optopt == 'S' || optopt == 'i' || optopt == 'u' ||
+					optopt == 'g' || optopt == 'm' || optopt == 'o' ||
+					optopt == 'R' || optopt == 'B' || optopt == 'A' ||
+					optopt == 'w') {
 					LogError("Option %c requires an argument.\n", optopt);
 				}
 				else {
@@ -270,12 +463,42 @@ int main (int argc, char * argv[]) {
 		}
 	}
 	
+	// From here on, logging goes through the writer thread.
+	LoggingStart(*(globals->logPath) ? globals->logPath : NULL);
+	
 	// Print out some info in verbose mode:
 	LogV("%s v%s, %s2009 Backlight, LLC.\n", PROGNAME, VERSION, "©");
 	
+#ifdef __APPLE__
+	if (globals->fileEvents && !canFileEvents)
+	{
+		LogError("File events (-e) need Mac OS X 10.7; walking directories "
+				 "instead\n");
+		globals->fileEvents = false;
+	}
+#endif
+	
+	// An audit is one pass that changes nothing, then we're done.
+	if (*(globals->auditPath))
+	{
+		if (!AuditOpen(globals->auditPath, globals->auditBinary ?
+					   AUDIT_FORMAT_BINARY : AUDIT_FORMAT_JSONL))
+		{
+			exit(1);
+		}
+		globals->once = true;
+	}
+	
 	// Setup signal handling:
 	setup_signals();
 	
+	if (globals->ioBudget > 0)
+	{
+		LogV("Background walks limited to %lu syscalls a second.\n",
+			 globals->ioBudget);
+		BudgetSetRate(globals->ioBudget);
+	}
+	
 	// If we aren't root, display a warning.  (But keep going!!)
 	if (geteuid() != 0)
 	{
@@ -284,171 +507,103 @@ int main (int argc, char * argv[]) {
 				 PROGNAME);
 	}
 	
+	// Counting starts regardless; this is just so somebody can look.
+	if (*(globals->metricsPath) && !globals->once)
+	{
+		MetricsStartServer(globals->metricsPath);
+	}
+	
+	// Load what we already know is right before anything gets walked.  "-i -"
+	// keeps it in memory only.
+	VerifiedIndexOpen(strcmp(globals->indexPath, "-") ? globals->indexPath
+					  : NULL);
+	
+#ifdef __APPLE__
+	// Where each root's stream got to lives next to the index, and goes with
+	// it: "-i -" means starting from now every time.
+	if (!globals->once)
+	{
+		char historyPath[PATH_MAX];
+		
+		snprintf(historyPath, PATH_MAX, "%s.events", globals->indexPath);
+		HistoryOpen(strcmp(globals->indexPath, "-") ? historyPath : NULL);
+	}
+#endif
+	
+	// Event walks go to the workers, so they have to be there before any
+	// stream is.
+	if (!globals->once && !WorkStart(globals->workers))
+	{
+		exit(1);
+	}
+	
+	// With -s the roots are collected first, then share one stream.
+	if (globals->sharedStream && !globals->once &&
+		(globals->dispatch = DispatchCreate()) == NULL)
+	{
+		exit(1);
+	}
+	
 	// Configuring everything here.
 
 	if (*(globals->plistPath))
 	{
-		CFPropertyListRef configFile = CreatePropertyListFromFile(globals->plistPath);
-		if (!configFile)
+#ifdef __APPLE__
+		CFArrayRef configArray = CopyConfigArray(globals->plistPath);
+		
+		if (!configArray)
 		{
-			LogError("Couldn't get property list from file %s.  "
-					 "It could be corrupt!\n", globals->plistPath);
 			exit(1);
 		}
 		
-		CFTypeID plistType = CFGetTypeID(configFile);
-		
-		// Only one dictionary.  Use it as the sole configuration
-		if (plistType == CFDictionaryGetTypeID())
+		int i;
+		for (i = 0; i < CFArrayGetCount(configArray); i++)
 		{
-			FSEventStreamRef newStream = EventStreamFromDictionary((CFDictionaryRef)configFile);
+			CFTypeRef currObject;
+			currObject = CFArrayGetValueAtIndex(configArray, i);
+			CFTypeID currObjectType = CFGetTypeID(currObject);
 			
-			if (!newStream)
+			if (currObjectType == CFDictionaryGetTypeID())
 			{
-				// Stream creation failed on the only config object, bail!
-				LogError("Could not get a valid stream from config!\n");
-				exit(1);
-			}
-			
-			FSEventStreamScheduleWithRunLoop(newStream,
-											 CFRunLoopGetCurrent(),
-											 kCFRunLoopDefaultMode);
-			FSEventStreamStart(newStream);
-			CFArrayAppendValue(globals->streamArray, newStream);
-			FSEventStreamRelease(newStream);
-
-		}
-		// If it's an array, get the dictionaries therein and use them as all
-		// the configs
-		else if (plistType == CFArrayGetTypeID())
-		{
-			int i;
-			for (i = 0; i < CFArrayGetCount(configFile); i++)
-			{
-				CFTypeRef currObject;
-				currObject = CFArrayGetValueAtIndex(configFile, i);
-				CFTypeID currObjectType = CFGetTypeID(currObject);
+				struct policy_t *policy;
 				
-				if (currObjectType == CFDictionaryGetTypeID())
-				{
-					FSEventStreamRef
-					newStream =
-						EventStreamFromDictionary((CFDictionaryRef)currObject);
-					
-					if (!newStream)
-					{
-						// Stream creation failed on the only config object, bail!
-						LogError("Could not get a valid stream from config!\n");
-						exit(1);
-					}
-					
-					FSEventStreamScheduleWithRunLoop(newStream,
-													 CFRunLoopGetCurrent(),
-													 kCFRunLoopDefaultMode);
-					FSEventStreamStart(newStream);
-					CFArrayAppendValue(globals->streamArray, newStream);
-					FSEventStreamRelease(newStream);
-				}
-				else
+				policy = PolicyCreateFromDictionary((CFDictionaryRef)currObject);
+				
+				if (!policy || !WatchPolicy(policy))
 				{
-					LogError("Plist Config File error: Expecting an array of "
-							 "dictionaries!\n");
+					// Stream creation failed on a config object, bail!
+					LogError("Could not get a valid stream from config!\n");
+					exit(1);
 				}
+				
+				PolicyRelease(policy);
+			}
+			else
+			{
+				LogError("Plist Config File error: Expecting an array of "
+						 "dictionaries!\n");
 			}
-		}
-		// If it's somthing else, then we have a problem with the plist and bail
-		else
-		{
-			LogError("CFType at root of plist %s was not a dictionary or an "
-					 "array!\n", globals->plistPath);
-			exit(1);
 		}
 		
-		CFRelease(configFile);
-	 }
+		CFRelease(configArray);
+#else
+		LogError("Plist config files are only supported on Mac OS X, use -d "
+				 "instead.\n");
+		exit(1);
+#endif
+	}
 	else if (*(globals->directoryPath))
 	{
-		// Create a CFDictionary to hold our config info passed in through
-		// parameters.
-		
-		CFMutableDictionaryRef 
-		config = CFDictionaryCreateMutable(kCFAllocatorDefault,
-										   0,
-										   &kCFTypeDictionaryKeyCallBacks,
-										   &kCFTypeDictionaryValueCallBacks);
-		
-		// Create CFString path and add it to config.
-		CFStringRef path = CFStringCreateWithCString(kCFAllocatorDefault,
-													 globals->directoryPath,
-													 kCFStringEncodingUTF8);
-		CFDictionarySetValue(config, kCHMODDPathKey, path);
-		
-		if (*(globals->mode))
-		{
-			CFStringRef
-			perms = CFStringCreateWithCString(kCFAllocatorDefault,
-											  globals->mode,
-											  kCFStringEncodingUTF8);
-			CFDictionarySetValue(config, kCHMODDPermKey, perms);
-		}
-		
-		if (globals->owner != -1)
-		{
-			CFNumberRef owner = CFNumberCreate(kCFAllocatorDefault,
-											   kCFNumberSInt32Type,
-											   &(globals->owner));
-			CFDictionarySetValue(config, kCHMODDOwnerKey, owner);
-		}
-
-		if (globals->group != -1)
-		{
-			CFNumberRef group = CFNumberCreate(kCFAllocatorDefault,
-											   kCFNumberSInt32Type,
-											   &(globals->group));
-			CFDictionarySetValue(config, kCHMODDGroupKey, group);
-		}
-		if (globals->acl == true)
-		{
-			CFBooleanRef myBool = kCFBooleanTrue;
-			CFDictionarySetValue(config, kCHMODDACLKey, myBool);
-		}
-		if (globals->followSymbolicLinks == true)
-		{
-			CFBooleanRef myBool = kCFBooleanTrue;
-			CFDictionarySetValue(config, kCHMODDFollowLinkKey, myBool);
-		}
-		if (globals->force == true)
-		{
-			CFBooleanRef myBool = kCFBooleanTrue;
-			CFDictionarySetValue(config, kCHMODDForceKey, myBool);
-		}
-		if (globals->create == true)
-		{
-			CFBooleanRef myBool = kCFBooleanTrue;
-			CFDictionarySetValue(config, kCHMODDCreateKey, myBool);
-		}
-		if (globals->prescan == true)
-		{
-			CFBooleanRef myBool = kCFBooleanTrue;
-			CFDictionarySetValue(config, kCHMODDPreScanKey, myBool);
-		}
+		struct policy_t *policy = PolicyCreateFromGlobals();
 		
-		FSEventStreamRef newStream = EventStreamFromDictionary((CFDictionaryRef)config);
-		
-		if (!newStream)
+		if (!policy || !WatchPolicy(policy))
 		{
 			// Stream creation failed on the only config object, bail!
 			LogError("Could not get a valid stream from config!\n");
 			exit(1);
 		}
 		
-		FSEventStreamScheduleWithRunLoop(newStream,
-										 CFRunLoopGetCurrent(),
-										 kCFRunLoopDefaultMode);
-		FSEventStreamStart(newStream);
-		CFArrayAppendValue(globals->streamArray, newStream);
-		FSEventStreamRelease(newStream);
-		CFRelease(config);
+		PolicyRelease(policy);
 	}
 	else
 	{
@@ -457,26 +612,43 @@ int main (int argc, char * argv[]) {
 		exit(1);
 	}
 	
+	if (globals->dispatch && !StartSharedStream())
+	{
+		LogError("Could not get a valid stream for the roots!\n");
+		exit(1);
+	}
+	
+#ifdef __APPLE__
+	globals->streamsStarted = true;
+#endif
+	
+	if (globals->once)
+	{
+		// Everything's been applied (or audited) once already, we're done.
+		if (AuditIsOpen())
+		{
+			struct audit_stats_t auditStats;
+			
+			AuditClose(&auditStats);
+			LogV("Audit: %lu entr%s out of policy (%lu mode, %lu owner, "
+				 "%lu group, %lu ACL).\n", auditStats.records,
+				 (auditStats.records != 1) ? "ies" : "y", auditStats.mode,
+				 auditStats.owner, auditStats.group, auditStats.acl);
+		}
+		VerifiedIndexClose();
+		LoggingStop();
+		return 0;
+	}
+	
+#ifdef __APPLE__
 	// Main loop (only if we have something in the array):
 	if (CFArrayGetCount(globals->streamArray) > 0)
 	{
-		Boolean done = false;
 		do {
 			// Start the run loop with a time out of 2 seconds:
 			CFRunLoopRunInMode(kCFRunLoopDefaultMode, 2, true);
-			
-			if (globals->rescanSignal)
-			{
-				//LogV("Got signal to rescan, rescanning %s\n", globals->path);
-				globals->rescanSignal = false;
-			}
-			if (globals->quitSignal)
-			{
-				LogV("Got SIGINT or SIGTERM, cleaning and quiting.\n");
-				done = true;
-			}
 		}
-		while (!done);
+		while (!HandleSignals());
 	}
 	
 	CFIndex arrayCount = CFArrayGetCount(globals->streamArray);
@@ -492,77 +664,738 @@ int main (int argc, char * argv[]) {
 	}
 	
 	CFRelease(globals->streamArray);
+	CFRelease(globals->policyArray);
+#else
+	// Same thing with our own streams:
+	if (globals->streamList)
+	{
+		do {
+			StreamRunOnce(2);
+		}
+		while (!HandleSignals());
+	}
 	
-    return 0;
-}
-
-// Load a property list from a path.
-CFPropertyListRef CreatePropertyListFromFile(const char *path)
-{
-	CFURLRef myURL;
-	CFPropertyListRef propertyList;
-	CFStringRef errorString;
-	CFStringRef myString = CFStringCreateWithCString(kCFAllocatorDefault,
-													 path,
-													 kCFStringEncodingUTF8);
-	CFDataRef resourceData;
-	Boolean status;
-	SInt32 errorCode;
-	
-	/* Create CFURL from CFString */
-	myURL = CFURLCreateWithFileSystemPath(kCFAllocatorDefault,
-										  myString,
-										  kCFURLPOSIXPathStyle,
-										  FALSE);
+	StreamReleaseAll();
+#endif
 	
-	status = CFURLCreateDataAndPropertiesFromResource(kCFAllocatorDefault,
-													  myURL,
-													  &resourceData,
-													  NULL,
-													  NULL,
-													  &errorCode);
+	// What the streams handed over gets done before we go.
+	WorkStop();
 	
-	propertyList = CFPropertyListCreateFromXMLData(kCFAllocatorDefault,
-												   resourceData,
-												   kCFPropertyListImmutable,
-												   &errorString);
+	// The background thread gives up on whatever walk it's on; what that had
+	// verified is kept.
+#ifdef __APPLE__
+	// Roots with walks left undone get a full walk next time...
+	RescanStop(HistoryLoseWalk);
 	
-	CFRelease(resourceData);
-	CFRelease(myString);
+	// ...and if anything else is left, every event since the last commit is
+	// delivered again.
+	if (WorkIsIdle())
+	{
+		HistoryCommit();
+	}
+	HistoryClose();
+#else
+	RescanStop(NULL);
+#endif
 	
-	if (globals->mode)
+	if (globals->dispatch)
 	{
-		free(globals->mode);
+		DispatchRelease(globals->dispatch);
 	}
 	
-	return propertyList;
+	SubtreeClear();
+	VerifiedIndexClose();
+	MetricsStopServer();
+	LoggingStop();
+	
+    return 0;
 }
 
-
-// Logs errors to stderr.
-static void LogError(const char *format, ...)
+Boolean HandleSignals(void)
 {
-	va_list ap;
-    va_start(ap, format);
-    vfprintf(stderr, format, ap);
-    va_end(ap);
+	if (globals->rescanSignal)
+	{
+		// Goes on in the background; we keep handling events meanwhile.
+		LogV("Got SIGUSR1 or SIGUSR2, rescanning.\n");
+		globals->rescanSignal = false;
+		RescanRequest();
+	}
+	if (globals->hangupSignal)
+	{
+		struct idcache_stats_t stats;
+		
+		IDCacheGetStats(&stats);
+		LogV("Got SIGHUP, flushing user/group cache (%lu hits, "
+			 "%lu misses).\n", stats.hits, stats.misses);
+		LogV("Coalescing has saved %lu walks so far.\n",
+			 CoalesceWalksSaved());
+		IDCacheInvalidate();
+		globals->hangupSignal = false;
+		
+#ifdef __APPLE__
+		if (*(globals->plistPath))
+		{
+			ReloadConfig();
+		}
+#else
+		LogV("Config comes from the command line, nothing to reload.\n");
+#endif
+	}
+	if (globals->quitSignal)
+	{
+		LogV("Got SIGINT or SIGTERM, cleaning and quiting.\n");
+		return true;
+	}
+	
+#ifdef __APPLE__
+	RestartRetunedStreams();
+	
+	// Only we hand the workers (and the background thread) anything, so if
+	// they're idle now, everything handed over so far is done.
+	if (WorkIsIdle())
+	{
+		HistoryCommit();
+	}
+	HistorySave();
+#endif
+	
+	return false;
 }
 
-// For verbose output, goes to stderr.
-static void LogV(const char *format, ...)
+struct policy_t *PolicyCreateFromGlobals(void)
 {
-	if (!globals->verbose) {
-        return;
-    }
-    
-    va_list ap;
+	struct policy_t *policy = PolicyCreate(globals->directoryPath,
+										   globals->directoryPath);
+	int i;
+	
+	if (!policy)
+	{
+		return NULL;
+	}
+	
+	if (globals->mode && *(globals->mode))
+	{
+		PolicySetMode(policy, globals->mode);
+	}
+	
+	if (globals->owner)
+	{
+		PolicySetOwner(policy, globals->owner);
+	}
+	
+	if (globals->group)
+	{
+		PolicySetGroup(policy, globals->group);
+	}
+	
+	if (globals->acl == true)
+	{
+#ifdef __APPLE__
+		policy->applyACL = true;
+		PolicyLoadACL(policy);
+#else
+		LogError("ACLs are only supported on Mac OS X, ignoring -a\n");
+#endif
+	}
+	
+	for (i = 0; i < globals->ruleCount; i++)
+	{
+		if (!PolicyAddRuleFromString(policy, globals->rules[i]))
+		{
+			PolicyRelease(policy);
+			return NULL;
+		}
+	}
+	
+	policy->followLinks = globals->followSymbolicLinks;
+	policy->force = globals->force;
+	policy->create = globals->create;
+	policy->prescan = globals->prescan;
+	policy->cachedAttributes = globals->cachedAttributes;
+	
+	return policy;
+}
+
+Boolean WatchPolicy(struct policy_t *policy)
+{
+	if (globals->once)
+	{
+		applyPermissionsToFolder(policy->path, policy, true);
+		return true;
+	}
+	
+	if (globals->dispatch)
+	{
+		// StartSharedStream() does the rest once every root is in.
+		if (!DispatchAddPolicy(globals->dispatch, policy))
+		{
+			return false;
+		}
+		
+		if (policy->force)
+		{
+			policy->rootDescriptor = open(policy->path, O_NONBLOCK);
+		}
+		
+		RescanAddPolicy(policy);
+		return true;
+	}
+	
+#ifdef __APPLE__
+	FSEventStreamRef newStream;
+	
+	// If we're forcing the root to be there, let's open a file descriptor to
+	// it, so we can detect where it's gone.
+	if (policy->force)
+	{
+		policy->rootDescriptor = open(policy->path, O_NONBLOCK);
+	}
+	
+	if (!policy->latency &&
+		(policy->latency = LatencyCreate(policy->path)) == NULL)
+	{
+		return false;
+	}
+	
+	newStream = EventStreamFromPolicy(policy,
+									  EventIdToStartFrom(policy,
+														 !globals->streamsStarted));
+	if (!newStream)
+	{
+		return false;
+	}
+	
+	FSEventStreamScheduleWithRunLoop(newStream,
+									 CFRunLoopGetCurrent(),
+									 kCFRunLoopDefaultMode);
+	FSEventStreamStart(newStream);
+	CFArrayAppendValue(globals->streamArray, newStream);
+	CFArrayAppendValue(globals->policyArray, policy);
+	FSEventStreamRelease(newStream);
+	RescanAddPolicy(policy);
+#else
+	struct stream_t *newStream;
+	
+	if (policy->force)
+	{
+		policy->rootDescriptor = open(policy->path, O_NONBLOCK);
+	}
+	
+	// Watch first, so nothing that happens during the prescan is missed.
+	if ((newStream = StreamCreateFromPolicy(policy)) == NULL)
+	{
+		return false;
+	}
+	
+	StreamSchedule(newStream);
+	RescanAddPolicy(policy);
+	
+	if (policy->prescan)
+	{
+		RescanRequestWalk(policy, policy->path, true);
+	}
+#endif
+	
+	return true;
+}
+
+Boolean StartSharedStream(void)
+{
+	struct dispatch_t *dispatch = globals->dispatch;
+	size_t i;
+	
+	if (dispatch->policyCount == 0)
+	{
+		return true;
+	}
+	
+#ifdef __APPLE__
+	FSEventStreamRef newStream;
+	FSEventStreamEventId since = kFSEventStreamEventIdSinceNow, rootSince;
+	
+	// The stream can only start in one place, so it starts where the root
+	// furthest behind got to.  The others see some events again, and walking
+	// a path that's already right costs a stat.
+	for (i = 0; i < dispatch->policyCount; i++)
+	{
+		rootSince = EventIdToStartFrom(dispatch->policies[i], true);
+		
+		if (rootSince != kFSEventStreamEventIdSinceNow &&
+			(since == kFSEventStreamEventIdSinceNow || rootSince < since))
+		{
+			since = rootSince;
+		}
+	}
+	
+	newStream = EventStreamFromDispatch(dispatch, since);
+	if (!newStream)
+	{
+		return false;
+	}
+	
+	FSEventStreamScheduleWithRunLoop(newStream,
+									 CFRunLoopGetCurrent(),
+									 kCFRunLoopDefaultMode);
+	FSEventStreamStart(newStream);
+	CFArrayAppendValue(globals->streamArray, newStream);
+	FSEventStreamRelease(newStream);
+#else
+	struct stream_t *newStream;
+	
+	if ((newStream = StreamCreateShared(dispatch)) == NULL)
+	{
+		return false;
+	}
+	
+	StreamSchedule(newStream);
+#endif
+	
+	LogV("Watching %lu root%s on one stream\n",
+		 (unsigned long)dispatch->policyCount,
+		 (dispatch->policyCount != 1) ? "s" : "");
+	
+#ifndef __APPLE__
+	// As with a stream of its own, each prescan comes after the watching
+	// starts, so nothing that happens during it is missed.  (On the Mac,
+	// EventIdToStartFrom() queued them, unless there was history to resume.)
+	for (i = 0; i < dispatch->policyCount; i++)
+	{
+		if (dispatch->policies[i]->prescan)
+		{
+			RescanRequestWalk(dispatch->policies[i],
+							  dispatch->policies[i]->path, true);
+		}
+	}
+#endif
+	
+	return true;
+}
+
+#ifdef __APPLE__
+
+CFArrayRef CopyConfigArray(const char *path)
+{
+	CFPropertyListRef configFile = CreatePropertyListFromFile(path);
+	CFArrayRef configArray = NULL;
+	
+	if (!configFile)
+	{
+		LogError("Couldn't get property list from file %s.  "
+				 "It could be corrupt!\n", path);
+		return NULL;
+	}
+	
+	CFTypeID plistType = CFGetTypeID(configFile);
+	
+	// Only one dictionary.  Use it as the sole configuration
+	if (plistType == CFDictionaryGetTypeID())
+	{
+		configArray = CFArrayCreate(kCFAllocatorDefault,
+									&configFile,
+									1,
+									&kCFTypeArrayCallBacks);
+	}
+	// If it's an array, get the dictionaries therein and use them as all
+	// the configs
+	else if (plistType == CFArrayGetTypeID())
+	{
+		configArray = CFRetain(configFile);
+	}
+	// If it's somthing else, then we have a problem with the plist and bail
+	else
+	{
+		LogError("CFType at root of plist %s was not a dictionary or an "
+				 "array!\n", path);
+	}
+	
+	CFRelease(configFile);
+	
+	return configArray;
+}
+
+void StopStreamAtIndex(CFIndex index)
+{
+	FSEventStreamRef stream;
+	struct policy_t *policy;
+	
+	stream = (FSEventStreamRef)CFArrayGetValueAtIndex(globals->streamArray,
+													  index);
+	policy = (struct policy_t *)CFArrayGetValueAtIndex(globals->policyArray,
+													   index);
+	
+	LogV("Stopped watching %s\n", policy->path);
+	
+	FSEventStreamStop(stream);
+	FSEventStreamInvalidate(stream);
+	RescanRemovePolicy(policy, NULL);
+	
+	CFArrayRemoveValueAtIndex(globals->streamArray, index);
+	CFArrayRemoveValueAtIndex(globals->policyArray, index);
+}
+
+void RestartRetunedStreams(void)
+{
+	struct dispatch_t *dispatch = globals->dispatch;
+	struct policy_t *policy = NULL;
+	struct latency_t *latency;
+	FSEventStreamRef oldStream, newStream;
+	FSEventStreamEventId since;
+	CFIndex i;
+	
+	for (i = 0; i < CFArrayGetCount(globals->streamArray); i++)
+	{
+		if (dispatch)
+		{
+			latency = dispatch->latency;
+		}
+		else
+		{
+			policy = (struct policy_t *)
+				CFArrayGetValueAtIndex(globals->policyArray, i);
+			latency = policy->latency;
+		}
+		
+		if (!latency || !LatencyNeedsRestart(latency))
+		{
+			continue;
+		}
+		
+		// Hand over what the old stream is holding first, so the new one only
+		// has to start after it.
+		oldStream = (FSEventStreamRef)
+			CFArrayGetValueAtIndex(globals->streamArray, i);
+		FSEventStreamFlushSync(oldStream);
+		
+		if ((since = FSEventStreamGetLatestEventId(oldStream)) ==
+			kFSEventStreamEventIdSinceNow)
+		{
+			since = FSEventsGetCurrentEventId();
+		}
+		
+		newStream = dispatch ? EventStreamFromDispatch(dispatch, since) :
+			EventStreamFromPolicy(policy, since);
+		if (!newStream)
+		{
+			continue;
+		}
+		
+		LogMV("Restarted the stream for %s with a latency of %gs\n",
+			  latency->name, LatencyCurrent(latency));
+		
+		FSEventStreamStop(oldStream);
+		FSEventStreamInvalidate(oldStream);
+		
+		FSEventStreamScheduleWithRunLoop(newStream,
+										 CFRunLoopGetCurrent(),
+										 kCFRunLoopDefaultMode);
+		FSEventStreamStart(newStream);
+		CFArraySetValueAtIndex(globals->streamArray, i, newStream);
+		FSEventStreamRelease(newStream);
+	}
+}
+
+void ReloadConfig(void)
+{
+	CFArrayRef configArray = CopyConfigArray(globals->plistPath);
+	CFIndex oldCount, i, j;
+	Boolean *keep;
+	int unchanged = 0, started = 0, stopped = 0;
+	
+	if (!configArray)
+	{
+		LogError("Keeping the running config.\n");
+		return;
+	}
+	
+	if (globals->dispatch)
+	{
+		ReloadSharedConfig(configArray);
+		CFRelease(configArray);
+		return;
+	}
+	
+	oldCount = CFArrayGetCount(globals->streamArray);
+	
+	if ((keep = calloc(oldCount + 1, sizeof(Boolean))) == NULL)
+	{
+		CFRelease(configArray);
+		return;
+	}
+	
+	for (i = 0; i < CFArrayGetCount(configArray); i++)
+	{
+		CFTypeRef currObject = CFArrayGetValueAtIndex(configArray, i);
+		struct policy_t *policy;
+		
+		if (CFGetTypeID(currObject) != CFDictionaryGetTypeID())
+		{
+			LogError("Plist Config File error: Expecting an array of "
+					 "dictionaries!\n");
+			continue;
+		}
+		
+		if ((policy = PolicyCreateFromDictionary(currObject)) == NULL)
+		{
+			continue;
+		}
+		
+		// A root that's configured just like before keeps its stream, and
+		// with it its place in the event history and everything cached.
+		for (j = 0; j < oldCount; j++)
+		{
+			if (!keep[j] &&
+				PolicyEqual(policy,
+							CFArrayGetValueAtIndex(globals->policyArray, j)))
+			{
+				keep[j] = true;
+				break;
+			}
+		}
+		
+		if (j < oldCount)
+		{
+			unchanged++;
+		}
+		else if (WatchPolicy(policy))
+		{
+			started++;
+		}
+		else
+		{
+			LogError("Could not get a valid stream for %s!\n",
+					 policy->configPath);
+		}
+		
+		PolicyRelease(policy);
+	}
+	
+	// Whatever wasn't matched is gone from the config (or was changed, and
+	// its replacement started above).  New streams went on the end, so the
+	// old indexes are still good going backwards.
+	for (j = oldCount - 1; j >= 0; j--)
+	{
+		if (!keep[j])
+		{
+			StopStreamAtIndex(j);
+			stopped++;
+		}
+	}
+	
+	free(keep);
+	CFRelease(configArray);
+	
+	LogV("Reloaded %s: %d root%s unchanged, %d started, %d stopped.\n",
+		 globals->plistPath, unchanged, (unchanged != 1) ? "s" : "", started,
+		 stopped);
+}
+
+void ReloadSharedConfig(CFArrayRef configArray)
+{
+	struct dispatch_t *oldDispatch = globals->dispatch, *newDispatch;
+	FSEventStreamRef oldStream = NULL, newStream;
+	FSEventStreamEventId since = kFSEventStreamEventIdSinceNow;
+	struct policy_t **replacements;
+	Boolean *unchanged;
+	size_t i, j, match, changed = 0;
+	
+	if ((newDispatch = DispatchCreate()) == NULL)
+	{
+		return;
+	}
+	
+	unchanged = calloc(CFArrayGetCount(configArray) + 1, sizeof(Boolean));
+	replacements = calloc(oldDispatch->policyCount + 1,
+						  sizeof(struct policy_t *));
+	if (!unchanged || !replacements)
+	{
+		free(unchanged);
+		free(replacements);
+		DispatchRelease(newDispatch);
+		return;
+	}
+	
+	for (i = 0; i < (size_t)CFArrayGetCount(configArray); i++)
+	{
+		CFTypeRef currObject = CFArrayGetValueAtIndex(configArray, i);
+		struct policy_t *policy;
+		
+		if (CFGetTypeID(currObject) != CFDictionaryGetTypeID() ||
+			(policy = PolicyCreateFromDictionary(currObject)) == NULL)
+		{
+			continue;
+		}
+		
+		for (match = 0; match < oldDispatch->policyCount; match++)
+		{
+			if (!replacements[match] &&
+				PolicyEqual(policy, oldDispatch->policies[match]))
+			{
+				break;
+			}
+		}
+		
+		// A root that couldn't be added doesn't take the match, or the next
+		// one added would inherit it and miss its prescan.
+		if (DispatchAddPolicy(newDispatch, policy))
+		{
+			if (match < oldDispatch->policyCount)
+			{
+				replacements[match] = policy;
+				unchanged[newDispatch->policyCount - 1] = true;
+			}
+			
+			if (policy->force)
+			{
+				policy->rootDescriptor = open(policy->path, O_NONBLOCK);
+			}
+		}
+		
+		PolicyRelease(policy);
+	}
+	
+	for (j = 0; j < oldDispatch->policyCount; j++)
+	{
+		changed += !replacements[j];
+	}
+	for (i = 0; i < newDispatch->policyCount; i++)
+	{
+		changed += !unchanged[i];
+	}
+	
+	if (changed == 0)
+	{
+		LogV("Reloaded %s: nothing changed.\n", globals->plistPath);
+		DispatchRelease(newDispatch);
+		free(unchanged);
+		free(replacements);
+		return;
+	}
+	
+	// Every root shares the stream, so it has to be replaced.  The new one
+	// starts where the old one got to, so nothing in between is lost; the
+	// policies are new, but their hashes (and so what the verified index
+	// knows) are the same for any root whose config didn't change.
+	if (CFArrayGetCount(globals->streamArray) > 0)
+	{
+		oldStream = (FSEventStreamRef)
+			CFArrayGetValueAtIndex(globals->streamArray, 0);
+		since = FSEventStreamGetLatestEventId(oldStream);
+		FSEventStreamStop(oldStream);
+		FSEventStreamInvalidate(oldStream);
+		CFArrayRemoveValueAtIndex(globals->streamArray, 0);
+	}
+	
+	// An old policy with a replacement is configured just the same, so
+	// whatever was left to do under it still needs doing, under the new one.
+	// The rest stop, so nothing applies their old settings from here on.
+	for (j = 0; j < oldDispatch->policyCount; j++)
+	{
+		RescanRemovePolicy(oldDispatch->policies[j], replacements[j]);
+	}
+	for (i = 0; i < newDispatch->policyCount; i++)
+	{
+		RescanAddPolicy(newDispatch->policies[i]);
+	}
+	
+	globals->dispatch = newDispatch;
+	DispatchRelease(oldDispatch);
+	
+	if (newDispatch->policyCount > 0 &&
+		(newStream = EventStreamFromDispatch(newDispatch, since)) != NULL)
+	{
+		FSEventStreamScheduleWithRunLoop(newStream,
+										 CFRunLoopGetCurrent(),
+										 kCFRunLoopDefaultMode);
+		FSEventStreamStart(newStream);
+		CFArrayAppendValue(globals->streamArray, newStream);
+		FSEventStreamRelease(newStream);
+	}
+	
+	// New or changed roots start their history over, and get their prescans.
+	for (i = 0; i < newDispatch->policyCount; i++)
+	{
+		if (!unchanged[i])
+		{
+			EventIdToStartFrom(newDispatch->policies[i], false);
+		}
+	}
+	
+	LogV("Reloaded %s: %lu root%s on one stream, %lu changed.\n",
+		 globals->plistPath, (unsigned long)newDispatch->policyCount,
+		 (newDispatch->policyCount != 1) ? "s" : "", (unsigned long)changed);
+	
+	free(unchanged);
+	free(replacements);
+}
+
+// Load a property list from a path.
+CFPropertyListRef CreatePropertyListFromFile(const char *path)
+{
+	CFURLRef myURL;
+	CFPropertyListRef propertyList;
+	CFStringRef errorString;
+	CFStringRef myString = CFStringCreateWithCString(kCFAllocatorDefault,
+													 path,
+													 kCFStringEncodingUTF8);
+	CFDataRef resourceData;
+	Boolean status;
+	SInt32 errorCode;
+	
+	/* Create CFURL from CFString */
+	myURL = CFURLCreateWithFileSystemPath(kCFAllocatorDefault,
+										  myString,
+										  kCFURLPOSIXPathStyle,
+										  FALSE);
+	
+	status = CFURLCreateDataAndPropertiesFromResource(kCFAllocatorDefault,
+													  myURL,
+													  &resourceData,
+													  NULL,
+													  NULL,
+													  &errorCode);
+	
+	propertyList = CFPropertyListCreateFromXMLData(kCFAllocatorDefault,
+												   resourceData,
+												   kCFPropertyListImmutable,
+												   &errorString);
+	
+	CFRelease(resourceData);
+	CFRelease(myString);
+	
+	if (globals->mode)
+	{
+		free(globals->mode);
+		globals->mode = NULL; // We're called again on SIGHUP.
+	}
+	
+	return propertyList;
+}
+#endif
+
+// Logs errors to stderr.
+void LogError(const char *format, ...)
+{
+	va_list ap;
     va_start(ap, format);
-    vfprintf(stderr, format, ap);
+    LoggingWrite(format, ap);
+    va_end(ap);
+}
+
+// For verbose output, goes to stderr.
+void LogV(const char *format, ...)
+{
+	if (!globals->verbose) {
+        return;
+    }
+    
+    va_list ap;
+    va_start(ap, format);
+    LoggingWrite(format, ap);
     va_end(ap);
 }
 
 // For mega-verbose output, goes to stderr.
-static void LogMV(const char *format, ...)
+void LogMV(const char *format, ...)
 {
 	if (!globals->megaVerbose) {
         return;
@@ -570,113 +1403,114 @@ static void LogMV(const char *format, ...)
     
     va_list ap;
     va_start(ap, format);
-    vfprintf(stderr, format, ap);
+    LoggingWrite(format, ap);
     va_end(ap);
 }
 
-FSEventStreamRef EventStreamFromDictionary(CFDictionaryRef config)
+#ifdef __APPLE__
+FSEventStreamEventId EventIdToStartFrom(struct policy_t *policy,
+										Boolean resume)
+{
+	struct stat info;
+	CFUUIDRef uuid = NULL;
+	CFStringRef uuidString = NULL;
+	char uuidCString[64];
+	FSEventStreamEventId since, current = FSEventsGetCurrentEventId();
+	int found = HISTORY_NONE;
+	
+	// Volumes without an event history (some network ones) have no UUID, and
+	// nothing to resume from.
+	if (stat(policy->path, &info) == 0 &&
+		(uuid = FSEventsCopyUUIDForDevice(info.st_dev)) != NULL &&
+		(uuidString = CFUUIDCreateString(kCFAllocatorDefault, uuid)) != NULL &&
+		getCStringFromCFString(uuidString, uuidCString, sizeof(uuidCString)))
+	{
+		if (resume)
+		{
+			found = HistoryResume(policy->path, uuidCString, current, &since);
+		}
+		else
+		{
+			HistoryRestart(policy->path, uuidCString, current);
+		}
+	}
+	
+	if (uuidString)
+	{
+		CFRelease(uuidString);
+	}
+	if (uuid)
+	{
+		CFRelease(uuid);
+	}
+	
+	if (found == HISTORY_RESUME)
+	{
+		LogV("Resuming %s from event %llu\n", policy->path,
+			 (unsigned long long)since);
+		policy->resumed = true;
+		return since;
+	}
+	
+	if (found == HISTORY_LOST)
+	{
+		// We were watching, and can't know what happened since: look at
+		// everything, whatever _prescan says.
+		LogV("Event history for %s is gone, rescanning it\n", policy->path);
+		RescanRequestWalk(policy, policy->path, true);
+	}
+	else if (policy->prescan)
+	{
+		RescanRequestWalk(policy, policy->path, true);
+	}
+	
+	return kFSEventStreamEventIdSinceNow;
+}
+
+void HistoryLoseWalk(struct policy_t *policy, const char *path)
+{
+	LogV("Background walk of %s never finished, %s will be walked in full "
+		 "next time\n", path, policy->path);
+	HistoryLose(policy->path);
+}
+
+FSEventStreamRef EventStreamFromPolicy(struct policy_t *policy,
+									   FSEventStreamEventId since)
 {
 	CFStringRef path;
 	CFArrayRef pathArray;
 	FSEventStreamRef stream;
-	Boolean status;
-	Boolean present;
-	CFBooleanRef booleanValue;
-	CFAbsoluteTime latency = globals->latency; // Latency (in seconds).
+	CFAbsoluteTime latency = LatencyCurrent(policy->latency); // In seconds.
 	FSEventStreamContext streamContext;
-	char cPath[PATH_MAX], absoluteCPath[PATH_MAX];
-	bzero(cPath, PATH_MAX);
-	bzero(absoluteCPath, PATH_MAX);
 	FSEventStreamCreateFlags myFlags = 0;
     
     // If we have a (relatively) low latencly, let's assume they want them as they come:
-    if (latency < 2.5)
+    if (latency < LATENCY_NO_DEFER)
     {
         myFlags |= kFSEventStreamCreateFlagNoDefer; // If it's been more than (latency) seconds, we get the notificiation right away!
     }
-    
-	status = CFDictionaryGetValueIfPresent(config,
-										   kCHMODDPathKey,
-										   (const void **) (&path));
-	// Make sure we have a string in the config
-	if (! status)
-	{
-		LogError("Config with no path key!\n");
-		return NULL;
-	}
-	
-	// Convert the CFStringRef into a cString so we can use it for the following
-	// calls.  (We shouldn't need it again after that!).
-	status = CFStringGetCString(path,
-								cPath,
-								PATH_MAX,
-								kCFStringEncodingUTF8);
-	if (!status)
-	{
-		LogError("ERROR: Internal error converting path string!\n");
-		return NULL;
-	}
 	
-	// Make sure it's an absolute path:
-	if (realpath(cPath, absoluteCPath) == NULL)
-	{
-		present = CFDictionaryGetValueIfPresent(config,
-												kCHMODDCreateKey,
-												(const void **)&booleanValue);
-		
-		if (present && CFBooleanGetValue(booleanValue))
-		{
-			if (mkdir(absoluteCPath, 0755) == -1) {
-				LogError("ERROR: Could not find/create file: %s: %s\n",
-						 cPath, strerror(errno));
-				return NULL;
-			}
-			
-		}
-	}
-	
-    // If we're forcing the root to be there, let's open a file descriptor to it,
-    // so we can detect where it's gone.  We'll also make sure that the root itself
+    // If we're forcing the root to be there, make sure that the root itself
     // is watched by the FSEvents API.
-    present = CFDictionaryGetValueIfPresent(config,
-                                            kCHMODDForceKey,
-                                            (const void **)&booleanValue);
-    if (present && CFBooleanGetValue(booleanValue))
+    if (policy->force)
     {
         myFlags |= kFSEventStreamCreateFlagWatchRoot;
-        
-        int descriptor = open(absoluteCPath, O_NONBLOCK);
-        CFNumberRef descRef = CFNumberCreate(kCFAllocatorDefault,
-                                             kCFNumberIntType,
-                                             &descriptor);
-        
-        CFDictionarySetValue(globals->descriptorDict,
-                             path,
-                             descRef);
-        
-        CFRelease(descRef);
     }
 	
-	
-	present = CFDictionaryGetValueIfPresent(config,
-											kCHMODDPreScanKey,
-											(const void **)&booleanValue);
-	
-	if (present && CFBooleanGetValue(booleanValue))
-	{
-		applyPermissionsToFolder(absoluteCPath, config, true);
-	}
-	
+	path = CFStringCreateWithCString(kCFAllocatorDefault,
+									 policy->configPath,
+									 kCFStringEncodingUTF8);
 	pathArray = CFArrayCreate(kCFAllocatorDefault,
 							  (const void **) &path,
 							  1,
 							  &kCFTypeArrayCallBacks);
+	CFRelease(path);
 	
 	// Fill out the context so we can send the info along with it.
 	streamContext.version			=	0;
-	streamContext.info				=	(void *)config;
-	streamContext.retain			=	&CFRetain;
-	streamContext.release			=	&CFRelease;
+	streamContext.info				=	(void *)policy;
+	streamContext.retain			=	&PolicyRetain;
+	streamContext.release			=	&PolicyRelease;
 	streamContext.copyDescription	=	NULL;
 	
 	// Magic.  This should work on Leopard and Snow Leopard.
@@ -685,539 +1519,631 @@ FSEventStreamRef EventStreamFromDictionary(CFDictionaryRef config)
 		myFlags |= 0x00000008;
 	}
 	
+	// Events for each file, not just the directory it's in.
+	if (globals->fileEvents)
+	{
+		myFlags |= kFSEventStreamCreateFlagFileEvents;
+	}
+	
 	stream = FSEventStreamCreate(kCFAllocatorDefault,
 								 &FSCallback,
 								 &streamContext,
 								 pathArray,
-								 kFSEventStreamEventIdSinceNow,
+								 since,
 								 latency,
 								 myFlags);
 	
 	CFRelease(pathArray);
 	
+	if (stream)
+	{
+		LatencyApplied(policy->latency, latency);
+	}
+	
 	return stream;
 }
 
-void FSCallback(ConstFSEventStreamRef streamRef,
-				void *clientCallBackInfo,
-				size_t numEvents,
-				void *eventPaths,
-				const FSEventStreamEventFlags eventFlags[],
-				const FSEventStreamEventId eventIds[])
+FSEventStreamRef EventStreamFromDispatch(struct dispatch_t *dispatch,
+										 FSEventStreamEventId since)
+{
+	CFMutableArrayRef pathArray;
+	FSEventStreamRef stream;
+	CFAbsoluteTime latency;
+	FSEventStreamContext streamContext;
+	FSEventStreamCreateFlags myFlags = 0;
+	size_t i;
+	
+	if (!dispatch->latency &&
+		(dispatch->latency = LatencyCreate("every root")) == NULL)
+	{
+		return NULL;
+	}
+	
+	latency = LatencyCurrent(dispatch->latency);
+	
+	if (latency < LATENCY_NO_DEFER)
+	{
+		myFlags |= kFSEventStreamCreateFlagNoDefer;
+	}
+	
+	if (globals->ignoreSelf)
+	{
+		myFlags |= 0x00000008;
+	}
+	
+	if (globals->fileEvents)
+	{
+		myFlags |= kFSEventStreamCreateFlagFileEvents;
+	}
+	
+	pathArray = CFArrayCreateMutable(kCFAllocatorDefault,
+									 dispatch->policyCount,
+									 &kCFTypeArrayCallBacks);
+	
+	for (i = 0; i < dispatch->policyCount; i++)
+	{
+		CFStringRef path;
+		
+		// One _force root is enough to need root change events; the others'
+		// are just ignored.
+		if (dispatch->policies[i]->force)
+		{
+			myFlags |= kFSEventStreamCreateFlagWatchRoot;
+		}
+		
+		path = CFStringCreateWithCString(kCFAllocatorDefault,
+										 dispatch->policies[i]->configPath,
+										 kCFStringEncodingUTF8);
+		CFArrayAppendValue(pathArray, path);
+		CFRelease(path);
+	}
+	
+	streamContext.version			=	0;
+	streamContext.info				=	(void *)dispatch;
+	streamContext.retain			=	&DispatchRetain;
+	streamContext.release			=	&DispatchRelease;
+	streamContext.copyDescription	=	NULL;
+	
+	stream = FSEventStreamCreate(kCFAllocatorDefault,
+								 &SharedFSCallback,
+								 &streamContext,
+								 pathArray,
+								 since,
+								 latency,
+								 myFlags);
+	
+	CFRelease(pathArray);
+	
+	if (stream)
+	{
+		LatencyApplied(dispatch->latency, latency);
+	}
+	
+	return stream;
+}
+
+struct policy_t *PolicyCreateFromDictionary(CFDictionaryRef config)
 {
-	CFDictionaryRef config = (CFDictionaryRef)clientCallBackInfo;
-	int i;
-	char **pathArray = eventPaths;
-	Boolean status;
+	struct policy_t *policy;
+	CFTypeRef returnedValue;
+	char configPath[PATH_MAX], absolutePath[PATH_MAX];
+	bzero(configPath, PATH_MAX);
+	bzero(absolutePath, PATH_MAX);
 	
-	for (i = 0; i < numEvents; i++)
+	returnedValue = CFDictionaryGetValue(config, kCHMODDPathKey);
+	// Make sure we have a string in the config
+	if (!returnedValue)
 	{
-		if (eventFlags[i] == kFSEventStreamEventFlagNone)
-		{
-			// Base case:
-			applyPermissionsToFolder(pathArray[i], config, false);
-		}
-		else if (eventFlags[i] & kFSEventStreamEventFlagRootChanged)
+		LogError("Config with no path key!\n");
+		return NULL;
+	}
+	
+	if (!CFStringGetCString(returnedValue,
+							configPath,
+							PATH_MAX,
+							kCFStringEncodingUTF8))
+	{
+		LogError("ERROR: Internal error converting path string!\n");
+		return NULL;
+	}
+	
+	// Make sure it's an absolute path:
+	if (realpath(configPath, absolutePath) == NULL)
+	{
+		// An audit doesn't make anything, roots included.
+		if (getBooleanFromConfig(config, kCHMODDCreateKey) && !AuditIsOpen())
 		{
-			// Our root moved:
-			char newPath[MAXPATHLEN];
-			const char *string_to_use = NULL;
-			const char *original_root_ptr = NULL;
-			char path_string[MAXPATHLEN];
-			
-			CFStringRef	CFStringPath = CFDictionaryGetValue(config,
-															kCHMODDPathKey);
-			
-			original_root_ptr = CFStringGetCStringPtr(CFStringPath,
-													  kCFStringEncodingUTF8);
-			
-			if (original_root_ptr && *original_root_ptr)
-			{
-				string_to_use = original_root_ptr;
-			}
-			else
-			{
-				status = CFStringGetCString(CFStringPath,
-											path_string,
-											MAXPATHLEN-1,
-											kCFStringEncodingUTF8);
-				
-				if (status)
-				{
-					string_to_use = path_string;
-				}
+			if (mkdir(absolutePath, 0755) == -1) {
+				LogError("ERROR: Could not find/create file: %s: %s\n",
+						 configPath, strerror(errno));
+				return NULL;
 			}
 			
-			CFStringRef path = CFDictionaryGetValue(config, kCHMODDPathKey);
-			
-			CFNumberRef descRef;
-			status = CFDictionaryGetValueIfPresent(globals->descriptorDict,
-												   path,
-												   (void *)&descRef);
-			
-			if (status) {
-				int descriptor;
-				Boolean err = CFNumberGetValue(descRef,
-											   kCFNumberIntType,
-											   &descriptor);
-				
-				if (!err)
-				{
-					fcntl(descriptor, F_GETPATH, newPath);
-					rename(string_to_use, newPath);
-				}
-
-			}
-
-		}
-		else if (eventFlags[i] & kFSEventStreamEventFlagMustScanSubDirs)
-		{
-			// Must rescan:
-			applyPermissionsToFolder(pathArray[i], config, true);
-		}
-		else
-		{
-			// Unaccounted for flags, treat like base case:
-			applyPermissionsToFolder(pathArray[i], config, false);
 		}
 	}
 	
-}
-
-int applyPermissionsToFolder(const char *path,
-							 CFDictionaryRef config,
-							 Boolean force_recursion)
-{
-	FTS *ftsp;
-	FTSENT *p;
-	int filesChanged = 0, filesTouched = 0, filesVisited = 0, fts_options = 0;
-	char *pathargv[] = {(char*)path, NULL};
-	acl_t acl = NULL;
-		
-	if ((ftsp = fts_open(pathargv, fts_options, NULL)) == NULL)
+	policy = PolicyCreate(absolutePath, configPath);
+	if (!policy)
 	{
-		LogError("fts_open: %s\n", strerror(errno));
-		return(-1);
+		return NULL;
 	}
 	
-	while ((p = fts_read(ftsp)) != NULL)
+	// Everything below used to be looked up again for every file we visited.
+	// Any problems with the config are now reported once, here.
+	
+	returnedValue = CFDictionaryGetValue(config, kCHMODDPermKey);
+	
+	if (returnedValue != NULL)
 	{
-		Boolean changed = false;
-		Boolean isFolder = false;
-		
-		switch (p->fts_info) {
-			case FTS_D:
-				isFolder = true;
-				break;
-			case FTS_DNR:
-				LogError("%s: %s\n", p->fts_path, strerror(p->fts_errno));
-				break;
-			case FTS_DP:
-				isFolder = true;
-				continue;
-			case FTS_ERR:
-			case FTS_NS:
-				LogError("%s: %s\n", p->fts_path, strerror(p->fts_errno));
-				continue;
-			case FTS_SL:
-			case FTS_SLNONE:
-			default:
-				break;
-		}
-		
-		LogMV("MV: Visiting file: %s\n", p->fts_path);
-		
-		filesVisited++;
-
-		CFTypeRef returnedValue = NULL;
-		returnedValue = CFDictionaryGetValue(config,
-											 kCHMODDPermKey);
-		
-		if (returnedValue != NULL)
+		if (CFGetTypeID(returnedValue) == CFStringGetTypeID())
 		{
-			if (CFGetTypeID(returnedValue) == CFStringGetTypeID())
+			char mode_string[POLICY_MODE_STRING_LENGTH];
+			bzero(mode_string, POLICY_MODE_STRING_LENGTH);
+			
+			if (CFStringGetCString((CFStringRef) returnedValue,
+								   mode_string,
+								   POLICY_MODE_STRING_LENGTH-1,
+								   kCFStringEncodingUTF8))
 			{
-#define MODE_STRING_LENGTH 21
-				const char *mode_string_ptr = NULL;
-				char mode_string[MODE_STRING_LENGTH];
-				const char *string_to_use = NULL;
-				bzero(mode_string, MODE_STRING_LENGTH);
-				
-				mode_string_ptr = CFStringGetCStringPtr((CFStringRef) returnedValue,
-														kCFStringEncodingUTF8);
-				
-				if (mode_string_ptr && *mode_string_ptr)
-				{
-					string_to_use = mode_string_ptr;
-				}
-				else
-				{
-					Boolean status = CFStringGetCString((CFStringRef) returnedValue,
-														mode_string,
-														MODE_STRING_LENGTH-1,
-														kCFStringEncodingUTF8);
-					
-					if (status)
-					{
-						string_to_use = mode_string;
-					}
-				}
-
-				if (string_to_use)
-				{
-					mode_t *modeChange;
-					
-					if ((modeChange = setmode(string_to_use)) == NULL)
-					{
-						LogError("Internal error setting file mode: %s\n",
-								 string_to_use);
-						LogError("This is probably an invalide mode!\n");
-					}
-					else {
-						mode_t computedMode = getmode(modeChange,
-													  p->fts_statp->st_mode);
-						
-						if (computedMode != p->fts_statp->st_mode)
-						{
-							// If the computed mode is not the same as the current
-							// mode, we have work to do!
-							changed = TRUE;
-							LogMV("Applying new permissions %s to file %s\n",
-								  string_to_use, p->fts_path);
-							if (lchmod(p->fts_path, computedMode) != 0)
-							{
-								LogError("%s: %s\n", p->fts_path, strerror(errno));
-							}
-							else {
-								filesChanged++;
-							}
-						}
-						
-						free(modeChange);
-						
-					}
-
-				}
-				else {
-					LogError("Unspecified internal error in config structure!\n");
-				}
-
-#undef MODE_STRING_LENGTH
+				PolicySetMode(policy, mode_string);
 			}
 			else {
 				LogError("Unspecified internal error in config structure!\n");
 			}
 		}
-		
-		returnedValue = NULL;
-		returnedValue = CFDictionaryGetValue(config,
-											 kCHMODDACLKey);
-
-		if (returnedValue != NULL)
+		else {
+			LogError("Unspecified internal error in config structure!\n");
+		}
+	}
+	
+	returnedValue = CFDictionaryGetValue(config, kCHMODDACLKey);
+	
+	if (returnedValue != NULL)
+	{
+		if (CFGetTypeID(returnedValue) == CFBooleanGetTypeID())
 		{
-			if (CFGetTypeID(returnedValue) == CFBooleanGetTypeID())
+			if (CFBooleanGetValue((CFBooleanRef)returnedValue))
 			{
-				if (CFBooleanGetValue((CFBooleanRef)returnedValue))
-				{
-					acl = acl_get_file(path, ACL_TYPE_EXTENDED);
-					
-					if (acl)
-					{
-						if (fileNeedsACLApplied(p->fts_path, acl))
-						{
-							filesChanged++;
-							acl_set_link_np(p->fts_path,
-											ACL_TYPE_EXTENDED,
-											acl);
-						}
-					}
-					else
-					{
-						LogError("Root folder (%s) doesn't have ACL set!\n",
-								 path);
-					}
-				}
-			}
-			else {
-				LogError("Internal error in config structure!\n");
+				policy->applyACL = true;
+				PolicyLoadACL(policy);
 			}
 		}
-		
-		returnedValue = NULL;
-		returnedValue = CFDictionaryGetValue(config, kCHMODDOwnerKey);
-		
-		if (returnedValue != NULL)
+		else {
+			LogError("Internal error in config structure!\n");
+		}
+	}
+	
+	returnedValue = CFDictionaryGetValue(config, kCHMODDOwnerKey);
+	
+	if (returnedValue != NULL)
+	{
+		if (CFGetTypeID(returnedValue) == CFStringGetTypeID())
 		{
-			uid_t ownerID = -1;
+			char owner_string[POLICY_NAME_LENGTH];
 			
-			if (CFGetTypeID(returnedValue) == CFStringGetTypeID())
+			if (getCStringFromCFString(returnedValue,
+									   owner_string,
+									   POLICY_NAME_LENGTH))
 			{
-				ownerID = getUIDfromCFString(returnedValue);
-			}
-			else if (CFGetTypeID(returnedValue) == CFNumberGetTypeID())
-			{
-				
-				Boolean status = CFNumberGetValue(returnedValue,
-												  kCFNumberSInt32Type,
-												  &ownerID);
-				if (!status)
-				{
-					LogError("Couldn't get number from plist for owner of "
-							 "config %s\n", path);
-					ownerID = -1;
-				}
+				PolicySetOwner(policy, owner_string);
 			}
 			else
 			{
 				LogError("Internal error in config structure!\n");
 			}
-			
-			if (p->fts_statp->st_uid != ownerID && ownerID != -1)
+		}
+		else if (CFGetTypeID(returnedValue) == CFNumberGetTypeID())
+		{
+			if (!CFNumberGetValue(returnedValue,
+								  kCFNumberSInt32Type,
+								  &(policy->owner)))
 			{
-				if (lchown(p->fts_path, ownerID, -1) != 0)
-				{
-					LogError("chown %s: %s\n", p->fts_path,strerror(errno));
-				}
-				else
-				{
-					filesChanged++;
-				}
+				LogError("Couldn't get number from plist for owner of "
+						 "config %s\n", configPath);
+				policy->owner = -1;
 			}
 		}
-
-		returnedValue = NULL;
-		returnedValue = CFDictionaryGetValue(config,
-											 kCHMODDGroupKey);
-		
-		if (returnedValue != NULL)
+		else
+		{
+			LogError("Internal error in config structure!\n");
+		}
+	}
+	
+	returnedValue = CFDictionaryGetValue(config, kCHMODDGroupKey);
+	
+	if (returnedValue != NULL)
+	{
+		if (CFGetTypeID(returnedValue) == CFStringGetTypeID())
 		{
-			gid_t groupID = -1;
+			char group_string[POLICY_NAME_LENGTH];
 			
-			if (CFGetTypeID(returnedValue) == CFStringGetTypeID())
+			if (getCStringFromCFString(returnedValue,
+									   group_string,
+									   POLICY_NAME_LENGTH))
 			{
-				groupID = getGIDfromCFString(returnedValue);
+				PolicySetGroup(policy, group_string);
 			}
-			else if (CFGetTypeID(returnedValue) == CFNumberGetTypeID())
+			else
 			{
-				Boolean status = CFNumberGetValue(returnedValue,
-												  kCFNumberSInt32Type,
-												  &groupID);
-				if (!status)
-				{
-					LogError("Couldn't get number from plist for group of "
-							 "config %s\n", path);
-					groupID = -1;
-				}
-			}
-			else {
 				LogError("Internal error in config structure!\n");
 			}
-			
-			if (p->fts_statp->st_gid != groupID && groupID != -1)
+		}
+		else if (CFGetTypeID(returnedValue) == CFNumberGetTypeID())
+		{
+			if (!CFNumberGetValue(returnedValue,
+								  kCFNumberSInt32Type,
+								  &(policy->group)))
 			{
-				if (lchown(p->fts_path, -1, groupID) != 0)
-				{
-					LogError("chown %s: %s\n", p->fts_path,strerror(errno));
-				}
-				else
-				{
-					filesChanged++;
-				}
+				LogError("Couldn't get number from plist for group of "
+						 "config %s\n", configPath);
+				policy->group = -1;
 			}
 		}
-				
-		// Under certian criteria, go ahead and skip a directory's children,
-		// because we know we already scanned it, and the permissions are 
-		// correct.
-		
-		if (isFolder &&				// Only applicable for a folder/dir.
-			p->fts_level > 0) {		// We aren't at the root.
-			
-			if (!force_recursion && // We weren't told specifically to rescan
-				!changed &&			// We didn't detect a changed needed above.
-				// We find that the ctime is greater than (or equal to) our
-				// launch time.
-				p->fts_statp->st_ctime >= globals->launch_time) {
-				
-				// We passed the test!  We know we can skip this now.
-				LogMV("Skipping children of %s\n", p->fts_path);
-				fts_set(ftsp, p, FTS_SKIP);
-			}
-			else if (p->fts_statp->st_ctime < globals->launch_time) {
-				// We store the access and modify time, and set them to the
-				// exact same thing.  This effectively changes ONLY the ctime,
-				// which is much less visible to an end user.  Changing the
-				// ctime will effectively mark it so we don't have to recurse
-				// all the time (shwew!).  If necessary, this could probably be
-				// stored in other file metadata, like extended attributes.
-				// Let's consider this a "TODO," though.
-				struct timeval times[2];
-				times[0].tv_sec = p->fts_statp->st_atime;
-				times[1].tv_sec = p->fts_statp->st_mtime;
-				utimes(p->fts_path, times);
-				filesTouched++;
-			}
+		else {
+			LogError("Internal error in config structure!\n");
 		}
 	}
 	
-	if (acl)
+	returnedValue = CFDictionaryGetValue(config, kCHMODDRulesKey);
+	
+	if (returnedValue != NULL)
 	{
-		acl_free(acl);
+		if (CFGetTypeID(returnedValue) != CFArrayGetTypeID() ||
+			!addRulesFromConfig(policy, (CFArrayRef)returnedValue))
+		{
+			// Half a set of rules would put the wrong modes on things.
+			LogError("Bad _rules in config %s, not using it\n", configPath);
+			PolicyRelease(policy);
+			return NULL;
+		}
 	}
 	
-	fts_close(ftsp);
-	
-	LogV("Applied Permission changes to %d file%s.\n", filesChanged,
-		 (filesChanged != 1) ? "s" : "");
-	LogV("Touched %d file%s.\n", filesTouched, (filesTouched != 1) ? "s" : "");
-	LogV("Visited %d file%s.\n", filesVisited, (filesVisited != 1) ? "s" : "");
+	policy->force = getBooleanFromConfig(config, kCHMODDForceKey);
+	policy->create = getBooleanFromConfig(config, kCHMODDCreateKey);
+	policy->followLinks = getBooleanFromConfig(config, kCHMODDFollowLinkKey);
+	policy->prescan = getBooleanFromConfig(config, kCHMODDPreScanKey);
+	policy->cachedAttributes = getBooleanFromConfig(config, kCHMODDCachedKey);
 	
-	return filesChanged;
+	return policy;
 }
 
-#define OWNER_TYPE 0
-#define GROUP_TYPE 1
-UInt32 getUInt32fromSpecifiedString(CFStringRef mystring, int type)
+// Copies a CFString into buffer, returning false if it doesn't fit.  Tries the
+// quick way first, and only does the conversion if that doesn't work.
+Boolean getCStringFromCFString(CFStringRef myString,
+							   char *buffer,
+							   CFIndex bufferSize)
 {
-	UInt32 retVal = -1;
+	const char *quick = CFStringGetCStringPtr(myString, kCFStringEncodingUTF8);
 	
-	// Strategy.  This string could be anything from 0 to 501 to Frank.Fleschner
-	// to who knows what else.  We'll use 0 as our base case, because this makes
-	// it easy to detect if we got back an accurate number for our
-	// CFStringGetIntValue call.  If we don't get an accurate number back, we
-	// fall back to ... something.
-	SInt32 result = CFStringCompare(mystring, CFSTR("0"), 0);
-	
-	if (result == kCFCompareEqualTo)
+	if (quick && *quick)
 	{
-		return 0;
+		return (snprintf(buffer, bufferSize, "%s", quick) < bufferSize);
 	}
 	
-	result = CFStringGetIntValue(mystring);
-	if (result != 0)
+	return CFStringGetCString(myString,
+							  buffer,
+							  bufferSize,
+							  kCFStringEncodingUTF8);
+}
+
+Boolean addRulesFromConfig(struct policy_t *policy, CFArrayRef rules)
+{
+	CFIndex i;
+	
+	for (i = 0; i < CFArrayGetCount(rules); i++)
 	{
-		return (UInt32)result;
+		CFDictionaryRef rule = CFArrayGetValueAtIndex(rules, i);
+		CFTypeRef returnedValue;
+		char pattern[PATH_MAX], mode[POLICY_MODE_STRING_LENGTH];
+		char owner[POLICY_NAME_LENGTH], group[POLICY_NAME_LENGTH];
+		char typeName[16];
+		int type = POLICY_RULE_ANY;
+		
+		if (CFGetTypeID(rule) != CFDictionaryGetTypeID())
+		{
+			LogError("Sub-rule %ld of %s isn't a dictionary\n", (long)i,
+					 policy->configPath);
+			return false;
+		}
+		
+		returnedValue = CFDictionaryGetValue(rule, kCHMODDMatchKey);
+		if (!returnedValue || CFGetTypeID(returnedValue) != CFStringGetTypeID() ||
+			!getCStringFromCFString(returnedValue, pattern, PATH_MAX))
+		{
+			LogError("Sub-rule %ld of %s has no _match string\n", (long)i,
+					 policy->configPath);
+			return false;
+		}
+		
+		returnedValue = CFDictionaryGetValue(rule, kCHMODDTypeKey);
+		if (returnedValue &&
+			(CFGetTypeID(returnedValue) != CFStringGetTypeID() ||
+			 !getCStringFromCFString(returnedValue, typeName,
+									 sizeof(typeName)) ||
+			 (type = PolicyRuleTypeFromString(typeName)) == -1))
+		{
+			LogError("Sub-rule %s of %s has a bad _type (use file, directory, "
+					 "link or any)\n", pattern, policy->configPath);
+			return false;
+		}
+		
+		if (!getIDStringFromConfig(rule, kCHMODDPermKey, mode,
+								   POLICY_MODE_STRING_LENGTH) ||
+			!getIDStringFromConfig(rule, kCHMODDOwnerKey, owner,
+								   POLICY_NAME_LENGTH) ||
+			!getIDStringFromConfig(rule, kCHMODDGroupKey, group,
+								   POLICY_NAME_LENGTH))
+		{
+			LogError("Internal error in config structure!\n");
+			return false;
+		}
+		
+		if (!PolicyAddRule(policy, pattern, type, mode, owner, group))
+		{
+			return false;
+		}
 	}
 	
-	// Get the C string...this can take some work, because we try a short cut
-	// the first time, and if it doesn't work, we do it the hard
-	// (computationally expensive) way.
+	return true;
+}
+
+Boolean getIDStringFromConfig(CFDictionaryRef config, CFStringRef key,
+							  char *buffer, CFIndex bufferSize)
+{
+	CFTypeRef returnedValue = CFDictionaryGetValue(config, key);
+	SInt32 number;
+	
+	buffer[0] = '\0';
+	
+	if (returnedValue == NULL)
+	{
+		return true;
+	}
+	else if (CFGetTypeID(returnedValue) == CFStringGetTypeID())
+	{
+		return getCStringFromCFString(returnedValue, buffer, bufferSize);
+	}
+	else if (CFGetTypeID(returnedValue) == CFNumberGetTypeID() &&
+			 CFNumberGetValue(returnedValue, kCFNumberSInt32Type, &number))
+	{
+		return (snprintf(buffer, bufferSize, "%ld", (long)number) < bufferSize);
+	}
 	
+	return false;
+}
+
+// Returns true only if key is present in config and is a true CFBoolean.
+Boolean getBooleanFromConfig(CFDictionaryRef config, CFStringRef key)
+{
+	CFTypeRef returnedValue = CFDictionaryGetValue(config, key);
 	
-#define SHORT_NAME_LENGTH 50
-	const char *short_name_quick = NULL;
-	char short_string_nonquick[SHORT_NAME_LENGTH];
-	const char *string_to_use = NULL;
-	bzero(short_string_nonquick, SHORT_NAME_LENGTH);
+	return (returnedValue != NULL &&
+			CFGetTypeID(returnedValue) == CFBooleanGetTypeID() &&
+			CFBooleanGetValue((CFBooleanRef)returnedValue));
+}
+
+void HandleEvents(struct policy_t *policy,
+				  struct dispatch_t *dispatch,
+				  size_t numEvents,
+				  char **pathArray,
+				  const FSEventStreamEventFlags eventFlags[],
+				  const FSEventStreamEventId eventIds[])
+{
+	struct coalesce_request_t *requests;
+	size_t i, requestCount = 0;
 	
-	// Quick way...
-	short_name_quick = CFStringGetCStringPtr(mystring, kCFStringEncodingUTF8);
+	MetricsCountEvents(numEvents);
 	
-	// If it works, point our final to it.
-	if (short_name_quick && *short_name_quick)
+	if ((requests = calloc(numEvents, sizeof(struct coalesce_request_t))) == NULL)
 	{
-		string_to_use = short_name_quick;
+		LogError("Couldn't allocate %lu event requests\n",
+				 (unsigned long)numEvents);
+		return;
 	}
-	// If not, try it again, but the long way, and point our bookmark to it
-	// (also only if it works).
-	else
+	
+	for (i = 0; i < numEvents; i++)
 	{
-		Boolean status = CFStringGetCString(mystring,
-											short_string_nonquick,
-											SHORT_NAME_LENGTH-1,
-											kCFStringEncodingUTF8);
-		
-		if (status)
+		// Only marks where replaying history ended; there's nothing at its
+		// path to look at.
+		if (eventFlags[i] & kFSEventStreamEventFlagHistoryDone)
 		{
-			string_to_use = short_string_nonquick;
+			LogV("Caught up on %s's event history\n", policy->path);
+			continue;
 		}
-	}
-#undef SHORT_NAME_LENGTH
-	
-	// If we have a string_to_use
-	if (string_to_use)
-	{
-		if (type == GROUP_TYPE)
+		
+		if (eventFlags[i] & kFSEventStreamEventFlagRootChanged)
 		{
-			struct group *group_info = NULL;
-			
-			group_info = getgrnam(string_to_use);
+			// Our root moved, so put it back where the config says it goes:
+			char newPath[MAXPATHLEN];
 			
-			if (group_info)
+			if (policy->rootDescriptor != -1 &&
+				fcntl(policy->rootDescriptor, F_GETPATH, newPath) != -1)
 			{
-				retVal = group_info->gr_gid;
+				rename(newPath, policy->configPath);
 			}
+			
+			continue;
 		}
-		else if (type == OWNER_TYPE)
+		
+		// If FSEvents says it dropped events below this path, the full walk
+		// that needs goes in the background; nobody is waiting on it.
+		if (eventFlags[i] & kFSEventStreamEventFlagMustScanSubDirs)
 		{
-			struct passwd *user_info = NULL;
-			
-			user_info = getpwnam(string_to_use);
-			
-			if (user_info)
-			{
-				retVal = user_info->pw_uid;
-			}
+			RescanRequestWalk(policy, pathArray[i], true);
+			continue;
 		}
-		else {
-			LogError("Internal Error: Unsupported type specified to "
-					 "getUInt32fromSpecifiedString\n");
+		
+		requests[requestCount].path = pathArray[i];
+		requests[requestCount].eventId = eventIds[i];
+		
+		// With file events the path is the file or directory that changed,
+		// and that's all that needs fixing, unless it's a directory that's
+		// new here (created, or renamed in) and so was never looked at.
+		if (globals->fileEvents &&
+			(eventFlags[i] & (kFSEventStreamEventFlagItemIsFile |
+							  kFSEventStreamEventFlagItemIsDir |
+							  kFSEventStreamEventFlagItemIsSymlink)))
+		{
+			requests[requestCount].entry = true;
+			requests[requestCount].recursive =
+				(eventFlags[i] & kFSEventStreamEventFlagItemIsDir) &&
+				(eventFlags[i] & (kFSEventStreamEventFlagItemCreated |
+								  kFSEventStreamEventFlagItemRenamed));
 		}
-
-			
+		// Everything else (including flags we don't know about) is the usual
+		// walk.
+		else
+		{
+			requests[requestCount].entry = false;
+			requests[requestCount].recursive = false;
+		}
+		requestCount++;
 	}
 	
-	return retVal;
-}
+	// Work out the walks before handing any of them over, so /a, /a/b and /a
+	// again don't turn into three passes over the same tree.
+	requestCount = CoalesceRequests(requests, requestCount);
 	
-// Returns the UID specified in the CFString (whether the string is a username
-// or a UID itself.
-uid_t getUIDfromCFString(CFStringRef myString)
-{
-	uid_t retVal = -1;
-	assert(myString);
+	for (i = 0; i < requestCount; i++)
+	{
+		WorkEnqueue(policy, dispatch, requests[i].path, requests[i].recursive,
+					requests[i].entry, requests[i].eventId);
+	}
 	
-	retVal = getUInt32fromSpecifiedString(myString, OWNER_TYPE);
+	// They only count as dealt with once the workers have nothing left (see
+	// HandleSignals()); if we die before that, the next run sees them again.
+	if (numEvents > 0)
+	{
+		HistoryAdvance(policy->path, eventIds[numEvents - 1]);
+	}
+	
+	free(requests);
+}
+
+void FSCallback(ConstFSEventStreamRef streamRef,
+				void *clientCallBackInfo,
+				size_t numEvents,
+				void *eventPaths,
+				const FSEventStreamEventFlags eventFlags[],
+				const FSEventStreamEventId eventIds[])
+{
+	struct policy_t *policy = (struct policy_t *)clientCallBackInfo;
 	
-	return retVal;
+	HandleEvents(policy, NULL, numEvents, eventPaths, eventFlags, eventIds);
+	LatencyBatch(policy->latency, numEvents);
 }
 
-// Returns the GID specified in the CFString (whether the string is a username
-// or a GID itself.
-gid_t getGIDfromCFString(CFStringRef myString)
+// Returns the policy in dispatch whose configured path is path (give or take
+// a trailing slash), for root change events, which come with that path.
+static struct policy_t *SharedRootForConfigPath(struct dispatch_t *dispatch,
+												const char *path)
 {
-	gid_t retVal = -1;
-	assert(myString);
+	size_t i, length;
 	
-	retVal = getUInt32fromSpecifiedString(myString, GROUP_TYPE);
+	for (i = 0; i < dispatch->policyCount; i++)
+	{
+		length = strlen(dispatch->policies[i]->configPath);
+		
+		if (strncmp(path, dispatch->policies[i]->configPath, length) == 0 &&
+			(path[length] == '\0' ||
+			 (path[length] == '/' && path[length + 1] == '\0')))
+		{
+			return dispatch->policies[i];
+		}
+	}
 	
-	return retVal;
+	return NULL;
 }
 
-Boolean fileNeedsACLApplied(const char *path, acl_t acl)
+void SharedFSCallback(ConstFSEventStreamRef streamRef,
+					  void *clientCallBackInfo,
+					  size_t numEvents,
+					  void *eventPaths,
+					  const FSEventStreamEventFlags eventFlags[],
+					  const FSEventStreamEventId eventIds[])
 {
-	Boolean retVal = FALSE;
-	acl_t test_acl;
+	struct dispatch_t *dispatch = (struct dispatch_t *)clientCallBackInfo;
+	struct policy_t **policies;
+	char **pathArray = eventPaths, **paths;
+	FSEventStreamEventFlags *flags;
+	FSEventStreamEventId *ids;
+	size_t i, j, count;
+	
+	policies = calloc(numEvents, sizeof(struct policy_t *));
+	paths = calloc(numEvents, sizeof(char *));
+	flags = calloc(numEvents, sizeof(FSEventStreamEventFlags));
+	ids = calloc(numEvents, sizeof(FSEventStreamEventId));
+	
+	if (!policies || !paths || !flags || !ids)
+	{
+		LogError("Couldn't allocate %lu event requests\n",
+				 (unsigned long)numEvents);
+		free(policies);
+		free(paths);
+		free(flags);
+		free(ids);
+		return;
+	}
+	
+	for (i = 0; i < numEvents; i++)
+	{
+		policies[i] = (eventFlags[i] & kFSEventStreamEventFlagRootChanged) ?
+			SharedRootForConfigPath(dispatch, pathArray[i]) :
+			DispatchLookup(dispatch, pathArray[i]);
+	}
 	
-	test_acl = acl_get_link_np(path, ACL_TYPE_EXTENDED);
+	// One HandleEvents() per policy, with its events in the order they came.
+	for (i = 0; i < numEvents; i++)
+	{
+		struct policy_t *policy = policies[i];
+		
+		if (!policy)
+		{
+			continue;
+		}
+		
+		for (j = i, count = 0; j < numEvents; j++)
+		{
+			if (policies[j] == policy)
+			{
+				paths[count] = pathArray[j];
+				flags[count] = eventFlags[j];
+				ids[count] = eventIds[j];
+				count++;
+				policies[j] = NULL;
+			}
+		}
+		
+		HandleEvents(policy, dispatch, count, paths, flags, ids);
+	}
 	
-	if (test_acl == (acl_t)NULL) {
-		LogV("%s has no ACL, assuming we need to propigate one to it!\n", path);
-		retVal = true;
+	// Roots with nothing in this batch have had nothing happen up to its last
+	// event either.
+	for (i = 0; i < dispatch->policyCount && numEvents > 0; i++)
+	{
+		HistoryAdvance(dispatch->policies[i]->path, eventIds[numEvents - 1]);
 	}
 	
-	acl_free((void *) test_acl);
+	if (dispatch->latency)
+	{
+		LatencyBatch(dispatch->latency, numEvents);
+	}
 	
-	return retVal;
+	free(policies);
+	free(paths);
+	free(flags);
+	free(ids);
 }
 
+#endif
+
 // Prints the usage to stderr
 void usage(void)
 {
 	fprintf(stderr, "\nUsage: %s [-H -L -f -F -v -V -h -a] -d "
 			"</path/to/directory>  -p <chmod-style permissions to use>\n"
 			"For example:  %s -F -d /Users/Shared \"a+w\"\n", 
-			getprogname(), getprogname());
+			PROGNAME, PROGNAME);
 }
 // Signal related functions
 void setup_signals(void)
@@ -1235,6 +2161,9 @@ void handle(int signal)
 		case SIGUSR2:
 			globals->rescanSignal = true;
 			break;
+		case SIGHUP:
+			globals->hangupSignal = true;
+			break;
 		case SIGINT:
 		case SIGTERM:
 			globals->quitSignal = true;
@@ -1244,6 +2173,7 @@ void handle(int signal)
 	}
 }
 
+#ifdef __APPLE__
 // Stream Array callbacks:
 void MyCFArrayReleaseCallback(CFAllocatorRef allocator,
 							  const void *value)
@@ -1261,3 +2191,16 @@ const void *MyCFArrayRetainCallBack(CFAllocatorRef allocator,
 	FSEventStreamRetain((FSEventStreamRef)value);
 	return value;
 }
+
+// Policy Array callbacks:
+void MyPolicyArrayReleaseCallBack(CFAllocatorRef allocator,
+								  const void *value)
+{
+	PolicyRelease(value);
+}
+const void *MyPolicyArrayRetainCallBack(CFAllocatorRef allocator,
+										const void *value)
+{
+	return PolicyRetain(value);
+}
+#endif
@@ -0,0 +1,649 @@
+/*
+ *	metrics.c -- counters and histograms, served over a Unix domain socket.
+ *
+ *	The counters are always kept; they're just atomic adds.  What the walker
+ *	already counts (walk_stats_t) comes from WalkGetTotals() when somebody
+ *	asks, rather than being counted twice.
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "metrics.h"
+#include "walk.h"
+#include "idcache.h"
+#include "coalesce.h"
+#include "logging.h"
+#include "rescan.h"
+#include "budget.h"
+#include "latency.h"
+#include "work.h"
+#include "subtree.h"
+
+#define METRICS_BUFFER_SIZE		65536
+
+// How long a client gets to take its answer, all told.  There's one thread
+// answering; a client that stops reading mustn't hang it for everyone else.
+#define METRICS_SEND_SECONDS	2
+
+// A client that hangs up before it has its answer mustn't take us down with
+// SIGPIPE.  Mac OS X has no MSG_NOSIGNAL; the socket gets SO_NOSIGPIPE there.
+#ifdef MSG_NOSIGNAL
+#define METRICS_SEND_FLAGS		MSG_NOSIGNAL
+#else
+#define METRICS_SEND_FLAGS		0
+#endif
+
+// Roots past this many don't get their latency reported.
+#define METRICS_MAX_LATENCIES	64
+
+// Upper bounds (seconds) of the walk duration histogram's buckets.
+static const double metricsDurationBounds[] = {
+	0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 30, 120
+};
+#define METRICS_DURATION_BUCKETS	\
+	(sizeof(metricsDurationBounds) / sizeof(metricsDurationBounds[0]))
+
+static struct {
+	unsigned long			eventsReceived;
+	unsigned long			walksStarted;
+	unsigned long			walksRecursive;
+	unsigned long			errors[METRICS_MAX_ERRNO + 1];
+
+	// Not cumulative; the +Inf bucket is durationCount.
+	unsigned long			durationBuckets[METRICS_DURATION_BUCKETS];
+	unsigned long			durationCount;
+	unsigned long			durationMicroseconds;
+
+	// The same, for how long queued walks wait for a worker.
+	unsigned long			waitBuckets[METRICS_DURATION_BUCKETS];
+	unsigned long			waitCount;
+	unsigned long			waitMicroseconds;
+
+	int						listenSocket;
+	char					socketPath[PATH_MAX];
+	pthread_t				thread;
+} metrics = { .listenSocket = -1 };
+
+void MetricsCountEvents(unsigned long count)
+{
+	__sync_fetch_and_add(&metrics.eventsReceived, count);
+}
+
+void MetricsWalkStarted(Boolean recursive)
+{
+	__sync_fetch_and_add(&metrics.walksStarted, 1);
+
+	if (recursive)
+	{
+		__sync_fetch_and_add(&metrics.walksRecursive, 1);
+	}
+}
+
+void MetricsWalkFinished(double seconds)
+{
+	size_t i;
+
+	for (i = 0; i < METRICS_DURATION_BUCKETS; i++)
+	{
+		if (seconds <= metricsDurationBounds[i])
+		{
+			__sync_fetch_and_add(&metrics.durationBuckets[i], 1);
+			break;
+		}
+	}
+
+	__sync_fetch_and_add(&metrics.durationCount, 1);
+	__sync_fetch_and_add(&metrics.durationMicroseconds,
+						 (unsigned long)(seconds * 1e6));
+}
+
+void MetricsWorkWaited(double seconds)
+{
+	size_t i;
+
+	for (i = 0; i < METRICS_DURATION_BUCKETS; i++)
+	{
+		if (seconds <= metricsDurationBounds[i])
+		{
+			__sync_fetch_and_add(&metrics.waitBuckets[i], 1);
+			break;
+		}
+	}
+
+	__sync_fetch_and_add(&metrics.waitCount, 1);
+	__sync_fetch_and_add(&metrics.waitMicroseconds,
+						 (unsigned long)(seconds * 1e6));
+}
+
+void MetricsCountError(int error)
+{
+	if (error < 0 || error > METRICS_MAX_ERRNO)
+	{
+		error = METRICS_MAX_ERRNO;
+	}
+
+	__sync_fetch_and_add(&metrics.errors[error], 1);
+}
+
+// snprintf into buffer at *used, never past size.
+static void MetricsAppend(char *buffer, size_t size, size_t *used,
+						  const char *format, ...)
+__attribute__((format(printf, 4, 5)));
+
+static void MetricsAppend(char *buffer, size_t size, size_t *used,
+						  const char *format, ...)
+{
+	va_list ap;
+	int length;
+
+	if (*used >= size)
+	{
+		return;
+	}
+
+	va_start(ap, format);
+	length = vsnprintf(buffer + *used, size - *used, format, ap);
+	va_end(ap);
+
+	if (length > 0)
+	{
+		*used += length;
+	}
+}
+
+// Appends string as a label value, escaped the way Prometheus wants.
+static void MetricsAppendLabel(char *buffer, size_t size, size_t *used,
+							   const char *string)
+{
+	for (; *string && *used + 2 < size; string++)
+	{
+		if (*string == '\\' || *string == '"')
+		{
+			buffer[(*used)++] = '\\';
+			buffer[(*used)++] = *string;
+		}
+		else if (*string == '\n')
+		{
+			buffer[(*used)++] = '\\';
+			buffer[(*used)++] = 'n';
+		}
+		else
+		{
+			buffer[(*used)++] = *string;
+		}
+	}
+}
+
+// Starts a line of metric name for the stream of root: `name{root="..."} `.
+static void MetricsAppendRoot(char *buffer, size_t size, size_t *used,
+							  const char *name, const char *root,
+							  const char *moreLabels)
+{
+	MetricsAppend(buffer, size, used, "%s{root=\"", name);
+	MetricsAppendLabel(buffer, size, used, root);
+	MetricsAppend(buffer, size, used, "\"%s} ", moreLabels);
+}
+
+// Latency controllers, one per stream (see latency.h).
+static void MetricsRenderLatencies(char *buffer, size_t size, size_t *used)
+{
+	struct latency_status_t *statuses;
+	size_t i, count;
+
+	if ((statuses = calloc(METRICS_MAX_LATENCIES,
+						   sizeof(struct latency_status_t))) == NULL)
+	{
+		return;
+	}
+
+	count = LatencyGetStatus(statuses, METRICS_MAX_LATENCIES);
+	if (count > METRICS_MAX_LATENCIES)
+	{
+		count = METRICS_MAX_LATENCIES;
+	}
+
+	MetricsAppend(buffer, size, used,
+				  "# HELP chmodd_latency_seconds How long each stream holds "
+				  "events right now.\n"
+				  "# TYPE chmodd_latency_seconds gauge\n");
+	for (i = 0; i < count; i++)
+	{
+		MetricsAppendRoot(buffer, size, used, "chmodd_latency_seconds",
+						  statuses[i].name, "");
+		MetricsAppend(buffer, size, used, "%g\n", statuses[i].current);
+	}
+
+	MetricsAppend(buffer, size, used,
+				  "# HELP chmodd_latency_bound_seconds The bounds (-l) latency "
+				  "moves between.\n"
+				  "# TYPE chmodd_latency_bound_seconds gauge\n");
+	for (i = 0; i < count; i++)
+	{
+		MetricsAppendRoot(buffer, size, used, "chmodd_latency_bound_seconds",
+						  statuses[i].name, ",bound=\"min\"");
+		MetricsAppend(buffer, size, used, "%g\n", statuses[i].minimum);
+		MetricsAppendRoot(buffer, size, used, "chmodd_latency_bound_seconds",
+						  statuses[i].name, ",bound=\"max\"");
+		MetricsAppend(buffer, size, used, "%g\n", statuses[i].maximum);
+	}
+
+	MetricsAppend(buffer, size, used,
+				  "# HELP chmodd_event_rate Events a second, smoothed over the "
+				  "last few batches.\n"
+				  "# TYPE chmodd_event_rate gauge\n");
+	for (i = 0; i < count; i++)
+	{
+		MetricsAppendRoot(buffer, size, used, "chmodd_event_rate",
+						  statuses[i].name, "");
+		MetricsAppend(buffer, size, used, "%.3f\n", statuses[i].eventRate);
+	}
+
+	MetricsAppend(buffer, size, used,
+				  "# HELP chmodd_event_walk_share Share of the time spent "
+				  "walking for events, smoothed the same way.\n"
+				  "# TYPE chmodd_event_walk_share gauge\n");
+	for (i = 0; i < count; i++)
+	{
+		MetricsAppendRoot(buffer, size, used, "chmodd_event_walk_share",
+						  statuses[i].name, "");
+		MetricsAppend(buffer, size, used, "%.3f\n", statuses[i].walkShare);
+	}
+
+	MetricsAppend(buffer, size, used,
+				  "# HELP chmodd_event_batches_total Event batches walked.\n"
+				  "# TYPE chmodd_event_batches_total counter\n");
+	for (i = 0; i < count; i++)
+	{
+		MetricsAppendRoot(buffer, size, used, "chmodd_event_batches_total",
+						  statuses[i].name, "");
+		MetricsAppend(buffer, size, used, "%lu\n", statuses[i].batches);
+	}
+
+	MetricsAppend(buffer, size, used,
+				  "# HELP chmodd_latency_changes_total Times latency was "
+				  "raised or lowered.\n"
+				  "# TYPE chmodd_latency_changes_total counter\n");
+	for (i = 0; i < count; i++)
+	{
+		MetricsAppendRoot(buffer, size, used, "chmodd_latency_changes_total",
+						  statuses[i].name, ",direction=\"raised\"");
+		MetricsAppend(buffer, size, used, "%lu\n", statuses[i].raised);
+		MetricsAppendRoot(buffer, size, used, "chmodd_latency_changes_total",
+						  statuses[i].name, ",direction=\"lowered\"");
+		MetricsAppend(buffer, size, used, "%lu\n", statuses[i].lowered);
+	}
+
+	free(statuses);
+}
+
+static void MetricsCounter(char *buffer, size_t size, size_t *used,
+						   const char *name, const char *help,
+						   unsigned long value)
+{
+	MetricsAppend(buffer, size, used, "# HELP %s %s\n# TYPE %s counter\n"
+				  "%s %lu\n", name, help, name, name, value);
+}
+
+// Writes every metric into buffer, returning the length.
+static size_t MetricsRender(char *buffer, size_t size)
+{
+	struct idcache_stats_t idStats;
+	struct walk_stats_t walkStats;
+	struct rescan_status_t rescanStatus;
+	struct budget_status_t budgetStatus;
+	struct work_status_t workStatus;
+	struct subtree_status_t subtreeStatus;
+	unsigned long cumulative = 0;
+	size_t i, used = 0;
+
+	WalkGetTotals(&walkStats);
+	IDCacheGetStats(&idStats);
+	RescanGetStatus(&rescanStatus);
+	BudgetGetStatus(&budgetStatus);
+	WorkGetStatus(&workStatus);
+	SubtreeGetStatus(&subtreeStatus);
+
+	MetricsCounter(buffer, size, &used, "chmodd_events_received_total",
+				   "File system events received.",
+				   metrics.eventsReceived);
+	MetricsCounter(buffer, size, &used, "chmodd_walks_started_total",
+				   "Walks started.", metrics.walksStarted);
+	MetricsCounter(buffer, size, &used, "chmodd_walks_recursive_total",
+				   "Walks started that had to visit everything.",
+				   metrics.walksRecursive);
+	MetricsCounter(buffer, size, &used, "chmodd_walks_coalesced_total",
+				   "Walks saved by coalescing event batches.",
+				   CoalesceWalksSaved());
+	MetricsCounter(buffer, size, &used, "chmodd_entries_visited_total",
+				   "Files and directories looked at.", walkStats.filesVisited);
+	MetricsCounter(buffer, size, &used, "chmodd_entries_changed_total",
+				   "Changes applied.", walkStats.filesChanged);
+	MetricsCounter(buffer, size, &used, "chmodd_entries_alone_total",
+				   "Entries fixed on their own, for file events (-e).",
+				   walkStats.entries);
+	MetricsCounter(buffer, size, &used, "chmodd_directories_skipped_total",
+				   "Directories skipped because the index had them verified.",
+				   walkStats.directoriesSkipped);
+	MetricsCounter(buffer, size, &used, "chmodd_log_dropped_total",
+				   "Log messages dropped because a ring was full.",
+				   LoggingDropped());
+
+	MetricsAppend(buffer, size, &used,
+				  "# HELP chmodd_syscalls_total Syscalls made by walks.\n"
+				  "# TYPE chmodd_syscalls_total counter\n"
+				  "chmodd_syscalls_total{call=\"stat\"} %lu\n"
+				  "chmodd_syscalls_total{call=\"open\"} %lu\n"
+				  "chmodd_syscalls_total{call=\"chmod\"} %lu\n"
+				  "chmodd_syscalls_total{call=\"chown\"} %lu\n"
+				  "chmodd_syscalls_total{call=\"acl_get\"} %lu\n"
+				  "chmodd_syscalls_total{call=\"acl_set\"} %lu\n",
+				  walkStats.statCalls, walkStats.openCalls,
+				  walkStats.chmodCalls, walkStats.chownCalls,
+				  walkStats.aclReadCalls, walkStats.aclWriteCalls);
+
+	MetricsAppend(buffer, size, &used,
+				  "# HELP chmodd_errors_total Failed syscalls, by errno.\n"
+				  "# TYPE chmodd_errors_total counter\n");
+	for (i = 0; i <= METRICS_MAX_ERRNO; i++)
+	{
+		if (metrics.errors[i])
+		{
+			MetricsAppend(buffer, size, &used,
+						  "chmodd_errors_total{errno=\"%lu\",error=\"%s\"} "
+						  "%lu\n", (unsigned long)i,
+						  (i == METRICS_MAX_ERRNO) ? "other" : strerror(i),
+						  metrics.errors[i]);
+		}
+	}
+
+	MetricsAppend(buffer, size, &used,
+				  "# HELP chmodd_walk_duration_seconds How long walks take.\n"
+				  "# TYPE chmodd_walk_duration_seconds histogram\n");
+	for (i = 0; i < METRICS_DURATION_BUCKETS; i++)
+	{
+		cumulative += metrics.durationBuckets[i];
+		MetricsAppend(buffer, size, &used,
+					  "chmodd_walk_duration_seconds_bucket{le=\"%g\"} %lu\n",
+					  metricsDurationBounds[i], cumulative);
+	}
+	MetricsAppend(buffer, size, &used,
+				  "chmodd_walk_duration_seconds_bucket{le=\"+Inf\"} %lu\n"
+				  "chmodd_walk_duration_seconds_sum %.6f\n"
+				  "chmodd_walk_duration_seconds_count %lu\n",
+				  metrics.durationCount,
+				  metrics.durationMicroseconds / 1e6,
+				  metrics.durationCount);
+
+	MetricsCounter(buffer, size, &used, "chmodd_idcache_hits_total",
+				   "User/group lookups answered from the cache.", idStats.hits);
+	MetricsCounter(buffer, size, &used, "chmodd_idcache_misses_total",
+				   "User/group lookups that went to the directory service.",
+				   idStats.misses);
+
+	MetricsCounter(buffer, size, &used, "chmodd_rescans_total",
+				   "Rescans finished.", rescanStatus.completed);
+	MetricsCounter(buffer, size, &used, "chmodd_rescans_merged_total",
+				   "Rescan requests folded into one already running.",
+				   rescanStatus.merged);
+	MetricsAppend(buffer, size, &used,
+				  "# HELP chmodd_rescan_running Whether a rescan is going.\n"
+				  "# TYPE chmodd_rescan_running gauge\n"
+				  "chmodd_rescan_running %d\n"
+				  "# HELP chmodd_rescan_roots Roots in the current (or last) "
+				  "rescan, and how many are done.\n"
+				  "# TYPE chmodd_rescan_roots gauge\n"
+				  "chmodd_rescan_roots{state=\"done\"} %lu\n"
+				  "chmodd_rescan_roots{state=\"total\"} %lu\n",
+				  rescanStatus.running ? 1 : 0, rescanStatus.rootsDone,
+				  rescanStatus.rootsTotal);
+
+	MetricsCounter(buffer, size, &used, "chmodd_background_walks_total",
+				   "Prescans and dropped-event walks done in the background.",
+				   rescanStatus.walksDone);
+	MetricsAppend(buffer, size, &used,
+				  "# HELP chmodd_background_walks_queued Background walks "
+				  "waiting (and going).\n"
+				  "# TYPE chmodd_background_walks_queued gauge\n"
+				  "chmodd_background_walks_queued %lu\n"
+				  "# HELP chmodd_budget_rate Syscalls a second background "
+				  "walks may make, 0 for no limit.\n"
+				  "# TYPE chmodd_budget_rate gauge\n"
+				  "chmodd_budget_rate %lu\n",
+				  rescanStatus.walksQueued + (rescanStatus.walkRunning ? 1 : 0),
+				  budgetStatus.rate);
+	MetricsCounter(buffer, size, &used, "chmodd_budget_syscalls_total",
+				   "Syscalls made by background walks.", budgetStatus.charged);
+	MetricsCounter(buffer, size, &used, "chmodd_budget_throttled_total",
+				   "Times a background walk waited on the budget.",
+				   budgetStatus.throttled);
+	MetricsCounter(buffer, size, &used, "chmodd_budget_preempted_total",
+				   "Times a background walk stood aside for live events.",
+				   budgetStatus.preempted);
+	MetricsAppend(buffer, size, &used,
+				  "# HELP chmodd_budget_wait_seconds_total Time background "
+				  "walks spent waiting, by reason.\n"
+				  "# TYPE chmodd_budget_wait_seconds_total counter\n"
+				  "chmodd_budget_wait_seconds_total{reason=\"throttled\"} %.3f\n"
+				  "chmodd_budget_wait_seconds_total{reason=\"preempted\"} %.3f\n",
+				  budgetStatus.throttledSeconds, budgetStatus.preemptedSeconds);
+
+	MetricsAppend(buffer, size, &used,
+				  "# HELP chmodd_work_queue Walks events asked for, by state, "
+				  "and the queue's size.\n"
+				  "# TYPE chmodd_work_queue gauge\n"
+				  "chmodd_work_queue{state=\"queued\"} %lu\n"
+				  "chmodd_work_queue{state=\"running\"} %lu\n"
+				  "chmodd_work_queue{state=\"capacity\"} %lu\n"
+				  "# HELP chmodd_workers Worker threads walking for events.\n"
+				  "# TYPE chmodd_workers gauge\n"
+				  "chmodd_workers %d\n",
+				  workStatus.depth, workStatus.running, workStatus.capacity,
+				  workStatus.workers);
+	MetricsCounter(buffer, size, &used, "chmodd_work_queued_total",
+				   "Walks handed to the work queue, with the ones it had no "
+				   "room for.", workStatus.enqueued);
+	MetricsCounter(buffer, size, &used, "chmodd_work_overflowed_total",
+				   "Walks turned into a walk of their root, the queue being "
+				   "full.", workStatus.overflowed);
+	MetricsAppend(buffer, size, &used,
+				  "# HELP chmodd_walks_absorbed_total Walks not done because "
+				  "another covered them, by whether it was still going.\n"
+				  "# TYPE chmodd_walks_absorbed_total counter\n"
+				  "chmodd_walks_absorbed_total{by=\"running\"} %lu\n"
+				  "chmodd_walks_absorbed_total{by=\"recent\"} %lu\n"
+				  "# HELP chmodd_walks_in_flight Walks going, and requests "
+				  "waiting for one of them to finish.\n"
+				  "# TYPE chmodd_walks_in_flight gauge\n"
+				  "chmodd_walks_in_flight{state=\"running\"} %lu\n"
+				  "chmodd_walks_in_flight{state=\"waiting\"} %lu\n",
+				  subtreeStatus.absorbed, subtreeStatus.recent,
+				  subtreeStatus.running, subtreeStatus.waiting);
+
+	cumulative = 0;
+	MetricsAppend(buffer, size, &used,
+				  "# HELP chmodd_work_wait_seconds How long queued walks wait "
+				  "for a worker.\n"
+				  "# TYPE chmodd_work_wait_seconds histogram\n");
+	for (i = 0; i < METRICS_DURATION_BUCKETS; i++)
+	{
+		cumulative += metrics.waitBuckets[i];
+		MetricsAppend(buffer, size, &used,
+					  "chmodd_work_wait_seconds_bucket{le=\"%g\"} %lu\n",
+					  metricsDurationBounds[i], cumulative);
+	}
+	MetricsAppend(buffer, size, &used,
+				  "chmodd_work_wait_seconds_bucket{le=\"+Inf\"} %lu\n"
+				  "chmodd_work_wait_seconds_sum %.6f\n"
+				  "chmodd_work_wait_seconds_count %lu\n",
+				  metrics.waitCount, metrics.waitMicroseconds / 1e6,
+				  metrics.waitCount);
+
+	MetricsRenderLatencies(buffer, size, &used);
+
+	return (used < size) ? used : size - 1;
+}
+
+static void MetricsAnswer(int client)
+{
+	static const char header[] = "HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n\r\n";
+	char request[512], *buffer;
+	struct pollfd pfd = { client, POLLIN, 0 };
+	struct timeval timeout = { METRICS_SEND_SECONDS, 0 };
+#ifdef __APPLE__
+	int on = 1;
+#endif
+	Boolean http = false;
+	size_t length, sent = 0;
+	time_t deadline;
+	ssize_t n;
+
+	// Scrapers speak HTTP, nc doesn't say anything.  Give either a moment.
+	if (poll(&pfd, 1, 100) == 1 &&
+		(n = read(client, request, sizeof(request) - 1)) > 0)
+	{
+		request[n] = '\0';
+		http = (strncmp(request, "GET ", 4) == 0);
+	}
+
+	if ((buffer = malloc(METRICS_BUFFER_SIZE)) == NULL)
+	{
+		return;
+	}
+
+	length = MetricsRender(buffer, METRICS_BUFFER_SIZE);
+
+	// The timeout stops any one send() blocking for good, the deadline a
+	// client that reads a trickle at a time.
+	setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+#ifdef __APPLE__
+	setsockopt(client, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+	deadline = time(NULL) + METRICS_SEND_SECONDS;
+
+	if (http)
+	{
+		send(client, header, sizeof(header) - 1, METRICS_SEND_FLAGS);
+	}
+
+	while (sent < length && time(NULL) <= deadline &&
+		   (n = send(client, buffer + sent, length - sent,
+					 METRICS_SEND_FLAGS)) > 0)
+	{
+		sent += n;
+	}
+
+	free(buffer);
+}
+
+static void *MetricsServe(void *context)
+{
+	for (;;)
+	{
+		int client = accept(metrics.listenSocket, NULL, NULL);
+
+		if (client == -1)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+			{
+				continue;
+			}
+			LogError("metrics accept: %s\n", strerror(errno));
+			return NULL;
+		}
+
+		MetricsAnswer(client);
+		close(client);
+	}
+
+	return NULL;
+}
+
+Boolean MetricsStartServer(const char *path)
+{
+	struct sockaddr_un address;
+	sigset_t allSignals, oldSignals;
+	int error;
+
+	if (strlen(path) >= sizeof(address.sun_path))
+	{
+		LogError("Metrics socket path %s is too long\n", path);
+		return false;
+	}
+
+	bzero(&address, sizeof(address));
+	address.sun_family = AF_UNIX;
+	snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+
+	if ((metrics.listenSocket = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+	{
+		LogError("metrics socket: %s\n", strerror(errno));
+		return false;
+	}
+
+	// A socket left over from a previous run would make bind() fail.
+	unlink(path);
+
+	if (bind(metrics.listenSocket, (struct sockaddr *)&address,
+			 sizeof(address)) != 0 ||
+		listen(metrics.listenSocket, 8) != 0)
+	{
+		LogError("metrics %s: %s\n", path, strerror(errno));
+		close(metrics.listenSocket);
+		metrics.listenSocket = -1;
+		return false;
+	}
+
+	snprintf(metrics.socketPath, PATH_MAX, "%s", path);
+
+	// Signals are for the run loop, so the thread starts with them blocked.
+	sigfillset(&allSignals);
+	pthread_sigmask(SIG_SETMASK, &allSignals, &oldSignals);
+	error = pthread_create(&metrics.thread, NULL, MetricsServe, NULL);
+	pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+
+	if (error != 0)
+	{
+		LogError("metrics thread: %s\n", strerror(error));
+		unlink(path);
+		close(metrics.listenSocket);
+		metrics.listenSocket = -1;
+		return false;
+	}
+
+	pthread_detach(metrics.thread);
+
+	LogV("Serving metrics on %s\n", path);
+
+	return true;
+}
+
+void MetricsStopServer(void)
+{
+	if (metrics.listenSocket == -1)
+	{
+		return;
+	}
+
+	// The thread is left blocked in accept(); we're on our way out.
+	unlink(metrics.socketPath);
+}
@@ -0,0 +1,40 @@
+/*
+ *	metrics.h -- counters and histograms, served over a Unix domain socket.
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#ifndef CHMODD_METRICS_H
+#define CHMODD_METRICS_H
+
+#include "chmodd.h"
+
+// Errors at or above this are all counted together.
+#define METRICS_MAX_ERRNO		160
+
+// File system events handed to us by FSEvents/inotify/fanotify.
+void MetricsCountEvents(unsigned long count);
+
+// A walk was started (recursive or not), and how long it took.
+void MetricsWalkStarted(Boolean recursive);
+void MetricsWalkFinished(double seconds);
+
+// A queued walk started, seconds after it was queued (see work.h).
+void MetricsWorkWaited(double seconds);
+
+// A syscall on a file failed with error.
+void MetricsCountError(int error);
+
+// Starts a thread answering on a Unix domain socket at path: every
+// connection gets the metrics in Prometheus' text format (wrapped in an
+// HTTP response if it looks like it asked for one) and is closed.
+Boolean MetricsStartServer(const char *path);
+
+// Removes the socket.
+void MetricsStopServer(void);
+
+#endif
@@ -0,0 +1,1026 @@
+/*
+ *	policy.c -- a config dictionary compiled down to what the walker needs.
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "policy.h"
+#include "idcache.h"
+#include "compat.h"
+#include "latency.h"
+
+// FNV-1a, which is plenty to tell ACLs (and policies) apart.  seed is a
+// previous result, to hash several pieces as one.
+static UInt64 PolicyHashBytes(const void *bytes, size_t length, UInt64 seed)
+{
+	const unsigned char *p = bytes;
+	UInt64 hash = seed;
+
+	while (length--)
+	{
+		hash ^= *p++;
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+#define POLICY_HASH_SEED	14695981039346656037ULL
+
+struct policy_t *PolicyCreate(const char *path, const char *configPath)
+{
+	struct policy_t *policy = calloc(1, sizeof(struct policy_t));
+
+	if (!policy)
+	{
+		LogError("Couldn't allocate policy for %s\n", path);
+		return NULL;
+	}
+
+	policy->refCount		=	1;
+	policy->hasMode			=	false;
+	policy->owner			=	-1;
+	policy->group			=	-1;
+	policy->applyACL		=	false;
+#ifdef __APPLE__
+	policy->acl				=	NULL;
+	pthread_mutex_init(&policy->aclLock, NULL);
+#endif
+	policy->rootDescriptor	=	-1;
+	pthread_mutex_init(&policy->refreshLock, NULL);
+
+	snprintf(policy->path, PATH_MAX, "%s", path);
+	snprintf(policy->configPath, PATH_MAX, "%s", configPath ? configPath : path);
+
+	return policy;
+}
+
+const void *PolicyRetain(const void *info)
+{
+	struct policy_t *policy = (struct policy_t *)info;
+
+	__sync_add_and_fetch(&policy->refCount, 1);
+
+	return info;
+}
+
+void PolicyRelease(const void *info)
+{
+	struct policy_t *policy = (struct policy_t *)info;
+
+	if (__sync_sub_and_fetch(&policy->refCount, 1) > 0)
+	{
+		return;
+	}
+
+#ifdef __APPLE__
+	PolicyReleaseACL(policy->acl);
+	pthread_mutex_destroy(&policy->aclLock);
+#endif
+
+	if (policy->rootDescriptor != -1)
+	{
+		close(policy->rootDescriptor);
+	}
+
+	if (policy->latency)
+	{
+		LatencyRelease(policy->latency);
+	}
+
+	while (policy->nestedCount > 0)
+	{
+		free(policy->nestedRoots[--policy->nestedCount]);
+	}
+	free(policy->nestedRoots);
+
+	while (policy->ruleCount > 0)
+	{
+		free(policy->rules[--policy->ruleCount].pattern);
+	}
+	free(policy->rules);
+
+	pthread_mutex_destroy(&policy->refreshLock);
+	free(policy);
+}
+
+// Fills table with the result of modeString for every starting mode.  Returns
+// false if the string can't be parsed.
+static Boolean PolicyCompileMode(const char *modeString,
+								 mode_t table[2][POLICY_MODE_TABLE_SIZE])
+{
+	void *modeChange;
+	mode_t perms;
+
+	if ((modeChange = setmode(modeString)) == NULL)
+	{
+		LogError("Internal error setting file mode: %s\n", modeString);
+		LogError("This is probably an invalide mode!\n");
+		return false;
+	}
+
+	// getmode() only looks at the permission bits and whether the item is a
+	// directory, so we can work out every answer up front and turn the per file
+	// work into a table lookup.
+	for (perms = 0; perms < POLICY_MODE_TABLE_SIZE; perms++)
+	{
+		table[0][perms] = getmode(modeChange, S_IFREG | perms) & 07777;
+		table[1][perms] = getmode(modeChange, S_IFDIR | perms) & 07777;
+	}
+
+	free(modeChange);
+
+	return true;
+}
+
+Boolean PolicySetMode(struct policy_t *policy, const char *modeString)
+{
+	if (!PolicyCompileMode(modeString, policy->modeTable))
+	{
+		policy->hasMode = false;
+		return false;
+	}
+
+	snprintf(policy->modeString, POLICY_MODE_STRING_LENGTH, "%s", modeString);
+	policy->hasMode = true;
+
+	return true;
+}
+
+// Returns true (and the number in value) if string is entirely a number.
+static Boolean PolicyParseID(const char *string, UInt32 *value)
+{
+	char *end = NULL;
+	unsigned long number;
+
+	if (!*string)
+	{
+		return false;
+	}
+
+	number = strtoul(string, &end, 10);
+
+	if (*end != '\0')
+	{
+		return false;
+	}
+
+	*value = (UInt32)number;
+	return true;
+}
+
+void PolicySetOwner(struct policy_t *policy, const char *owner)
+{
+	UInt32 value;
+
+	if (PolicyParseID(owner, &value))
+	{
+		policy->owner = value;
+		policy->ownerName[0] = '\0';
+	}
+	else
+	{
+		snprintf(policy->ownerName, POLICY_NAME_LENGTH, "%s", owner);
+		policy->owner = IDCacheLookupUser(policy->ownerName);
+		policy->idGeneration = IDCacheGeneration();
+	}
+}
+
+void PolicySetGroup(struct policy_t *policy, const char *group)
+{
+	UInt32 value;
+
+	if (PolicyParseID(group, &value))
+	{
+		policy->group = value;
+		policy->groupName[0] = '\0';
+	}
+	else
+	{
+		snprintf(policy->groupName, POLICY_NAME_LENGTH, "%s", group);
+		policy->group = IDCacheLookupGroup(policy->groupName);
+		policy->idGeneration = IDCacheGeneration();
+	}
+}
+
+void PolicyRefreshIDs(struct policy_t *policy)
+{
+	struct policy_rule_t *rule;
+	unsigned long generation;
+	size_t i;
+
+	if (!policy->ownerName[0] && !policy->groupName[0] &&
+		policy->ruleCount == 0)
+	{
+		return;
+	}
+
+	generation = IDCacheGeneration();
+
+	if (generation == policy->idGeneration)
+	{
+		return;
+	}
+
+	if (policy->ownerName[0])
+	{
+		policy->owner = IDCacheLookupUser(policy->ownerName);
+	}
+
+	if (policy->groupName[0])
+	{
+		policy->group = IDCacheLookupGroup(policy->groupName);
+	}
+
+	for (i = 0; i < policy->ruleCount; i++)
+	{
+		rule = &policy->rules[i];
+
+		if (rule->ownerName[0])
+		{
+			rule->owner = IDCacheLookupUser(rule->ownerName);
+		}
+
+		if (rule->groupName[0])
+		{
+			rule->group = IDCacheLookupGroup(rule->groupName);
+		}
+	}
+
+	policy->idGeneration = generation;
+}
+
+void PolicyUpdateHash(struct policy_t *policy)
+{
+	const struct policy_rule_t *rule;
+	UInt64 hash = POLICY_HASH_SEED;
+	size_t i;
+
+	// The mode string compiles to the same table every time, so it stands in
+	// for the table.
+	if (policy->hasMode)
+	{
+		hash = PolicyHashBytes(policy->modeString, strlen(policy->modeString),
+							   hash);
+	}
+
+	hash = PolicyHashBytes(&policy->owner, sizeof(policy->owner), hash);
+	hash = PolicyHashBytes(&policy->group, sizeof(policy->group), hash);
+	hash = PolicyHashBytes(&policy->applyACL, sizeof(policy->applyACL), hash);
+
+	// Rules are in order, since the first match wins.
+	for (i = 0; i < policy->ruleCount; i++)
+	{
+		rule = &policy->rules[i];
+
+		hash = PolicyHashBytes(rule->pattern, strlen(rule->pattern) + 1, hash);
+		hash = PolicyHashBytes(&rule->type, sizeof(rule->type), hash);
+		hash = PolicyHashBytes(&rule->matchName, sizeof(rule->matchName), hash);
+		if (rule->hasMode)
+		{
+			hash = PolicyHashBytes(rule->modeString,
+								   strlen(rule->modeString) + 1, hash);
+		}
+		hash = PolicyHashBytes(&rule->owner, sizeof(rule->owner), hash);
+		hash = PolicyHashBytes(&rule->group, sizeof(rule->group), hash);
+	}
+
+#ifdef __APPLE__
+	if (policy->acl)
+	{
+		hash = PolicyHashBytes(&policy->acl->hash, sizeof(policy->acl->hash),
+							   hash);
+	}
+#endif
+
+	policy->hash = hash;
+}
+
+Boolean PolicyTakeSnapshot(const struct policy_t *policy,
+						   struct policy_snapshot_t *snapshot)
+{
+	size_t i;
+
+	snapshot->root.owner = policy->owner;
+	snapshot->root.group = policy->group;
+	snapshot->hash = policy->hash;
+	snapshot->rules = NULL;
+
+	if (policy->ruleCount == 0)
+	{
+		return true;
+	}
+
+	snapshot->rules = malloc(policy->ruleCount * sizeof(struct policy_ids_t));
+	if (!snapshot->rules)
+	{
+		return false;
+	}
+
+	for (i = 0; i < policy->ruleCount; i++)
+	{
+		snapshot->rules[i].owner = policy->rules[i].owner;
+		snapshot->rules[i].group = policy->rules[i].group;
+	}
+
+	return true;
+}
+
+void PolicyFreeSnapshot(struct policy_snapshot_t *snapshot)
+{
+	free(snapshot->rules);
+	snapshot->rules = NULL;
+}
+
+// Finds where path is, or would go, in policy's nested roots.
+static size_t PolicyNestedSearch(const struct policy_t *policy,
+								 const char *path, Boolean *found)
+{
+	size_t low = 0, high = policy->nestedCount;
+
+	*found = false;
+
+	while (low < high)
+	{
+		size_t middle = (low + high) / 2;
+		int compare = strcmp(policy->nestedRoots[middle], path);
+
+		if (compare == 0)
+		{
+			*found = true;
+			return middle;
+		}
+
+		if (compare < 0)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+
+	return low;
+}
+
+void PolicyAddNestedRoot(struct policy_t *policy, const char *path)
+{
+	char **nestedRoots, *pathCopy;
+	Boolean found;
+	size_t index = PolicyNestedSearch(policy, path, &found);
+
+	if (found)
+	{
+		return;
+	}
+
+	nestedRoots = realloc(policy->nestedRoots,
+						  (policy->nestedCount + 1) * sizeof(char *));
+	if (!nestedRoots || (pathCopy = strdup(path)) == NULL)
+	{
+		if (nestedRoots)
+		{
+			policy->nestedRoots = nestedRoots;
+		}
+		LogError("Couldn't record %s as nested in %s\n", path, policy->path);
+		return;
+	}
+
+	memmove(nestedRoots + index + 1, nestedRoots + index,
+			(policy->nestedCount - index) * sizeof(char *));
+	nestedRoots[index] = pathCopy;
+	policy->nestedRoots = nestedRoots;
+	policy->nestedCount++;
+
+	LogV("%s is a root of its own inside %s\n", path, policy->path);
+}
+
+Boolean PolicyIsNestedRoot(const struct policy_t *policy, const char *path)
+{
+	Boolean found;
+
+	PolicyNestedSearch(policy, path, &found);
+
+	return found;
+}
+
+// Matches c against the [...] class starting at *pattern, leaving *pattern just
+// past it.  An unterminated class matches nothing.
+static Boolean PolicyClassMatch(const char **pattern, char c)
+{
+	const char *p = *pattern + 1;
+	Boolean negate = false, matched = false;
+
+	if (*p == '!' || *p == '^')
+	{
+		negate = true;
+		p++;
+	}
+
+	// A ']' straight after the '[' (or the negation) is part of the class.
+	do
+	{
+		if (!*p)
+		{
+			*pattern = p;
+			return false;
+		}
+
+		if (p[1] == '-' && p[2] && p[2] != ']')
+		{
+			matched |= (c >= p[0] && c <= p[2]);
+			p += 3;
+		}
+		else
+		{
+			matched |= (c == *p);
+			p++;
+		}
+	} while (*p != ']');
+
+	*pattern = p + 1;
+
+	return (matched != negate);
+}
+
+// fnmatch(3) with FNM_PATHNAME, plus "**", which matches across directories
+// ("**/" matching none at all, too).
+static Boolean PolicyGlobMatch(const char *pattern, const char *string)
+{
+	for (;;)
+	{
+		switch (*pattern)
+		{
+			case '\0':
+				return (*string == '\0');
+			case '*':
+				if (pattern[1] == '*')
+				{
+					pattern += 2;
+					if (*pattern == '/' && PolicyGlobMatch(pattern + 1, string))
+					{
+						return true;
+					}
+					for (;; string++)
+					{
+						if (PolicyGlobMatch(pattern, string))
+						{
+							return true;
+						}
+						if (!*string)
+						{
+							return false;
+						}
+					}
+				}
+				pattern++;
+				for (;; string++)
+				{
+					if (PolicyGlobMatch(pattern, string))
+					{
+						return true;
+					}
+					if (!*string || *string == '/')
+					{
+						return false;
+					}
+				}
+			case '?':
+				if (!*string || *string == '/')
+				{
+					return false;
+				}
+				pattern++;
+				string++;
+				break;
+			case '[':
+				if (!*string || *string == '/' ||
+					!PolicyClassMatch(&pattern, *string))
+				{
+					return false;
+				}
+				string++;
+				break;
+			case '\\':
+				if (pattern[1])
+				{
+					pattern++;
+				}
+				/* FALLTHROUGH */
+			default:
+				if (*pattern != *string)
+				{
+					return false;
+				}
+				pattern++;
+				string++;
+				break;
+		}
+	}
+}
+
+int PolicyRuleTypeFromString(const char *name)
+{
+	if (strcmp(name, "any") == 0)
+	{
+		return POLICY_RULE_ANY;
+	}
+	else if (strcmp(name, "file") == 0)
+	{
+		return POLICY_RULE_FILE;
+	}
+	else if (strcmp(name, "directory") == 0)
+	{
+		return POLICY_RULE_DIRECTORY;
+	}
+	else if (strcmp(name, "link") == 0)
+	{
+		return POLICY_RULE_LINK;
+	}
+
+	return -1;
+}
+
+static int PolicyRuleTypeOf(mode_t mode)
+{
+	if (S_ISREG(mode))
+	{
+		return POLICY_RULE_FILE;
+	}
+	else if (S_ISDIR(mode))
+	{
+		return POLICY_RULE_DIRECTORY;
+	}
+	else if (S_ISLNK(mode))
+	{
+		return POLICY_RULE_LINK;
+	}
+
+	return POLICY_RULE_ANY;
+}
+
+Boolean PolicyAddRule(struct policy_t *policy, const char *pattern, int type,
+					  const char *mode, const char *owner, const char *group)
+{
+	struct policy_rule_t *rules, *rule;
+	const char *end;
+	UInt32 value;
+	Boolean anchored = false;
+
+	// A leading '/' anchors the pattern at the root: it's matched against the
+	// path relative to it, even with no other '/' in it.
+	while (*pattern == '/')
+	{
+		anchored = true;
+		pattern++;
+	}
+
+	if (!*pattern)
+	{
+		LogError("Empty sub-rule pattern for %s\n", policy->path);
+		return false;
+	}
+
+	rules = realloc(policy->rules,
+					(policy->ruleCount + 1) * sizeof(struct policy_rule_t));
+	if (!rules)
+	{
+		LogError("Couldn't allocate sub-rule %s for %s\n", pattern,
+				 policy->path);
+		return false;
+	}
+	policy->rules = rules;
+
+	rule = &rules[policy->ruleCount];
+	memset(rule, 0, sizeof(struct policy_rule_t));
+	rule->type = type;
+	rule->owner = -1;
+	rule->group = -1;
+
+	if ((rule->pattern = strdup(pattern)) == NULL)
+	{
+		LogError("Couldn't allocate sub-rule %s for %s\n", pattern,
+				 policy->path);
+		return false;
+	}
+
+	if (mode && *mode)
+	{
+		if (!PolicyCompileMode(mode, rule->modeTable))
+		{
+			free(rule->pattern);
+			return false;
+		}
+		snprintf(rule->modeString, POLICY_MODE_STRING_LENGTH, "%s", mode);
+		rule->hasMode = true;
+	}
+
+	if (owner && *owner)
+	{
+		if (PolicyParseID(owner, &value))
+		{
+			rule->owner = value;
+		}
+		else
+		{
+			snprintf(rule->ownerName, POLICY_NAME_LENGTH, "%s", owner);
+			rule->owner = IDCacheLookupUser(rule->ownerName);
+		}
+	}
+
+	if (group && *group)
+	{
+		if (PolicyParseID(group, &value))
+		{
+			rule->group = value;
+		}
+		else
+		{
+			snprintf(rule->groupName, POLICY_NAME_LENGTH, "%s", group);
+			rule->group = IDCacheLookupGroup(rule->groupName);
+		}
+	}
+
+	// The literal tail runs back to the last character that means anything
+	// to the matcher.  A pattern that's all literal gets compared whole.
+	rule->matchName = (!anchored && strchr(rule->pattern, '/') == NULL);
+	end = rule->pattern + strlen(rule->pattern);
+	rule->suffix = end;
+	while (rule->suffix > rule->pattern &&
+		   !strchr("*?[]\\", rule->suffix[-1]))
+	{
+		rule->suffix--;
+	}
+	rule->suffixLength = end - rule->suffix;
+
+	policy->ruleTypes |= (type == POLICY_RULE_ANY) ? ~0U : (1U << type);
+	policy->ruleCount++;
+
+	LogV("Sub-rule %lu for %s: %s%s%s%s%s%s%s%s\n",
+		 (unsigned long)policy->ruleCount, policy->path, rule->pattern,
+		 (type == POLICY_RULE_FILE) ? " (files)" :
+		 (type == POLICY_RULE_DIRECTORY) ? " (directories)" :
+		 (type == POLICY_RULE_LINK) ? " (links)" : "",
+		 rule->hasMode ? " mode " : "", rule->modeString,
+		 (owner && *owner) ? " owner " : "", (owner && *owner) ? owner : "",
+		 (group && *group) ? " group " : "", (group && *group) ? group : "");
+
+	return true;
+}
+
+Boolean PolicyAddRuleFromString(struct policy_t *policy, const char *spec)
+{
+	char buffer[PATH_MAX], *pattern, *mode, *owner, *group = NULL;
+	int type = POLICY_RULE_ANY;
+
+	if (snprintf(buffer, PATH_MAX, "%s", spec) >= PATH_MAX)
+	{
+		LogError("Sub-rule too long: %s\n", spec);
+		return false;
+	}
+
+	pattern = buffer;
+	if (pattern[0] && pattern[1] == ':')
+	{
+		switch (pattern[0])
+		{
+			case 'f':
+				type = POLICY_RULE_FILE;
+				pattern += 2;
+				break;
+			case 'd':
+				type = POLICY_RULE_DIRECTORY;
+				pattern += 2;
+				break;
+			case 'l':
+				type = POLICY_RULE_LINK;
+				pattern += 2;
+				break;
+		}
+	}
+
+	// Modes have '='s of their own, so the pattern ends at the first one.
+	if ((mode = strchr(pattern, '=')) == NULL)
+	{
+		LogError("Sub-rule %s has no '=' (use pattern=mode[:owner[:group]])\n",
+				 spec);
+		return false;
+	}
+	*mode++ = '\0';
+
+	if ((owner = strchr(mode, ':')) != NULL)
+	{
+		*owner++ = '\0';
+		if ((group = strchr(owner, ':')) != NULL)
+		{
+			*group++ = '\0';
+		}
+	}
+
+	return PolicyAddRule(policy, pattern, type, mode, owner, group);
+}
+
+const struct policy_rule_t *PolicyMatchRule(const struct policy_t *policy,
+											const char *path, mode_t mode)
+{
+	const struct policy_rule_t *rule;
+	const char *relative, *name;
+	size_t rootLength = strlen(policy->path), relativeLength, nameLength, i;
+	int type = PolicyRuleTypeOf(mode);
+
+	if (type != POLICY_RULE_ANY && !(policy->ruleTypes & (1U << type)))
+	{
+		return NULL;
+	}
+
+	while (rootLength > 0 && policy->path[rootLength - 1] == '/')
+	{
+		rootLength--;
+	}
+
+	// The root itself only ever gets the root's settings.
+	if (strncmp(path, policy->path, rootLength) != 0 || path[rootLength] != '/')
+	{
+		return NULL;
+	}
+
+	relative = path + rootLength + 1;
+	relativeLength = strlen(relative);
+	name = strrchr(relative, '/');
+	name = name ? name + 1 : relative;
+	nameLength = relativeLength - (name - relative);
+
+	for (i = 0; i < policy->ruleCount; i++)
+	{
+		rule = &policy->rules[i];
+
+		if (rule->type != POLICY_RULE_ANY && rule->type != type)
+		{
+			continue;
+		}
+
+		if (rule->matchName)
+		{
+			if (nameLength < rule->suffixLength ||
+				memcmp(name + nameLength - rule->suffixLength, rule->suffix,
+					   rule->suffixLength) != 0 ||
+				!PolicyGlobMatch(rule->pattern, name))
+			{
+				continue;
+			}
+		}
+		else if (relativeLength < rule->suffixLength ||
+				 memcmp(relative + relativeLength - rule->suffixLength,
+						rule->suffix, rule->suffixLength) != 0 ||
+				 !PolicyGlobMatch(rule->pattern, relative))
+		{
+			continue;
+		}
+
+		return rule;
+	}
+
+	return NULL;
+}
+
+// Same pattern, type and settings, with names compared as in PolicyEqual().
+static Boolean PolicyRuleEqual(const struct policy_rule_t *a,
+							   const struct policy_rule_t *b)
+{
+	return (strcmp(a->pattern, b->pattern) == 0 &&
+			a->type == b->type &&
+			a->matchName == b->matchName &&
+			a->hasMode == b->hasMode &&
+			(!a->hasMode || strcmp(a->modeString, b->modeString) == 0) &&
+			strcmp(a->ownerName, b->ownerName) == 0 &&
+			strcmp(a->groupName, b->groupName) == 0 &&
+			(a->ownerName[0] || a->owner == b->owner) &&
+			(a->groupName[0] || a->group == b->group));
+}
+
+Boolean PolicyEqual(const struct policy_t *a, const struct policy_t *b)
+{
+	size_t i;
+
+	if (strcmp(a->path, b->path) != 0 ||
+		strcmp(a->configPath, b->configPath) != 0 ||
+		a->hasMode != b->hasMode ||
+		(a->hasMode && strcmp(a->modeString, b->modeString) != 0))
+	{
+		return false;
+	}
+
+	// Names are compared as names (they may not resolve to the same id until
+	// the next walk), numbers as numbers.
+	if (strcmp(a->ownerName, b->ownerName) != 0 ||
+		strcmp(a->groupName, b->groupName) != 0 ||
+		(!a->ownerName[0] && a->owner != b->owner) ||
+		(!a->groupName[0] && a->group != b->group))
+	{
+		return false;
+	}
+
+	if (a->ruleCount != b->ruleCount)
+	{
+		return false;
+	}
+
+	for (i = 0; i < a->ruleCount; i++)
+	{
+		if (!PolicyRuleEqual(&a->rules[i], &b->rules[i]))
+		{
+			return false;
+		}
+	}
+
+	return (a->applyACL == b->applyACL &&
+			a->force == b->force &&
+			a->create == b->create &&
+			a->followLinks == b->followLinks &&
+			a->prescan == b->prescan &&
+			a->cachedAttributes == b->cachedAttributes);
+}
+
+#ifdef __APPLE__
+
+// Puts acl in its external form in buffer (or a malloc'd buffer if it doesn't
+// fit, which the caller must free).  Returns NULL on failure.
+static void *PolicyCopyACLBlob(acl_t acl, void *buffer, ssize_t bufferSize,
+							   ssize_t *blobSize)
+{
+	void *blob = buffer;
+	ssize_t size = acl_size(acl);
+
+	if (size <= 0)
+	{
+		return NULL;
+	}
+
+	if (size > bufferSize)
+	{
+		if ((blob = malloc(size)) == NULL)
+		{
+			return NULL;
+		}
+	}
+
+	if ((*blobSize = acl_copy_ext_native(blob, acl, size)) <= 0)
+	{
+		if (blob != buffer)
+		{
+			free(blob);
+		}
+		return NULL;
+	}
+
+	return blob;
+}
+
+Boolean PolicyLoadACL(struct policy_t *policy)
+{
+	struct policy_acl_t *acl, *old;
+	struct stat info;
+
+	if ((acl = calloc(1, sizeof(struct policy_acl_t))) == NULL)
+	{
+		LogError("Couldn't allocate ACL for %s\n", policy->path);
+		return false;
+	}
+
+	acl->refCount = 1;
+
+	if (lstat(policy->path, &info) == 0)
+	{
+		acl->rootDevice = info.st_dev;
+		acl->rootInode = info.st_ino;
+		acl->rootCtime = STAT_CTIME(&info);
+	}
+
+	acl->acl = acl_get_file(policy->path, ACL_TYPE_EXTENDED);
+
+	if (!acl->acl)
+	{
+		LogError("Root folder (%s) doesn't have ACL set!\n", policy->path);
+		free(acl);
+		acl = NULL;
+	}
+	else if ((acl->blob = PolicyCopyACLBlob(acl->acl, NULL, 0,
+											&(acl->blobSize))) != NULL)
+	{
+		acl->hash = PolicyHashBytes(acl->blob, acl->blobSize,
+									POLICY_HASH_SEED);
+	}
+	else
+	{
+		LogError("Couldn't get external form of ACL on %s\n", policy->path);
+	}
+
+	// Walks that have the old one keep it until they're done with it.
+	pthread_mutex_lock(&policy->aclLock);
+	old = policy->acl;
+	policy->acl = acl;
+	pthread_mutex_unlock(&policy->aclLock);
+
+	PolicyReleaseACL(old);
+
+	return (acl != NULL);
+}
+
+void PolicyRefreshACL(struct policy_t *policy)
+{
+	struct stat info;
+
+	if (!policy->applyACL)
+	{
+		return;
+	}
+
+	if (lstat(policy->path, &info) != 0)
+	{
+		return;
+	}
+
+	// Only refreshes change policy->acl, and we're the only one going, so
+	// it can be read without aclLock.
+	if (!policy->acl ||
+		info.st_dev != policy->acl->rootDevice ||
+		info.st_ino != policy->acl->rootInode ||
+		STAT_CTIME(&info).tv_sec != policy->acl->rootCtime.tv_sec ||
+		STAT_CTIME(&info).tv_nsec != policy->acl->rootCtime.tv_nsec)
+	{
+		LogMV("Root %s changed, re-reading its ACL\n", policy->path);
+		PolicyLoadACL(policy);
+	}
+}
+
+struct policy_acl_t *PolicyRetainACL(struct policy_t *policy)
+{
+	struct policy_acl_t *acl;
+
+	pthread_mutex_lock(&policy->aclLock);
+	if ((acl = policy->acl) != NULL)
+	{
+		__sync_fetch_and_add(&acl->refCount, 1);
+	}
+	pthread_mutex_unlock(&policy->aclLock);
+
+	return acl;
+}
+
+void PolicyReleaseACL(struct policy_acl_t *acl)
+{
+	if (!acl || __sync_sub_and_fetch(&acl->refCount, 1) > 0)
+	{
+		return;
+	}
+
+	acl_free(acl->acl);
+	free(acl->blob);
+	free(acl);
+}
+
+Boolean PolicyACLMatches(const struct policy_acl_t *rootACL, acl_t acl)
+{
+#define ACL_BUFFER_SIZE 4096
+	char buffer[ACL_BUFFER_SIZE];
+	ssize_t blobSize = 0;
+	void *blob;
+	Boolean retVal;
+
+	if (!rootACL->blob)
+	{
+		// We couldn't work out the root's external form, so the best we can
+		// do is the old "has any ACL at all" check.
+		return (acl != NULL);
+	}
+
+	blob = PolicyCopyACLBlob(acl, buffer, ACL_BUFFER_SIZE, &blobSize);
+	if (!blob)
+	{
+		return false;
+	}
+
+	retVal = (blobSize == rootACL->blobSize &&
+			  PolicyHashBytes(blob, blobSize,
+							  POLICY_HASH_SEED) == rootACL->hash &&
+			  memcmp(blob, rootACL->blob, blobSize) == 0);
+
+	if (blob != buffer)
+	{
+		free(blob);
+	}
+
+	return retVal;
+#undef ACL_BUFFER_SIZE
+}
+
+#endif
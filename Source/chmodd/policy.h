@@ -0,0 +1,268 @@
+/*
+ *	policy.h -- a config dictionary compiled down to what the walker needs.
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#ifndef CHMODD_POLICY_H
+#define CHMODD_POLICY_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <pthread.h>
+#ifdef __APPLE__
+#include <sys/acl.h>
+#endif
+#include "chmodd.h"
+
+// One slot for every combination of the twelve permission bits.
+#define POLICY_MODE_TABLE_SIZE		010000
+#define POLICY_MODE_STRING_LENGTH	21
+#define POLICY_NAME_LENGTH			256
+
+// What kind of entry a sub-rule applies to.
+#define POLICY_RULE_ANY				0
+#define POLICY_RULE_FILE			1
+#define POLICY_RULE_DIRECTORY		2
+#define POLICY_RULE_LINK			3
+
+// A sub-rule: for the entries below the root that match pattern (and type),
+// whichever of mode/owner/group it gives is used instead of the root's.
+// Patterns without a '/' are matched against the entry's name, anywhere in
+// the tree; patterns with one against its path relative to the root, where
+// "**" also matches across directories.
+struct policy_rule_t {
+	char			*pattern;
+	int				type;
+	Boolean			matchName;
+
+	// The literal end of the pattern (".sh" for "*.sh"), so most entries can
+	// be turned away with a memcmp before the pattern is looked at.
+	const char		*suffix;
+	size_t			suffixLength;
+
+	// As for the root, below.
+	Boolean			hasMode;
+	char			modeString[POLICY_MODE_STRING_LENGTH];
+	mode_t			modeTable[2][POLICY_MODE_TABLE_SIZE];
+	uid_t			owner;
+	gid_t			group;
+	char			ownerName[POLICY_NAME_LENGTH];
+	char			groupName[POLICY_NAME_LENGTH];
+};
+
+#ifdef __APPLE__
+// The root's ACL as it was read at one point, with its external form and a
+// hash of that so children can be compared against it cheaply.  It never
+// changes once made: when the root's ACL is read again a new one replaces it,
+// and walks still using the old one keep it alive with a reference.
+struct policy_acl_t {
+	int				refCount;
+	acl_t			acl;
+	void			*blob;
+	ssize_t			blobSize;
+	UInt64			hash;
+	dev_t			rootDevice;
+	ino_t			rootInode;
+	struct timespec	rootCtime;
+};
+#endif
+
+// Everything applyPermissionsToFolder() needs from a config, decoded once when
+// the stream is created rather than for every file we visit.
+struct policy_t {
+	int				refCount;
+
+	// Held while a walk refreshes the ids, ACL and hash below, since a
+	// background rescan can be walking the same root as an event.
+	pthread_mutex_t	refreshLock;
+
+	// Absolute path of the root, and the _path string as it was configured
+	// (which is what we try to move the root back to if it goes away).
+	char			path[PATH_MAX];
+	char			configPath[PATH_MAX];
+
+	// The result of setmode()/getmode() for every possible starting mode,
+	// split by whether the item is a directory (so "X" still works).
+	Boolean			hasMode;
+	char			modeString[POLICY_MODE_STRING_LENGTH];
+	mode_t			modeTable[2][POLICY_MODE_TABLE_SIZE];
+
+	// -1 when the config doesn't enforce them.  When they were given as names
+	// the names are kept, so the ids can be looked up again when the id cache
+	// is refreshed.
+	uid_t			owner;
+	gid_t			group;
+	char			ownerName[POLICY_NAME_LENGTH];
+	char			groupName[POLICY_NAME_LENGTH];
+	unsigned long	idGeneration;
+
+	// ACL of the root, read once per walk (and only again if the root itself
+	// changed) and handed to every child.  NULL if the root doesn't have one.
+	// Only swapped under aclLock; walks take it with PolicyRetainACL().
+	Boolean			applyACL;
+#ifdef __APPLE__
+	struct policy_acl_t	*acl;
+	pthread_mutex_t	aclLock;
+#endif
+
+	// Changes whenever anything that decides a file's outcome does; the
+	// verified index only trusts what it recorded under the same hash.
+	UInt64			hash;
+
+	Boolean			force;
+	Boolean			create;
+	Boolean			followLinks;
+	Boolean			prescan;
+
+	// Its events picked up where the last run's left off (see history.h), so
+	// the verified index can go by what that run found too.
+	Boolean			resumed;
+
+	// Set when the root stops being watched under this policy, because it was
+	// changed or taken out of the config (see RescanRemovePolicy()).  Walks
+	// queued for it are dropped, and any going give up, so nothing applies
+	// the old settings after the new ones.
+	volatile Boolean	stopped;
+
+	// Walks may take attributes the kernel has cached rather than asking the
+	// server again (see WalkStat()).
+	Boolean			cachedAttributes;
+
+	// Open on the root when _force is set, so we can find it if it's moved.
+	int				rootDescriptor;
+
+	// The latency of the root's own stream (see latency.h), made when it's
+	// watched.  NULL when it shares a stream with other roots, or isn't
+	// watched at all.
+	struct latency_t	*latency;
+
+	// Roots configured inside this one (sorted), which walks leave to their
+	// own policies.  Only filled in when roots share a stream (-s).
+	char			**nestedRoots;
+	size_t			nestedCount;
+
+	// Sub-rules, in the order they were configured; the first one an entry
+	// matches is the one that applies to it.  ruleTypes has a bit set for
+	// every type some rule covers, so entries no rule could match skip the
+	// lot.
+	struct policy_rule_t	*rules;
+	size_t			ruleCount;
+	UInt32			ruleTypes;
+};
+
+// What a refresh can change about a policy (owners and groups looked up by
+// name, and so the hash), as it was when one walk started.  Walks go by this
+// rather than the policy, which another walk of the same root can refresh
+// while they're going: entries checked against one owner mustn't be recorded
+// as verified under the hash of another.
+struct policy_ids_t {
+	uid_t			owner;
+	gid_t			group;
+};
+
+struct policy_snapshot_t {
+	struct policy_ids_t	root;
+	struct policy_ids_t	*rules;		// One per sub-rule, NULL if there are none
+	UInt64			hash;
+};
+
+// Returns a new policy for the root at path with nothing enforced.
+struct policy_t *PolicyCreate(const char *path, const char *configPath);
+
+// Reference counting, shaped to be used as FSEventStreamContext callbacks.
+const void *PolicyRetain(const void *info);
+void PolicyRelease(const void *info);
+
+// Compiles a chmod(1) style mode string into the policy's mode table.  Returns
+// false (and leaves the mode unenforced) if the string can't be parsed.
+Boolean PolicySetMode(struct policy_t *policy, const char *modeString);
+
+// Sets the owner/group from a string that's either a number or a name.
+void PolicySetOwner(struct policy_t *policy, const char *owner);
+void PolicySetGroup(struct policy_t *policy, const char *group);
+
+// Adds a sub-rule after any already there.  type is POLICY_RULE_*; mode, owner
+// and group may each be NULL to leave the root's in force.  Returns false
+// (adding nothing) if the pattern or mode can't be compiled.
+Boolean PolicyAddRule(struct policy_t *policy, const char *pattern, int type,
+					  const char *mode, const char *owner, const char *group);
+
+// Adds a sub-rule written as [f:|d:|l:]pattern=[mode][:owner[:group]], which
+// is how they're given on the command line (-R).
+Boolean PolicyAddRuleFromString(struct policy_t *policy, const char *spec);
+
+// Returns the POLICY_RULE_* type for a name ("file", "directory", "link" or
+// "any"), or -1.
+int PolicyRuleTypeFromString(const char *name);
+
+// Returns the first sub-rule that applies to the entry at path (which is
+// under policy's root) with st_mode of mode, or NULL if none do.
+const struct policy_rule_t *PolicyMatchRule(const struct policy_t *policy,
+											const char *path, mode_t mode);
+
+// Looks owner/group names up again if the id cache has been refreshed since we
+// last did.  Cheap enough to call at the start of every walk.
+void PolicyRefreshIDs(struct policy_t *policy);
+
+// Recomputes policy->hash from the compiled policy.
+void PolicyUpdateHash(struct policy_t *policy);
+
+// Fills snapshot in from policy, for a walk about to start; under refreshLock
+// once the policy is in use.  Returns false if there's no memory for it.
+Boolean PolicyTakeSnapshot(const struct policy_t *policy,
+						   struct policy_snapshot_t *snapshot);
+void PolicyFreeSnapshot(struct policy_snapshot_t *snapshot);
+
+// Records that path is a root of its own inside policy's root.
+void PolicyAddNestedRoot(struct policy_t *policy, const char *path);
+
+// Returns true if path is one of policy's nested roots.
+Boolean PolicyIsNestedRoot(const struct policy_t *policy, const char *path);
+
+// Returns true if a and b were configured the same way (same root, same
+// settings), so a stream built for one will do for the other.
+Boolean PolicyEqual(const struct policy_t *a, const struct policy_t *b);
+
+#ifdef __APPLE__
+// Reads the root's ACL so it can be applied to children.  Returns false if the
+// root doesn't have one.  Walks may be using the old one, so this must be
+// called under refreshLock once the policy is in use.
+Boolean PolicyLoadACL(struct policy_t *policy);
+
+// Re-reads the root's ACL only if the root has been replaced or its metadata
+// changed since it was last read.  Also under refreshLock.
+void PolicyRefreshACL(struct policy_t *policy);
+
+// Returns the root's ACL, retained, or NULL if it doesn't have one.  It stays
+// good until PolicyReleaseACL(), however many times the root's ACL is read
+// again in the meantime.
+struct policy_acl_t *PolicyRetainACL(struct policy_t *policy);
+void PolicyReleaseACL(struct policy_acl_t *acl);
+
+// Returns true if acl is exactly rootACL.
+Boolean PolicyACLMatches(const struct policy_acl_t *rootACL, acl_t acl);
+#endif
+
+// The mode an item with st_mode of current should end up with, from a
+// compiled mode table (modeTable[0] of a policy or rule).
+static inline mode_t PolicyComputeModeFromTable(const mode_t *table,
+												mode_t current)
+{
+	return (current & ~07777) |
+		table[(S_ISDIR(current) ? POLICY_MODE_TABLE_SIZE : 0) +
+			  (current & 07777)];
+}
+
+static inline mode_t PolicyComputeMode(const struct policy_t *policy,
+									   mode_t current)
+{
+	return PolicyComputeModeFromTable(policy->modeTable[0], current);
+}
+
+#endif
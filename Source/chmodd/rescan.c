@@ -0,0 +1,449 @@
+/*
+ *	rescan.c -- checking every root again on demand (SIGUSR1/SIGUSR2), and
+ *	the other walks done in the background.
+ *
+ *	A rescan is for after something like a restore, which can go on without
+ *	us seeing all of it.  It runs on its own thread so events keep being
+ *	handled, and it's a full walk of each root: a restored file's mode or
+ *	owner changes its own ctime but not its directory's, so the verified index
+ *	can't tell which parts were touched.  The budget keeps it out of the way.
+ *
+ *	The same thread does the other walks nobody is waiting on: prescans, and
+ *	the full walks asked for when events were dropped.  Those go ahead of a
+ *	rescan, and everything here runs on the I/O budget (see budget.h).
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rescan.h"
+#include "walk.h"
+#include "budget.h"
+
+struct rescan_root_t {
+	struct rescan_root_t	*next;
+	struct policy_t			*policy;
+};
+
+// A walk of one path, queued by RescanRequestWalk().
+struct rescan_walk_t {
+	struct rescan_walk_t	*next;
+	struct policy_t			*policy;
+	char					*path;
+	Boolean					force;
+};
+
+static struct {
+	pthread_mutex_t			lock;
+	pthread_cond_t			wake;
+	struct rescan_root_t	*roots;
+	struct rescan_walk_t	*walks;
+	struct rescan_walk_t	**walksTail;
+	pthread_t				thread;
+	Boolean					started;
+	Boolean					requested;
+	Boolean					quit;
+	struct rescan_status_t	status;
+} rescan = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL,
+	&rescan.walks };
+
+static void RescanFreeWalk(struct rescan_walk_t *walk)
+{
+	PolicyRelease(walk->policy);
+	free(walk->path);
+	free(walk);
+}
+
+void RescanAddPolicy(struct policy_t *policy)
+{
+	struct rescan_root_t *root = malloc(sizeof(struct rescan_root_t));
+
+	if (!root)
+	{
+		LogError("Couldn't allocate rescan entry for %s\n", policy->path);
+		return;
+	}
+
+	root->policy = (struct policy_t *)PolicyRetain(policy);
+
+	pthread_mutex_lock(&rescan.lock);
+	root->next = rescan.roots;
+	rescan.roots = root;
+	pthread_mutex_unlock(&rescan.lock);
+}
+
+void RescanRemovePolicy(struct policy_t *policy, struct policy_t *replacement)
+{
+	struct rescan_root_t **link, *root;
+	struct rescan_walk_t **walkLink, *walk, *dropped = NULL;
+	unsigned long handedOver = 0;
+
+	if (!replacement)
+	{
+		policy->stopped = true;
+		__sync_synchronize();
+	}
+
+	pthread_mutex_lock(&rescan.lock);
+
+	for (link = &rescan.roots; (root = *link) != NULL; link = &root->next)
+	{
+		if (root->policy == policy)
+		{
+			*link = root->next;
+			break;
+		}
+	}
+
+	for (walkLink = &rescan.walks; (walk = *walkLink) != NULL; )
+	{
+		if (walk->policy != policy)
+		{
+			walkLink = &walk->next;
+		}
+		else if (replacement)
+		{
+			walk->policy = (struct policy_t *)PolicyRetain(replacement);
+			handedOver++;
+			walkLink = &walk->next;
+		}
+		else
+		{
+			*walkLink = walk->next;
+			walk->next = dropped;
+			dropped = walk;
+			rescan.status.walksQueued--;
+		}
+	}
+	rescan.walksTail = walkLink;
+
+	pthread_mutex_unlock(&rescan.lock);
+
+	if (root)
+	{
+		PolicyRelease(root->policy);
+		free(root);
+	}
+
+	// The references the handed over walks held.
+	for (; handedOver > 0; handedOver--)
+	{
+		PolicyRelease(policy);
+	}
+
+	for (; dropped; dropped = walk)
+	{
+		walk = dropped->next;
+		LogV("Dropped background walk of %s, its root was reconfigured\n",
+			 dropped->path);
+		RescanFreeWalk(dropped);
+	}
+}
+
+// Takes a retained copy of the roots, so they can be walked without the lock.
+// Returns the count (and NULL if there are none, or no memory).
+static struct policy_t **RescanCopyRootsLocked(unsigned long *count)
+{
+	struct policy_t **policies;
+	struct rescan_root_t *root;
+	unsigned long i = 0;
+
+	for (root = rescan.roots; root; root = root->next)
+	{
+		i++;
+	}
+
+	*count = 0;
+
+	if (i == 0 || (policies = malloc(i * sizeof(*policies))) == NULL)
+	{
+		return NULL;
+	}
+
+	for (root = rescan.roots; root; root = root->next)
+	{
+		policies[(*count)++] = (struct policy_t *)PolicyRetain(root->policy);
+	}
+
+	return policies;
+}
+
+static void *RescanThread(void *context)
+{
+	struct policy_t **policies;
+	struct rescan_walk_t *walk;
+	unsigned long count, i;
+	int changed;
+
+	BudgetEnterBackground();
+
+	pthread_mutex_lock(&rescan.lock);
+
+	for (;;)
+	{
+		while (!rescan.requested && !rescan.walks && !rescan.quit)
+		{
+			pthread_cond_wait(&rescan.wake, &rescan.lock);
+		}
+
+		// A walk given up on for BudgetStop() is back on the queue, and
+		// would only be given up on again.
+		if (rescan.quit || BudgetIsStopping())
+		{
+			break;
+		}
+
+		if ((walk = rescan.walks) != NULL)
+		{
+			if ((rescan.walks = walk->next) == NULL)
+			{
+				rescan.walksTail = &rescan.walks;
+			}
+			rescan.status.walksQueued--;
+			rescan.status.walkRunning = true;
+
+			pthread_mutex_unlock(&rescan.lock);
+
+			LogV("Background walk of %s%s\n", walk->path,
+				 walk->force ? " (full)" : "");
+			if (applyPermissionsToFolder(walk->path, walk->policy,
+										 walk->force) < 0)
+			{
+				LogError("Background walk: couldn't walk %s\n", walk->path);
+			}
+
+			pthread_mutex_lock(&rescan.lock);
+			rescan.status.walkRunning = false;
+
+			if (BudgetIsStopping())
+			{
+				// It gave up partway, so it still needs doing; RescanStop()
+				// will find it back on the queue.
+				if ((walk->next = rescan.walks) == NULL)
+				{
+					rescan.walksTail = &walk->next;
+				}
+				rescan.walks = walk;
+				rescan.status.walksQueued++;
+				continue;
+			}
+
+			rescan.status.walksDone++;
+			pthread_mutex_unlock(&rescan.lock);
+
+			RescanFreeWalk(walk);
+
+			pthread_mutex_lock(&rescan.lock);
+			continue;
+		}
+
+		rescan.requested = false;
+		policies = RescanCopyRootsLocked(&count);
+
+		rescan.status.running = true;
+		rescan.status.rootsDone = 0;
+		rescan.status.rootsTotal = count;
+		rescan.status.filesChanged = 0;
+
+		for (i = 0; i < count && !rescan.quit; i++)
+		{
+			pthread_mutex_unlock(&rescan.lock);
+
+			LogV("Rescan: checking %s (%lu of %lu)\n", policies[i]->path,
+				 i + 1, count);
+			changed = applyPermissionsToFolder(policies[i]->path,
+											   policies[i], true);
+
+			pthread_mutex_lock(&rescan.lock);
+
+			rescan.status.rootsDone++;
+			if (changed > 0)
+			{
+				rescan.status.filesChanged += changed;
+			}
+			else if (changed < 0)
+			{
+				LogError("Rescan: couldn't walk %s\n", policies[i]->path);
+			}
+		}
+
+		LogV("Rescan: %s, %lu of %lu root%s checked, %lu change%s made.\n",
+			 (i < count) ? "stopped" : "done", rescan.status.rootsDone,
+			 count, (count != 1) ? "s" : "", rescan.status.filesChanged,
+			 (rescan.status.filesChanged != 1) ? "s" : "");
+
+		rescan.status.running = false;
+		rescan.status.completed++;
+
+		pthread_mutex_unlock(&rescan.lock);
+
+		for (i = 0; i < count; i++)
+		{
+			PolicyRelease(policies[i]);
+		}
+		free(policies);
+
+		pthread_mutex_lock(&rescan.lock);
+	}
+
+	pthread_mutex_unlock(&rescan.lock);
+
+	return NULL;
+}
+
+// Starts the thread if it isn't going yet.  Returns false if it can't be.
+static Boolean RescanStartLocked(void)
+{
+	sigset_t allSignals, oldSignals;
+	int error;
+
+	if (rescan.started)
+	{
+		return true;
+	}
+
+	// Signals are for the run loop, so the thread starts with them blocked.
+	sigfillset(&allSignals);
+	pthread_sigmask(SIG_SETMASK, &allSignals, &oldSignals);
+	error = pthread_create(&rescan.thread, NULL, RescanThread, NULL);
+	pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+
+	if (error != 0)
+	{
+		LogError("Couldn't start rescan thread: %s\n", strerror(error));
+		return false;
+	}
+
+	rescan.started = true;
+
+	return true;
+}
+
+void RescanRequestWalk(struct policy_t *policy, const char *path,
+					   Boolean force)
+{
+	struct rescan_walk_t *walk;
+
+	pthread_mutex_lock(&rescan.lock);
+
+	// The same walk asked for twice (an overflow during a prescan, say) only
+	// needs doing once.
+	for (walk = rescan.walks; walk; walk = walk->next)
+	{
+		if (walk->policy == policy && strcmp(walk->path, path) == 0)
+		{
+			walk->force |= force;
+			pthread_mutex_unlock(&rescan.lock);
+			return;
+		}
+	}
+
+	if ((walk = calloc(1, sizeof(struct rescan_walk_t))) == NULL ||
+		(walk->path = strdup(path)) == NULL)
+	{
+		LogError("Couldn't queue background walk of %s\n", path);
+		free(walk);
+		pthread_mutex_unlock(&rescan.lock);
+		return;
+	}
+
+	if (!RescanStartLocked())
+	{
+		free(walk->path);
+		free(walk);
+		pthread_mutex_unlock(&rescan.lock);
+		return;
+	}
+
+	walk->policy = (struct policy_t *)PolicyRetain(policy);
+	walk->force = force;
+	*rescan.walksTail = walk;
+	rescan.walksTail = &walk->next;
+	rescan.status.walksQueued++;
+
+	pthread_cond_signal(&rescan.wake);
+
+	pthread_mutex_unlock(&rescan.lock);
+}
+
+void RescanRequest(void)
+{
+	pthread_mutex_lock(&rescan.lock);
+
+	if (rescan.status.running || rescan.requested)
+	{
+		rescan.status.merged++;
+		LogV("Rescan: already running (%lu of %lu roots checked), not "
+			 "starting another.\n", rescan.status.rootsDone,
+			 rescan.status.rootsTotal);
+		pthread_mutex_unlock(&rescan.lock);
+		return;
+	}
+
+	if (!RescanStartLocked())
+	{
+		pthread_mutex_unlock(&rescan.lock);
+		return;
+	}
+
+	rescan.requested = true;
+	pthread_cond_signal(&rescan.wake);
+
+	pthread_mutex_unlock(&rescan.lock);
+}
+
+void RescanStop(void (*unfinished)(struct policy_t *policy, const char *path))
+{
+	struct rescan_root_t *root;
+	struct rescan_walk_t *walk;
+	Boolean started;
+
+	// Whatever walk is going gives up as soon as it can.
+	BudgetStop();
+
+	pthread_mutex_lock(&rescan.lock);
+	rescan.quit = true;
+	started = rescan.started;
+	pthread_cond_signal(&rescan.wake);
+	pthread_mutex_unlock(&rescan.lock);
+
+	if (started)
+	{
+		pthread_join(rescan.thread, NULL);
+	}
+
+	pthread_mutex_lock(&rescan.lock);
+	while ((root = rescan.roots) != NULL)
+	{
+		rescan.roots = root->next;
+		PolicyRelease(root->policy);
+		free(root);
+	}
+	while ((walk = rescan.walks) != NULL)
+	{
+		rescan.walks = walk->next;
+		if (unfinished)
+		{
+			unfinished(walk->policy, walk->path);
+		}
+		RescanFreeWalk(walk);
+	}
+	rescan.walksTail = &rescan.walks;
+	rescan.status.walksQueued = 0;
+	rescan.started = false;
+	pthread_mutex_unlock(&rescan.lock);
+}
+
+void RescanGetStatus(struct rescan_status_t *status)
+{
+	pthread_mutex_lock(&rescan.lock);
+	*status = rescan.status;
+	pthread_mutex_unlock(&rescan.lock);
+}
@@ -0,0 +1,57 @@
+/*
+ *	rescan.h -- checking every root again on demand (SIGUSR1/SIGUSR2), and
+ *	the other walks done in the background.
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#ifndef CHMODD_RESCAN_H
+#define CHMODD_RESCAN_H
+
+#include "chmodd.h"
+#include "policy.h"
+
+struct rescan_status_t {
+	Boolean					running;
+	unsigned long			completed;	// Rescans finished since launch
+	unsigned long			merged;		// Requests folded into a running one
+	unsigned long			rootsDone;	// Of the current (or last) rescan
+	unsigned long			rootsTotal;
+	unsigned long			filesChanged;
+
+	// Single walks queued with RescanRequestWalk().
+	Boolean					walkRunning;
+	unsigned long			walksQueued;
+	unsigned long			walksDone;
+};
+
+// Adds (retaining) or removes a root for rescans to cover.  A root removed
+// with a replacement (the same config, reloaded) hands its queued walks over
+// to it.  Without one, the policy is stopped (see policy.h): its queued walks
+// are dropped, and any walk of it still going gives up.
+void RescanAddPolicy(struct policy_t *policy);
+void RescanRemovePolicy(struct policy_t *policy, struct policy_t *replacement);
+
+// Starts a rescan of every root on the background thread.  If one is already
+// running, the request is merged into it instead.
+void RescanRequest(void);
+
+// Queues a walk of path under policy (retaining it) for the background
+// thread, ahead of any rescan; force is as for applyPermissionsToFolder().
+// For prescans and the full walks asked for after events were dropped, which
+// nobody is waiting on.
+void RescanRequestWalk(struct policy_t *policy, const char *path,
+					   Boolean force);
+
+// Stops the background thread, giving up on the walk it's on (see
+// BudgetStop()), and forgets every root.  Each walk that never got done,
+// queued or given up on, is handed to unfinished (if it isn't NULL) first.
+void RescanStop(void (*unfinished)(struct policy_t *policy, const char *path));
+
+void RescanGetStatus(struct rescan_status_t *status);
+
+#endif
@@ -0,0 +1,455 @@
+/*
+ *	stream.c -- event streams for platforms without FSEvents.
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#ifndef __APPLE__
+
+#include <sys/types.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "stream.h"
+#include "coalesce.h"
+#include "latency.h"
+#include "work.h"
+
+double StreamNow(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+struct stream_t *StreamCreate(struct policy_t *policy,
+							  struct dispatch_t *dispatch,
+							  const char *name)
+{
+	struct stream_t *stream = calloc(1, sizeof(struct stream_t));
+
+	if (!stream)
+	{
+		LogError("Couldn't allocate %s stream for %s\n", name,
+				 policy ? policy->path : "every root");
+		return NULL;
+	}
+
+	if (policy)
+	{
+		if (!policy->latency)
+		{
+			policy->latency = LatencyCreate(policy->path);
+		}
+		stream->policy = (struct policy_t *)PolicyRetain(policy);
+		stream->latency = policy->latency;
+	}
+	else
+	{
+		if (!dispatch->latency)
+		{
+			dispatch->latency = LatencyCreate("every root");
+		}
+		stream->dispatch = (struct dispatch_t *)DispatchRetain(dispatch);
+		stream->latency = dispatch->latency;
+	}
+	stream->name = name;
+	stream->fd = -1;
+
+	if (!stream->latency)
+	{
+		StreamReleaseOne(stream);
+		return NULL;
+	}
+
+	return stream;
+}
+
+size_t StreamRootCount(const struct stream_t *stream)
+{
+	return stream->dispatch ? stream->dispatch->policyCount : 1;
+}
+
+struct policy_t *StreamRootAt(const struct stream_t *stream, size_t index)
+{
+	return stream->dispatch ? stream->dispatch->policies[index] :
+		stream->policy;
+}
+
+struct policy_t *StreamPolicyForPath(const struct stream_t *stream,
+									 const char *path)
+{
+	size_t rootLength;
+
+	if (stream->dispatch)
+	{
+		return DispatchLookup(stream->dispatch, path);
+	}
+
+	rootLength = strlen(stream->policy->path);
+
+	if (rootLength == 1 ||
+		(strncmp(path, stream->policy->path, rootLength) == 0 &&
+		 (path[rootLength] == '\0' || path[rootLength] == '/')))
+	{
+		return stream->policy;
+	}
+
+	return NULL;
+}
+
+int StreamSourceFromString(const char *name)
+{
+	if (strcmp(name, "inotify") == 0)
+	{
+		return STREAM_SOURCE_INOTIFY;
+	}
+	else if (strcmp(name, "fanotify") == 0)
+	{
+		return STREAM_SOURCE_FANOTIFY;
+	}
+
+	return -1;
+}
+
+struct stream_t *StreamCreateFromPolicy(struct policy_t *policy)
+{
+	if (globals->eventSource == STREAM_SOURCE_FANOTIFY)
+	{
+		return FanotifyStreamCreate(policy, NULL);
+	}
+
+	return InotifyStreamCreate(policy, NULL);
+}
+
+struct stream_t *StreamCreateShared(struct dispatch_t *dispatch)
+{
+	if (globals->eventSource == STREAM_SOURCE_FANOTIFY)
+	{
+		return FanotifyStreamCreate(NULL, dispatch);
+	}
+
+	return InotifyStreamCreate(NULL, dispatch);
+}
+
+void StreamSchedule(struct stream_t *stream)
+{
+	stream->next = globals->streamList;
+	globals->streamList = stream;
+}
+
+static void StreamRequest(struct stream_t *stream, const char *path,
+						  Boolean recursive, Boolean entry)
+{
+	struct stream_request_t *last = NULL;
+	double now, latency;
+
+	stream->events++;
+
+	if (stream->pendingCount > 0)
+	{
+		last = &(stream->pending[stream->pendingCount - 1]);
+	}
+
+	// A busy directory sends the same thing over and over; don't keep a copy
+	// of every one for the coalescer to throw away.
+	if (!(last && (last->recursive || !recursive) &&
+		  (!last->entry || entry) && strcmp(last->path, path) == 0))
+	{
+		if (stream->pendingCount == stream->pendingCapacity)
+		{
+			size_t capacity = stream->pendingCapacity ?
+				stream->pendingCapacity * 2 : 32;
+			struct stream_request_t *pending;
+
+			pending = realloc(stream->pending,
+							  capacity * sizeof(struct stream_request_t));
+			if (!pending)
+			{
+				LogError("%s: %s\n", path, strerror(ENOMEM));
+				return;
+			}
+
+			stream->pending = pending;
+			stream->pendingCapacity = capacity;
+		}
+
+		if ((stream->pending[stream->pendingCount].path = strdup(path)) == NULL)
+		{
+			LogError("%s: %s\n", path, strerror(ENOMEM));
+			return;
+		}
+
+		stream->pending[stream->pendingCount].recursive = recursive;
+		stream->pending[stream->pendingCount].entry = entry;
+		stream->pendingCount++;
+	}
+
+	if (stream->deadline == 0)
+	{
+		now = StreamNow();
+		latency = LatencyCurrent(stream->latency);
+
+		if (latency < LATENCY_NO_DEFER && now - stream->lastFlush >= latency)
+		{
+			stream->deadline = now;
+		}
+		else if (latency < LATENCY_NO_DEFER)
+		{
+			stream->deadline = stream->lastFlush + latency;
+		}
+		else
+		{
+			stream->deadline = now + latency;
+		}
+	}
+}
+
+void StreamRequestWalk(struct stream_t *stream, const char *path,
+					   Boolean recursive)
+{
+	StreamRequest(stream, path, recursive, false);
+}
+
+void StreamRequestEntry(struct stream_t *stream, const char *path,
+						Boolean recursive)
+{
+	StreamRequest(stream, path, recursive, true);
+}
+
+// Hands everything that's pending to the workers, the way HandleEvents()
+// does a batch.  A shared stream's batch is split up by policy first:
+// coalescing across roots could let an outer root's walk swallow a nested
+// root's.
+static void StreamFlush(struct stream_t *stream)
+{
+	struct coalesce_request_t *requests;
+	struct policy_t **policies;
+	size_t i, j, requestCount = stream->pendingCount;
+	unsigned long events = stream->events;
+
+	stream->deadline = 0;
+	stream->lastFlush = StreamNow();
+	stream->events = 0;
+
+	if (requestCount == 0)
+	{
+		return;
+	}
+
+	requests = calloc(requestCount, sizeof(struct coalesce_request_t));
+	policies = calloc(requestCount, sizeof(struct policy_t *));
+	if (requests && policies)
+	{
+		for (i = 0; i < requestCount; i++)
+		{
+			policies[i] = stream->dispatch ?
+				DispatchLookup(stream->dispatch, stream->pending[i].path) :
+				stream->policy;
+		}
+
+		for (i = 0; i < stream->pendingCount; i++)
+		{
+			struct policy_t *policy = policies[i];
+
+			if (!policy)
+			{
+				continue;
+			}
+
+			for (j = i, requestCount = 0; j < stream->pendingCount; j++)
+			{
+				if (policies[j] == policy)
+				{
+					requests[requestCount].path = stream->pending[j].path;
+					requests[requestCount].recursive =
+						stream->pending[j].recursive;
+					requests[requestCount].entry = stream->pending[j].entry;
+					requestCount++;
+					policies[j] = NULL;
+				}
+			}
+
+			requestCount = CoalesceRequests(requests, requestCount);
+
+			// inotify and fanotify events have no ids, so each eventId is 0.
+			for (j = 0; j < requestCount; j++)
+			{
+				WorkEnqueue(policy, stream->dispatch, requests[j].path,
+							requests[j].recursive, requests[j].entry,
+							requests[j].eventId);
+			}
+		}
+	}
+	else
+	{
+		LogError("Couldn't allocate %lu event requests\n",
+				 (unsigned long)requestCount);
+	}
+
+	free(requests);
+	free(policies);
+
+	for (i = 0; i < stream->pendingCount; i++)
+	{
+		free(stream->pending[i].path);
+	}
+
+	stream->pendingCount = 0;
+
+	LatencyBatch(stream->latency, events);
+}
+
+void StreamRootMoved(struct policy_t *policy)
+{
+	char link[64], newPath[PATH_MAX];
+	ssize_t length;
+
+	if (policy->rootDescriptor == -1)
+	{
+		return;
+	}
+
+	// There's no F_GETPATH here, but /proc knows where the descriptor went.
+	snprintf(link, sizeof(link), "/proc/self/fd/%d", policy->rootDescriptor);
+
+	if ((length = readlink(link, newPath, PATH_MAX - 1)) == -1)
+	{
+		LogError("%s: %s\n", link, strerror(errno));
+		return;
+	}
+
+	newPath[length] = '\0';
+
+	if (strcmp(newPath, policy->configPath) != 0)
+	{
+		LogV("Root %s was moved to %s, moving it back.\n", policy->configPath,
+			 newPath);
+		if (rename(newPath, policy->configPath) != 0)
+		{
+			LogError("rename %s: %s\n", newPath, strerror(errno));
+		}
+	}
+}
+
+void StreamRunOnce(double timeout)
+{
+	struct stream_t *stream;
+	struct pollfd *fds;
+	nfds_t i, count = 0;
+	double now = StreamNow(), wait = timeout;
+
+	for (stream = globals->streamList; stream; stream = stream->next)
+	{
+		count++;
+
+		if (stream->deadline != 0 && stream->deadline - now < wait)
+		{
+			wait = stream->deadline - now;
+		}
+	}
+
+	if (count == 0)
+	{
+		return;
+	}
+
+	if ((fds = calloc(count, sizeof(struct pollfd))) == NULL)
+	{
+		return;
+	}
+
+	for (i = 0, stream = globals->streamList; stream; stream = stream->next, i++)
+	{
+		fds[i].fd = stream->fd;
+		fds[i].events = POLLIN;
+	}
+
+	if (wait < 0)
+	{
+		wait = 0;
+	}
+
+	// A signal just cuts the wait short; the caller looks at the flags.
+	if (poll(fds, count, (int)(wait * 1000 + 0.5)) > 0)
+	{
+		for (i = 0, stream = globals->streamList; stream;
+			 stream = stream->next, i++)
+		{
+			if (fds[i].revents & POLLIN)
+			{
+				stream->read(stream);
+			}
+		}
+	}
+
+	free(fds);
+
+	now = StreamNow();
+
+	for (stream = globals->streamList; stream; stream = stream->next)
+	{
+		if (stream->deadline != 0 && stream->deadline <= now)
+		{
+			StreamFlush(stream);
+		}
+	}
+}
+
+void StreamReleaseOne(struct stream_t *stream)
+{
+	size_t i;
+
+	if (stream->release && stream->context)
+	{
+		stream->release(stream);
+	}
+
+	if (stream->fd != -1)
+	{
+		close(stream->fd);
+	}
+
+	for (i = 0; i < stream->pendingCount; i++)
+	{
+		free(stream->pending[i].path);
+	}
+
+	free(stream->pending);
+	if (stream->policy)
+	{
+		PolicyRelease(stream->policy);
+	}
+	else
+	{
+		DispatchRelease(stream->dispatch);
+	}
+	free(stream);
+}
+
+void StreamReleaseAll(void)
+{
+	struct stream_t *stream = globals->streamList;
+
+	while (stream)
+	{
+		struct stream_t *next = stream->next;
+
+		StreamReleaseOne(stream);
+		stream = next;
+	}
+
+	globals->streamList = NULL;
+}
+
+#endif
@@ -0,0 +1,123 @@
+/*
+ *	stream.h -- event streams for platforms without FSEvents.
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#ifndef CHMODD_STREAM_H
+#define CHMODD_STREAM_H
+
+#ifndef __APPLE__
+
+#include "chmodd.h"
+#include "policy.h"
+#include "dispatch.h"
+
+// Event sources, selected with -S.
+#define STREAM_SOURCE_INOTIFY		0	// A watch on every directory of the root
+#define STREAM_SOURCE_FANOTIFY		1	// One mark on the root's whole filesystem
+
+// A walk an event asked for, held until the stream's latency runs out.  With
+// entry set, it's just the one entry (see coalesce.h).
+struct stream_request_t {
+	char					*path;
+	Boolean					recursive;
+	Boolean					entry;
+};
+
+// The Linux stand-in for an FSEventStreamRef: one per policy (or, with -s,
+// one for every root), all of them kept on globals->streamList.  A backend
+// fills in fd and the hooks, and reports what it reads with
+// StreamRequestWalk() (or, with -e, StreamRequestEntry()).
+struct stream_t {
+	struct stream_t			*next;
+	struct policy_t			*policy;	// NULL when shared
+	struct dispatch_t		*dispatch;	// NULL unless shared
+	const char				*name;
+
+	// What the run loop poll()s; read() is called when it's readable and
+	// release() when the stream goes away.
+	int						fd;
+	void					(*read)(struct stream_t *stream);
+	void					(*release)(struct stream_t *stream);
+	void					*context;
+
+	// Batching, with the same meaning -l has for FSEvents: hold events for
+	// the current latency after the first one, unless latency is short and
+	// we haven't delivered anything for that long, in which case go right
+	// away.  latency is the root's (or, shared, the dispatch's).
+	struct latency_t		*latency;
+	double					deadline;	// 0 when nothing is pending
+	double					lastFlush;
+	unsigned long			events;		// Requests since the last flush
+	struct stream_request_t	*pending;
+	size_t					pendingCount;
+	size_t					pendingCapacity;
+};
+
+// Allocates a stream for policy, or for every root in dispatch (retaining
+// whichever one is given).  The caller sets the backend fields and hands it
+// to StreamSchedule().
+struct stream_t *StreamCreate(struct policy_t *policy,
+							  struct dispatch_t *dispatch,
+							  const char *name);
+
+// The roots a stream covers, for backends to set up watches on.
+size_t StreamRootCount(const struct stream_t *stream);
+struct policy_t *StreamRootAt(const struct stream_t *stream, size_t index);
+
+// Returns the policy an event at path falls under, or NULL if it's in none
+// of the stream's roots.
+struct policy_t *StreamPolicyForPath(const struct stream_t *stream,
+									 const char *path);
+
+// Puts the stream on globals->streamList, where StreamRunOnce() will see it.
+void StreamSchedule(struct stream_t *stream);
+
+// Queues a walk of path for the stream's next batch.
+void StreamRequestWalk(struct stream_t *stream, const char *path,
+					   Boolean recursive);
+
+// For file events (-e): queues just the entry at path, which an event named,
+// walking it too if it's a new directory (recursive).
+void StreamRequestEntry(struct stream_t *stream, const char *path,
+						Boolean recursive);
+
+// The root of a _force policy was moved; put it back where the config says.
+void StreamRootMoved(struct policy_t *policy);
+
+// Waits up to timeout seconds for events on any stream, reads them and
+// applies every batch whose latency has run out.
+void StreamRunOnce(double timeout);
+
+// Frees a stream that never made it onto globals->streamList.
+void StreamReleaseOne(struct stream_t *stream);
+
+// Stops and frees every stream on globals->streamList.
+void StreamReleaseAll(void);
+
+// Seconds on a clock that doesn't jump.
+double StreamNow(void);
+
+// Returns the STREAM_SOURCE_* for a name given on the command line, or -1.
+int StreamSourceFromString(const char *name);
+
+// Makes a stream for policy, or one for every root in dispatch (-s), with
+// whichever backend -S picked.
+struct stream_t *StreamCreateFromPolicy(struct policy_t *policy);
+struct stream_t *StreamCreateShared(struct dispatch_t *dispatch);
+
+// Backends, given one of policy or dispatch.  Each returns a stream ready
+// for StreamSchedule(), or NULL.
+struct stream_t *InotifyStreamCreate(struct policy_t *policy,
+									 struct dispatch_t *dispatch);
+struct stream_t *FanotifyStreamCreate(struct policy_t *policy,
+									  struct dispatch_t *dispatch);
+
+#endif
+
+#endif
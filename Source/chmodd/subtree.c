@@ -0,0 +1,361 @@
+/*
+ *	subtree.c -- the walks going on, and just done, so the same directory
+ *	isn't walked twice at once or twice in a row.
+ *
+ *	Under heavy churn one directory gets queued over and over, and with
+ *	several workers the copies end up walking it side by side, or walking it
+ *	again straight after, none of them finding anything the first didn't.
+ *	A walk that started after the event that asked for a directory will see
+ *	whatever that event was about, so the request can be dropped: that's the
+ *	whole test, for a walk of the same directory (by dev and ino, so a renamed
+ *	path still matches) or a full walk of one above it, whether it's still
+ *	going or finished in the last few seconds.
+ *
+ *	A walk that started before the event may already have been past it, so
+ *	the request waits for that walk to finish and is queued again then; any
+ *	number of requests for the same directory wait as one.
+ *
+ *	Only walks from the work pool are kept track of.  Background walks (see
+ *	rescan.h) are paced by the budget and give up on BudgetStop(), so an
+ *	event left to one, or waiting on one, could sit behind it indefinitely or
+ *	never be seen to at all.
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "subtree.h"
+#include "work.h"
+
+// A request waiting for a running walk to finish.
+struct subtree_waiter_t {
+	struct subtree_waiter_t	*next;
+	dev_t					dev;
+	ino_t					ino;
+	struct policy_t			*policy;
+	struct dispatch_t		*dispatch;
+	char					*path;
+	Boolean					recursive;
+	UInt64					eventId;
+};
+
+struct subtree_t {
+	struct subtree_t		*next;
+	dev_t					dev;
+	ino_t					ino;
+	struct policy_t			*policy;
+	char					*path;
+	size_t					length;		// Without any trailing '/'
+	Boolean					recursive;
+	double					started;
+	double					finished;
+	struct subtree_waiter_t	*waiters;
+};
+
+static struct {
+	pthread_mutex_t			lock;
+	struct subtree_t		*running;
+	struct subtree_t		*recent[SUBTREE_RECENT_COUNT];
+	unsigned long			recentNext;	// Oldest, next to be replaced
+	struct subtree_status_t	status;
+} subtrees = { PTHREAD_MUTEX_INITIALIZER };
+
+static double SubtreeNow(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return now.tv_sec + now.tv_usec / 1e6;
+}
+
+static void SubtreeFree(struct subtree_t *subtree)
+{
+	PolicyRelease(subtree->policy);
+	free(subtree->path);
+	free(subtree);
+}
+
+static void SubtreeFreeWaiter(struct subtree_waiter_t *waiter)
+{
+	PolicyRelease(waiter->policy);
+	if (waiter->dispatch)
+	{
+		DispatchRelease(waiter->dispatch);
+	}
+	free(waiter->path);
+	free(waiter);
+}
+
+// Returns true if walking subtree takes in a walk of the directory (dev, ino)
+// at path.
+static Boolean SubtreeCovers(const struct subtree_t *subtree,
+							 struct policy_t *policy, dev_t dev, ino_t ino,
+							 const char *path, Boolean recursive)
+{
+	if (subtree->policy != policy)
+	{
+		return false;
+	}
+
+	if (subtree->dev == dev && subtree->ino == ino)
+	{
+		return (subtree->recursive || !recursive);
+	}
+
+	// Only a full walk is sure to go all the way down to it.
+	return (subtree->recursive &&
+			strncmp(path, subtree->path, subtree->length) == 0 &&
+			path[subtree->length] == '/');
+}
+
+static struct subtree_t *SubtreeCreate(struct policy_t *policy,
+									   const char *path, Boolean recursive,
+									   const struct stat *info)
+{
+	struct subtree_t *subtree = calloc(1, sizeof(struct subtree_t));
+
+	if (!subtree || (subtree->path = strdup(path)) == NULL)
+	{
+		LogError("Couldn't allocate walk entry for %s\n", path);
+		free(subtree);
+		return NULL;
+	}
+
+	subtree->dev = info->st_dev;
+	subtree->ino = info->st_ino;
+	subtree->policy = (struct policy_t *)PolicyRetain(policy);
+	subtree->recursive = recursive;
+	subtree->started = SubtreeNow();
+
+	subtree->length = strlen(path);
+	while (subtree->length > 0 && path[subtree->length - 1] == '/')
+	{
+		subtree->length--;
+	}
+
+	return subtree;
+}
+
+// Adds the request to those waiting on subtree, merging it with any for the
+// same directory.  Returns false if there's no memory for it.
+static Boolean SubtreeWaitLocked(struct subtree_t *subtree,
+								 struct policy_t *policy,
+								 struct dispatch_t *dispatch, const char *path,
+								 Boolean recursive, UInt64 eventId,
+								 const struct stat *info)
+{
+	struct subtree_waiter_t *waiter;
+
+	for (waiter = subtree->waiters; waiter; waiter = waiter->next)
+	{
+		if (waiter->dev == info->st_dev && waiter->ino == info->st_ino &&
+			waiter->policy == policy)
+		{
+			waiter->recursive |= recursive;
+			if (eventId > waiter->eventId)
+			{
+				waiter->eventId = eventId;
+			}
+			return true;
+		}
+	}
+
+	if ((waiter = calloc(1, sizeof(struct subtree_waiter_t))) == NULL ||
+		(waiter->path = strdup(path)) == NULL)
+	{
+		LogError("Couldn't allocate walk entry for %s\n", path);
+		free(waiter);
+		return false;
+	}
+
+	waiter->dev = info->st_dev;
+	waiter->ino = info->st_ino;
+	waiter->policy = (struct policy_t *)PolicyRetain(policy);
+	waiter->dispatch = dispatch ?
+		(struct dispatch_t *)DispatchRetain(dispatch) : NULL;
+	waiter->recursive = recursive;
+	waiter->eventId = eventId;
+
+	waiter->next = subtree->waiters;
+	subtree->waiters = waiter;
+	subtrees.status.waiting++;
+
+	return true;
+}
+
+int SubtreeBegin(struct policy_t *policy, struct dispatch_t *dispatch,
+				 const char *path, Boolean recursive, UInt64 eventId,
+				 double requested, struct subtree_t **subtree)
+{
+	struct subtree_t *walk, *earlier = NULL;
+	struct stat info;
+	double now;
+	unsigned long i;
+
+	*subtree = NULL;
+
+	// Gone, or can't be looked at: the walk will say why.
+	if (stat(path, &info) != 0)
+	{
+		return SUBTREE_WALK;
+	}
+
+	pthread_mutex_lock(&subtrees.lock);
+
+	for (walk = subtrees.running; walk; walk = walk->next)
+	{
+		if (SubtreeCovers(walk, policy, info.st_dev, info.st_ino, path,
+						  recursive))
+		{
+			if (walk->started >= requested)
+			{
+				subtrees.status.absorbed++;
+				pthread_mutex_unlock(&subtrees.lock);
+
+				LogMV("%s: already being walked (%s)\n", path, walk->path);
+				return SUBTREE_ABSORBED;
+			}
+
+			if (!earlier)
+			{
+				earlier = walk;
+			}
+		}
+	}
+
+	// If it can't wait, it'll just have to be walked alongside.
+	if (earlier && SubtreeWaitLocked(earlier, policy, dispatch, path,
+									 recursive, eventId, &info))
+	{
+		subtrees.status.absorbed++;
+		pthread_mutex_unlock(&subtrees.lock);
+
+		LogMV("%s: waiting for the walk of %s to finish\n", path,
+			  earlier->path);
+		return SUBTREE_ABSORBED;
+	}
+
+	now = SubtreeNow();
+
+	for (i = 0; i < SUBTREE_RECENT_COUNT; i++)
+	{
+		if ((walk = subtrees.recent[i]) != NULL &&
+			now - walk->finished <= SUBTREE_RECENT_SECONDS &&
+			walk->started >= requested &&
+			SubtreeCovers(walk, policy, info.st_dev, info.st_ino, path,
+						  recursive))
+		{
+			subtrees.status.recent++;
+			pthread_mutex_unlock(&subtrees.lock);
+
+			LogMV("%s: walked %.3fs ago (%s)\n", path, now - walk->finished,
+				  walk->path);
+			return SUBTREE_RECENT;
+		}
+	}
+
+	if ((walk = SubtreeCreate(policy, path, recursive, &info)) != NULL)
+	{
+		walk->next = subtrees.running;
+		subtrees.running = walk;
+		subtrees.status.running++;
+	}
+
+	pthread_mutex_unlock(&subtrees.lock);
+
+	*subtree = walk;
+
+	return SUBTREE_WALK;
+}
+
+void SubtreeEnd(struct subtree_t *subtree)
+{
+	struct subtree_t **link, *oldest;
+	struct subtree_waiter_t *waiter, *next;
+
+	if (!subtree)
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&subtrees.lock);
+
+	for (link = &subtrees.running; *link; link = &(*link)->next)
+	{
+		if (*link == subtree)
+		{
+			*link = subtree->next;
+			break;
+		}
+	}
+	subtrees.status.running--;
+
+	subtree->next = NULL;
+	subtree->finished = SubtreeNow();
+	waiter = subtree->waiters;
+	subtree->waiters = NULL;
+
+	oldest = subtrees.recent[subtrees.recentNext];
+	subtrees.recent[subtrees.recentNext] = subtree;
+	subtrees.recentNext = (subtrees.recentNext + 1) % SUBTREE_RECENT_COUNT;
+
+	pthread_mutex_unlock(&subtrees.lock);
+
+	if (oldest)
+	{
+		SubtreeFree(oldest);
+	}
+
+	// Queued before they stop counting as waiting, so there's never a moment
+	// when nothing seems left to do (see WorkIsIdle()).
+	for (; waiter; waiter = next)
+	{
+		next = waiter->next;
+
+		WorkEnqueue(waiter->policy, waiter->dispatch, waiter->path,
+					waiter->recursive, false, waiter->eventId);
+
+		pthread_mutex_lock(&subtrees.lock);
+		subtrees.status.waiting--;
+		pthread_mutex_unlock(&subtrees.lock);
+
+		SubtreeFreeWaiter(waiter);
+	}
+}
+
+void SubtreeClear(void)
+{
+	struct subtree_t *recent[SUBTREE_RECENT_COUNT];
+	unsigned long i;
+
+	pthread_mutex_lock(&subtrees.lock);
+	memcpy(recent, subtrees.recent, sizeof(recent));
+	memset(subtrees.recent, 0, sizeof(subtrees.recent));
+	subtrees.recentNext = 0;
+	pthread_mutex_unlock(&subtrees.lock);
+
+	for (i = 0; i < SUBTREE_RECENT_COUNT; i++)
+	{
+		if (recent[i])
+		{
+			SubtreeFree(recent[i]);
+		}
+	}
+}
+
+void SubtreeGetStatus(struct subtree_status_t *status)
+{
+	pthread_mutex_lock(&subtrees.lock);
+	*status = subtrees.status;
+	pthread_mutex_unlock(&subtrees.lock);
+}
@@ -0,0 +1,56 @@
+/*
+ *	subtree.h -- the walks going on, and just done, so the same directory
+ *	isn't walked twice at once or twice in a row.
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#ifndef CHMODD_SUBTREE_H
+#define CHMODD_SUBTREE_H
+
+#include "chmodd.h"
+#include "policy.h"
+#include "dispatch.h"
+
+// How long a finished walk is remembered, and how many of them.
+#define SUBTREE_RECENT_SECONDS	2.0
+#define SUBTREE_RECENT_COUNT	256
+
+// What SubtreeBegin() decided.
+#define SUBTREE_WALK			0	// Walk it, then SubtreeEnd()
+#define SUBTREE_ABSORBED		1	// Left to a walk already going
+#define SUBTREE_RECENT			2	// A walk since it was asked for did it
+
+struct subtree_t;
+
+struct subtree_status_t {
+	unsigned long			running;	// Walks going now
+	unsigned long			waiting;	// Absorbed, to be walked after them
+	unsigned long			absorbed;	// Requests left to a running walk
+	unsigned long			recent;		// Requests a finished walk covered
+};
+
+// For a walk of path under policy that an event at requested (seconds, as
+// gettimeofday()) asked for.  If a walk of it, or a full walk of a directory
+// above it, has started since, this returns SUBTREE_ABSORBED or
+// SUBTREE_RECENT and it needn't be walked.  If one started earlier is still
+// going, the request waits for it and is queued again (see work.h) when it's
+// done.  Otherwise this returns SUBTREE_WALK with *subtree set (NULL if path
+// couldn't be looked at) for SubtreeEnd().
+int SubtreeBegin(struct policy_t *policy, struct dispatch_t *dispatch,
+				 const char *path, Boolean recursive, UInt64 eventId,
+				 double requested, struct subtree_t **subtree);
+
+// The walk is done; whatever waited on it is queued again.
+void SubtreeEnd(struct subtree_t *subtree);
+
+// Forgets every finished walk.
+void SubtreeClear(void);
+
+void SubtreeGetStatus(struct subtree_status_t *status);
+
+#endif
@@ -0,0 +1,369 @@
+/*
+ *	verified.c -- on-disk record of the directories we've already verified.
+ *
+ *	This is what lets a walk skip a subdirectory whose permissions we already
+ *	know are right.  It's an open addressing hash table keyed by (dev, ino),
+ *	mmap'd straight from the file, so it survives restarts and costs no writes
+ *	to the tree itself.
+ *
+ *	A directory's ctime only moves for changes to the directory itself: a
+ *	chmod of a file three levels down leaves every directory above it as it
+ *	was.  Skipping a subtree is safe while we're watching it, since the
+ *	event for that file gets its own directory walked, but nothing watched it
+ *	between runs.  So each entry notes the run that recorded it, and what an
+ *	earlier run recorded only counts for a root whose events picked up where
+ *	that run's left off.
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "verified.h"
+
+#define VERIFIED_MAGIC			"CHMDVIX1"
+// 2: a directory goes in only after everything under it was put right, so
+// anything a version 1 index says is suspect.
+// 3: entries note the run that recorded them.
+#define VERIFIED_VERSION		3
+#define VERIFIED_MIN_ENTRIES	65536
+// Past this we start over rather than grow; stale inodes pile up otherwise.
+#define VERIFIED_MAX_ENTRIES	(1 << 23)
+
+struct verified_header_t {
+	char					magic[8];
+	UInt32					version;
+	UInt32					entrySize;
+	UInt64					capacity;
+	UInt64					count;
+	UInt64					run;		// The latest to have opened it
+};
+
+// ino is never 0 for a real file, so an all zero entry is an empty slot.
+struct verified_entry_t {
+	UInt64					dev;
+	UInt64					ino;
+	SInt64					ctimeSeconds;
+	SInt64					ctimeNanoseconds;
+	UInt64					policyHash;
+	UInt64					run;
+};
+
+static struct {
+	pthread_mutex_t			lock;
+	int						fd;		// -1 when we're only in memory
+	struct verified_header_t *header;
+	struct verified_entry_t	*entries;
+	size_t					mapSize;
+	UInt64					run;		// Ours
+} verified = { PTHREAD_MUTEX_INITIALIZER, -1, NULL, NULL, 0, 0 };
+
+static size_t VerifiedMapSize(UInt64 capacity)
+{
+	return sizeof(struct verified_header_t) +
+		capacity * sizeof(struct verified_entry_t);
+}
+
+static size_t VerifiedSlot(UInt64 dev, UInt64 ino, UInt64 capacity)
+{
+	UInt64 key = (ino * 0x9E3779B97F4A7C15ULL) ^ (dev * 0xC2B2AE3D27D4EB4FULL);
+
+	return (size_t)((key ^ (key >> 29)) & (capacity - 1));
+}
+
+// Maps size bytes of the file (or anonymous memory).  Must be called with the
+// lock held.
+static Boolean VerifiedMapLocked(size_t size)
+{
+	void *map;
+
+	if (verified.fd != -1)
+	{
+		if (ftruncate(verified.fd, size) != 0)
+		{
+			LogError("verified index: %s\n", strerror(errno));
+			return false;
+		}
+
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+				   verified.fd, 0);
+	}
+	else
+	{
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON,
+				   -1, 0);
+	}
+
+	if (map == MAP_FAILED)
+	{
+		LogError("verified index mmap: %s\n", strerror(errno));
+		return false;
+	}
+
+	verified.header = map;
+	verified.entries = (struct verified_entry_t *)(verified.header + 1);
+	verified.mapSize = size;
+
+	return true;
+}
+
+static void VerifiedUnmapLocked(void)
+{
+	if (verified.header)
+	{
+		munmap(verified.header, verified.mapSize);
+		verified.header = NULL;
+		verified.entries = NULL;
+		verified.mapSize = 0;
+	}
+}
+
+// Starts an empty table with room for capacity entries.  Must be called with
+// the lock held.
+static Boolean VerifiedResetLocked(UInt64 capacity)
+{
+	VerifiedUnmapLocked();
+
+	// Truncating to 0 first throws away the old contents without writing.
+	if (verified.fd != -1 && ftruncate(verified.fd, 0) != 0)
+	{
+		LogError("verified index: %s\n", strerror(errno));
+	}
+
+	if (!VerifiedMapLocked(VerifiedMapSize(capacity)))
+	{
+		return false;
+	}
+
+	memcpy(verified.header->magic, VERIFIED_MAGIC, 8);
+	verified.header->version = VERIFIED_VERSION;
+	verified.header->entrySize = sizeof(struct verified_entry_t);
+	verified.header->capacity = capacity;
+	verified.header->count = 0;
+	verified.header->run = verified.run;
+
+	return true;
+}
+
+// Opens the file's table if it looks like ours.  Must be called with the lock
+// held.
+static Boolean VerifiedLoadLocked(void)
+{
+	struct verified_header_t header;
+	struct stat info;
+
+	if (fstat(verified.fd, &info) != 0 ||
+		info.st_size < (off_t)sizeof(header) ||
+		pread(verified.fd, &header, sizeof(header), 0) != sizeof(header))
+	{
+		return false;
+	}
+
+	if (memcmp(header.magic, VERIFIED_MAGIC, 8) != 0 ||
+		header.version != VERIFIED_VERSION ||
+		header.entrySize != sizeof(struct verified_entry_t) ||
+		header.capacity < VERIFIED_MIN_ENTRIES ||
+		header.capacity > VERIFIED_MAX_ENTRIES ||
+		(header.capacity & (header.capacity - 1)) != 0 ||
+		info.st_size != (off_t)VerifiedMapSize(header.capacity))
+	{
+		LogError("Ignoring unrecognised verified index\n");
+		return false;
+	}
+
+	return VerifiedMapLocked(VerifiedMapSize(header.capacity));
+}
+
+void VerifiedIndexOpen(const char *path)
+{
+	pthread_mutex_lock(&verified.lock);
+
+	if (path)
+	{
+		verified.fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+		if (verified.fd == -1)
+		{
+			LogError("Couldn't open verified index %s: %s (keeping it in "
+					 "memory)\n", path, strerror(errno));
+		}
+		else if (flock(verified.fd, LOCK_EX | LOCK_NB) != 0)
+		{
+			LogError("Verified index %s is in use by another chmodd (keeping "
+					 "it in memory)\n", path);
+			close(verified.fd);
+			verified.fd = -1;
+		}
+	}
+
+	if (verified.fd != -1 && VerifiedLoadLocked())
+	{
+		LogV("Loaded %llu verified directories from %s\n",
+			 (unsigned long long)verified.header->count, path);
+		verified.run = verified.header->run + 1;
+		verified.header->run = verified.run;
+	}
+	else
+	{
+		verified.run = 1;
+		VerifiedResetLocked(VERIFIED_MIN_ENTRIES);
+	}
+
+	pthread_mutex_unlock(&verified.lock);
+}
+
+void VerifiedIndexClose(void)
+{
+	pthread_mutex_lock(&verified.lock);
+
+	if (verified.header && verified.fd != -1)
+	{
+		msync(verified.header, verified.mapSize, MS_SYNC);
+	}
+
+	VerifiedUnmapLocked();
+
+	if (verified.fd != -1)
+	{
+		close(verified.fd);
+		verified.fd = -1;
+	}
+
+	pthread_mutex_unlock(&verified.lock);
+}
+
+// Returns the slot for (dev, ino): either its entry or the empty slot it would
+// go in.  Must be called with the lock held.
+static struct verified_entry_t *VerifiedFindLocked(UInt64 dev, UInt64 ino)
+{
+	UInt64 capacity = verified.header->capacity;
+	size_t slot = VerifiedSlot(dev, ino, capacity);
+
+	for (;;)
+	{
+		struct verified_entry_t *entry = &(verified.entries[slot]);
+
+		if (entry->ino == 0 || (entry->ino == ino && entry->dev == dev))
+		{
+			return entry;
+		}
+
+		slot = (slot + 1) & (capacity - 1);
+	}
+}
+
+// Doubles the table, or starts over once it's as big as we let it get.  Must
+// be called with the lock held.
+static void VerifiedGrowLocked(void)
+{
+	UInt64 i, oldCapacity = verified.header->capacity;
+	struct verified_entry_t *oldEntries;
+
+	if (oldCapacity * 2 > VERIFIED_MAX_ENTRIES)
+	{
+		LogV("Verified index is full, starting it over\n");
+		VerifiedResetLocked(oldCapacity);
+		return;
+	}
+
+	// Rehash out of a private copy, since the file is about to be rebuilt.
+	if ((oldEntries = malloc(oldCapacity * sizeof(struct verified_entry_t))) == NULL)
+	{
+		VerifiedResetLocked(oldCapacity);
+		return;
+	}
+
+	memcpy(oldEntries, verified.entries,
+		   oldCapacity * sizeof(struct verified_entry_t));
+
+	if (!VerifiedResetLocked(oldCapacity * 2))
+	{
+		free(oldEntries);
+		return;
+	}
+
+	for (i = 0; i < oldCapacity; i++)
+	{
+		if (oldEntries[i].ino != 0)
+		{
+			*VerifiedFindLocked(oldEntries[i].dev, oldEntries[i].ino) =
+				oldEntries[i];
+			verified.header->count++;
+		}
+	}
+
+	free(oldEntries);
+}
+
+Boolean VerifiedIndexCheck(dev_t dev, ino_t ino, const struct timespec *ctime,
+						   UInt64 policyHash, Boolean earlierRuns)
+{
+	struct verified_entry_t *entry;
+	Boolean retVal = false;
+
+	pthread_mutex_lock(&verified.lock);
+
+	if (verified.header && ino != 0)
+	{
+		entry = VerifiedFindLocked(dev, ino);
+
+		retVal = (entry->ino != 0 &&
+				  (entry->run == verified.run || earlierRuns) &&
+				  entry->policyHash == policyHash &&
+				  entry->ctimeSeconds == ctime->tv_sec &&
+				  entry->ctimeNanoseconds == ctime->tv_nsec);
+	}
+
+	pthread_mutex_unlock(&verified.lock);
+
+	return retVal;
+}
+
+void VerifiedIndexRecord(dev_t dev, ino_t ino, const struct timespec *ctime,
+						 UInt64 policyHash)
+{
+	struct verified_entry_t *entry;
+
+	pthread_mutex_lock(&verified.lock);
+
+	if (verified.header && ino != 0)
+	{
+		// Keep the table at most 3/4 full so probes stay short.
+		if ((verified.header->count + 1) * 4 > verified.header->capacity * 3)
+		{
+			VerifiedGrowLocked();
+		}
+
+		if (verified.header)
+		{
+			entry = VerifiedFindLocked(dev, ino);
+
+			if (entry->ino == 0)
+			{
+				entry->dev = dev;
+				entry->ino = ino;
+				verified.header->count++;
+			}
+
+			entry->ctimeSeconds = ctime->tv_sec;
+			entry->ctimeNanoseconds = ctime->tv_nsec;
+			entry->policyHash = policyHash;
+			entry->run = verified.run;
+		}
+	}
+
+	pthread_mutex_unlock(&verified.lock);
+}
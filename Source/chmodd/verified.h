@@ -0,0 +1,44 @@
+/*
+ *	verified.h -- on-disk record of the directories we've already verified.
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#ifndef CHMODD_VERIFIED_H
+#define CHMODD_VERIFIED_H
+
+#include <sys/types.h>
+#include <time.h>
+#include "chmodd.h"
+
+#ifdef __APPLE__
+#define VERIFIED_DEFAULT_PATH	"/var/db/chmodd.index"
+#else
+#define VERIFIED_DEFAULT_PATH	"/var/lib/chmodd/index"
+#endif
+
+// Opens (creating if needed) the index at path and maps it.  If that can't be
+// done, or path is NULL, the index lives in memory for this run only.
+void VerifiedIndexOpen(const char *path);
+
+// Writes the index back and unmaps it.
+void VerifiedIndexClose(void);
+
+// Returns true if the directory (dev, ino) was verified against a policy with
+// this hash and hasn't changed (by its ctime) since.  Only what this run
+// recorded counts, unless earlierRuns: the root's events were resumed from
+// where the last run stopped (see history.h), so nothing went unseen.
+Boolean VerifiedIndexCheck(dev_t dev, ino_t ino, const struct timespec *ctime,
+						   UInt64 policyHash, Boolean earlierRuns);
+
+// Notes that the directory (dev, ino) with this ctime matches the policy, and
+// so does everything under it, as of this run: walks call this once they're
+// done with it.
+void VerifiedIndexRecord(dev_t dev, ino_t ino, const struct timespec *ctime,
+						 UInt64 policyHash);
+
+#endif
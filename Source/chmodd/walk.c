@@ -0,0 +1,1458 @@
+/*
+ *	walk.c -- applying a policy to everything under a path.
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fts.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __APPLE__
+#include <sys/acl.h>
+#else
+#include <sys/sysmacros.h>
+#endif
+#include "walk.h"
+#include "verified.h"
+#include "metrics.h"
+#include "budget.h"
+#include "audit.h"
+#ifndef __APPLE__
+#include "echo.h"
+#endif
+
+// The level applyPolicyToEntry() is given for an entry fixed on its own:
+// below the root, but with nothing under it looked at.
+#define WALK_LEVEL_ENTRY	-1
+
+#if !defined(__APPLE__) && defined(STATX_TYPE)
+// Everything applyPolicyToEntry() and the verified index look at (the device
+// comes back whatever is asked for).
+#define WALK_STATX_MASK		(STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID | \
+							 STATX_INO | STATX_CTIME)
+
+// Set once statx() turns out to be missing, and fstatat() does it all.
+static Boolean walkNoStatx = false;
+#endif
+
+#ifdef __APPLE__
+// Returns TRUE if the file at path does NOT have exactly the root's ACL.
+static Boolean fileNeedsACLApplied(const char *path,
+								   const struct policy_acl_t *rootACL);
+#endif
+
+// A directory being walked, as it was once it had been put right.  It goes
+// in the verified index only after everything under it has been visited
+// without a failure: recorded any sooner, a crash (or a child that can't be
+// fixed) would leave it there as verified when it isn't, and the index
+// outlives us.
+struct walk_verify_t {
+	Boolean					record;		// Not for skipped ones, or with -A
+	dev_t					device;
+	ino_t					inode;
+	struct timespec			ctime;
+	unsigned long			failures;	// stats->failures before it was looked at
+};
+
+// Applies the policy to one item.  The item is name relative to the directory
+// dirfd (which can be AT_FDCWD with name a full path); path is the full path,
+// used for messages and for ACLs, which have no *at() calls.  Returns true if
+// a directory's children should be visited, with verify filled in for
+// walkVerified() once they have been.  The owners, groups and hash are the
+// walk's snapshot of them, not the policy's.
+static Boolean applyPolicyToEntry(struct policy_t *policy,
+								  const struct policy_snapshot_t *snapshot,
+								  int dirfd,
+								  const char *name,
+								  const char *path,
+								  const struct stat *info,
+								  int level,
+								  Boolean force_recursion,
+								  struct walk_stats_t *stats,
+								  struct walk_verify_t *verify);
+
+// Logs a syscall on path failing with error (after operation, if given),
+// and counts it, in the walk's stats too if it's given them.
+static void walkLogError(struct walk_stats_t *stats, const char *operation,
+						 const char *path, int error)
+{
+	MetricsCountError(error);
+
+	if (stats)
+	{
+		stats->failures++;
+	}
+
+	if (operation)
+	{
+		LogError("%s %s: %s\n", operation, path, strerror(error));
+	}
+	else
+	{
+		LogError("%s: %s\n", path, strerror(error));
+	}
+}
+
+static struct {
+	pthread_mutex_t			lock;
+	struct walk_stats_t		stats;
+} walkTotals = { PTHREAD_MUTEX_INITIALIZER };
+
+static void walkAddStats(struct walk_stats_t *to,
+						 const struct walk_stats_t *from)
+{
+	to->filesChanged += from->filesChanged;
+	to->directoriesSkipped += from->directoriesSkipped;
+	to->filesVisited += from->filesVisited;
+	to->statCalls += from->statCalls;
+	to->chmodCalls += from->chmodCalls;
+	to->chownCalls += from->chownCalls;
+	to->aclReadCalls += from->aclReadCalls;
+	to->aclWriteCalls += from->aclWriteCalls;
+	to->openCalls += from->openCalls;
+	to->entries += from->entries;
+	to->failures += from->failures;
+}
+
+// Pays the I/O budget for the syscalls made since the last time.  Returns
+// false if the walk should give up instead, because we're quitting.
+static Boolean walkCharge(struct walk_stats_t *stats)
+{
+	unsigned long total = stats->statCalls + stats->chmodCalls +
+		stats->chownCalls + stats->aclReadCalls + stats->aclWriteCalls +
+		stats->openCalls;
+	unsigned long ops = total - stats->charged;
+
+	if (ops > 0)
+	{
+		stats->charged = total;
+		return BudgetCharge(ops);
+	}
+
+	return !BudgetIsStopping();
+}
+
+// Background walks give up once we're quitting (see BudgetStop()), rather
+// than hold us up, and any walk does once its policy is stopped (see
+// policy.h); whatever they leave undone doesn't count as verified.
+static Boolean walkCancelled(const struct policy_t *policy,
+							 struct walk_stats_t *stats)
+{
+	if (policy->stopped || (BudgetIsStopping() && BudgetIsBackground()))
+	{
+		stats->failures++;
+		return true;
+	}
+
+	return false;
+}
+
+static int walkFTS(const char *path,
+				   struct policy_t *policy,
+				   const struct policy_snapshot_t *snapshot,
+				   Boolean force_recursion,
+				   struct walk_stats_t *stats);
+
+static int walkFD(const char *path,
+				  struct policy_t *policy,
+				  const struct policy_snapshot_t *snapshot,
+				  Boolean force_recursion,
+				  struct walk_stats_t *stats);
+
+static int walkParallel(const char *path,
+						struct policy_t *policy,
+						const struct policy_snapshot_t *snapshot,
+						Boolean force_recursion,
+						struct walk_stats_t *stats);
+
+// Brings what the policy was compiled from up to date before it's used, and
+// takes the walk's snapshot of it.  Returns false if there's no memory for
+// that.
+static Boolean walkRefreshPolicy(struct policy_t *policy,
+								 struct policy_snapshot_t *snapshot)
+{
+	Boolean retVal;
+
+	pthread_mutex_lock(&policy->refreshLock);
+
+	// Owner/group names only get looked up again if the id cache has been
+	// refreshed since the last walk.
+	PolicyRefreshIDs(policy);
+
+#ifdef __APPLE__
+	// Likewise the root's ACL is only read again if the root has changed.
+	PolicyRefreshACL(policy);
+#endif
+
+	// Either of those may have changed what "verified" means.
+	PolicyUpdateHash(policy);
+
+	retVal = PolicyTakeSnapshot(policy, snapshot);
+
+	pthread_mutex_unlock(&policy->refreshLock);
+
+	return retVal;
+}
+
+int applyPermissionsToFolder(const char *path,
+							 struct policy_t *policy,
+							 Boolean force_recursion)
+{
+	struct policy_snapshot_t snapshot;
+	struct walk_stats_t stats;
+	struct timeval start, end;
+	int status;
+
+	if (!walkRefreshPolicy(policy, &snapshot))
+	{
+		walkLogError(NULL, NULL, path, ENOMEM);
+		return -1;
+	}
+
+	bzero(&stats, sizeof(stats));
+	MetricsWalkStarted(force_recursion);
+	gettimeofday(&start, NULL);
+
+	// Full walks in the background (prescans, rescans) and for -O are where
+	// the whole tree gets looked at, so those get spread over the worker
+	// threads.  Full walks events ask for are of new directories, usually
+	// small, and with the work pool (see work.h) there can be one going on
+	// each worker; starting threads for each of them costs more than it saves.
+	if (force_recursion && globals->walkThreads > 1 &&
+		(BudgetIsBackground() || globals->once))
+	{
+		status = walkParallel(path, policy, &snapshot, force_recursion,
+							  &stats);
+	}
+	else if (globals->walkEngine == WALK_ENGINE_FD)
+	{
+		status = walkFD(path, policy, &snapshot, force_recursion, &stats);
+	}
+	else
+	{
+		status = walkFTS(path, policy, &snapshot, force_recursion, &stats);
+	}
+
+	gettimeofday(&end, NULL);
+	MetricsWalkFinished((end.tv_sec - start.tv_sec) +
+						(end.tv_usec - start.tv_usec) / 1e6);
+
+	PolicyFreeSnapshot(&snapshot);
+
+	if (status == -1)
+	{
+		return -1;
+	}
+
+	pthread_mutex_lock(&walkTotals.lock);
+	walkAddStats(&walkTotals.stats, &stats);
+	pthread_mutex_unlock(&walkTotals.lock);
+
+	LogV("Applied Permission changes to %lu file%s.\n", stats.filesChanged,
+		 (stats.filesChanged != 1) ? "s" : "");
+	LogV("Skipped %lu verified director%s.\n", stats.directoriesSkipped,
+		 (stats.directoriesSkipped != 1) ? "ies" : "y");
+	LogV("Visited %lu file%s.\n", stats.filesVisited,
+		 (stats.filesVisited != 1) ? "s" : "");
+	LogMV("MV: Syscalls: %lu stat, %lu open, %lu chmod, %lu chown, "
+		  "%lu acl get, %lu acl set\n", stats.statCalls, stats.openCalls,
+		  stats.chmodCalls, stats.chownCalls, stats.aclReadCalls,
+		  stats.aclWriteCalls);
+
+	return (int)stats.filesChanged;
+}
+
+int WalkStat(const struct policy_t *policy, int dirfd, const char *name,
+			 struct stat *info)
+{
+#if !defined(__APPLE__) && defined(STATX_TYPE)
+	struct statx attributes;
+	int flags = AT_SYMLINK_NOFOLLOW;
+
+	if (!walkNoStatx)
+	{
+		if (policy && policy->cachedAttributes)
+		{
+			flags |= AT_STATX_DONT_SYNC;
+		}
+
+		if (statx(dirfd, name, flags, WALK_STATX_MASK, &attributes) != 0)
+		{
+			if (errno != ENOSYS)
+			{
+				return -1;
+			}
+			walkNoStatx = true;
+		}
+		// A filesystem that can't give all of it gets the full lookup.
+		else if ((attributes.stx_mask & WALK_STATX_MASK) == WALK_STATX_MASK)
+		{
+			bzero(info, sizeof(*info));
+			info->st_dev = makedev(attributes.stx_dev_major,
+								   attributes.stx_dev_minor);
+			info->st_ino = attributes.stx_ino;
+			info->st_mode = attributes.stx_mode;
+			info->st_uid = attributes.stx_uid;
+			info->st_gid = attributes.stx_gid;
+			STAT_CTIME(info).tv_sec = attributes.stx_ctime.tv_sec;
+			STAT_CTIME(info).tv_nsec = attributes.stx_ctime.tv_nsec;
+			return 0;
+		}
+	}
+#else
+	(void)policy;
+#endif
+
+	return fstatat(dirfd, name, info, AT_SYMLINK_NOFOLLOW);
+}
+
+int applyPermissionsToEntry(const char *path,
+							struct policy_t *policy,
+							Boolean force_recursion)
+{
+	struct policy_snapshot_t snapshot;
+	struct walk_verify_t verify;
+	struct walk_stats_t stats;
+	struct stat info;
+
+	if (WalkStat(policy, AT_FDCWD, path, &info) != 0)
+	{
+		// Removed, or renamed away, before we got to it: the event that
+		// says so is all there is to it.
+		if (errno == ENOENT || errno == ENOTDIR)
+		{
+			return 0;
+		}
+
+		walkLogError(NULL, NULL, path, errno);
+		return -1;
+	}
+
+	if (S_ISDIR(info.st_mode) && force_recursion)
+	{
+		return applyPermissionsToFolder(path, policy, true);
+	}
+
+	bzero(&stats, sizeof(stats));
+	stats.statCalls++;
+	stats.entries++;
+
+	if (!walkRefreshPolicy(policy, &snapshot))
+	{
+		walkLogError(NULL, NULL, path, ENOMEM);
+		return -1;
+	}
+
+	applyPolicyToEntry(policy, &snapshot, AT_FDCWD, path, path, &info,
+					   WALK_LEVEL_ENTRY, false, &stats, &verify);
+
+	PolicyFreeSnapshot(&snapshot);
+
+	pthread_mutex_lock(&walkTotals.lock);
+	walkAddStats(&walkTotals.stats, &stats);
+	pthread_mutex_unlock(&walkTotals.lock);
+
+	return (int)stats.filesChanged;
+}
+
+void WalkGetTotals(struct walk_stats_t *totals)
+{
+	pthread_mutex_lock(&walkTotals.lock);
+	*totals = walkTotals.stats;
+	pthread_mutex_unlock(&walkTotals.lock);
+}
+
+int WalkDefaultThreadCount(void)
+{
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (count < 1 || count > WALK_MAX_THREADS)
+	{
+		return (count < 1) ? 1 : WALK_MAX_THREADS;
+	}
+
+	return (int)count;
+}
+
+int WalkEngineFromString(const char *name)
+{
+	if (strcmp(name, "fts") == 0)
+	{
+		return WALK_ENGINE_FTS;
+	}
+	else if (strcmp(name, "fd") == 0)
+	{
+		return WALK_ENGINE_FD;
+	}
+
+	return -1;
+}
+
+// applyPolicyToEntry() for -A: works out the same answers, but records them
+// instead of making any changes.  Every directory is gone into.
+static Boolean walkAuditEntry(struct policy_t *policy,
+							  const char *path,
+							  const struct stat *info,
+							  Boolean hasMode,
+							  const mode_t *modeTable,
+							  uid_t wantOwner,
+							  gid_t wantGroup,
+							  struct walk_stats_t *stats)
+{
+	mode_t computedMode = info->st_mode;
+	int flags = 0;
+#ifdef __APPLE__
+	struct policy_acl_t *rootACL;
+#endif
+
+	if (wantOwner != -1 && info->st_uid != wantOwner)
+	{
+		flags |= AUDIT_OWNER;
+	}
+
+	if (wantGroup != -1 && info->st_gid != wantGroup)
+	{
+		flags |= AUDIT_GROUP;
+	}
+
+#ifdef __APPLE__
+	if (hasMode)
+#else
+	if (hasMode && !S_ISLNK(info->st_mode))
+#endif
+	{
+		computedMode = PolicyComputeModeFromTable(modeTable, info->st_mode);
+		if (computedMode != info->st_mode)
+		{
+			flags |= AUDIT_MODE;
+		}
+	}
+
+#ifdef __APPLE__
+	if (policy->applyACL && (rootACL = PolicyRetainACL(policy)) != NULL)
+	{
+		if (!(info->st_ino == rootACL->rootInode &&
+			  info->st_dev == rootACL->rootDevice))
+		{
+			stats->aclReadCalls++;
+			if (fileNeedsACLApplied(path, rootACL))
+			{
+				flags |= AUDIT_ACL;
+			}
+		}
+
+		PolicyReleaseACL(rootACL);
+	}
+#endif
+
+	if (flags)
+	{
+		LogMV("MV: %s is out of policy\n", path);
+		AuditRecord(path, info, flags, computedMode, wantOwner, wantGroup);
+	}
+
+	return true;
+}
+
+static Boolean applyPolicyToEntry(struct policy_t *policy,
+								  const struct policy_snapshot_t *snapshot,
+								  int dirfd,
+								  const char *name,
+								  const char *path,
+								  const struct stat *info,
+								  int level,
+								  Boolean force_recursion,
+								  struct walk_stats_t *stats,
+								  struct walk_verify_t *verify)
+{
+	unsigned long failures = stats->failures;
+	Boolean changed = false, chowned = false;
+	const struct policy_rule_t *rule = NULL;
+	const mode_t *modeTable = policy->modeTable[0];
+	const char *modeString = policy->modeString;
+	Boolean hasMode = policy->hasMode;
+	uid_t wantOwner = snapshot->root.owner;
+	gid_t wantGroup = snapshot->root.group;
+	const struct policy_ids_t *ruleIDs;
+#ifdef __APPLE__
+	struct policy_acl_t *rootACL;
+#endif
+
+	verify->record = false;
+
+	// The root has been reconfigured since the walk started.
+	if (policy->stopped)
+	{
+		stats->failures++;
+		return false;
+	}
+
+	// A root configured inside this one has a policy of its own.
+	if (level != 0 && policy->nestedCount > 0 && S_ISDIR(info->st_mode) &&
+		PolicyIsNestedRoot(policy, path))
+	{
+		LogMV("MV: Leaving %s to its own policy\n", path);
+		return false;
+	}
+
+	// Background walks pay for the stat that found this entry (and whatever
+	// the last one cost) before doing anything more, and wait here while
+	// walks for live events go.  If we're quitting, they stop here.
+	if (BudgetIsBackground() && !walkCharge(stats))
+	{
+		stats->failures++;
+		return false;
+	}
+
+	LogMV("MV: Visiting file: %s\n", path);
+
+	stats->filesVisited++;
+
+	// The first sub-rule that matches stands in for whatever of the root's
+	// settings it gives.
+	if (policy->ruleCount > 0 &&
+		(rule = PolicyMatchRule(policy, path, info->st_mode)) != NULL)
+	{
+		LogMV("MV: %s matches sub-rule %s\n", path, rule->pattern);
+		if (rule->hasMode)
+		{
+			modeTable = rule->modeTable[0];
+			modeString = rule->modeString;
+			hasMode = true;
+		}
+		ruleIDs = &snapshot->rules[rule - policy->rules];
+		if (ruleIDs->owner != -1)
+		{
+			wantOwner = ruleIDs->owner;
+		}
+		if (ruleIDs->group != -1)
+		{
+			wantGroup = ruleIDs->group;
+		}
+	}
+
+	if (AuditIsOpen())
+	{
+		return walkAuditEntry(policy, path, info, hasMode, modeTable,
+							  wantOwner, wantGroup, stats);
+	}
+
+	// Everything from here on is integer compares against the compiled
+	// policy, plus whatever syscalls are actually needed.  Ownership goes
+	// first, in one call, since a chown can change the mode underneath us.
+	if ((wantOwner != -1 && info->st_uid != wantOwner) ||
+		(wantGroup != -1 && info->st_gid != wantGroup))
+	{
+		uid_t owner = (wantOwner != -1 && info->st_uid != wantOwner) ?
+			wantOwner : (uid_t)-1;
+		gid_t group = (wantGroup != -1 && info->st_gid != wantGroup) ?
+			wantGroup : (gid_t)-1;
+
+		stats->chownCalls++;
+		if (fchownat(dirfd, name, owner, group, AT_SYMLINK_NOFOLLOW) != 0)
+		{
+			walkLogError(stats, "chown", path, errno);
+		}
+		else
+		{
+			chowned = TRUE;
+			changed = TRUE;
+			stats->filesChanged++;
+#ifndef __APPLE__
+			EchoNoteChange(path);
+#endif
+		}
+	}
+
+#ifdef __APPLE__
+	if (hasMode)
+#else
+	// Symbolic links are always 0777 on Linux and can't be chmod'ed.
+	if (hasMode && !S_ISLNK(info->st_mode))
+#endif
+	{
+		mode_t computedMode = PolicyComputeModeFromTable(modeTable,
+														 info->st_mode);
+
+		// If the computed mode is not the same as the current mode, we have
+		// work to do!  The same goes if we just chowned a file that's meant
+		// to be setuid/setgid: the chown took those bits off again.
+		if (computedMode != info->st_mode ||
+			(chowned && !S_ISDIR(info->st_mode) &&
+			 (computedMode & (S_ISUID | S_ISGID))))
+		{
+			changed = TRUE;
+			LogMV("Applying new permissions %s to file %s\n",
+				  modeString, path);
+			stats->chmodCalls++;
+			if (fchmodat(dirfd, name, computedMode & 07777,
+						 AT_SYMLINK_NOFOLLOW) != 0)
+			{
+				walkLogError(stats, NULL, path, errno);
+			}
+			else {
+				stats->filesChanged++;
+#ifndef __APPLE__
+				EchoNoteChange(path);
+#endif
+			}
+		}
+	}
+
+#ifdef __APPLE__
+	// Another walk may read the root's ACL again while we use it; our own
+	// reference keeps the one we have good until we're done.  The root is
+	// where it came from, so it can't need it.
+	if (policy->applyACL && (rootACL = PolicyRetainACL(policy)) != NULL)
+	{
+		if (!(info->st_ino == rootACL->rootInode &&
+			  info->st_dev == rootACL->rootDevice))
+		{
+			stats->aclReadCalls++;
+			if (fileNeedsACLApplied(path, rootACL))
+			{
+				stats->aclWriteCalls++;
+				if (acl_set_link_np(path,
+									ACL_TYPE_EXTENDED,
+									rootACL->acl) != 0)
+				{
+					walkLogError(stats, "acl", path, errno);
+				}
+				else
+				{
+					changed = TRUE;
+					stats->filesChanged++;
+				}
+			}
+		}
+
+		PolicyReleaseACL(rootACL);
+	}
+#endif
+
+	// Nothing under a directory fixed on its own gets looked at, so it can't
+	// count as verified.
+	if (level == WALK_LEVEL_ENTRY)
+	{
+		return false;
+	}
+
+	// Under certian criteria, go ahead and skip a directory's children,
+	// because we know we already scanned it, and the permissions are
+	// correct.
+	if (S_ISDIR(info->st_mode))
+	{
+		struct stat newInfo;
+
+		if (level > 0 &&			// We aren't at the root.
+			!force_recursion &&		// We weren't told specifically to rescan
+			!changed &&				// We didn't detect a changed needed above.
+			// The index says we've been through it with this same policy,
+			// and nothing about it has changed since.
+			VerifiedIndexCheck(info->st_dev, info->st_ino, &STAT_CTIME(info),
+							   snapshot->hash, policy->resumed))
+		{
+			// We passed the test!  We know we can skip this now.
+			LogMV("Skipping children of %s\n", path);
+			stats->directoriesSkipped++;
+			return false;
+		}
+
+		// We're about to go through it, so if all goes well it's verified as
+		// of now.  If we just changed it, its ctime moved, and it's the new
+		// one that counts.
+		if (changed)
+		{
+			stats->statCalls++;
+			if (WalkStat(NULL, dirfd, name, &newInfo) == 0)
+			{
+				info = &newInfo;
+			}
+		}
+
+		verify->record = true;
+		verify->device = info->st_dev;
+		verify->inode = info->st_ino;
+		verify->ctime = STAT_CTIME(info);
+		verify->failures = failures;
+	}
+
+	return true;
+}
+
+// A directory's children have all been visited; it's verified if nothing
+// failed since applyPolicyToEntry() started on it.
+static void walkVerified(const struct policy_snapshot_t *snapshot,
+						 const struct walk_verify_t *verify,
+						 const struct walk_stats_t *stats)
+{
+	if (verify->record && stats->failures == verify->failures)
+	{
+		VerifiedIndexRecord(verify->device, verify->inode, &verify->ctime,
+							snapshot->hash);
+	}
+}
+
+#pragma mark -
+#pragma mark fts engine
+
+static int walkFTS(const char *path,
+				   struct policy_t *policy,
+				   const struct policy_snapshot_t *snapshot,
+				   Boolean force_recursion,
+				   struct walk_stats_t *stats)
+{
+	struct walk_verify_t *levels = NULL, *verify, other;
+	size_t levelCount = 0;
+	FTS *ftsp;
+	FTSENT *p;
+	struct stat info;
+	// Without FTS_NOCHDIR, fts changes the whole process's directory as it
+	// goes, and walks on other threads lose their way.
+	// With FTS_NOSTAT it only stats directories (and whatever readdir() can't
+	// tell the type of), and keeps none of it; each entry gets the cheaper
+	// WalkStat() below instead.
+	int fts_options = FTS_PHYSICAL | FTS_NOCHDIR | FTS_NOSTAT;
+	char *pathargv[] = {(char*)path, NULL};
+
+	if ((ftsp = fts_open(pathargv, fts_options, NULL)) == NULL)
+	{
+		LogError("fts_open: %s\n", strerror(errno));
+		return(-1);
+	}
+
+	while ((p = fts_read(ftsp)) != NULL && !walkCancelled(policy, stats))
+	{
+		switch (p->fts_info) {
+			case FTS_D:
+				// ...which it will open.
+				stats->openCalls++;
+				break;
+			case FTS_DNR:
+				walkLogError(stats, NULL, p->fts_path, p->fts_errno);
+				break;
+			case FTS_DP:
+				if (p->fts_level < levelCount)
+				{
+					walkVerified(snapshot, &levels[p->fts_level], stats);
+				}
+				continue;
+			case FTS_ERR:
+			case FTS_NS:
+				walkLogError(stats, NULL, p->fts_path, p->fts_errno);
+				continue;
+			case FTS_SL:
+			case FTS_SLNONE:
+			default:
+				break;
+		}
+
+		// Ours, and the lstat() fts did if it couldn't do without.
+		stats->statCalls += (p->fts_info == FTS_NSOK) ? 1 : 2;
+
+		if (WalkStat(policy, AT_FDCWD, p->fts_path, &info) != 0)
+		{
+			// Probably deleted out from under us.
+			walkLogError(stats, NULL, p->fts_path, errno);
+			continue;
+		}
+
+		// A directory is recorded on its post-order visit, and nothing else
+		// at its level comes in between, so a slot a level will do.
+		if (p->fts_info == FTS_D && p->fts_level >= levelCount)
+		{
+			size_t count = p->fts_level + 16;
+
+			if ((verify = realloc(levels, count * sizeof(*levels))) != NULL)
+			{
+				levels = verify;
+				levelCount = count;
+			}
+		}
+
+		verify = (p->fts_info == FTS_D && p->fts_level < levelCount) ?
+			&levels[p->fts_level] : &other;
+
+		if (!applyPolicyToEntry(policy, snapshot, AT_FDCWD, p->fts_path,
+								p->fts_path, &info, p->fts_level,
+								force_recursion, stats, verify))
+		{
+			fts_set(ftsp, p, FTS_SKIP);
+		}
+	}
+
+	fts_close(ftsp);
+	free(levels);
+
+	return 0;
+}
+
+#pragma mark -
+#pragma mark fd-relative engine
+
+// Visits everything in the directory open on dirfd (and takes ownership of
+// dirfd).  path holds the directory's full path, pathLength long, and has room
+// to append children to it.
+static void walkDirectoryFD(int dirfd,
+							char *path,
+							size_t pathLength,
+							int level,
+							struct policy_t *policy,
+							const struct policy_snapshot_t *snapshot,
+							Boolean force_recursion,
+							struct walk_stats_t *stats)
+{
+	DIR *dir;
+	struct dirent *entry;
+
+	if ((dir = fdopendir(dirfd)) == NULL)
+	{
+		walkLogError(stats, NULL, path, errno);
+		close(dirfd);
+		return;
+	}
+
+	while (!walkCancelled(policy, stats) && (entry = readdir(dir)) != NULL)
+	{
+		struct walk_verify_t verify;
+		struct stat info;
+		size_t nameLength;
+		int childfd;
+
+		if (entry->d_name[0] == '.' &&
+			(entry->d_name[1] == '\0' ||
+			 (entry->d_name[1] == '.' && entry->d_name[2] == '\0')))
+		{
+			continue;
+		}
+
+		nameLength = strlen(entry->d_name);
+		if (pathLength + 1 + nameLength >= PATH_MAX)
+		{
+			MetricsCountError(ENAMETOOLONG);
+			LogError("%s/%s: %s\n", path, entry->d_name, strerror(ENAMETOOLONG));
+			stats->failures++;
+			continue;
+		}
+
+		path[pathLength] = '/';
+		memcpy(path + pathLength + 1, entry->d_name, nameLength + 1);
+
+		stats->statCalls++;
+		if (WalkStat(policy, dirfd, entry->d_name, &info) != 0)
+		{
+			// Probably deleted out from under us.
+			walkLogError(stats, NULL, path, errno);
+		}
+		else if (applyPolicyToEntry(policy, snapshot, dirfd, entry->d_name,
+									path, &info, level, force_recursion, stats,
+									&verify) &&
+				 S_ISDIR(info.st_mode))
+		{
+			stats->openCalls++;
+			childfd = openat(dirfd, entry->d_name,
+							 O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+			if (childfd == -1)
+			{
+				walkLogError(stats, NULL, path, errno);
+			}
+			else
+			{
+				walkDirectoryFD(childfd, path, pathLength + 1 + nameLength,
+								level + 1, policy, snapshot, force_recursion,
+								stats);
+				walkVerified(snapshot, &verify, stats);
+			}
+		}
+
+		path[pathLength] = '\0';
+	}
+
+	closedir(dir);
+}
+
+static int walkFD(const char *path,
+				  struct policy_t *policy,
+				  const struct policy_snapshot_t *snapshot,
+				  Boolean force_recursion,
+				  struct walk_stats_t *stats)
+{
+	struct walk_verify_t verify;
+	char fullPath[PATH_MAX];
+	struct stat info;
+	size_t pathLength;
+	int fd;
+
+	pathLength = strlen(path);
+	while (pathLength > 1 && path[pathLength - 1] == '/')
+	{
+		pathLength--;
+	}
+
+	if (pathLength >= PATH_MAX)
+	{
+		walkLogError(stats, NULL, path, ENAMETOOLONG);
+		return -1;
+	}
+
+	memcpy(fullPath, path, pathLength);
+	fullPath[pathLength] = '\0';
+
+	stats->statCalls++;
+	if (WalkStat(policy, AT_FDCWD, fullPath, &info) != 0)
+	{
+		walkLogError(stats, NULL, fullPath, errno);
+		return -1;
+	}
+
+	if (!applyPolicyToEntry(policy, snapshot, AT_FDCWD, fullPath, fullPath,
+							&info, 0, force_recursion, stats, &verify) ||
+		!S_ISDIR(info.st_mode))
+	{
+		return 0;
+	}
+
+	stats->openCalls++;
+	fd = open(fullPath, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1)
+	{
+		walkLogError(stats, NULL, fullPath, errno);
+		return -1;
+	}
+
+	// A root of "/" would otherwise give us "//child".
+	if (pathLength == 1 && fullPath[0] == '/')
+	{
+		pathLength = 0;
+	}
+
+	walkDirectoryFD(fd, fullPath, pathLength, 1, policy, snapshot,
+					force_recursion, stats);
+	walkVerified(snapshot, &verify, stats);
+
+	return 0;
+}
+
+#pragma mark -
+#pragma mark parallel engine
+
+// A directory waiting to be listed.  Queued directories are kept as paths, not
+// open fds, so a wide tree can't run us out of descriptors; the directory is
+// opened once when it's picked up and everything in it is done relative to
+// that.
+struct pwalk_item_t {
+	char					*path;
+	int						level;
+	struct pwalk_dir_t		*dir;
+};
+
+// A directory of the walk, kept until everything under it is done (on
+// whichever threads), when it goes in the verified index if none of it
+// failed.
+struct pwalk_dir_t {
+	struct pwalk_dir_t		*parent;
+	long					refs;		// Its listing, and each child's node
+	long					failed;
+	struct walk_verify_t	verify;
+};
+
+// Each worker pushes and pops at the tail of its own deque, depth first, which
+// keeps it working near where it just was.  Idle workers steal from the head
+// of someone else's, which is where the oldest (and usually biggest) subtrees
+// are.
+struct pwalk_deque_t {
+	pthread_mutex_t			lock;
+	struct pwalk_item_t		*items;
+	size_t					head;
+	size_t					tail;
+	size_t					capacity;
+};
+
+struct pwalk_t {
+	struct policy_t			*policy;
+	const struct policy_snapshot_t	*snapshot;
+	Boolean					force_recursion;
+	Boolean					background;	// Workers are too (see budget.h)
+	int						threadCount;
+	struct pwalk_deque_t	*deques;
+
+	// Directories queued or being listed.  The walk is over when it hits 0.
+	long					pending;
+
+	// Where idle workers wait for something to steal.
+	pthread_mutex_t			idleLock;
+	pthread_cond_t			idleCond;
+	int						idleCount;
+};
+
+struct pwalk_worker_t {
+	struct pwalk_t			*walk;
+	int						index;
+	pthread_t				thread;
+	struct walk_stats_t		stats;
+};
+
+static Boolean pwalkPush(struct pwalk_t *walk, int index, char *path, int level,
+						 struct pwalk_dir_t *dir)
+{
+	struct pwalk_deque_t *deque = &(walk->deques[index]);
+
+	pthread_mutex_lock(&deque->lock);
+
+	if (deque->tail == deque->capacity)
+	{
+		struct pwalk_item_t *items;
+		size_t count = deque->tail - deque->head;
+
+		if (deque->head > 0)
+		{
+			// Reuse the room left behind by thieves before growing.
+			memmove(deque->items, deque->items + deque->head,
+					count * sizeof(struct pwalk_item_t));
+		}
+		else
+		{
+			size_t capacity = deque->capacity ? deque->capacity * 2 : 64;
+
+			items = realloc(deque->items, capacity * sizeof(struct pwalk_item_t));
+			if (!items)
+			{
+				pthread_mutex_unlock(&deque->lock);
+				walkLogError(NULL, NULL, path, ENOMEM);
+				return false;
+			}
+
+			deque->items = items;
+			deque->capacity = capacity;
+		}
+
+		deque->head = 0;
+		deque->tail = count;
+	}
+
+	deque->items[deque->tail].path = path;
+	deque->items[deque->tail].level = level;
+	deque->items[deque->tail].dir = dir;
+	deque->tail++;
+
+	__sync_fetch_and_add(&walk->pending, 1);
+
+	pthread_mutex_unlock(&deque->lock);
+
+	if (__sync_fetch_and_add(&walk->idleCount, 0) > 0)
+	{
+		pthread_mutex_lock(&walk->idleLock);
+		pthread_cond_signal(&walk->idleCond);
+		pthread_mutex_unlock(&walk->idleLock);
+	}
+
+	return true;
+}
+
+// Takes the newest item off our own deque, or failing that the oldest off
+// somebody else's.
+static Boolean pwalkTake(struct pwalk_t *walk, int index,
+						 struct pwalk_item_t *item)
+{
+	struct pwalk_deque_t *deque = &(walk->deques[index]);
+	int i;
+
+	pthread_mutex_lock(&deque->lock);
+	if (deque->tail > deque->head)
+	{
+		*item = deque->items[--deque->tail];
+		pthread_mutex_unlock(&deque->lock);
+		return true;
+	}
+	pthread_mutex_unlock(&deque->lock);
+
+	for (i = 1; i < walk->threadCount; i++)
+	{
+		deque = &(walk->deques[(index + i) % walk->threadCount]);
+
+		pthread_mutex_lock(&deque->lock);
+		if (deque->tail > deque->head)
+		{
+			*item = deque->items[deque->head++];
+			pthread_mutex_unlock(&deque->lock);
+			return true;
+		}
+		pthread_mutex_unlock(&deque->lock);
+	}
+
+	return false;
+}
+
+// Lets go of dir, marking it failed first if failed is set.  The last one to
+// let go of a directory records it, unless it failed, in which case so did
+// its parent, which it lets go of in turn.
+static void pwalkRelease(struct pwalk_t *walk, struct pwalk_dir_t *dir,
+						 Boolean failed)
+{
+	while (dir)
+	{
+		struct pwalk_dir_t *parent = dir->parent;
+
+		if (failed)
+		{
+			__sync_fetch_and_or(&dir->failed, 1);
+		}
+
+		if (__sync_sub_and_fetch(&dir->refs, 1) > 0)
+		{
+			return;
+		}
+
+		failed = (__sync_fetch_and_or(&dir->failed, 0) != 0);
+		if (!failed && dir->verify.record)
+		{
+			VerifiedIndexRecord(dir->verify.device, dir->verify.inode,
+								&dir->verify.ctime, walk->snapshot->hash);
+		}
+
+		free(dir);
+		dir = parent;
+	}
+}
+
+// Lists one queued directory, applying the policy to each child and queueing
+// the child directories we need to go into.
+static void pwalkDirectory(struct pwalk_worker_t *worker,
+						   struct pwalk_item_t *item)
+{
+	struct pwalk_t *walk = worker->walk;
+	unsigned long failures = worker->stats.failures;
+	char path[PATH_MAX];
+	size_t pathLength = strlen(item->path);
+	struct dirent *entry;
+	DIR *dir;
+	int dirfd;
+
+	if (walkCancelled(walk->policy, &worker->stats))
+	{
+		pwalkRelease(walk, item->dir, true);
+		return;
+	}
+
+	worker->stats.openCalls++;
+	dirfd = open(item->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (dirfd == -1 || (dir = fdopendir(dirfd)) == NULL)
+	{
+		walkLogError(&worker->stats, NULL, item->path, errno);
+		if (dirfd != -1)
+		{
+			close(dirfd);
+		}
+		pwalkRelease(walk, item->dir, true);
+		return;
+	}
+
+	memcpy(path, item->path, pathLength + 1);
+
+	// A root of "/" would otherwise give us "//child".
+	if (pathLength == 1 && path[0] == '/')
+	{
+		pathLength = 0;
+	}
+
+	while (!walkCancelled(walk->policy, &worker->stats) &&
+		   (entry = readdir(dir)) != NULL)
+	{
+		struct walk_verify_t verify;
+		struct pwalk_dir_t *child;
+		struct stat info;
+		size_t nameLength;
+		char *childPath;
+
+		if (entry->d_name[0] == '.' &&
+			(entry->d_name[1] == '\0' ||
+			 (entry->d_name[1] == '.' && entry->d_name[2] == '\0')))
+		{
+			continue;
+		}
+
+		nameLength = strlen(entry->d_name);
+		if (pathLength + 1 + nameLength >= PATH_MAX)
+		{
+			MetricsCountError(ENAMETOOLONG);
+			LogError("%s/%s: %s\n", item->path, entry->d_name,
+					 strerror(ENAMETOOLONG));
+			worker->stats.failures++;
+			continue;
+		}
+
+		path[pathLength] = '/';
+		memcpy(path + pathLength + 1, entry->d_name, nameLength + 1);
+
+		worker->stats.statCalls++;
+		if (WalkStat(walk->policy, dirfd, entry->d_name, &info) != 0)
+		{
+			// Probably deleted out from under us.
+			walkLogError(&worker->stats, NULL, path, errno);
+		}
+		else if (applyPolicyToEntry(walk->policy, walk->snapshot, dirfd,
+									entry->d_name, path, &info, item->level,
+									walk->force_recursion, &worker->stats,
+									&verify) &&
+				 S_ISDIR(info.st_mode))
+		{
+			if ((child = calloc(1, sizeof(struct pwalk_dir_t))) == NULL ||
+				(childPath = strdup(path)) == NULL)
+			{
+				walkLogError(&worker->stats, NULL, path, ENOMEM);
+				free(child);
+				continue;
+			}
+
+			child->parent = item->dir;
+			child->refs = 1;
+			child->failed = (worker->stats.failures != verify.failures);
+			child->verify = verify;
+			__sync_fetch_and_add(&item->dir->refs, 1);
+
+			if (!pwalkPush(walk, worker->index, childPath, item->level + 1,
+						   child))
+			{
+				free(childPath);
+				pwalkRelease(walk, child, true);
+			}
+		}
+	}
+
+	closedir(dir);
+
+	pwalkRelease(walk, item->dir, worker->stats.failures != failures);
+}
+
+static void *pwalkWorker(void *context)
+{
+	struct pwalk_worker_t *worker = context;
+	struct pwalk_t *walk = worker->walk;
+	struct pwalk_item_t item;
+	struct timespec until;
+	struct timeval now;
+
+	// Worker 0 is whoever started the walk, and already is.
+	if (walk->background && worker->index > 0)
+	{
+		BudgetEnterBackground();
+	}
+
+	for (;;)
+	{
+		if (pwalkTake(walk, worker->index, &item))
+		{
+			pwalkDirectory(worker, &item);
+			free(item.path);
+
+			if (__sync_sub_and_fetch(&walk->pending, 1) == 0)
+			{
+				// That was the last one, wake everybody up so they can leave.
+				pthread_mutex_lock(&walk->idleLock);
+				pthread_cond_broadcast(&walk->idleCond);
+				pthread_mutex_unlock(&walk->idleLock);
+			}
+			continue;
+		}
+
+		pthread_mutex_lock(&walk->idleLock);
+
+		if (__sync_fetch_and_add(&walk->pending, 0) == 0)
+		{
+			pthread_mutex_unlock(&walk->idleLock);
+			break;
+		}
+
+		// Someone is still listing a directory and may be about to queue more.
+		// The timeout covers a push that lands between our steal attempt and
+		// getting here.
+		gettimeofday(&now, NULL);
+		until.tv_sec = now.tv_sec;
+		until.tv_nsec = (now.tv_usec + 5000) * 1000;
+		if (until.tv_nsec >= 1000000000)
+		{
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000;
+		}
+
+		__sync_fetch_and_add(&walk->idleCount, 1);
+		pthread_cond_timedwait(&walk->idleCond, &walk->idleLock, &until);
+		__sync_fetch_and_sub(&walk->idleCount, 1);
+
+		pthread_mutex_unlock(&walk->idleLock);
+	}
+
+	return NULL;
+}
+
+static int walkParallel(const char *path,
+						struct policy_t *policy,
+						const struct policy_snapshot_t *snapshot,
+						Boolean force_recursion,
+						struct walk_stats_t *stats)
+{
+	struct pwalk_worker_t *workers;
+	struct walk_verify_t verify;
+	struct pwalk_dir_t *root;
+	struct pwalk_t walk;
+	struct stat info;
+	char *rootPath;
+	size_t pathLength;
+	int i, started;
+
+	pathLength = strlen(path);
+	while (pathLength > 1 && path[pathLength - 1] == '/')
+	{
+		pathLength--;
+	}
+
+	if (pathLength >= PATH_MAX)
+	{
+		walkLogError(stats, NULL, path, ENAMETOOLONG);
+		return -1;
+	}
+
+	if ((rootPath = strndup(path, pathLength)) == NULL)
+	{
+		walkLogError(stats, NULL, path, ENOMEM);
+		return -1;
+	}
+
+	stats->statCalls++;
+	if (WalkStat(policy, AT_FDCWD, rootPath, &info) != 0)
+	{
+		walkLogError(stats, NULL, rootPath, errno);
+		free(rootPath);
+		return -1;
+	}
+
+	// The root itself is done here, before any threads exist.
+	if (!applyPolicyToEntry(policy, snapshot, AT_FDCWD, rootPath, rootPath,
+							&info, 0, force_recursion, stats, &verify) ||
+		!S_ISDIR(info.st_mode))
+	{
+		free(rootPath);
+		return 0;
+	}
+
+	if ((root = calloc(1, sizeof(struct pwalk_dir_t))) == NULL)
+	{
+		walkLogError(stats, NULL, rootPath, ENOMEM);
+		free(rootPath);
+		return -1;
+	}
+
+	root->refs = 1;
+	root->failed = (stats->failures != verify.failures);
+	root->verify = verify;
+
+	bzero(&walk, sizeof(walk));
+	walk.policy = policy;
+	walk.snapshot = snapshot;
+	walk.force_recursion = force_recursion;
+	walk.background = BudgetIsBackground();
+	walk.threadCount = globals->walkThreads;
+	pthread_mutex_init(&walk.idleLock, NULL);
+	pthread_cond_init(&walk.idleCond, NULL);
+
+	walk.deques = calloc(walk.threadCount, sizeof(struct pwalk_deque_t));
+	workers = calloc(walk.threadCount, sizeof(struct pwalk_worker_t));
+	if (!walk.deques || !workers)
+	{
+		LogError("Couldn't allocate %d walker threads\n", walk.threadCount);
+		free(walk.deques);
+		free(workers);
+		free(rootPath);
+		free(root);
+		return -1;
+	}
+
+	for (i = 0; i < walk.threadCount; i++)
+	{
+		pthread_mutex_init(&walk.deques[i].lock, NULL);
+		workers[i].walk = &walk;
+		workers[i].index = i;
+	}
+
+	if (!pwalkPush(&walk, 0, rootPath, 1, root))
+	{
+		free(rootPath);
+		free(root);
+	}
+
+	// Worker 0 is us; if some threads can't be started the rest just steal
+	// more.
+	for (started = 1; started < walk.threadCount; started++)
+	{
+		if (pthread_create(&workers[started].thread, NULL, pwalkWorker,
+						   &workers[started]) != 0)
+		{
+			LogError("Couldn't start walker thread: %s\n", strerror(errno));
+			break;
+		}
+	}
+
+	pwalkWorker(&workers[0]);
+
+	for (i = 1; i < started; i++)
+	{
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	for (i = 0; i < walk.threadCount; i++)
+	{
+		walkAddStats(stats, &workers[i].stats);
+
+		free(walk.deques[i].items);
+		pthread_mutex_destroy(&walk.deques[i].lock);
+	}
+
+	LogMV("MV: %d walker thread%s finished %s\n", started,
+		  (started != 1) ? "s" : "", path);
+
+	pthread_cond_destroy(&walk.idleCond);
+	pthread_mutex_destroy(&walk.idleLock);
+	free(walk.deques);
+	free(workers);
+
+	return 0;
+}
+
+#ifdef __APPLE__
+static Boolean fileNeedsACLApplied(const char *path,
+								   const struct policy_acl_t *rootACL)
+{
+	Boolean retVal = FALSE;
+	acl_t test_acl;
+
+	test_acl = acl_get_link_np(path, ACL_TYPE_EXTENDED);
+
+	if (test_acl == (acl_t)NULL) {
+		LogV("%s has no ACL, assuming we need to propigate one to it!\n", path);
+		retVal = true;
+	}
+	else if (!PolicyACLMatches(rootACL, test_acl))
+	{
+		LogV("%s has a different ACL than its root, replacing it!\n", path);
+		retVal = true;
+	}
+
+	acl_free((void *) test_acl);
+
+	return retVal;
+}
+#endif
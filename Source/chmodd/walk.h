@@ -0,0 +1,80 @@
+/*
+ *	walk.h -- applying a policy to everything under a path.
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#ifndef CHMODD_WALK_H
+#define CHMODD_WALK_H
+
+#include "chmodd.h"
+#include "policy.h"
+
+// Traversal engines, selected with -W.
+#define WALK_ENGINE_FTS		0	// fts(3), every syscall re-resolves the full path
+#define WALK_ENGINE_FD		1	// Holds directory fds, works relative to them
+
+// Upper bound for -T, and the default when the CPU count can't be found.
+#define WALK_MAX_THREADS	64
+
+struct walk_stats_t {
+	unsigned long			filesChanged;
+	unsigned long			directoriesSkipped;
+	unsigned long			filesVisited;
+
+	// What it cost, by syscall.
+	unsigned long			statCalls;
+	unsigned long			chmodCalls;
+	unsigned long			chownCalls;
+	unsigned long			aclReadCalls;
+	unsigned long			aclWriteCalls;
+	unsigned long			openCalls;
+
+	// How many of those a background walk has paid for (see budget.h).
+	unsigned long			charged;
+
+	// Entries fixed on their own, for file events (-e).
+	unsigned long			entries;
+
+	// Entries that couldn't be looked at or put right.  A directory with any
+	// of these under it isn't verified (see verified.h).
+	unsigned long			failures;
+};
+
+// No, this is the actual heavy lifting.  Applies what's in the policy passed
+// down through the tree.  Forcing recursion if necessary.
+int applyPermissionsToFolder(const char *path,
+							 struct policy_t *policy,
+							 Boolean force_recursion);
+
+// Applies the policy to just the one entry at path, for file events (-e);
+// with force_recursion a directory gets all of it walked, as it does when
+// it's new.  Something that's gone by now is left be.  Returns the number of
+// changes made, or -1.
+int applyPermissionsToEntry(const char *path,
+							struct policy_t *policy,
+							Boolean force_recursion);
+
+// The lstat() the walkers do: name relative to dirfd (AT_FDCWD with a full
+// path).  Only the type, mode, owner, group, device, inode and ctime are sure
+// to be filled in.  On Linux that's all statx() is asked for, so network
+// filesystems needn't revalidate sizes and times, and if policy allows
+// cachedAttributes (NULL: it doesn't) whatever the kernel has cached will do.
+// Returns 0, or -1 with errno set.
+int WalkStat(const struct policy_t *policy, int dirfd, const char *name,
+			 struct stat *info);
+
+// Adds up every walk since launch into totals.
+void WalkGetTotals(struct walk_stats_t *totals);
+
+// Returns the number of walker threads to use when -T isn't given.
+int WalkDefaultThreadCount(void);
+
+// Returns the WALK_ENGINE_* for a name given on the command line, or -1.
+int WalkEngineFromString(const char *name);
+
+#endif
@@ -0,0 +1,394 @@
+/*
+ *	work.c -- the walks events ask for, done by a pool of workers so the run
+ *	loop never waits on one.
+ *
+ *	The stream callbacks only sort out what needs walking (coalescing each
+ *	batch as before) and put it on the queue; signals, other streams and the
+ *	next batch get seen to while the workers walk.  The queue is a bounded
+ *	ring of slots, each with a sequence number saying whose turn it is
+ *	(Vyukov's), so putting work on it and taking it off are a compare and swap
+ *	each, with no lock.  The lock here is only for workers to sleep on when
+ *	there's nothing to do.
+ *
+ *	A full queue means we're far behind, and walking the root again is
+ *	cheaper than walking its events one by one: the rest of that root's work
+ *	becomes one full walk in the background (see rescan.h).
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#include <sys/time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include "work.h"
+#include "walk.h"
+#include "rescan.h"
+#include "subtree.h"
+#include "budget.h"
+#include "latency.h"
+#include "metrics.h"
+
+#define WORK_QUEUE_MASK			(WORK_QUEUE_CAPACITY - 1)
+
+struct work_item_t {
+	struct policy_t			*policy;
+	struct dispatch_t		*dispatch;
+	char					*path;
+	Boolean					recursive;
+	Boolean					entry;
+	UInt64					eventId;
+	double					enqueued;
+};
+
+// A slot is free for the producer whose position is sequence, and holds an
+// item for the worker whose position is sequence - 1.
+struct work_cell_t {
+	volatile unsigned long	sequence;
+	struct work_item_t		item;
+};
+
+static struct {
+	struct work_cell_t		cells[WORK_QUEUE_CAPACITY];
+	volatile unsigned long	enqueuePosition;
+	volatile unsigned long	dequeuePosition;
+
+	pthread_mutex_t			lock;
+	pthread_cond_t			wake;
+	volatile int			sleeping;
+	Boolean					quit;
+	Boolean					full;		// Last enqueue overflowed
+	pthread_t				threads[WORK_MAX_WORKERS];
+
+	struct work_status_t	status;
+} work = { .lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER };
+
+static double WorkNow(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return now.tv_sec + now.tv_usec / 1e6;
+}
+
+static Boolean WorkPush(const struct work_item_t *item)
+{
+	struct work_cell_t *cell;
+	unsigned long position = work.enqueuePosition;
+	long difference;
+
+	for (;;)
+	{
+		cell = &work.cells[position & WORK_QUEUE_MASK];
+		difference = (long)(cell->sequence - position);
+
+		if (difference == 0)
+		{
+			if (__sync_bool_compare_and_swap(&work.enqueuePosition, position,
+											 position + 1))
+			{
+				break;
+			}
+		}
+		else if (difference < 0)
+		{
+			// A whole lap behind: full.
+			return false;
+		}
+
+		position = work.enqueuePosition;
+	}
+
+	cell->item = *item;
+	__sync_synchronize();
+	cell->sequence = position + 1;
+
+	return true;
+}
+
+static Boolean WorkPop(struct work_item_t *item)
+{
+	struct work_cell_t *cell;
+	unsigned long position = work.dequeuePosition;
+	long difference;
+
+	for (;;)
+	{
+		cell = &work.cells[position & WORK_QUEUE_MASK];
+		difference = (long)(cell->sequence - (position + 1));
+
+		if (difference == 0)
+		{
+			if (__sync_bool_compare_and_swap(&work.dequeuePosition, position,
+											 position + 1))
+			{
+				break;
+			}
+		}
+		else if (difference < 0)
+		{
+			return false;
+		}
+
+		position = work.dequeuePosition;
+	}
+
+	__sync_synchronize();
+	*item = cell->item;
+	__sync_synchronize();
+	cell->sequence = position + WORK_QUEUE_CAPACITY;
+
+	return true;
+}
+
+static void WorkRun(struct work_item_t *item)
+{
+	struct latency_t *latency;
+	struct subtree_t *subtree = NULL;
+	double started = WorkNow();
+
+	MetricsWorkWaited(started - item->enqueued);
+
+	// The root was reconfigured (see RescanRemovePolicy()) since this was
+	// queued, and walking it now would put the old settings back.
+	if (item->policy->stopped)
+	{
+		LogMV("Dropping walk of %s, its root was reconfigured\n", item->path);
+	}
+	// Another walk may already have it in hand, or have just done it.  One
+	// entry is only a stat or two, so that isn't worth looking for.
+	else if (item->entry ||
+		SubtreeBegin(item->policy, item->dispatch, item->path,
+					 item->recursive, item->eventId, item->enqueued,
+					 &subtree) == SUBTREE_WALK)
+	{
+		__sync_fetch_and_add(&work.status.running, 1);
+
+		LogMV("%s %s for event %llu, %.3fs after it was queued\n",
+			  item->entry ? "Fixing" : "Walking", item->path,
+			  (unsigned long long)item->eventId, started - item->enqueued);
+
+		BudgetLiveBegin();
+		if (item->entry)
+		{
+			applyPermissionsToEntry(item->path, item->policy,
+									item->recursive);
+		}
+		else
+		{
+			applyPermissionsToFolder(item->path, item->policy,
+									 item->recursive);
+		}
+		BudgetLiveEnd();
+
+		latency = item->dispatch ? item->dispatch->latency :
+			item->policy->latency;
+		if (latency)
+		{
+			LatencyWalked(latency, WorkNow() - started);
+		}
+
+		SubtreeEnd(subtree);
+
+		__sync_fetch_and_sub(&work.status.running, 1);
+	}
+
+	free(item->path);
+	PolicyRelease(item->policy);
+	if (item->dispatch)
+	{
+		DispatchRelease(item->dispatch);
+	}
+
+	__sync_fetch_and_add(&work.status.done, 1);
+}
+
+static void *WorkThread(void *context)
+{
+	struct work_item_t item;
+
+	for (;;)
+	{
+		if (WorkPop(&item))
+		{
+			WorkRun(&item);
+			continue;
+		}
+
+		pthread_mutex_lock(&work.lock);
+
+		// Say we're going to sleep before looking one last time, so anything
+		// queued after the look sees us and wakes us.
+		__sync_fetch_and_add(&work.sleeping, 1);
+
+		if (work.enqueuePosition == work.dequeuePosition)
+		{
+			if (work.quit)
+			{
+				__sync_fetch_and_sub(&work.sleeping, 1);
+				pthread_mutex_unlock(&work.lock);
+				break;
+			}
+
+			pthread_cond_wait(&work.wake, &work.lock);
+		}
+
+		__sync_fetch_and_sub(&work.sleeping, 1);
+		pthread_mutex_unlock(&work.lock);
+	}
+
+	return NULL;
+}
+
+Boolean WorkStart(int workers)
+{
+	sigset_t allSignals, oldSignals;
+	unsigned long i;
+	int error;
+
+	for (i = 0; i < WORK_QUEUE_CAPACITY; i++)
+	{
+		work.cells[i].sequence = i;
+	}
+
+	if (workers > WORK_MAX_WORKERS)
+	{
+		workers = WORK_MAX_WORKERS;
+	}
+
+	// Signals are for the run loop, so the workers start with them blocked.
+	sigfillset(&allSignals);
+	pthread_sigmask(SIG_SETMASK, &allSignals, &oldSignals);
+
+	for (i = 0; i < (unsigned long)workers; i++)
+	{
+		if ((error = pthread_create(&work.threads[i], NULL, WorkThread,
+									NULL)) != 0)
+		{
+			LogError("Couldn't start worker thread: %s\n", strerror(error));
+			break;
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+
+	work.status.capacity = WORK_QUEUE_CAPACITY;
+	work.status.workers = (int)i;
+
+	if (i > 0)
+	{
+		LogV("Started %lu worker%s\n", i, (i != 1) ? "s" : "");
+	}
+
+	return (i > 0);
+}
+
+Boolean WorkEnqueue(struct policy_t *policy, struct dispatch_t *dispatch,
+					const char *path, Boolean recursive, Boolean entry,
+					UInt64 eventId)
+{
+	struct work_item_t item;
+
+	item.policy = (struct policy_t *)PolicyRetain(policy);
+	item.dispatch = dispatch ? (struct dispatch_t *)DispatchRetain(dispatch) :
+		NULL;
+	item.path = strdup(path);
+	item.recursive = recursive;
+	item.entry = entry;
+	item.eventId = eventId;
+	item.enqueued = WorkNow();
+
+	__sync_fetch_and_add(&work.status.enqueued, 1);
+
+	if (!item.path || !WorkPush(&item))
+	{
+		if (!work.full)
+		{
+			LogV("Work queue full, walking all of %s instead\n", policy->path);
+		}
+		work.full = true;
+
+		__sync_fetch_and_add(&work.status.overflowed, 1);
+		RescanRequestWalk(policy, policy->path, true);
+
+		free(item.path);
+		PolicyRelease(item.policy);
+		if (item.dispatch)
+		{
+			DispatchRelease(item.dispatch);
+		}
+
+		__sync_fetch_and_add(&work.status.done, 1);
+		return false;
+	}
+
+	work.full = false;
+
+	// Pairs with the workers' add to sleeping: either they see the item, or
+	// we see them.
+	__sync_synchronize();
+	if (work.sleeping > 0)
+	{
+		pthread_mutex_lock(&work.lock);
+		pthread_cond_signal(&work.wake);
+		pthread_mutex_unlock(&work.lock);
+	}
+
+	return true;
+}
+
+Boolean WorkIsIdle(void)
+{
+	struct subtree_status_t subtrees;
+	struct rescan_status_t rescans;
+
+	// Requests waiting on a walk are queued again before they stop counting
+	// as waiting, so this has to be looked at first.
+	SubtreeGetStatus(&subtrees);
+	if (subtrees.waiting > 0)
+	{
+		return false;
+	}
+
+	// Events can be left to a background walk too: when the queue is full,
+	// when FSEvents says to look under a directory, when events were
+	// dropped.  They aren't dealt with until it's done.
+	RescanGetStatus(&rescans);
+	if (rescans.walkRunning || rescans.walksQueued > 0)
+	{
+		return false;
+	}
+
+	return (__sync_fetch_and_add(&work.status.done, 0) ==
+			__sync_fetch_and_add(&work.status.enqueued, 0));
+}
+
+void WorkStop(void)
+{
+	int i;
+
+	pthread_mutex_lock(&work.lock);
+	work.quit = true;
+	pthread_cond_broadcast(&work.wake);
+	pthread_mutex_unlock(&work.lock);
+
+	for (i = 0; i < work.status.workers; i++)
+	{
+		pthread_join(work.threads[i], NULL);
+	}
+
+	work.status.workers = 0;
+}
+
+void WorkGetStatus(struct work_status_t *status)
+{
+	*status = work.status;
+	status->depth = work.enqueuePosition - work.dequeuePosition;
+}
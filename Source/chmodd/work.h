@@ -0,0 +1,58 @@
+/*
+ *	work.h -- the walks events ask for, done by a pool of workers so the run
+ *	loop never waits on one.
+ *
+ *	© 2009, Backlight Software
+ *
+ *	Created by Frank Fleschner
+ *
+ *
+ */
+
+#ifndef CHMODD_WORK_H
+#define CHMODD_WORK_H
+
+#include "chmodd.h"
+#include "policy.h"
+#include "dispatch.h"
+
+// Slots in the queue (a power of two).  When they're all taken, more work for
+// a root becomes a full walk of it in the background instead.
+#define WORK_QUEUE_CAPACITY		4096
+
+#define WORK_DEFAULT_WORKERS	4
+#define WORK_MAX_WORKERS		64
+
+struct work_status_t {
+	unsigned long			capacity;
+	unsigned long			depth;		// Queued, not started yet
+	unsigned long			running;
+	unsigned long			enqueued;
+	unsigned long			done;
+	unsigned long			overflowed;	// Turned into root walks, queue full
+	int						workers;
+};
+
+// Starts workers threads.  Returns false if none could be started.
+Boolean WorkStart(int workers);
+
+// Queues a walk of path under policy (retaining it, and dispatch if the root
+// is on a shared stream), for event eventId; recursive is as for
+// applyPermissionsToFolder(), or with entry, applyPermissionsToEntry().  Safe
+// from any thread.  If the queue is full, the root gets a full background
+// walk (see rescan.h) and this returns false.
+Boolean WorkEnqueue(struct policy_t *policy, struct dispatch_t *dispatch,
+					const char *path, Boolean recursive, Boolean entry,
+					UInt64 eventId);
+
+// Returns true when nothing is queued, being walked or waiting on another
+// walk (see subtree.h), and no walk is left to the background thread (see
+// rescan.h), so every event handed over so far has been dealt with.
+Boolean WorkIsIdle(void);
+
+// Lets the workers finish what's queued, then stops them.
+void WorkStop(void);
+
+void WorkGetStatus(struct work_status_t *status);
+
+#endif